@@ -5,6 +5,8 @@ if(NOT DXC_EXECUTABLE)
     message(FATAL_ERROR "DXC not found. Set VULKAN_SDK or install DXC.")
 endif()
 
+set(EMBED_SPIRV_SCRIPT "${CMAKE_CURRENT_LIST_DIR}/EmbedSpirv.cmake")
+
 set(CMAKE_C_STANDARD 20)
 set(CMAKE_CXX_STANDARD 20)
 set(CMAKE_CUDA_STANDARD 20)
@@ -67,6 +69,66 @@ function(target_configure target)
 	target_link_options(${target} PRIVATE $<$<CONFIG:Debug>:${DEV_SANITIZERS}>)
 endfunction()
 
+# --- SPIR-V embedding ------------------------------------------------
+# Every compiled shader is also turned into a word list (<name>.spv.inc) that
+# gets #included into a constexpr array, so the engine never has to open a
+# .spv file at startup. embed_shaders() has to be called once per target
+# after all compile_*_to_spirv calls to generate the lookup table.
+function(embed_spirv target name spv_file)
+    set(output_inc "${spv_file}.inc")
+
+    add_custom_command(
+        OUTPUT ${output_inc}
+        COMMAND ${CMAKE_COMMAND}
+                -DINPUT=${spv_file}
+                -DOUTPUT=${output_inc}
+                -P ${EMBED_SPIRV_SCRIPT}
+        DEPENDS ${spv_file} ${EMBED_SPIRV_SCRIPT}
+        COMMENT "Embedding ${name} SPIR-V"
+        VERBATIM
+    )
+
+    target_sources(${target} PRIVATE ${output_inc})
+    set_property(TARGET ${target} APPEND PROPERTY EMBEDDED_SHADERS ${name})
+endfunction()
+
+function(embed_shaders target)
+    get_target_property(shader_names ${target} EMBEDDED_SHADERS)
+    if(NOT shader_names)
+        set(shader_names "")
+    endif()
+
+    set(EMBEDDED_ARRAYS "")
+    set(EMBEDDED_ENTRIES "")
+    foreach(name IN LISTS shader_names)
+        string(APPEND EMBEDDED_ARRAYS
+            "alignas(4) constexpr uint32_t ${name}_spv[] = {\n"
+            "#include \"shaders/${name}.spv.inc\"\n"
+            "};\n")
+        string(APPEND EMBEDDED_ENTRIES "\t{\"${name}\", ${name}_spv},\n")
+    endforeach()
+
+    set(output_cpp "${CMAKE_CURRENT_BINARY_DIR}/embedded_shaders.cpp")
+    file(CONFIGURE OUTPUT ${output_cpp} CONTENT [=[
+// Generated by embed_shaders() in cmake/Configuration.cmake - do not edit.
+#include <vk_pipelines.h>
+
+namespace {
+@EMBEDDED_ARRAYS@
+constexpr EmbeddedShader embeddedShaders[] = {
+@EMBEDDED_ENTRIES@	{nullptr, {}},
+};
+} // namespace
+
+std::span<const EmbeddedShader> vkutil::embedded_shaders() {
+	return std::span<const EmbeddedShader>(embeddedShaders, std::size(embeddedShaders) - 1);
+}
+]=] @ONLY)
+
+    target_sources(${target} PRIVATE ${output_cpp})
+    target_include_directories(${target} PRIVATE ${CMAKE_CURRENT_BINARY_DIR})
+endfunction()
+
 # --- HLSL to SPIR-V compile function --------------------------------
 function(compile_hlsl_to_spirv target shader_name shader_file stage entry)
     get_filename_component(file_we ${shader_file} NAME_WE)
@@ -88,6 +150,8 @@ function(compile_hlsl_to_spirv target shader_name shader_file stage entry)
         VERBATIM
     )
 
+    embed_spirv(${target} ${file_we}_${stage} ${output_spv})
+
     # Group shaders in a common target
     add_custom_target(${shader_name} DEPENDS ${output_spv})
     add_dependencies(${target} ${shader_name})
@@ -102,6 +166,7 @@ function(compile_glsl_to_spirv target shader_name shader_file stage entry)
         OUTPUT ${output_spv}
         COMMAND glslangValidator
                 -V
+                --target-env vulkan1.3
                 -o ${output_spv}
                 ${shader_file}
         DEPENDS ${shader_file}
@@ -109,6 +174,8 @@ function(compile_glsl_to_spirv target shader_name shader_file stage entry)
         VERBATIM
     )
 
+    embed_spirv(${target} ${file_we}_${stage} ${output_spv})
+
     # Group shaders in a common target
     add_custom_target(${shader_name} DEPENDS ${output_spv})
     add_dependencies(${target} ${shader_name})
@@ -0,0 +1,22 @@
+# Converts a SPIR-V binary into a list of 32-bit words that can be #included
+# into an array initializer.
+#
+# Usage: cmake -DINPUT=<file.spv> -DOUTPUT=<file.spv.inc> -P EmbedSpirv.cmake
+
+if(NOT INPUT OR NOT OUTPUT)
+    message(FATAL_ERROR "EmbedSpirv.cmake requires INPUT and OUTPUT")
+endif()
+
+file(READ "${INPUT}" spv_hex HEX)
+string(LENGTH "${spv_hex}" spv_hex_length)
+math(EXPR spv_misaligned "${spv_hex_length} % 8")
+if(spv_hex_length EQUAL 0 OR NOT spv_misaligned EQUAL 0)
+    message(FATAL_ERROR "${INPUT} is not a valid SPIR-V binary")
+endif()
+
+# SPIR-V is emitted little endian, swap every word into a literal
+string(REGEX REPLACE "(..)(..)(..)(..)" "0x\\4\\3\\2\\1u," spv_words "${spv_hex}")
+# keep the lines short so the generated file stays readable
+string(REGEX REPLACE "((0x........u,){8})" "\\1\n" spv_words "${spv_words}")
+
+file(WRITE "${OUTPUT}" "${spv_words}\n")
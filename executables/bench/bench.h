@@ -0,0 +1,104 @@
+#pragma once
+
+#include "vk_engine.h"
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+struct BenchOptions {
+	uint32_t repetitions{30};    // samples per microbenchmark
+	uint32_t warmup{3};          // samples thrown away first
+	uint32_t gpuRepetitions{5};  // samples per GPU primitive, each is a batch of recordings
+	uint32_t frames{300};        // samples of the frame benchmark
+	float theta{0.5f};           // Barnes-Hut opening angle
+	std::string filter;          // only groups whose name contains this
+	std::string jsonPath;
+
+	bool enabled(std::string_view group) const
+	{
+		return filter.empty() || group.find(filter) != std::string_view::npos;
+	}
+};
+
+struct BenchResult {
+	std::string name;  // <group>/<case>
+	std::string unit;  // of the samples
+	std::vector<double> samples;
+	double bytes{0.0};      // moved per operation, for a bandwidth
+	uint64_t elements{0};   // processed per operation, for a rate
+};
+
+struct BenchStatistics {
+	double min;
+	double max;
+	double mean;
+	double median;
+	double stddev;
+	double mad;  // median absolute deviation, robust against outliers
+};
+
+BenchStatistics bench_statistics(std::span<const double> samples);
+
+// Collects results, logs each one and writes them all as JSON in the end
+class BenchReport {
+public:
+	void add(BenchResult result);
+	bool write_json(const std::string& path, const VulkanEngine& engine, const BenchOptions& options,
+		bool correct) const;
+
+private:
+	std::vector<BenchResult> _results;
+};
+
+// GPU milliseconds per recording of `record`, from timestamps around
+// `iterations` back to back recordings
+class GpuTimer {
+public:
+	explicit GpuTimer(VulkanEngine& engine) : _engine(engine)
+	{
+		VkQueryPoolCreateInfo info{.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO};
+		info.queryType = VK_QUERY_TYPE_TIMESTAMP;
+		info.queryCount = 2;
+		vk_check(vkCreateQueryPool(_engine._device, &info, nullptr, &_pool));
+	}
+	~GpuTimer() { vkDestroyQueryPool(_engine._device, _pool, nullptr); }
+
+	double measure(const std::function<void(VkCommandBuffer cmd)>& record, uint32_t iterations = 20)
+	{
+		_engine.immediate_submit([&](VkCommandBuffer cmd) {
+			vkCmdResetQueryPool(cmd, _pool, 0, 2);
+			vkCmdWriteTimestamp2(cmd, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, _pool, 0);
+			for (uint32_t i = 0; i < iterations; i++) {
+				record(cmd);
+			}
+			vkCmdWriteTimestamp2(cmd, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, _pool, 1);
+		});
+
+		uint64_t timestamps[2];
+		vk_check(vkGetQueryPoolResults(_engine._device, _pool, 0, 2, sizeof(timestamps), timestamps, sizeof(uint64_t),
+			VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT));
+		double nanoseconds = vkutil::timestamp_nanoseconds(timestamps[0], timestamps[1], _engine._timestampValidBits,
+			_engine._gpuProperties.limits.timestampPeriod);
+		return nanoseconds / 1e6 / iterations;
+	}
+
+	// one measure() per sample
+	std::vector<double> sample(const std::function<void(VkCommandBuffer cmd)>& record, uint32_t samples)
+	{
+		std::vector<double> result(samples);
+		for (double& ms : result) {
+			ms = measure(record);
+		}
+		return result;
+	}
+
+private:
+	VulkanEngine& _engine;
+	VkQueryPool _pool{VK_NULL_HANDLE};
+};
+
+// CPU side costs of the engine core: descriptor allocation, deletion queues,
+// command recording and submission, barriers, shader modules, pipeline
+// creation and whole frames
+void run_microbenchmarks(VulkanEngine& engine, BenchReport& report, const BenchOptions& options);
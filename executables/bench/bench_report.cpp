@@ -0,0 +1,149 @@
+#include "bench.h"
+
+#include <spdlog/fmt/fmt.h>
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <numeric>
+
+static double median_of(std::vector<double> values)
+{
+	size_t middle = values.size() / 2;
+	std::nth_element(values.begin(), values.begin() + middle, values.end());
+	double upper = values[middle];
+	if (values.size() % 2 == 1) {
+		return upper;
+	}
+	double lower = *std::max_element(values.begin(), values.begin() + middle);
+	return (lower + upper) / 2.0;
+}
+
+BenchStatistics bench_statistics(std::span<const double> samples)
+{
+	BenchStatistics stats{};
+	if (samples.empty()) {
+		return stats;
+	}
+	auto [min, max] = std::minmax_element(samples.begin(), samples.end());
+	stats.min = *min;
+	stats.max = *max;
+	stats.mean = std::accumulate(samples.begin(), samples.end(), 0.0) / samples.size();
+
+	double squares = 0.0;
+	for (double sample : samples) {
+		squares += (sample - stats.mean) * (sample - stats.mean);
+	}
+	stats.stddev = samples.size() > 1 ? std::sqrt(squares / (samples.size() - 1)) : 0.0;
+
+	stats.median = median_of(std::vector<double>(samples.begin(), samples.end()));
+	std::vector<double> deviations(samples.size());
+	std::transform(samples.begin(), samples.end(), deviations.begin(),
+		[&](double sample) { return std::abs(sample - stats.median); });
+	stats.mad = median_of(std::move(deviations));
+	return stats;
+}
+
+// seconds per operation, for the derived rates
+static double unit_seconds(std::string_view unit)
+{
+	if (unit == "ns") {
+		return 1e-9;
+	}
+	if (unit == "us") {
+		return 1e-6;
+	}
+	if (unit == "ms") {
+		return 1e-3;
+	}
+	return 1.0;
+}
+
+void BenchReport::add(BenchResult result)
+{
+	BenchStatistics stats = bench_statistics(result.samples);
+	std::string line = fmt::format("{:<34} {:10.3f} {:<2} ±{:5.1f}%  min {:10.3f}", result.name, stats.median,
+		result.unit, stats.median > 0.0 ? 100.0 * stats.mad / stats.median : 0.0, stats.min);
+	double seconds = stats.median * unit_seconds(result.unit);
+	if (result.bytes > 0.0 && seconds > 0.0) {
+		line += fmt::format("  {:8.1f} GB/s", result.bytes / seconds / 1e9);
+	}
+	if (result.elements > 0 && seconds > 0.0) {
+		line += fmt::format("  {:9.1f} M/s", result.elements / seconds / 1e6);
+	}
+	spdlog::info("{}", line);
+	_results.push_back(std::move(result));
+}
+
+static std::string json_string(std::string_view text)
+{
+	std::string result = "\"";
+	for (char c : text) {
+		switch (c) {
+		case '"':
+			result += "\\\"";
+			break;
+		case '\\':
+			result += "\\\\";
+			break;
+		default:
+			if ((unsigned char)c < 0x20) {
+				result += fmt::format("\\u{:04x}", (unsigned)c);
+			} else {
+				result += c;
+			}
+		}
+	}
+	return result + "\"";
+}
+
+bool BenchReport::write_json(const std::string& path, const VulkanEngine& engine, const BenchOptions& options,
+	bool correct) const
+{
+	std::ofstream file(path, std::ios::trunc);
+	if (!file.is_open()) {
+		spdlog::error("Could not write benchmark results to {}", path);
+		return false;
+	}
+
+	const VkPhysicalDeviceProperties& properties = engine._gpuProperties;
+	file << "{\n";
+	file << "  \"device\": {\n";
+	file << fmt::format("    \"name\": {},\n", json_string(properties.deviceName));
+	file << fmt::format("    \"type\": {},\n", json_string(string_VkPhysicalDeviceType(properties.deviceType)));
+	file << fmt::format("    \"vendor_id\": {},\n", properties.vendorID);
+	file << fmt::format("    \"driver_version\": {},\n", properties.driverVersion);
+	file << fmt::format("    \"api_version\": \"{}.{}.{}\"\n", VK_API_VERSION_MAJOR(properties.apiVersion),
+		VK_API_VERSION_MINOR(properties.apiVersion), VK_API_VERSION_PATCH(properties.apiVersion));
+	file << "  },\n";
+	file << fmt::format("  \"pipeline_library\": {},\n", engine._graphicsPipelineLibrary);
+	file << fmt::format("  \"repetitions\": {},\n", options.repetitions);
+	file << fmt::format("  \"warmup\": {},\n", options.warmup);
+	file << fmt::format("  \"theta\": {},\n", options.theta);
+	file << fmt::format("  \"correct\": {},\n", correct);
+	file << "  \"results\": [";
+	for (size_t i = 0; i < _results.size(); i++) {
+		const BenchResult& result = _results[i];
+		BenchStatistics stats = bench_statistics(result.samples);
+		file << (i == 0 ? "\n" : ",\n");
+		file << fmt::format("    {{\"name\": {}, \"unit\": {}, \"samples\": {}, ", json_string(result.name),
+			json_string(result.unit), result.samples.size());
+		file << fmt::format("\"min\": {}, \"max\": {}, \"mean\": {}, \"median\": {}, \"stddev\": {}, \"mad\": {}",
+			stats.min, stats.max, stats.mean, stats.median, stats.stddev, stats.mad);
+		if (result.bytes > 0.0) {
+			file << fmt::format(", \"bytes\": {}", result.bytes);
+		}
+		if (result.elements > 0) {
+			file << fmt::format(", \"elements\": {}", result.elements);
+		}
+		file << ", \"values\": [";
+		for (size_t s = 0; s < result.samples.size(); s++) {
+			file << (s == 0 ? "" : ", ") << fmt::format("{}", result.samples[s]);
+		}
+		file << "]}";
+	}
+	file << "\n  ]\n}\n";
+
+	spdlog::info("Wrote {} benchmark results to {}", _results.size(), path);
+	return file.good();
+}
@@ -0,0 +1,946 @@
+// Checks the GPU primitives against CPU references, and the CPU simulation
+// backend against the GPU one, reports their throughput and runs the engine
+// microbenchmarks. Exits non zero when any result differs.
+//
+// Runs headless through SDL's offscreen video driver by default, so it works
+// on lavapipe in CI as well as on real GPUs:
+//   vkengine_bench [--json <file>] [--repetitions <n>] [--filter <group>]
+//                  [--theta <opening angle>] [--window] [--validation]
+#include "bench.h"
+#include "camera.h"
+#include "cpu_gravity.h"
+#include "cpu_particles.h"
+#include "cpu_xpbd.h"
+#include <SDL3/SDL_hints.h>
+#include <spdlog/spdlog.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <numeric>
+#include <random>
+#include <tuple>
+
+#include <glm/gtc/constants.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+static AllocatedBuffer device_buffer(VulkanEngine& engine, size_t size)
+{
+	return engine._memory.create_buffer(size,
+		VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT
+			| VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+		VMA_MEMORY_USAGE_GPU_ONLY, MemoryTag::Other);
+}
+
+static AllocatedBuffer upload(VulkanEngine& engine, const std::vector<uint32_t>& data)
+{
+	return engine.upload_buffer(data.data(), data.size() * sizeof(uint32_t),
+		VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT
+			| VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+		MemoryTag::Other);
+}
+
+static std::vector<uint32_t> download(VulkanEngine& engine, const AllocatedBuffer& buffer, size_t count)
+{
+	AllocatedBuffer readback = engine._memory.create_buffer(count * sizeof(uint32_t),
+		VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_TO_CPU, MemoryTag::Readback,
+		VMA_ALLOCATION_CREATE_MAPPED_BIT);
+	engine.immediate_submit([&](VkCommandBuffer cmd) {
+		VkBufferCopy copy{0, 0, count * sizeof(uint32_t)};
+		vkCmdCopyBuffer(cmd, buffer.buffer, readback.buffer, 1, &copy);
+	});
+	vmaInvalidateAllocation(engine._allocator, readback.allocation, 0, VK_WHOLE_SIZE);
+
+	std::vector<uint32_t> result(count);
+	memcpy(result.data(), readback.info.pMappedData, count * sizeof(uint32_t));
+	engine._memory.destroy_buffer(readback);
+	return result;
+}
+
+static bool report(BenchReport& results, const char* name, uint32_t count, bool correct,
+	std::vector<double> milliseconds, double bytes)
+{
+	if (!correct) {
+		spdlog::error("{:<14} {:>9} elements  result differs from the CPU reference", name, count);
+		return false;
+	}
+	BenchResult result{fmt::format("primitives/{}/{}", name, count), "ms", std::move(milliseconds)};
+	result.bytes = bytes;
+	result.elements = count;
+	results.add(std::move(result));
+	return true;
+}
+
+static bool bench_scan(VulkanEngine& engine, BenchReport& results, GpuTimer& timer, const BenchOptions& options,
+	std::mt19937& rng, uint32_t count)
+{
+	std::vector<uint32_t> input(count);
+	for (uint32_t& v : input) {
+		v = rng() & 0xff;
+	}
+	std::vector<uint32_t> expected(count);
+	std::exclusive_scan(input.begin(), input.end(), expected.begin(), 0u);
+
+	AllocatedBuffer src = upload(engine, input);
+	AllocatedBuffer dst = device_buffer(engine, count * sizeof(uint32_t));
+	auto record = [&](VkCommandBuffer cmd) { engine._primitives.exclusive_scan(cmd, src, dst, count); };
+
+	engine.immediate_submit(record);
+	bool correct = download(engine, dst, count) == expected;
+	std::vector<double> ms = timer.sample(record, options.gpuRepetitions);
+
+	engine._memory.destroy_buffer(src);
+	engine._memory.destroy_buffer(dst);
+	return report(results, "exclusive_scan", count, correct, std::move(ms), 2.0 * count * sizeof(uint32_t));
+}
+
+static bool bench_reduce(VulkanEngine& engine, BenchReport& results, GpuTimer& timer, const BenchOptions& options,
+	std::mt19937& rng, uint32_t count)
+{
+	std::vector<uint32_t> input(count);
+	for (uint32_t& v : input) {
+		v = rng();
+	}
+	uint32_t expected = std::accumulate(input.begin(), input.end(), 0u);
+
+	AllocatedBuffer src = upload(engine, input);
+	AllocatedBuffer result = device_buffer(engine, sizeof(uint32_t));
+	auto record = [&](VkCommandBuffer cmd) { engine._primitives.reduce(cmd, src, result, count); };
+
+	engine.immediate_submit(record);
+	bool correct = download(engine, result, 1)[0] == expected;
+	std::vector<double> ms = timer.sample(record, options.gpuRepetitions);
+
+	engine._memory.destroy_buffer(src);
+	engine._memory.destroy_buffer(result);
+	return report(results, "reduce", count, correct, std::move(ms), double(count) * sizeof(uint32_t));
+}
+
+static bool bench_compact(VulkanEngine& engine, BenchReport& results, GpuTimer& timer, const BenchOptions& options,
+	std::mt19937& rng, uint32_t count)
+{
+	std::vector<uint32_t> input(count), flags(count), expected;
+	for (uint32_t i = 0; i < count; i++) {
+		input[i] = rng();
+		flags[i] = rng() & 1;
+		if (flags[i]) {
+			expected.push_back(input[i]);
+		}
+	}
+
+	AllocatedBuffer src = upload(engine, input);
+	AllocatedBuffer flagBuffer = upload(engine, flags);
+	AllocatedBuffer dst = device_buffer(engine, count * sizeof(uint32_t));
+	AllocatedBuffer outCount = device_buffer(engine, sizeof(uint32_t));
+	auto record = [&](VkCommandBuffer cmd) {
+		engine._primitives.compact(cmd, src, flagBuffer, dst, outCount, count);
+	};
+
+	engine.immediate_submit(record);
+	uint32_t survivors = download(engine, outCount, 1)[0];
+	std::vector<uint32_t> result = download(engine, dst, count);
+	result.resize(std::min(survivors, count));
+	bool correct = survivors == expected.size() && result == expected;
+	std::vector<double> ms = timer.sample(record, options.gpuRepetitions);
+
+	for (AllocatedBuffer* buffer : {&src, &flagBuffer, &dst, &outCount}) {
+		engine._memory.destroy_buffer(*buffer);
+	}
+	// flags are read twice, inputs once, about half of them written
+	return report(results, "compact", count, correct, std::move(ms), 3.5 * count * sizeof(uint32_t));
+}
+
+static bool bench_radix_sort(VulkanEngine& engine, BenchReport& results, GpuTimer& timer, const BenchOptions& options,
+	std::mt19937& rng, uint32_t count)
+{
+	std::vector<uint32_t> keys(count), values(count);
+	for (uint32_t i = 0; i < count; i++) {
+		keys[i] = rng();
+		values[i] = i;
+	}
+	std::vector<uint32_t> order(count);
+	std::iota(order.begin(), order.end(), 0u);
+	std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return keys[a] < keys[b]; });
+
+	AllocatedBuffer keyBuffer = upload(engine, keys);
+	AllocatedBuffer valueBuffer = upload(engine, values);
+	auto record = [&](VkCommandBuffer cmd) { engine._primitives.radix_sort(cmd, keyBuffer, valueBuffer, count); };
+
+	engine.immediate_submit(record);
+	std::vector<uint32_t> sortedKeys = download(engine, keyBuffer, count);
+	std::vector<uint32_t> sortedValues = download(engine, valueBuffer, count);
+	bool correct = true;
+	for (uint32_t i = 0; i < count && correct; i++) {
+		correct = sortedValues[i] == order[i] && sortedKeys[i] == keys[order[i]];
+	}
+
+	// sorting sorted keys costs the same, so the timed runs can reuse them
+	std::vector<double> ms = timer.sample(record, options.gpuRepetitions);
+
+	engine._memory.destroy_buffer(keyBuffer);
+	engine._memory.destroy_buffer(valueBuffer);
+	// per digit pass: keys read twice, keys and values read and written once
+	uint32_t passes = 32 / GpuPrimitives::radixBits;
+	return report(results, "radix_sort", count, correct, std::move(ms), passes * 5.0 * count * sizeof(uint32_t));
+}
+
+// Runs the same population through both particle backends without emission
+// and compares the survivors. Compaction orders them differently, so both
+// sides are matched by lifetime, age and color, which integration leaves
+// alone or changes identically.
+static bool bench_cpu_backend(VulkanEngine& engine, BenchReport& results, uint32_t count)
+{
+	const float dt = 1.f / 60.f;
+	const uint32_t frames = 120;
+
+	ParticleSettings settings = engine._particles.settings();
+	settings.capacity = count;
+	CpuParticleSystem cpu;
+	cpu.init(settings);
+	cpu.set_emit_rate(0.f);
+	cpu.spawn(count);
+
+	std::vector<glm::vec4> positions(count), velocities(count);
+	std::vector<uint32_t> colors(count);
+	cpu.current().to_gpu(cpu.alive(), positions.data(), velocities.data(), colors.data());
+
+	float gpuEmitRate = engine._particles.settings().emitRate;
+	engine._particles.set_emit_rate(0.f);
+	engine._particles.load(positions.data(), velocities.data(), colors.data(), cpu.alive());
+
+	BenchResult simulate{fmt::format("cpu_backend/simulate/{}", count), "ms"};
+	simulate.elements = uint64_t(count) * settings.substeps;
+	for (uint32_t frame = 0; frame < frames; frame++) {
+		engine.immediate_submit([&](VkCommandBuffer cmd) { engine._particles.simulate(cmd, 0, dt); });
+		cpu.simulate(dt);
+		simulate.samples.push_back(cpu.stats().gpuMilliseconds);
+	}
+	engine._particles.collect(0);
+	engine._particles.set_emit_rate(gpuEmitRate);
+
+	uint32_t gpuAlive = engine._particles.download(positions, velocities, colors);
+	std::vector<glm::vec4> cpuPositions(cpu.alive()), cpuVelocities(cpu.alive());
+	std::vector<uint32_t> cpuColors(cpu.alive());
+	cpu.current().to_gpu(cpu.alive(), cpuPositions.data(), cpuVelocities.data(), cpuColors.data());
+
+	auto sorted_order = [](const std::vector<glm::vec4>& p, const std::vector<glm::vec4>& v,
+		const std::vector<uint32_t>& c) {
+		std::vector<uint32_t> order(p.size());
+		std::iota(order.begin(), order.end(), 0u);
+		std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+			return std::tie(v[a].w, p[a].w, c[a]) < std::tie(v[b].w, p[b].w, c[b]);
+		});
+		return order;
+	};
+
+	bool correct = gpuAlive == cpu.alive();
+	float maxError = 0.f;
+	if (correct) {
+		std::vector<uint32_t> gpuOrder = sorted_order(positions, velocities, colors);
+		std::vector<uint32_t> cpuOrder = sorted_order(cpuPositions, cpuVelocities, cpuColors);
+		for (uint32_t i = 0; i < gpuAlive; i++) {
+			glm::vec4 a = positions[gpuOrder[i]];
+			glm::vec4 b = cpuPositions[cpuOrder[i]];
+			// the GPU may contract multiply-adds, errors grow with the distance
+			float error = glm::length(glm::vec3(a) - glm::vec3(b)) / (1.f + glm::length(glm::vec3(b)));
+			maxError = std::max(maxError, error);
+		}
+		correct = maxError < 1e-3f;
+	}
+
+	if (correct) {
+		spdlog::info("{:<14} {:>9} particles  {} alive  max relative error {:.2e}", "cpu_backend", count, gpuAlive,
+			maxError);
+		results.add(std::move(simulate));
+	} else {
+		spdlog::error("{:<14} {:>9} particles  CPU {} alive, GPU {} alive, max relative error {:.2e}",
+			"cpu_backend", count, cpu.alive(), gpuAlive, maxError);
+	}
+	cpu.cleanup();
+	return correct;
+}
+
+// Plummer sphere in units with G = 1, total mass 1 and scale radius 1,
+// sampled as in Aarseth, Henon and Wielen 1974 and moved into its center of
+// mass frame. Radii beyond 10 are drawn again.
+static void plummer_sphere(std::mt19937& rng, uint32_t count, CpuParticleSet& set)
+{
+	std::uniform_real_distribution<float> uniform(0.f, 1.f);
+	auto direction = [&]() {
+		float z = 2.f * uniform(rng) - 1.f;
+		float phi = 2.f * glm::pi<float>() * uniform(rng);
+		float s = std::sqrt(1.f - z * z);
+		return glm::vec3(s * std::cos(phi), s * std::sin(phi), z);
+	};
+
+	set.resize(count);
+	glm::dvec3 meanPosition(0.0), meanVelocity(0.0);
+	for (uint32_t i = 0; i < count; i++) {
+		float r;
+		do {
+			r = 1.f / std::sqrt(std::pow(std::max(uniform(rng), 1e-6f), -2.f / 3.f) - 1.f);
+		} while (r > 10.f);
+
+		float q, g;
+		do {
+			q = uniform(rng);
+			g = 0.1f * uniform(rng);
+		} while (g > q * q * std::pow(1.f - q * q, 3.5f));
+		float speed = q * std::sqrt(2.f) * std::pow(1.f + r * r, -0.25f);
+
+		glm::vec3 p = r * direction();
+		glm::vec3 v = speed * direction();
+		set.x[i] = p.x;
+		set.y[i] = p.y;
+		set.z[i] = p.z;
+		set.vx[i] = v.x;
+		set.vy[i] = v.y;
+		set.vz[i] = v.z;
+		meanPosition += glm::dvec3(p);
+		meanVelocity += glm::dvec3(v);
+	}
+	glm::vec3 dp(meanPosition / double(count)), dv(meanVelocity / double(count));
+	for (uint32_t i = 0; i < count; i++) {
+		set.x[i] -= dp.x;
+		set.y[i] -= dp.y;
+		set.z[i] -= dp.z;
+		set.vx[i] -= dv.x;
+		set.vy[i] -= dv.y;
+		set.vz[i] -= dv.z;
+	}
+}
+
+// kinetic plus potential energy of equal bodies of `mass`, with potentials
+// that already include G times the mass
+static double total_energy(std::span<const glm::vec3> velocities, std::span<const float> potentials, double mass)
+{
+	double kinetic = 0.0, potential = 0.0;
+	for (size_t i = 0; i < velocities.size(); i++) {
+		kinetic += 0.5 * mass * glm::dot(glm::dvec3(velocities[i]), glm::dvec3(velocities[i]));
+		potential += 0.5 * mass * potentials[i];
+	}
+	return kinetic + potential;
+}
+
+// Barnes-Hut gravity on the CPU and the GPU over the same Plummer sphere at
+// the opening angle from --theta. The first solve is checked against a
+// direct sum over a sample of bodies and between both backends, then both
+// integrate with leapfrog (kick, drift, solve, kick) and report the solve
+// time with the interactions per solve, and the relative energy drift.
+static bool bench_barnes_hut(VulkanEngine& engine, BenchReport& results, GpuTimer& timer,
+	const BenchOptions& options, uint32_t count)
+{
+	const uint32_t steps = 32;
+	const float dt = 1.f / 64.f;
+	const uint32_t samples = 256;
+	const size_t chunk = 1024;
+
+	GravitySettings settings;
+	settings.strength = 1.f / count;
+	settings.softening = 0.02f;
+	settings.theta = options.theta;
+
+	std::mt19937 rng{count};
+	CpuParticleSet bodies;
+	plummer_sphere(rng, count, bodies);
+
+	// direct sum reference for the first bodies, which are in random order
+	std::vector<glm::dvec3> exact(std::min(samples, count));
+	double softening2 = double(settings.softening) * settings.softening;
+	for (uint32_t i = 0; i < exact.size(); i++) {
+		glm::dvec3 p(bodies.x[i], bodies.y[i], bodies.z[i]);
+		glm::dvec3 acc(0.0);
+		for (uint32_t j = 0; j < count; j++) {
+			glm::dvec3 d = glm::dvec3(bodies.x[j], bodies.y[j], bodies.z[j]) - p;
+			double r2 = glm::dot(d, d);
+			if (j != i) {
+				acc += d / std::pow(r2 + softening2, 1.5);
+			}
+		}
+		exact[i] = acc * double(settings.strength);
+	}
+	auto force_error = [&](auto&& acceleration) {
+		double sum = 0.0;
+		for (uint32_t i = 0; i < exact.size(); i++) {
+			double e = glm::length(glm::dvec3(acceleration(i)) - exact[i]) / std::max(glm::length(exact[i]), 1e-12);
+			sum += e * e;
+		}
+		return std::sqrt(sum / exact.size());
+	};
+
+	// CPU
+	JobPool jobs;
+	jobs.init();
+	CpuGravitySolver cpu;
+	cpu.init(count, settings);
+	CpuParticleSet cpuBodies = bodies;
+	auto cpu_velocities = [&]() {
+		std::vector<glm::vec3> v(count);
+		for (uint32_t i = 0; i < count; i++) {
+			v[i] = glm::vec3(cpuBodies.vx[i], cpuBodies.vy[i], cpuBodies.vz[i]);
+		}
+		return v;
+	};
+
+	cpu.solve(jobs, chunk, cpuBodies.x.data(), cpuBodies.y.data(), cpuBodies.z.data(), count);
+	std::vector<glm::vec3> cpuAcceleration(count);
+	for (uint32_t i = 0; i < count; i++) {
+		cpuAcceleration[i] = glm::vec3(cpu.ax[i], cpu.ay[i], cpu.az[i]);
+	}
+	double cpuError = force_error([&](uint32_t i) { return cpuAcceleration[i]; });
+	double cpuStart = total_energy(cpu_velocities(), cpu.potential, 1.0 / count);
+
+	BenchResult cpuSolve{fmt::format("barnes_hut/cpu/{}", count), "ms"};
+	cpuSolve.elements = cpu.interactions();
+	for (uint32_t step = 0; step < steps; step++) {
+		cpu.kick(jobs, chunk, cpuBodies, count, 0.5f * dt);
+		cpu.drift(jobs, chunk, cpuBodies, count, dt);
+		auto start = std::chrono::steady_clock::now();
+		cpu.solve(jobs, chunk, cpuBodies.x.data(), cpuBodies.y.data(), cpuBodies.z.data(), count);
+		cpuSolve.samples.push_back(
+			std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+		cpu.kick(jobs, chunk, cpuBodies, count, 0.5f * dt);
+	}
+	double cpuDrift = std::abs(total_energy(cpu_velocities(), cpu.potential, 1.0 / count) - cpuStart)
+		/ std::abs(cpuStart);
+	uint32_t cpuNodes = cpu.octree().node_count();
+	uint32_t cpuOverflow = cpu.octree().overflow();
+	jobs.cleanup();
+
+	// GPU, on bodies laid out like a particle set
+	std::vector<glm::vec4> positions(count), velocities(count);
+	for (uint32_t i = 0; i < count; i++) {
+		positions[i] = glm::vec4(bodies.x[i], bodies.y[i], bodies.z[i], 0.f);
+		velocities[i] = glm::vec4(bodies.vx[i], bodies.vy[i], bodies.vz[i], 0.f);
+	}
+	auto upload_vec4 = [&](const std::vector<glm::vec4>& data) {
+		return engine.upload_buffer(data.data(), data.size() * sizeof(glm::vec4),
+			VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT
+				| VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+			MemoryTag::Other);
+	};
+	auto download_vec4 = [&](const AllocatedBuffer& buffer) {
+		std::vector<uint32_t> words = download(engine, buffer, size_t(count) * 4);
+		std::vector<glm::vec4> result(count);
+		memcpy(result.data(), words.data(), result.size() * sizeof(glm::vec4));
+		return result;
+	};
+	auto gpu_energy = [&](const std::vector<glm::vec4>& v, const std::vector<glm::vec4>& a) {
+		std::vector<glm::vec3> v3(v.begin(), v.end());
+		std::vector<float> phi(count);
+		for (uint32_t i = 0; i < count; i++) {
+			phi[i] = a[i].w;
+		}
+		return total_energy(v3, phi, 1.0 / count);
+	};
+
+	AllocatedBuffer positionBuffer = upload_vec4(positions);
+	AllocatedBuffer velocityBuffer = upload_vec4(velocities);
+	AllocatedBuffer countBuffer = upload(engine, {count});
+	GravitySolver gpu;
+	gpu.init(&engine, count, settings);
+	GravityBodies gpuBodies{positionBuffer.address, velocityBuffer.address, countBuffer.address, 0};
+
+	engine.immediate_submit([&](VkCommandBuffer cmd) { gpu.solve(cmd, gpuBodies); });
+	std::vector<glm::vec4> gpuAcceleration = download_vec4(gpu.accelerations());
+	std::vector<uint32_t> interactions = download(engine, gpu.interactions(), count);
+	double gpuError = force_error([&](uint32_t i) { return glm::vec3(gpuAcceleration[i]); });
+	double gpuStart = gpu_energy(velocities, gpuAcceleration);
+
+	// the trees are the same, only rounding and the odd cell right at the
+	// opening angle may differ
+	double rms = 0.0;
+	for (const glm::vec3& a : cpuAcceleration) {
+		rms += glm::dot(glm::dvec3(a), glm::dvec3(a));
+	}
+	rms = std::sqrt(rms / count);
+	double backendDifference = 0.0;
+	for (uint32_t i = 0; i < count; i++) {
+		backendDifference += glm::length(glm::dvec3(gpuAcceleration[i]) - glm::dvec3(cpuAcceleration[i])) / rms;
+	}
+	backendDifference /= count;
+
+	BenchResult gpuSolve{fmt::format("barnes_hut/gpu/{}", count), "ms"};
+	gpuSolve.elements = std::accumulate(interactions.begin(), interactions.end(), uint64_t(0));
+	gpuSolve.samples = timer.sample([&](VkCommandBuffer cmd) { gpu.solve(cmd, gpuBodies); }, options.gpuRepetitions);
+
+	// the timed solves ran at the initial positions, so the integration can
+	// start from their accelerations
+	engine.immediate_submit([&](VkCommandBuffer cmd) {
+		for (uint32_t step = 0; step < steps; step++) {
+			gpu.kick(cmd, gpuBodies, 0.5f * dt);
+			gpu.drift(cmd, gpuBodies, dt);
+			gpu.solve(cmd, gpuBodies);
+			gpu.kick(cmd, gpuBodies, 0.5f * dt);
+		}
+	});
+	double gpuDrift = std::abs(gpu_energy(download_vec4(velocityBuffer), download_vec4(gpu.accelerations())) - gpuStart)
+		/ std::abs(gpuStart);
+
+	gpu.cleanup();
+	for (AllocatedBuffer* buffer : {&positionBuffer, &velocityBuffer, &countBuffer}) {
+		engine._memory.destroy_buffer(*buffer);
+	}
+
+	// a quadrupole expansion stays well inside this up to theta 1, larger
+	// errors mean a broken tree
+	bool correct = backendDifference < 1e-3 && (options.theta > 1.f || std::max(cpuError, gpuError) < 0.05);
+	if (!correct) {
+		spdlog::error("{:<14} {:>9} bodies  theta {}  force error CPU {:.2e} GPU {:.2e}, backends differ by {:.2e}",
+			"barnes_hut", count, options.theta, cpuError, gpuError, backendDifference);
+		return false;
+	}
+
+	auto rate = [](const BenchResult& result) {
+		return result.elements / (bench_statistics(result.samples).median * 1e-3);
+	};
+	spdlog::info("{:<14} {:>9} bodies  theta {}  {} nodes ({} cells left unsplit)", "barnes_hut", count,
+		options.theta, cpuNodes, cpuOverflow);
+	spdlog::info("{:<14} CPU {:.3g} interactions/s, force error {:.2e}, energy drift {:.2e} over {} steps", "",
+		rate(cpuSolve), cpuError, cpuDrift, steps);
+	spdlog::info("{:<14} GPU {:.3g} interactions/s, force error {:.2e}, energy drift {:.2e} over {} steps", "",
+		rate(gpuSolve), gpuError, gpuDrift, steps);
+	results.add(std::move(cpuSolve));
+	results.add(std::move(gpuSolve));
+	results.add({fmt::format("barnes_hut/cpu_energy_drift/{}", count), "relative", {cpuDrift}});
+	results.add({fmt::format("barnes_hut/gpu_energy_drift/{}", count), "relative", {gpuDrift}});
+	return true;
+}
+
+// UV sphere around the origin, as a collider for the cloth
+static MeshBvh sphere_collider(float radius, uint32_t segments)
+{
+	std::vector<glm::vec3> positions;
+	for (uint32_t y = 0; y <= segments; y++) {
+		float theta = glm::pi<float>() * y / segments;
+		for (uint32_t x = 0; x <= 2 * segments; x++) {
+			float phi = glm::pi<float>() * x / segments;
+			positions.push_back(radius * glm::vec3(std::sin(theta) * std::cos(phi), std::cos(theta),
+				std::sin(theta) * std::sin(phi)));
+		}
+	}
+	std::vector<uint32_t> indices;
+	uint32_t row = 2 * segments + 1;
+	for (uint32_t y = 0; y < segments; y++) {
+		for (uint32_t x = 0; x < 2 * segments; x++) {
+			uint32_t i = y * row + x;
+			// counter-clockwise seen from outside, MeshBvh normals point out
+			indices.insert(indices.end(), {i, i + 1, i + row, i + 1, i + row + 1, i + row});
+		}
+	}
+	MeshBvh bvh;
+	bvh.build(positions, indices, glm::mat4(1.f));
+	return bvh;
+}
+
+static bool bench_xpbd(VulkanEngine& engine, BenchReport& results, GpuTimer& timer, const BenchOptions& options,
+	uint32_t resolution)
+{
+	const uint32_t frames = 30;
+	const float dt = 1.f / 60.f;
+	const size_t chunk = 1024;
+
+	ClothSettings cloth;
+	cloth.resolution = resolution;
+	XpbdSettings settings;
+	settings.thickness = cloth.size / resolution * 0.5f;
+	MeshBvh collider = sphere_collider(0.3f, 32);
+	XpbdModel model = vkutil::make_cloth(glm::translate(glm::mat4(1.f), glm::vec3(0.f, 0.4f, 0.f)), cloth);
+	uint32_t particles = (uint32_t)model.positions.size();
+	uint32_t constraints = (uint32_t)model.constraints.size();
+
+	// CPU coloring
+	JobPool jobs;
+	jobs.init();
+	XpbdAdjacency adjacency = vkutil::constraint_adjacency(model);
+	BenchResult cpuColoring{fmt::format("xpbd/cpu_coloring/{}", constraints), "ms"};
+	cpuColoring.elements = constraints;
+	std::vector<uint32_t> colors;
+	uint32_t cpuRounds = 0;
+	for (uint32_t i = 0; i < options.repetitions; i++) {
+		auto start = std::chrono::steady_clock::now();
+		colors = vkutil::color_constraints(jobs, chunk, model, adjacency, &cpuRounds);
+		cpuColoring.samples.push_back(
+			std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+	}
+	XpbdModel batched = model;
+	vkutil::batch_constraints(batched, colors);
+
+	// GPU coloring and batching happen in init, the uploads are timed along
+	// with the rounds
+	XpbdSolver gpu;
+	gpu.init(&engine, model, settings, &collider);
+	const XpbdModel& gpuModel = gpu.model();
+	bool sameColors = gpuModel.batchStart == batched.batchStart
+		&& std::equal(gpuModel.constraints.begin(), gpuModel.constraints.end(), batched.constraints.begin(),
+			[](const XpbdConstraint& a, const XpbdConstraint& b) { return a.a == b.a && a.b == b.b; });
+	bool valid = vkutil::valid_batches(batched) && vkutil::valid_batches(gpuModel)
+		&& std::find(colors.begin(), colors.end(), XPBD_UNCOLORED) == colors.end();
+
+	// both backends from the same batched model, so particles line up
+	CpuXpbdSolver cpu;
+	cpu.init(batched, settings, &collider);
+	BenchResult cpuStep{fmt::format("xpbd/cpu/{}", particles), "ms"};
+	cpuStep.elements = uint64_t(constraints) * settings.substeps * settings.iterations;
+	for (uint32_t frame = 0; frame < frames; frame++) {
+		auto start = std::chrono::steady_clock::now();
+		cpu.step(jobs, chunk, dt);
+		cpuStep.samples.push_back(
+			std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+		engine.immediate_submit([&](VkCommandBuffer cmd) { gpu.step(cmd, dt); });
+	}
+	jobs.cleanup();
+
+	std::vector<uint32_t> words = download(engine, gpu.positions(), size_t(particles) * 4);
+	std::vector<glm::vec4> gpuPositions(particles);
+	memcpy(gpuPositions.data(), words.data(), gpuPositions.size() * sizeof(glm::vec4));
+	float difference = 0.f;
+	float lowest = 3.4e38f;
+	for (uint32_t i = 0; i < particles; i++) {
+		difference = std::max(difference, glm::length(glm::vec3(gpuPositions[i]) - glm::vec3(cpu.positions()[i])));
+		lowest = std::min(lowest, cpu.positions()[i].y);
+	}
+	difference /= cloth.size;
+
+	BenchResult gpuStep{fmt::format("xpbd/gpu/{}", particles), "ms"};
+	gpuStep.elements = cpuStep.elements;
+	gpuStep.samples = timer.sample([&](VkCommandBuffer cmd) { gpu.step(cmd, dt); }, options.gpuRepetitions);
+	XpbdStats stats = gpu.stats();
+	gpu.cleanup();
+
+	// the same batches in the same order, only rounding differs; a cloth
+	// that fell past the sphere did not collide
+	bool correct = sameColors && valid && difference < 1e-2f && lowest > -1.f;
+	if (!correct) {
+		spdlog::error("{:<14} {:>9} particles  colors valid {} equal {}, backends differ by {:.2e}, lowest y {:.2f}",
+			"xpbd", particles, valid, sameColors, difference, lowest);
+		return false;
+	}
+
+	auto rate = [](const BenchResult& result) {
+		return result.elements / (bench_statistics(result.samples).median * 1e-3);
+	};
+	spdlog::info("{:<14} {:>9} particles  {} constraints in {} colors, {} rounds on the CPU, {} on the GPU ({:.1f} ms)",
+		"xpbd", particles, constraints, stats.colors, cpuRounds, stats.coloringRounds, stats.coloringMilliseconds);
+	spdlog::info("{:<14} CPU {:.3g} projections/s, GPU {:.3g} projections/s, backends differ by {:.2e}", "",
+		rate(cpuStep), rate(gpuStep), difference);
+	results.add(std::move(cpuColoring));
+	results.add({fmt::format("xpbd/gpu_coloring/{}", constraints), "ms", {stats.coloringMilliseconds}});
+	results.add({fmt::format("xpbd/colors/{}", constraints), "count", {double(stats.colors)}});
+	results.add(std::move(cpuStep));
+	results.add(std::move(gpuStep));
+	return true;
+}
+
+// Runs the same population through the particle system in every storage
+// layout and compares each against the Float32 run, matched by attribute.
+// Errors are relative to the extent of the box the particles start in, memory
+// is per particle and set. Float16 positions lose steps shorter than half a
+// unit in the last place, so they only have to stay finite; layouts with
+// Float32 or Fixed positions must stay within a percent.
+static bool bench_storage(VulkanEngine& engine, BenchReport& results, GpuTimer& timer, const BenchOptions& options,
+	uint32_t count)
+{
+	const float dt = 1.f / 60.f;
+	const uint32_t frames = 60;
+	const float extent = 64.f;
+
+	std::mt19937 rng{1234};
+	std::uniform_real_distribution<float> box(-extent * 0.5f, extent * 0.5f);
+	std::uniform_real_distribution<float> speed(-4.f, 4.f);
+	std::vector<glm::vec4> positions(count), velocities(count);
+	std::vector<uint32_t> attributes(count);
+	for (uint32_t i = 0; i < count; i++) {
+		positions[i] = glm::vec4(box(rng), box(rng) + extent * 0.5f, box(rng), 0.f);
+		velocities[i] = glm::vec4(speed(rng), speed(rng), speed(rng), 60.f);
+		attributes[i] = i;
+	}
+
+	const struct {
+		StorageFormat position;
+		StorageFormat velocity;
+		float tolerance;
+	} layouts[] = {
+		{StorageFormat::Float32, StorageFormat::Float32, 0.f},
+		{StorageFormat::Float32, StorageFormat::Float16, 1e-2f},
+		{StorageFormat::Fixed, StorageFormat::Float16, 1e-2f},
+		{StorageFormat::Float16, StorageFormat::Float16, 1.f},
+	};
+
+	bool correct = true;
+	std::vector<glm::vec4> reference;
+	for (const auto& layout : layouts) {
+		ParticleSettings settings = engine._particles.settings();
+		settings.capacity = count;
+		settings.storage.position = layout.position;
+		settings.storage.velocity = layout.velocity;
+		settings.storage.cellExponent = vkutil::fixed_cell_exponent(extent);
+		ParticleSystem system;
+		system.init(&engine, settings);
+		system.set_emit_rate(0.f);
+		system.load(positions.data(), velocities.data(), attributes.data(), count);
+
+		for (uint32_t frame = 0; frame < frames; frame++) {
+			engine.immediate_submit([&](VkCommandBuffer cmd) { system.simulate(cmd, 0, dt); });
+		}
+		std::vector<glm::vec4> p, v;
+		std::vector<uint32_t> a;
+		uint32_t alive = system.download(p, v, a);
+
+		// compaction reorders the particles
+		std::vector<glm::vec4> byAttribute(count, glm::vec4(NAN));
+		for (uint32_t i = 0; i < alive; i++) {
+			if (a[i] < count) {
+				byAttribute[a[i]] = p[i];
+			}
+		}
+		if (reference.empty()) {
+			reference = byAttribute;
+		}
+
+		double squared = 0.0;
+		float maxError = 0.f;
+		bool finite = alive == count;
+		for (uint32_t i = 0; i < count && finite; i++) {
+			float error = glm::length(glm::vec3(byAttribute[i]) - glm::vec3(reference[i])) / extent;
+			finite = std::isfinite(error);
+			squared += double(error) * error;
+			maxError = std::max(maxError, error);
+		}
+		double rms = std::sqrt(squared / count);
+
+		std::string name = fmt::format("{}_{}", to_string(layout.position), to_string(layout.velocity));
+		BenchResult simulate{fmt::format("storage/{}/{}", name, count), "ms"};
+		simulate.elements = uint64_t(count) * settings.substeps;
+		simulate.bytes = double(count) * settings.substeps * system.particle_bytes() * 2.0;
+		simulate.samples =
+			timer.sample([&](VkCommandBuffer cmd) { system.simulate(cmd, 0, dt); }, options.gpuRepetitions);
+		size_t bytes = system.particle_bytes();
+		system.cleanup();
+
+		if (!finite || maxError > layout.tolerance) {
+			spdlog::error("{:<14} {:>9} particles  {} alive as {}, max error {:.2e} of the extent", "storage", count,
+				alive, name, maxError);
+			correct = false;
+			continue;
+		}
+		double milliseconds = bench_statistics(simulate.samples).median;
+		spdlog::info("{:<14} {:<11} {:>2} bytes, {:>4.0f}M particles/GiB, {:.3g} updates/s, rms error {:.2e}, "
+					 "max {:.2e}",
+			"storage", name, bytes, double(1ull << 30) / bytes / 1e6, simulate.elements / (milliseconds * 1e-3), rms,
+			maxError);
+		results.add(std::move(simulate));
+		results.add({fmt::format("storage/{}/rms_error", name), "ratio", {rms}});
+		results.add({fmt::format("storage/{}/bytes", name), "bytes", {double(bytes)}});
+	}
+	return correct;
+}
+
+// vkutil::cull_spheres and cull_aabbs against one vkutil::is_visible per
+// volume. The batches may round differently, so they only have to agree on
+// volumes that are not touching a plane.
+static bool bench_culling(BenchReport& results, const BenchOptions& options, uint32_t count)
+{
+	Camera camera;
+	camera.set_perspective(glm::radians(70.f), 16.f / 9.f, 0.1f);
+	camera.look_at(glm::vec3(0.f, 20.f, 120.f), glm::vec3(0.f));
+	const Frustum& frustum = camera.frustum();
+
+	std::mt19937 rng{count};
+	std::uniform_real_distribution<float> position(-100.f, 100.f), size(0.05f, 4.f);
+	SphereBoundsSoA spheres;
+	AabbBoundsSoA aabbs;
+	for (uint32_t i = 0; i < count; i++) {
+		glm::vec3 center(position(rng), position(rng), position(rng));
+		spheres.push_back(center, size(rng));
+		glm::vec3 half(size(rng), size(rng), size(rng));
+		aabbs.push_back(center - half, center + half);
+	}
+
+	// smallest distance of the volume's furthest point to any plane, a box
+	// reaches `extents` and a sphere `radius` past its center
+	auto margin = [&](const glm::vec3& center, const glm::vec3& extents, float radius) {
+		float closest = 3.4e38f;
+		for (const glm::vec4& p : frustum.planes) {
+			glm::vec3 n(p);
+			closest = std::min(closest, std::abs(glm::dot(n, center) + p.w + glm::dot(glm::abs(n), extents) + radius));
+		}
+		return closest;
+	};
+
+	auto measure = [&](auto&& cull) {
+		std::vector<double> samples;
+		for (uint32_t i = 0; i < options.warmup + options.repetitions; i++) {
+			auto start = std::chrono::steady_clock::now();
+			cull();
+			double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+			if (i >= options.warmup) {
+				samples.push_back(ms);
+			}
+		}
+		return samples;
+	};
+
+	bool correct = true;
+	auto compare = [&](const char* kind, std::vector<uint32_t> batch, std::vector<uint32_t> single,
+		auto&& volume_margin, std::vector<double> batchMs, std::vector<double> singleMs) {
+		std::vector<uint32_t> differ;
+		std::set_symmetric_difference(batch.begin(), batch.end(), single.begin(), single.end(),
+			std::back_inserter(differ));
+		uint32_t wrong = 0;
+		for (uint32_t i : differ) {
+			wrong += volume_margin(i) > 1e-3f ? 1 : 0;
+		}
+		double speedup = bench_statistics(singleMs).median / bench_statistics(batchMs).median;
+		if (wrong > 0) {
+			spdlog::error("{:<14} {:>9} {}  {} of {} visible differ from is_visible", "culling", count, kind, wrong,
+				single.size());
+			correct = false;
+			return;
+		}
+		spdlog::info("{:<14} {:>9} {}  {} visible, {:.1f}x the is_visible loop", "culling", count, kind,
+			batch.size(), speedup);
+
+		BenchResult batchResult{fmt::format("culling/{}/batch/{}", kind, count), "ms", std::move(batchMs)};
+		batchResult.elements = count;
+		results.add(std::move(batchResult));
+		BenchResult singleResult{fmt::format("culling/{}/is_visible/{}", kind, count), "ms", std::move(singleMs)};
+		singleResult.elements = count;
+		results.add(std::move(singleResult));
+	};
+
+	std::vector<uint32_t> batch, single;
+	std::vector<double> batchMs = measure([&]() {
+		batch.clear();
+		vkutil::cull_spheres(frustum, spheres, batch);
+	});
+	std::vector<double> singleMs = measure([&]() {
+		single.clear();
+		for (uint32_t i = 0; i < count; i++) {
+			if (vkutil::is_visible(frustum, glm::vec3(spheres.x[i], spheres.y[i], spheres.z[i]), spheres.radius[i])) {
+				single.push_back(i);
+			}
+		}
+	});
+	compare("spheres", batch, single, [&](uint32_t i) {
+		return margin(glm::vec3(spheres.x[i], spheres.y[i], spheres.z[i]), glm::vec3(0.f), spheres.radius[i]);
+	}, std::move(batchMs), std::move(singleMs));
+
+	batchMs = measure([&]() {
+		batch.clear();
+		vkutil::cull_aabbs(frustum, aabbs, batch);
+	});
+	singleMs = measure([&]() {
+		single.clear();
+		for (uint32_t i = 0; i < count; i++) {
+			glm::vec3 min(aabbs.minX[i], aabbs.minY[i], aabbs.minZ[i]);
+			glm::vec3 max(aabbs.maxX[i], aabbs.maxY[i], aabbs.maxZ[i]);
+			if (vkutil::is_visible(frustum, min, max)) {
+				single.push_back(i);
+			}
+		}
+	});
+	compare("aabbs", batch, single, [&](uint32_t i) {
+		glm::vec3 min(aabbs.minX[i], aabbs.minY[i], aabbs.minZ[i]);
+		glm::vec3 max(aabbs.maxX[i], aabbs.maxY[i], aabbs.maxZ[i]);
+		return margin((min + max) * 0.5f, (max - min) * 0.5f, 0.f);
+	}, std::move(batchMs), std::move(singleMs));
+	return correct;
+}
+
+static void usage()
+{
+	spdlog::info("vkengine_bench [--json <file>] [--repetitions <n>] [--filter <group>] [--theta <opening angle>] "
+				 "[--window] [--validation]");
+	spdlog::info("groups: primitives cpu_backend barnes_hut xpbd storage culling descriptors deletion_queue "
+				 "command_buffer barriers shader_modules pipelines metrics frame");
+}
+
+int main(int argc, char* argv[])
+{
+	BenchOptions options;
+	bool headless = true;
+	bool validation = false;
+	for (int i = 1; i < argc; i++) {
+		std::string_view arg = argv[i];
+		bool hasValue = i + 1 < argc;
+		if (arg == "--json" && hasValue) {
+			options.jsonPath = argv[++i];
+		} else if (arg == "--repetitions" && hasValue) {
+			options.repetitions = std::max(1, std::atoi(argv[++i]));
+		} else if (arg == "--filter" && hasValue) {
+			options.filter = argv[++i];
+		} else if (arg == "--theta" && hasValue) {
+			options.theta = std::max(0.f, std::strtof(argv[++i], nullptr));
+		} else if (arg == "--window") {
+			headless = false;
+		} else if (arg == "--validation") {
+			validation = true;
+		} else {
+			usage();
+			return 2;
+		}
+	}
+
+	// needs VK_EXT_headless_surface, which lavapipe and the desktop drivers have
+	if (headless) {
+		SDL_SetHint(SDL_HINT_VIDEO_DRIVER, "offscreen");
+	}
+
+	VulkanEngine engine;
+	engine._validationLayers = validation;
+	engine.init();
+	spdlog::info("{} on {}", headless ? "Headless" : "Windowed", engine._gpuProperties.deviceName);
+
+	BenchReport results;
+	bool correct = true;
+	if (options.enabled("primitives")) {
+		const uint32_t counts[] = {1000, 1u << 16, (1u << 20) + 7, 1u << 24};
+		engine._primitives.reserve(counts[3]);
+		spdlog::info("{} scan", engine._primitives.uses_lookback() ? "decoupled look-back" : "reduce-then-scan");
+
+		GpuTimer timer{engine};
+		std::mt19937 rng{1234};
+		for (uint32_t count : counts) {
+			correct &= bench_scan(engine, results, timer, options, rng, count);
+			correct &= bench_reduce(engine, results, timer, options, rng, count);
+			correct &= bench_compact(engine, results, timer, options, rng, count);
+			correct &= bench_radix_sort(engine, results, timer, options, rng, count);
+		}
+	}
+	if (options.enabled("cpu_backend")) {
+		correct &= bench_cpu_backend(engine, results, std::min(1u << 20, engine._particles.settings().capacity));
+	}
+	if (options.enabled("barnes_hut")) {
+		GpuTimer timer{engine};
+		for (uint32_t count : {1u << 14, 1u << 16}) {
+			correct &= bench_barnes_hut(engine, results, timer, options, count);
+		}
+	}
+	if (options.enabled("xpbd")) {
+		GpuTimer timer{engine};
+		for (uint32_t resolution : {64u, 256u}) {
+			correct &= bench_xpbd(engine, results, timer, options, resolution);
+		}
+	}
+	if (options.enabled("storage")) {
+		GpuTimer timer{engine};
+		correct &= bench_storage(engine, results, timer, options, 1u << 20);
+	}
+	if (options.enabled("culling")) {
+		for (uint32_t count : {1000u, (1u << 20) + 3}) {
+			correct &= bench_culling(results, options, count);
+		}
+	}
+	run_microbenchmarks(engine, results, options);
+
+	if (!options.jsonPath.empty()) {
+		correct &= results.write_json(options.jsonPath, engine, options, correct);
+	}
+
+	engine.cleanup();
+	return correct ? 0 : 1;
+}
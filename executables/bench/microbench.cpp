@@ -0,0 +1,460 @@
+#include "bench.h"
+
+#include "vk_descriptors.h"
+#include "vk_images.h"
+#include "vk_initializers.h"
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+using Clock = std::chrono::steady_clock;
+
+static double elapsed_ns(Clock::time_point start)
+{
+	return std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+}
+
+// Runs `sample` warmup + repetitions times and keeps what it returns after
+// the warmup
+template <typename F>
+static std::vector<double> collect(const BenchOptions& options, F&& sample)
+{
+	std::vector<double> samples;
+	samples.reserve(options.repetitions);
+	for (uint32_t i = 0; i < options.warmup + options.repetitions; i++) {
+		double value = sample();
+		if (i >= options.warmup) {
+			samples.push_back(value);
+		}
+	}
+	return samples;
+}
+
+static void bench_descriptors(VulkanEngine& engine, BenchReport& report, const BenchOptions& options)
+{
+	const uint32_t sets = 256;
+	VkDevice device = engine._device;
+
+	DescriptorLayoutBuilder builder;
+	builder.add_binding(0, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE);
+	builder.add_binding(1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+	VkDescriptorSetLayout layout = builder.build(device, VK_SHADER_STAGE_COMPUTE_BIT);
+
+	std::vector<DescriptorAllocator::PoolSizeRatio> ratios = {
+		{VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 1},
+		{VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1},
+	};
+	DescriptorAllocator allocator;
+	allocator.init_pool(device, sets, ratios);
+
+	// a reset frees a full pool, like the per frame allocators would
+	BenchResult allocate{"descriptors/allocate", "ns"};
+	BenchResult reset{"descriptors/reset", "ns"};
+	reset.samples = collect(options, [&]() {
+		Clock::time_point start = Clock::now();
+		for (uint32_t i = 0; i < sets; i++) {
+			allocator.allocate(device, layout);
+		}
+		allocate.samples.push_back(elapsed_ns(start) / sets);
+
+		start = Clock::now();
+		allocator.clear_descriptors(device);
+		return elapsed_ns(start);
+	});
+	allocate.samples.erase(allocate.samples.begin(), allocate.samples.begin() + options.warmup);
+	report.add(std::move(allocate));
+	report.add(std::move(reset));
+
+	allocator.destroy_pool(device);
+	vkDestroyDescriptorSetLayout(device, layout, nullptr);
+}
+
+static void bench_deletion_queue(VulkanEngine& engine, BenchReport& report, const BenchOptions& options)
+{
+	const uint32_t entries = 4096;
+	DeletionQueue queue;
+	uint64_t destroyed = 0;
+
+	// captures about what the engine's deleters capture, a pointer and a handle
+	BenchResult add{"deletion_queue/add", "ns"};
+	BenchResult flush{"deletion_queue/flush", "ns"};
+	flush.samples = collect(options, [&]() {
+		Clock::time_point start = Clock::now();
+		for (uint32_t i = 0; i < entries; i++) {
+			queue.add([&destroyed, handle = uint64_t(i)]() { destroyed += handle; });
+		}
+		add.samples.push_back(elapsed_ns(start) / entries);
+
+		start = Clock::now();
+		queue.flush(engine._device);
+		return elapsed_ns(start) / entries;
+	});
+	add.samples.erase(add.samples.begin(), add.samples.begin() + options.warmup);
+	report.add(std::move(add));
+	report.add(std::move(flush));
+
+	if (destroyed == 0) {
+		spdlog::error("Deletion queue ran no deleters");
+	}
+}
+
+static void bench_command_buffers(VulkanEngine& engine, BenchReport& report, const BenchOptions& options)
+{
+	const uint32_t recordings = 64;
+	const uint32_t passes = 16;
+	VkDevice device = engine._device;
+
+	VkCommandPool pool;
+	VkCommandPoolCreateInfo poolInfo = vkinit::command_pool_create_info(engine._graphicsQueueFamily);
+	vk_check(vkCreateCommandPool(device, &poolInfo, nullptr, &pool));
+	VkCommandBuffer cmd;
+	VkCommandBufferAllocateInfo allocInfo = vkinit::command_buffer_allocate_info(pool);
+	vk_check(vkAllocateCommandBuffers(device, &allocInfo, &cmd));
+	VkFence fence;
+	VkFenceCreateInfo fenceInfo = vkinit::fence_create_info();
+	vk_check(vkCreateFence(device, &fenceInfo, nullptr, &fence));
+
+	AllocatedBuffer buffer = engine._memory.create_buffer(passes * 256, VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+		VMA_MEMORY_USAGE_GPU_ONLY, MemoryTag::Other);
+
+	// a small but typical command buffer: fills with a barrier after each
+	auto record = [&]() {
+		vk_check(vkResetCommandPool(device, pool, 0));
+		VkCommandBufferBeginInfo beginInfo = vkinit::command_buffer_begin_info(
+			VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
+		vk_check(vkBeginCommandBuffer(cmd, &beginInfo));
+		for (uint32_t pass = 0; pass < passes; pass++) {
+			vkCmdFillBuffer(cmd, buffer.buffer, pass * 256, 256, pass);
+			vkutil::memory_barrier(cmd, VK_PIPELINE_STAGE_2_CLEAR_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT,
+				VK_PIPELINE_STAGE_2_CLEAR_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT);
+		}
+		vk_check(vkEndCommandBuffer(cmd));
+	};
+
+	BenchResult recording{"command_buffer/record", "ns"};
+	recording.samples = collect(options, [&]() {
+		Clock::time_point start = Clock::now();
+		for (uint32_t i = 0; i < recordings; i++) {
+			record();
+		}
+		return elapsed_ns(start) / recordings;
+	});
+	report.add(std::move(recording));
+
+	// submit, execute and wait, the latency immediate_submit pays
+	BenchResult submit{"command_buffer/submit_wait", "us"};
+	submit.samples = collect(options, [&]() {
+		record();
+		VkCommandBufferSubmitInfo cmdInfo = vkinit::command_buffer_submit_info(cmd);
+		VkSubmitInfo2 submitInfo = vkinit::submit_info(&cmdInfo, nullptr, nullptr);
+
+		Clock::time_point start = Clock::now();
+		vk_check(vkQueueSubmit2(engine._graphicsQueue, 1, &submitInfo, fence));
+		vk_check(vkWaitForFences(device, 1, &fence, VK_TRUE, UINT64_MAX));
+		double ns = elapsed_ns(start);
+		vk_check(vkResetFences(device, 1, &fence));
+		return ns / 1e3;
+	});
+	report.add(std::move(submit));
+
+	engine._memory.destroy_buffer(buffer);
+	vkDestroyFence(device, fence, nullptr);
+	vkDestroyCommandPool(device, pool, nullptr);
+}
+
+static void bench_barriers(VulkanEngine& engine, BenchReport& report, const BenchOptions& options)
+{
+	const uint32_t transitions = 256;
+	VkDevice device = engine._device;
+
+	VkImageCreateInfo imageInfo = vkinit::image_create_info(VK_FORMAT_R8G8B8A8_UNORM,
+		VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT, VkExtent3D{256, 256, 1});
+	VmaAllocationCreateInfo allocInfo = {};
+	allocInfo.usage = VMA_MEMORY_USAGE_GPU_ONLY;
+	VkImage image;
+	VmaAllocation allocation;
+	vk_check(engine._memory.create_image(imageInfo, allocInfo, MemoryTag::Other, &image, &allocation));
+	engine.immediate_submit([&](VkCommandBuffer cmd) {
+		vkutil::transition_image(cmd, image, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL);
+	});
+
+	// starts and ends in GENERAL
+	auto record = [&](VkCommandBuffer cmd) {
+		for (uint32_t i = 0; i < transitions; i += 2) {
+			vkutil::transition_image(cmd, image, VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+			vkutil::transition_image(cmd, image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_GENERAL);
+		}
+	};
+
+	VkCommandPool pool;
+	VkCommandPoolCreateInfo poolInfo = vkinit::command_pool_create_info(engine._graphicsQueueFamily);
+	vk_check(vkCreateCommandPool(device, &poolInfo, nullptr, &pool));
+	VkCommandBuffer cmd;
+	VkCommandBufferAllocateInfo cmdAllocInfo = vkinit::command_buffer_allocate_info(pool);
+	vk_check(vkAllocateCommandBuffers(device, &cmdAllocInfo, &cmd));
+
+	BenchResult recorded{"barriers/transition_record", "ns"};
+	recorded.samples = collect(options, [&]() {
+		vk_check(vkResetCommandPool(device, pool, 0));
+		VkCommandBufferBeginInfo beginInfo = vkinit::command_buffer_begin_info(
+			VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
+		vk_check(vkBeginCommandBuffer(cmd, &beginInfo));
+		Clock::time_point start = Clock::now();
+		record(cmd);
+		double ns = elapsed_ns(start);
+		vk_check(vkEndCommandBuffer(cmd));
+		return ns / transitions;
+	});
+	report.add(std::move(recorded));
+
+	// transition_image is a full pipeline barrier, this is what it costs the GPU
+	GpuTimer timer{engine};
+	BenchResult executed{"barriers/transition_gpu", "ns"};
+	executed.samples = collect(options, [&]() { return timer.measure(record, 1) * 1e6 / transitions; });
+	report.add(std::move(executed));
+
+	vkDestroyCommandPool(device, pool, nullptr);
+	engine._memory.destroy_image(image, allocation);
+}
+
+static void bench_shader_modules(VulkanEngine& engine, BenchReport& report, const BenchOptions& options)
+{
+	std::span<const EmbeddedShader> shaders = vkutil::embedded_shaders();
+	size_t bytes = 0;
+	for (const EmbeddedShader& shader : shaders) {
+		bytes += shader.code.size_bytes();
+	}
+
+	BenchResult load{"shader_modules/load", "us"};
+	load.bytes = double(bytes) / shaders.size();
+	load.samples = collect(options, [&]() {
+		double ns = 0.0;
+		for (const EmbeddedShader& shader : shaders) {
+			VkShaderModule module;
+			Clock::time_point start = Clock::now();
+			if (!vkutil::load_shader_module(shader.code, engine._device, &module)) {
+				spdlog::error("Could not create a shader module for {}", shader.name);
+				continue;
+			}
+			ns += elapsed_ns(start);
+			vkDestroyShaderModule(engine._device, module, nullptr);
+		}
+		return ns / shaders.size() / 1e3;
+	});
+	report.add(std::move(load));
+}
+
+// Drivers keep their own on-disk shader caches below VkPipelineCache. Disable
+// those (MESA_SHADER_CACHE_DISABLE=true, __GL_SHADER_DISK_CACHE=0) for the
+// uncached numbers to mean a full compile.
+static void bench_pipelines(VulkanEngine& engine, BenchReport& report, const BenchOptions& options)
+{
+	VkDevice device = engine._device;
+	auto time_us = [](auto&& create) {
+		Clock::time_point start = Clock::now();
+		create();
+		return elapsed_ns(start) / 1e3;
+	};
+
+	VkShaderModule gradient = engine._shaders.get("gradient_cs");
+	VkPipelineLayout computeLayout = engine._gradientPipelineLayout;
+	auto compute = [&](VkPipelineCache cache) {
+		VkPipeline pipeline = VK_NULL_HANDLE;
+		double us = time_us([&]() {
+			pipeline = vkutil::create_compute_pipeline(device, computeLayout, gradient, {16, 16, 1}, {}, cache);
+		});
+		vkDestroyPipeline(device, pipeline, nullptr);
+		return us;
+	};
+
+	// the mesh pipeline of IndirectRenderer, with a layout of its own
+	VkPushConstantRange meshRange{};
+	meshRange.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+	meshRange.size = 4 * sizeof(VkDeviceAddress);
+	VkPipelineLayoutCreateInfo layoutInfo = vkinit::pipeline_layout_create_info();
+	layoutInfo.pushConstantRangeCount = 1;
+	layoutInfo.pPushConstantRanges = &meshRange;
+	VkPipelineLayout meshLayout;
+	vk_check(vkCreatePipelineLayout(device, &layoutInfo, nullptr, &meshLayout));
+
+	PipelineBuilder builder;
+	builder.set_shaders(engine._shaders.get("mesh_vs"), engine._shaders.get("mesh_fs"));
+	builder.set_layout(meshLayout);
+	builder.set_input_topology(VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST);
+	builder.set_polygon_mode(VK_POLYGON_MODE_FILL);
+	builder.set_multisampling_none();
+	builder.disable_blending();
+	builder.set_color_attachment_format(engine._drawImage.imageFormat);
+	builder.set_depth_format(engine._depthImage.imageFormat);
+	auto graphics = [&](VkPipelineCache cache) {
+		VkPipeline pipeline = VK_NULL_HANDLE;
+		double us = time_us([&]() { pipeline = builder.build_pipeline(device, cache); });
+		vkDestroyPipeline(device, pipeline, nullptr);
+		return us;
+	};
+
+	VkPipelineCacheCreateInfo cacheInfo = {.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO};
+	VkPipelineCache cache;
+	vk_check(vkCreatePipelineCache(device, &cacheInfo, nullptr, &cache));
+	// the warmup fills the cache
+	BenchResult computeUncached{"pipelines/compute", "us"};
+	computeUncached.samples = collect(options, [&]() { return compute(VK_NULL_HANDLE); });
+	BenchResult computeCached{"pipelines/compute_cached", "us"};
+	computeCached.samples = collect(options, [&]() { return compute(cache); });
+	BenchResult graphicsUncached{"pipelines/graphics", "us"};
+	graphicsUncached.samples = collect(options, [&]() { return graphics(VK_NULL_HANDLE); });
+	BenchResult graphicsCached{"pipelines/graphics_cached", "us"};
+	graphicsCached.samples = collect(options, [&]() { return graphics(cache); });
+	for (BenchResult* result : {&computeUncached, &computeCached, &graphicsUncached, &graphicsCached}) {
+		report.add(std::move(*result));
+	}
+	vkDestroyPipelineCache(device, cache, nullptr);
+
+	// What a material switch costs in GraphicsPipelineCache. A new layout per
+	// sample gives new shader libraries, which are compiled up front like
+	// precompile() is meant to be used, so only the link is timed.
+	GraphicsPipelineCache pipelines;
+	pipelines.init(device, engine._graphicsPipelineLibrary, FRAME_OVERLAP);
+	std::vector<VkPipelineLayout> layouts;
+	if (engine._graphicsPipelineLibrary) {
+		BenchResult link{"pipelines/graphics_link", "us"};
+		link.samples = collect(options, [&]() {
+			VkPipelineLayout layout;
+			vk_check(vkCreatePipelineLayout(device, &layoutInfo, nullptr, &layout));
+			layouts.push_back(layout);
+			GraphicsPipelineDesc desc = builder.desc;
+			desc.layout = layout;
+			pipelines.precompile(desc);
+			return time_us([&]() { pipelines.get(desc); });
+		});
+		report.add(std::move(link));
+	}
+
+	const uint32_t lookups = 1024;
+	pipelines.get(builder.desc);
+	BenchResult hit{"pipelines/cache_hit", "ns"};
+	hit.samples = collect(options, [&]() {
+		VkPipeline pipeline = VK_NULL_HANDLE;
+		double us = time_us([&]() {
+			for (uint32_t i = 0; i < lookups; i++) {
+				pipeline = pipelines.get(builder.desc);
+			}
+		});
+		if (pipeline == VK_NULL_HANDLE) {
+			spdlog::error("Pipeline cache returned no pipeline");
+		}
+		return us * 1e3 / lookups;
+	});
+	report.add(std::move(hit));
+
+	pipelines.cleanup();
+	for (VkPipelineLayout layout : layouts) {
+		vkDestroyPipelineLayout(device, layout, nullptr);
+	}
+	vkDestroyPipelineLayout(device, meshLayout, nullptr);
+}
+
+// Hot path cost of the live metrics per update, from one thread and from
+// several threads recording into the same histogram, the worst case. Uses
+// its own registry in process memory.
+static void bench_metrics(BenchReport& report, const BenchOptions& options)
+{
+	const uint32_t updates = 1u << 20;
+	MetricsRegistry registry;
+	registry.init("");
+	MetricCounter counter = registry.counter("bench.counter");
+	MetricHistogram histogram = registry.histogram("bench.histogram");
+
+	BenchResult add{"metrics/counter", "ns"};
+	add.samples = collect(options, [&]() {
+		Clock::time_point start = Clock::now();
+		for (uint32_t i = 0; i < updates; i++) {
+			counter.add();
+		}
+		return elapsed_ns(start) / updates;
+	});
+
+	// spread over the buckets like frame times would be
+	BenchResult record{"metrics/histogram", "ns"};
+	record.samples = collect(options, [&]() {
+		Clock::time_point start = Clock::now();
+		for (uint32_t i = 0; i < updates; i++) {
+			histogram.record(uint64_t(i) * 977);
+		}
+		return elapsed_ns(start) / updates;
+	});
+
+	const uint32_t threads = std::clamp(std::thread::hardware_concurrency(), 2u, 8u);
+	BenchResult contended{fmt::format("metrics/histogram_{}_threads", threads), "ns"};
+	contended.samples = collect(options, [&]() {
+		std::vector<std::thread> workers;
+		Clock::time_point start = Clock::now();
+		for (uint32_t t = 0; t < threads; t++) {
+			workers.emplace_back([&, t]() {
+				for (uint32_t i = t; i < updates; i += threads) {
+					histogram.record(uint64_t(i) * 977);
+				}
+			});
+		}
+		for (std::thread& worker : workers) {
+			worker.join();
+		}
+		return elapsed_ns(start) / (updates / threads);
+	});
+	registry.cleanup();
+
+	report.add(std::move(add));
+	report.add(std::move(record));
+	report.add(std::move(contended));
+}
+
+// Whole frames through draw(), CPU time between the starts of two frames.
+// With FRAME_OVERLAP frames in flight this settles at the slower of the CPU
+// and the GPU side.
+static void bench_frames(VulkanEngine& engine, BenchReport& report, const BenchOptions& options)
+{
+	engine._deltaTime = 1.f / 60.f;
+	for (uint32_t i = 0; i < 30; i++) {
+		engine.draw();
+	}
+
+	BenchResult frame{"frame/draw", "ms"};
+	frame.samples.reserve(options.frames);
+	for (uint32_t i = 0; i < options.frames; i++) {
+		Clock::time_point start = Clock::now();
+		engine.draw();
+		frame.samples.push_back(elapsed_ns(start) / 1e6);
+	}
+	vk_check(vkDeviceWaitIdle(engine._device));
+	report.add(std::move(frame));
+}
+
+void run_microbenchmarks(VulkanEngine& engine, BenchReport& report, const BenchOptions& options)
+{
+	if (options.enabled("descriptors")) {
+		bench_descriptors(engine, report, options);
+	}
+	if (options.enabled("deletion_queue")) {
+		bench_deletion_queue(engine, report, options);
+	}
+	if (options.enabled("command_buffer")) {
+		bench_command_buffers(engine, report, options);
+	}
+	if (options.enabled("barriers")) {
+		bench_barriers(engine, report, options);
+	}
+	if (options.enabled("shader_modules")) {
+		bench_shader_modules(engine, report, options);
+	}
+	if (options.enabled("pipelines")) {
+		bench_pipelines(engine, report, options);
+	}
+	if (options.enabled("metrics")) {
+		bench_metrics(report, options);
+	}
+	// last, the frames leave simulation state behind
+	if (options.enabled("frame")) {
+		bench_frames(engine, report, options);
+	}
+}
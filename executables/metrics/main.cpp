@@ -0,0 +1,152 @@
+// Watches the live metrics of a running engine through its shared memory
+// segment, see graphics/header/metrics.h. Every interval it prints counters
+// with their rate, gauges, and the p50/p99/p999/max of the histogram samples
+// recorded since the last print:
+//   vkengine_metrics [--segment <name>] [--interval <ms>] [--once]
+//
+// The engine publishes to GPSIM_METRICS, /gpsim_metrics by default.
+#include "metrics.h"
+#include <spdlog/spdlog.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+
+#if !defined(_WIN32)
+#include <cerrno>
+#include <signal.h>
+#endif
+
+static std::string format_nanoseconds(uint64_t ns)
+{
+	if (ns < 1000) {
+		return fmt::format("{} ns", ns);
+	}
+	if (ns < 1000000) {
+		return fmt::format("{:.1f} us", double(ns) / 1e3);
+	}
+	if (ns < 1000000000) {
+		return fmt::format("{:.2f} ms", double(ns) / 1e6);
+	}
+	return fmt::format("{:.2f} s", double(ns) / 1e9);
+}
+
+static bool process_alive(uint32_t pid)
+{
+#if defined(_WIN32)
+	return true;
+#else
+	return kill((pid_t)pid, 0) == 0 || errno == EPERM;
+#endif
+}
+
+// Prints `current`, with rates and histograms over what changed since
+// `previous`, or since the start when it is from another process
+static void print(const MetricsSnapshot& current, const MetricsSnapshot& previous, double seconds,
+	const std::string& segment)
+{
+	bool interval = previous.pid == current.pid && seconds > 0.0;
+	fmt::print("{} from pid {}{}, {}\n", segment, current.pid, process_alive(current.pid) ? "" : " (exited)",
+		interval ? fmt::format("last {:.1f} s", seconds) : std::string("since start"));
+	fmt::print("{:<32} {:>12} {:>12} {:>12} {:>12} {:>12}\n", "metric", "value", "p50", "p99", "p999", "max");
+
+	for (const MetricSnapshot& metric : current.metrics) {
+		const MetricSnapshot* before = nullptr;
+		for (const MetricSnapshot& old : previous.metrics) {
+			if (interval && old.name == metric.name && old.kind == metric.kind) {
+				before = &old;
+			}
+		}
+
+		switch (metric.kind) {
+		case MetricKind::Counter:
+			if (before) {
+				fmt::print("{:<32} {:>12} {:>10.1f}/s\n", metric.name, metric.value,
+					double(metric.value - before->value) / seconds);
+			} else {
+				fmt::print("{:<32} {:>12}\n", metric.name, metric.value);
+			}
+			break;
+		case MetricKind::Gauge:
+			fmt::print("{:<32} {:>12.6g}\n", metric.name, metric.gauge());
+			break;
+		case MetricKind::Histogram: {
+			std::vector<uint64_t> buckets = metric.buckets;
+			if (before && before->buckets.size() == buckets.size()) {
+				for (size_t b = 0; b < buckets.size(); b++) {
+					buckets[b] -= before->buckets[b];
+				}
+			}
+			uint64_t count = vkutil::histogram_count(buckets);
+			if (count == 0) {
+				fmt::print("{:<32} {:>12}\n", metric.name, "no samples");
+				break;
+			}
+			fmt::print("{:<32} {:>12} {:>12} {:>12} {:>12} {:>12}\n", metric.name, count,
+				format_nanoseconds(vkutil::histogram_quantile(buckets, 0.5)),
+				format_nanoseconds(vkutil::histogram_quantile(buckets, 0.99)),
+				format_nanoseconds(vkutil::histogram_quantile(buckets, 0.999)),
+				format_nanoseconds(vkutil::histogram_quantile(buckets, 1.0)));
+			break;
+		}
+		}
+	}
+	fflush(stdout);
+}
+
+int main(int argc, char* argv[])
+{
+	std::string segment = "/gpsim_metrics";
+	uint32_t intervalMs = 1000;
+	bool once = false;
+	for (int i = 1; i < argc; i++) {
+		std::string_view arg = argv[i];
+		bool hasValue = i + 1 < argc;
+		if (arg == "--segment" && hasValue) {
+			segment = argv[++i];
+		} else if (arg == "--interval" && hasValue) {
+			intervalMs = std::max(10, std::atoi(argv[++i]));
+		} else if (arg == "--once") {
+			once = true;
+		} else {
+			spdlog::info("vkengine_metrics [--segment <name>] [--interval <ms>] [--once]");
+			return 2;
+		}
+	}
+
+	MetricsSnapshot previous;
+	auto previousTime = std::chrono::steady_clock::now();
+	bool waiting = false;
+	while (true) {
+		MetricsSnapshot current;
+		// reopened every time, so a restarted engine is picked up
+		if (!vkutil::read_metrics(segment, current)) {
+			if (once) {
+				spdlog::error("No metrics in {}, is the engine running?", segment);
+				return 1;
+			}
+			if (!waiting) {
+				spdlog::info("Waiting for {}", segment);
+				waiting = true;
+			}
+			previous = {};
+		} else {
+			waiting = false;
+			auto now = std::chrono::steady_clock::now();
+			double seconds = std::chrono::duration<double>(now - previousTime).count();
+			if (!once) {
+				// home and clear, so the table updates in place
+				fmt::print("\x1b[H\x1b[2J");
+			}
+			print(current, previous, seconds, segment);
+			if (once) {
+				return 0;
+			}
+			previous = std::move(current);
+			previousTime = now;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(intervalMs));
+	}
+}
@@ -1,7 +1,100 @@
+#pragma once
 
 #include <vk_types.h>
 
+#include <SDL3/SDL_events.h>
+#include <glm/trigonometric.hpp>
+
+// Normalized planes (xyz = inward normal, w = distance) in world space. A plane
+// that can never reject anything, like the far plane of an infinite
+// projection, is stored as (0, 0, 0, 1).
+struct Frustum {
+	glm::vec4 planes[6];
+
+	static Frustum from_matrix(const glm::mat4& viewproj);
+};
+
+// Bounding spheres in structure-of-arrays layout so that the culling loop can
+// load eight of them into one register per component.
+struct SphereBoundsSoA {
+	std::vector<float> x, y, z, radius;
+
+	size_t size() const { return x.size(); }
+	void push_back(const glm::vec3& center, float r);
+	void clear();
+};
+
+struct AabbBoundsSoA {
+	std::vector<float> minX, minY, minZ;
+	std::vector<float> maxX, maxY, maxZ;
+
+	size_t size() const { return minX.size(); }
+	void push_back(const glm::vec3& min, const glm::vec3& max);
+	void clear();
+};
+
+// Fly camera. The view and projection matrices and the frustum are cached and
+// only rebuilt after a setter or movement changed their inputs.
 class Camera {
 public:
+	// movement speed in world units per second, along the camera axes
+	float speed{5.f};
+
+	void set_position(const glm::vec3& position);
+	void set_rotation(float pitch, float yaw);
+	void look_at(const glm::vec3& eye, const glm::vec3& target);
+	// infinite reverse-Z perspective: depth 1 at the near plane, 0 at infinity
+	void set_perspective(float fovy, float aspect, float znear);
+	void set_aspect(float aspect);
+
+	const glm::vec3& position() const { return _position; }
+	float pitch() const { return _pitch; }
+	float yaw() const { return _yaw; }
+	float fovy() const { return _fovy; }
+	float znear() const { return _znear; }
+
+	// WASD moves, dragging with the right mouse button looks around
+	void process_sdl_event(const SDL_Event& e);
+	void update(float deltaSeconds);
+
+	const glm::mat4& view() const;
+	const glm::mat4& projection() const;
+	const glm::mat4& view_projection() const;
+	const Frustum& frustum() const;
+
+private:
+	glm::mat4 rotation_matrix() const;
+
+	glm::vec3 _position{0.f};
+	glm::vec3 _velocity{0.f};
+	float _pitch{0.f};
+	float _yaw{0.f};
+
+	float _fovy{glm::radians(70.f)};
+	float _aspect{16.f / 9.f};
+	float _znear{0.1f};
+
+	mutable glm::mat4 _view{1.f};
+	mutable glm::mat4 _projection{1.f};
+	mutable glm::mat4 _viewProjection{1.f};
+	mutable Frustum _frustum{};
+
+	mutable bool _viewDirty{true};
+	mutable bool _projectionDirty{true};
+	mutable bool _frustumDirty{true};
+};
+
+namespace vkutil {
+	glm::mat4 perspective_reverse_z(float fovy, float aspect, float znear);
+
+	// true when the volume intersects the frustum, the test the batch
+	// functions below apply to every volume
+	bool is_visible(const Frustum& frustum, const glm::vec3& center, float radius);
+	bool is_visible(const Frustum& frustum, const glm::vec3& min, const glm::vec3& max);
 
+	// Appends the indices of the volumes that intersect the frustum to
+	// `visible`. Eight volumes are tested per iteration with AVX2 when the CPU
+	// supports it, the remainder and other CPUs take the scalar path.
+	void cull_spheres(const Frustum& frustum, const SphereBoundsSoA& bounds, std::vector<uint32_t>& visible);
+	void cull_aabbs(const Frustum& frustum, const AabbBoundsSoA& bounds, std::vector<uint32_t>& visible);
 };
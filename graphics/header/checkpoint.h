@@ -0,0 +1,164 @@
+#pragma once
+
+#include <cpu_jobs.h>
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <span>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Chunked binary recording of simulation state, one chunk per frame:
+//
+//   header    magic, version, index offset, frame count, padded to a block
+//   schema    name and type of every field, in the header block
+//   frames    chunk header, then one encoded array per field
+//   index     step, time, count and file offset of every frame
+//
+// Fields are structure-of-arrays of 4 byte elements. A frame is either a
+// keyframe or a delta, where every element is XORed with the same element of
+// the frame before, which leaves mostly zero high bytes for slowly changing
+// values. Fields can additionally be byte shuffled into planes with the
+// all-zero 8 byte groups left out, which is cheap enough to keep up with the
+// disk. Fields that would not shrink are stored uncompressed.
+
+enum class CheckpointFieldType : uint32_t {
+	Float32,
+	Uint32,
+};
+
+struct CheckpointField {
+	std::string name;
+	CheckpointFieldType type{CheckpointFieldType::Float32};
+};
+
+struct CheckpointOptions {
+	// every Nth frame is stored whole, so replay never decodes more than N
+	uint32_t keyframeInterval{60};
+	bool delta{true};
+	bool compress{true};
+	// each of the two I/O buffers, rounded up to a multiple of the block size
+	size_t bufferBytes{size_t(32) << 20};
+	// bypasses the page cache (O_DIRECT), falls back when unsupported
+	bool direct{true};
+	// encodes the fields of a frame in parallel when set, called from the
+	// thread calling write_frame()
+	JobPool* jobs{nullptr};
+};
+
+struct CheckpointStats {
+	uint64_t frames{0};
+	uint64_t rawBytes{0};      // field data before encoding
+	uint64_t fileBytes{0};     // everything handed to the I/O thread
+	uint64_t stalls{0};        // waits of write_frame() for a free buffer
+	double encodeMilliseconds{0.0};
+};
+
+struct CheckpointFrameInfo {
+	uint64_t step{0};
+	double time{0.0};
+	uint64_t offset{0};  // of the chunk header in the file
+	uint64_t bytes{0};
+	uint32_t count{0};   // elements per field
+	uint32_t flags{0};
+};
+
+// Streams frames to disk. Encoding happens on the calling thread into one of
+// two aligned buffers, full buffers are written by a background thread, so
+// the caller only waits when the disk falls more than a whole buffer behind.
+class CheckpointWriter {
+public:
+	bool open(const std::string& path, std::span<const CheckpointField> fields, const CheckpointOptions& options = {});
+	// flushes the buffers and appends the index, the file is complete after
+	void close();
+	bool is_open() const { return _file != -1; }
+
+	// `fields[i]` points at `count` elements of field i
+	void write_frame(uint64_t step, double time, uint32_t count, std::span<const void* const> fields);
+
+	const CheckpointStats& stats() const { return _stats; }
+
+private:
+	struct IoBuffer {
+		uint8_t* data{nullptr};
+		size_t bytes{0};     // filled
+		uint64_t offset{0};  // in the file
+		bool busy{false};    // queued or being written
+	};
+
+	void put(const void* data, size_t size);
+	void pad_to(size_t alignment);
+	void submit(bool last);
+	void io_loop();
+
+	std::string _path;
+	intptr_t _file{-1};
+	bool _direct{false};
+	CheckpointOptions _options;
+	std::vector<CheckpointField> _fields;
+
+	IoBuffer _buffers[2];
+	uint32_t _fill{0};
+	uint64_t _fileOffset{0};  // of the start of the filling buffer
+	uint8_t* _headerBlock{nullptr};
+
+	// previous frame for deltas and encoding scratch, one per field
+	std::vector<std::vector<uint32_t>> _previous;
+	uint32_t _previousCount{0};
+	std::vector<std::vector<uint8_t>> _encoded;
+	std::vector<std::vector<uint8_t>> _shuffled;
+
+	std::vector<CheckpointFrameInfo> _index;
+	CheckpointStats _stats;
+
+	std::thread _thread;
+	std::mutex _mutex;
+	std::condition_variable _wake;
+	std::condition_variable _done;
+	std::deque<uint32_t> _queue;
+	uint64_t _truncateTo{0};
+	bool _stop{false};
+	bool _failed{false};
+};
+
+// Replays a recording through a memory map. Frames are found through the
+// index, or by walking the chunks when the writer never closed the file.
+class CheckpointReader {
+public:
+	bool open(const std::string& path);
+	void close();
+
+	const std::vector<CheckpointField>& fields() const { return _fields; }
+	size_t frame_count() const { return _index.size(); }
+	const CheckpointFrameInfo& frame(size_t index) const { return _index[index]; }
+	// last frame at or before `step`, 0 if there is none
+	size_t find(uint64_t step) const;
+
+	// Decodes frame `index` into `fields`, each with room for frame(index).count
+	// elements. Deltas decode forward from the nearest keyframe, except when
+	// reading the frame after the previous call, which decodes just one.
+	// False, with `fields` untouched, when a frame on the way is corrupt.
+	bool read_frame(size_t index, std::span<void* const> fields);
+
+private:
+	bool build_index(uint64_t indexOffset, uint64_t frameCount);
+	bool decode(size_t index);
+
+	intptr_t _file{-1};
+	intptr_t _mapping{0};
+	const uint8_t* _data{nullptr};
+	size_t _size{0};
+
+	std::vector<CheckpointField> _fields;
+	std::vector<CheckpointFrameInfo> _index;
+
+	// last decoded frame, the reference of the next delta
+	std::vector<std::vector<uint32_t>> _state;
+	std::vector<uint8_t> _shuffled;
+	size_t _decoded{SIZE_MAX};
+	uint32_t _decodedCount{0};
+};
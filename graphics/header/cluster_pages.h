@@ -0,0 +1,100 @@
+#pragma once
+
+#include <vk_loader.h>
+
+#include <cstdint>
+#include <filesystem>
+#include <span>
+#include <vector>
+
+// Paged cluster geometry for scenes larger than device memory:
+//
+//   header    magic, version, page size, counts, bounds and the source stamp
+//   groups    ClusterGroup per group
+//   clusters  ClusterInfo per cluster, all fine ones first
+//   pages     CLUSTER_PAGE_SIZE each, from the first page aligned offset
+//
+// Surfaces are split into meshlets, and up to CLUSTER_GROUP_SIZE neighbouring
+// meshlets form a group whose data always sits in a single page, so a group
+// is either resident or not. Every group is also simplified as a whole into a
+// few coarse clusters with its border locked, drawing a group coarse next to
+// fine neighbours therefore leaves no cracks. The coarse clusters fill the
+// last coarsePages pages, which a renderer keeps resident as the fallback for
+// groups whose page is missing.
+//
+// Cluster data is self contained and 4 byte aligned: vertexCount positions as
+// 3 floats, vertexCount VertexAttributes, then three 8 bit local indices per
+// triangle.
+
+constexpr uint32_t CLUSTER_PAGE_SIZE = 64 * 1024;
+constexpr uint32_t CLUSTER_MAX_VERTICES = 64;
+constexpr uint32_t CLUSTER_MAX_TRIANGLES = 124;
+constexpr uint32_t CLUSTER_GROUP_SIZE = 8;
+
+// also the GPU layout, see shaders/clusters.glsl
+struct ClusterInfo {
+	glm::vec4 sphere;  // object space bounding sphere
+	uint32_t page;
+	uint32_t offset;   // bytes into the page
+	uint32_t vertexCount;
+	uint32_t triangleCount;
+};
+
+struct ClusterGroup {
+	glm::vec4 sphere;
+	uint32_t page;         // holding all fine clusters of the group
+	uint32_t firstCluster;
+	uint32_t clusterCount;
+	uint32_t firstCoarse;
+	uint32_t coarseCount;
+	float error;           // object space error of the coarse clusters
+	uint32_t pad0;
+	uint32_t pad1;
+};
+
+struct ClusterFileHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t pageSize;
+	uint32_t pageCount;    // including the coarse ones
+	uint32_t coarsePages;
+	uint32_t groupCount;
+	uint32_t clusterCount;
+	uint32_t fineClusters;
+	uint64_t pagesOffset;  // file offset of page 0
+	uint64_t sourceSize;
+	int64_t sourceTime;
+	uint64_t pad;
+	glm::vec4 sphere;      // of everything
+};
+
+// Builds the cluster file for a glTF asset. Slow, meant to run once per asset
+// and then be reused until the asset changes.
+bool build_cluster_file(const std::filesystem::path& source, const std::filesystem::path& path);
+// true if `path` exists and was built from `source` as it is now
+bool cluster_file_current(const std::filesystem::path& source, const std::filesystem::path& path);
+
+// Read access to a cluster file. Groups and clusters are read whole on open,
+// pages on demand; read_page may be called from any thread.
+class ClusterFile {
+public:
+	~ClusterFile() { close(); }
+
+	bool open(const std::filesystem::path& path);
+	void close();
+
+	const ClusterFileHeader& header() const { return _header; }
+	std::span<const ClusterGroup> groups() const { return _groups; }
+	std::span<const ClusterInfo> clusters() const { return _clusters; }
+	uint32_t page_count() const { return _header.pageCount; }
+	bool is_coarse_page(uint32_t page) const { return page >= _header.pageCount - _header.coarsePages; }
+
+	// reads CLUSTER_PAGE_SIZE bytes, false on I/O errors
+	bool read_page(uint32_t page, uint8_t* out) const;
+
+private:
+	intptr_t _file{-1};
+	ClusterFileHeader _header{};
+	std::vector<ClusterGroup> _groups;
+	std::vector<ClusterInfo> _clusters;
+};
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <cstdint>
+
+// Instruction set extensions of the host CPU, queried once at startup so that
+// hot loops can pick a SIMD path at runtime instead of at compile time.
+struct CpuFeatures {
+	bool sse41{false};
+	bool avx2{false};
+	bool fma{false};
+	bool avx512f{false};
+
+	// per core L2 size, work on the CPU is chunked to stay inside it
+	uint32_t l2CacheBytes{1u << 20};
+	// hardware threads
+	uint32_t threads{1};
+};
+
+namespace vkutil {
+const CpuFeatures& cpu_features();
+};
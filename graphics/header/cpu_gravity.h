@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cpu_particles.h>
+#include <vk_gravity.h>
+
+// CPU counterpart of the octree in GravitySolver, with the same nodes and the
+// same level by level build. Sorting is a chunked LSD radix sort with a
+// histogram per chunk, every other pass is a parallel_for over bodies or
+// over the nodes of one level.
+class CpuOctree {
+public:
+	void init(uint32_t capacity, const GravitySettings& settings);
+	void build(JobPool& jobs, size_t chunk, const float* px, const float* py, const float* pz, uint32_t count);
+
+	uint32_t count() const { return _count; }
+	uint32_t node_count() const { return _nodeCount; }
+	uint32_t overflow() const { return _overflow; }
+	float extent() const { return _extent; }
+
+	std::vector<GPUOctreeNode> nodes;
+	std::vector<uint32_t> keys;         // Morton code per sorted body
+	std::vector<uint32_t> sortedIndex;  // per sorted slot, index in the unsorted bodies
+	std::vector<float> x, y, z;         // sorted positions
+
+private:
+	void sort(JobPool& jobs, size_t chunk);
+	void split_level(JobPool& jobs, uint32_t begin, uint32_t end, uint32_t level);
+	void multipoles(JobPool& jobs, uint32_t begin, uint32_t end);
+
+	GravitySettings _settings;
+	uint32_t _count{0};
+	uint32_t _nodeCount{0};
+	uint32_t _overflow{0};
+	float _extent{0.f};
+	std::vector<uint32_t> _keysTemp;
+	std::vector<uint32_t> _indexTemp;
+	std::vector<uint32_t> _histogram;  // digit major, a row of chunks per digit
+	uint32_t _levelStart[OCTREE_LEVELS + 1]{};
+};
+
+// CPU counterpart of GravitySolver with the same expansion and opening test,
+// as a substep pass of a CpuParticleSystem or on its own for benchmarks.
+class CpuGravitySolver {
+public:
+	void init(uint32_t capacity, const GravitySettings& settings);
+
+	// kicks the particles with the gravity of all of them after every substep
+	void attach(CpuParticleSystem* particles);
+
+	// accelerations and potentials per body, in body order
+	void solve(JobPool& jobs, size_t chunk, const float* px, const float* py, const float* pz, uint32_t count);
+	void kick(JobPool& jobs, size_t chunk, CpuParticleSet& set, uint32_t count, float dt);
+	void drift(JobPool& jobs, size_t chunk, CpuParticleSet& set, uint32_t count, float dt);
+
+	const CpuOctree& octree() const { return _octree; }
+	const GravitySettings& settings() const { return _settings; }
+	void set_theta(float theta) { _settings.theta = theta; }
+	// cells and bodies summed by the last solve
+	uint64_t interactions() const { return _interactions; }
+
+	std::vector<float> ax, ay, az, potential;
+
+private:
+	CpuParticleSystem* _particles{nullptr};
+	GravitySettings _settings;
+	CpuOctree _octree;
+	uint64_t _interactions{0};
+};
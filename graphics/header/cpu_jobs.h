@@ -0,0 +1,43 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Persistent worker threads for data parallel loops on the CPU. A loop is
+// cut into chunks that are handed out through an atomic counter, the calling
+// thread works on chunks too and returns once all of them are done.
+class JobPool {
+public:
+	// 0 uses every hardware thread
+	void init(uint32_t threads = 0);
+	void cleanup();
+
+	// threads taking part in a loop, including the caller
+	uint32_t size() const { return (uint32_t)_workers.size() + 1; }
+
+	// calls job(begin, end) for consecutive ranges of at most `chunk` elements
+	void parallel_for(size_t count, size_t chunk, const std::function<void(size_t begin, size_t end)>& job);
+
+private:
+	void worker_loop();
+	void run_chunks();
+
+	std::vector<std::thread> _workers;
+	std::mutex _mutex;
+	std::condition_variable _wake;
+	std::condition_variable _done;
+
+	const std::function<void(size_t begin, size_t end)>* _job{nullptr};
+	size_t _count{0};
+	size_t _chunk{1};
+	std::atomic<size_t> _next{0};
+	uint32_t _active{0};
+	uint64_t _generation{0};
+	bool _stop{false};
+};
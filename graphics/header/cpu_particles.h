@@ -0,0 +1,87 @@
+#pragma once
+
+#include <cpu_jobs.h>
+#include <vk_particles.h>
+
+// Particle storage on the CPU, one array per component so that a SIMD lane
+// holds the same component of consecutive particles. Holds the same fields
+// as the GPU sets in shaders/particles.glsl.
+struct CpuParticleSet {
+	std::vector<float> x, y, z, age;
+	std::vector<float> vx, vy, vz, lifetime;
+	std::vector<uint32_t> color;  // packed RGBA8
+
+	void resize(size_t count);
+	size_t capacity() const { return x.size(); }
+
+	// converts `count` particles from and to the GPU layout (vec4 position
+	// with age, vec4 velocity with lifetime, RGBA8 color)
+	void to_gpu(size_t count, glm::vec4* positions, glm::vec4* velocities, uint32_t* colors) const;
+	void from_gpu(size_t count, const glm::vec4* positions, const glm::vec4* velocities, const uint32_t* colors);
+};
+
+// CPU backend of ParticleSystem for machines without a usable GPU. Takes the
+// same settings and runs the same substeps (integrate, kill and compact into
+// the other set, emit behind the survivors), so both backends can run one
+// scenario. Compaction here is stable, so the order of the survivors differs
+// from the GPU, where each subgroup appends in whatever order it arrives.
+//
+// The integrator has scalar, AVX2 and AVX-512 paths chosen at runtime, and
+// every pass is split over the cores in chunks sized to stay inside L2.
+class CpuParticleSystem {
+public:
+	// `threads` 0 uses every hardware thread
+	void init(const ParticleSettings& settings, uint32_t threads = 0);
+	void cleanup();
+
+	void simulate(float deltaSeconds);
+	// called after every substep, when current() is the set it just wrote
+	void add_substep_pass(std::function<void(float dt)>&& pass);
+
+	// appends `count` particles from the emitter, for an initial population
+	void spawn(uint32_t count);
+	// replaces the alive particles, e.g. with a GPU snapshot
+	void load(const glm::vec4* positions, const glm::vec4* velocities, const uint32_t* colors, uint32_t count);
+
+	const ParticleStats& stats() const { return _stats; }
+	const ParticleSettings& settings() const { return _settings; }
+	void set_emit_rate(float rate) { _settings.emitRate = rate; }
+
+	CpuParticleSet& current() { return _sets[_current]; }
+	const CpuParticleSet& current() const { return _sets[_current]; }
+	uint32_t alive() const { return _alive; }
+	// after writing particles into current() directly, e.g. from a checkpoint
+	void set_alive(uint32_t count) { _alive = std::min(count, _settings.capacity); }
+
+	JobPool& jobs() { return _jobs; }
+	// particles per parallel_for chunk
+	size_t chunk_size() const { return _chunk; }
+
+private:
+	void substep(float dt, uint32_t emitCount);
+	void emit(CpuParticleSet& set, uint32_t first, uint32_t count, uint32_t seed);
+
+	ParticleSettings _settings;
+	CpuParticleSet _sets[2];
+	uint32_t _current{0};
+	uint32_t _alive{0};
+	float _emitAccumulator{0.f};
+	uint32_t _seed{0};
+
+	JobPool _jobs;
+	size_t _chunk{4096};
+	std::vector<uint8_t> _keep;          // per particle of the source set
+	std::vector<uint32_t> _chunkOffsets; // survivors before each chunk
+
+	std::vector<std::function<void(float dt)>> _substepPasses;
+
+	ParticleStats _stats;
+	uint64_t _integratedSinceReport{0};
+	std::chrono::steady_clock::time_point _lastReport{};
+};
+
+namespace vkutil {
+// the random numbers of shaders/particles.glsl
+uint32_t pcg_hash(uint32_t v);
+float random01(uint32_t& rng);
+};
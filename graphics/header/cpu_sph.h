@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cpu_particles.h>
+#include <vk_sph.h>
+
+// CPU counterpart of NeighborGrid: the same hashed cell table rebuilt with a
+// counting sort, with the sorted copy kept as structure of arrays so that
+// the particles of a cell can be streamed through SIMD registers.
+class CpuNeighborGrid {
+public:
+	void init(uint32_t capacity, float cellSize);
+	void build(JobPool& jobs, size_t chunk, const CpuParticleSet& set, uint32_t count);
+
+	uint32_t count() const { return _count; }
+	uint32_t table_size() const { return _tableSize; }
+	float cell_size() const { return _cellSize; }
+
+	std::vector<uint32_t> cellCount;
+	std::vector<uint32_t> cellStart;
+	std::vector<uint32_t> sortedIndex;  // per sorted slot, index in the unsorted set
+	std::vector<float> x, y, z;         // sorted positions
+	std::vector<float> vx, vy, vz;      // sorted velocities
+
+private:
+	std::vector<uint32_t> _particleCell;
+	std::vector<uint32_t> _particleRank;
+	uint32_t _count{0};
+	uint32_t _tableSize{0};
+	float _cellSize{1.f};
+};
+
+// CPU counterpart of SphSolver with the same kernels and constants, as a
+// substep pass of a CpuParticleSystem.
+class CpuSphSolver {
+public:
+	void init(CpuParticleSystem* particles, const SphSettings& settings);
+
+	void step(float dt);
+
+	const CpuNeighborGrid& grid() const { return _grid; }
+
+private:
+	CpuParticleSystem* _particles{nullptr};
+	SphSettings _settings;
+	CpuNeighborGrid _grid;
+	std::vector<float> _density;   // per sorted particle
+	std::vector<float> _pressure;
+};
+
+namespace vkutil {
+// Teschner et al. 2003 as cell_hash in shaders/grid.glsl, the table size is
+// a power of two
+inline uint32_t cell_hash(int32_t x, int32_t y, int32_t z, uint32_t tableSize)
+{
+	uint32_t h = ((uint32_t)x * 73856093u) ^ ((uint32_t)y * 19349663u) ^ ((uint32_t)z * 83492791u);
+	return h & (tableSize - 1u);
+}
+};
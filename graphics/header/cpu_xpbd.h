@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cpu_jobs.h>
+#include <vk_xpbd.h>
+
+// CPU counterpart of XpbdSolver with the same substeps and formulas. Every
+// color batch is one parallel_for, the constraints of a batch share no
+// particle so threads write disjoint positions without atomics.
+class CpuXpbdSolver {
+public:
+	// `model` must be batched already, see vkutil::batch_constraints
+	void init(XpbdModel model, const XpbdSettings& settings, const MeshBvh* collider = nullptr);
+
+	void step(JobPool& jobs, size_t chunk, float dt);
+
+	const XpbdModel& model() const { return _model; }
+	const XpbdSettings& settings() const { return _settings; }
+	// w = inverse mass, in the order of model()
+	const std::vector<glm::vec4>& positions() const { return _positions; }
+
+private:
+	XpbdModel _model;
+	XpbdSettings _settings;
+	const MeshBvh* _collider{nullptr};
+
+	std::vector<glm::vec4> _positions;
+	std::vector<glm::vec4> _previous;
+	std::vector<glm::vec3> _velocities;
+	std::vector<float> _lambdas;
+};
+
+namespace vkutil {
+// Speculative greedy coloring of the constraint graph, the same rounds as
+// the color pass of XpbdSolver so both give the same colors: every uncolored
+// constraint picks the lowest color its neighbours do not have, and keeps it
+// unless a lower numbered neighbour picked the same one. Returns a color per
+// constraint, XPBD_UNCOLORED where more than XPBD_MAX_COLORS were needed.
+std::vector<uint32_t> color_constraints(JobPool& jobs, size_t chunk, const XpbdModel& model,
+	const XpbdAdjacency& adjacency, uint32_t* rounds = nullptr);
+};
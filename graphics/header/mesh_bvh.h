@@ -0,0 +1,51 @@
+#pragma once
+
+#include <vk_types.h>
+
+#include <span>
+#include <vector>
+
+// Node of a MeshBvh, on the CPU and the GPU (shaders/bvh.glsl). Nodes are in
+// depth first order: the left child of an inner node follows it directly.
+struct GPUBvhNode {
+	glm::vec3 min;
+	uint32_t first;  // leaves: first triangle, inner nodes: right child
+	glm::vec3 max;
+	uint32_t count;  // triangles of a leaf, 0 for inner nodes
+};
+
+struct GPUBvhTriangle {
+	glm::vec4 v0;  // w unused
+	glm::vec4 v1;
+	glm::vec4 v2;
+};
+
+// Bounding volume hierarchy over a static triangle mesh for closest point
+// queries, built once on the CPU with binned SAH and uploaded as is.
+class MeshBvh {
+public:
+	// the triangles of `indices` over `positions`, moved by `transform`
+	void build(std::span<const glm::vec3> positions, std::span<const uint32_t> indices, const glm::mat4& transform,
+		uint32_t leafSize = 4);
+
+	// closest point on the mesh within maxDistance of p, with the normal of
+	// the triangle it lies on
+	bool closest_point(glm::vec3 p, float maxDistance, glm::vec3& point, glm::vec3& normal) const;
+
+	const std::vector<GPUBvhNode>& nodes() const { return _nodes; }
+	const std::vector<GPUBvhTriangle>& triangles() const { return _triangles; }
+	bool empty() const { return _triangles.empty(); }
+
+private:
+	uint32_t build_node(uint32_t first, uint32_t count, uint32_t leafSize, uint32_t depth);
+
+	std::vector<GPUBvhNode> _nodes;
+	std::vector<GPUBvhTriangle> _triangles;
+	std::vector<glm::vec3> _centroids;
+};
+
+namespace vkutil {
+// Ericson, Real-Time Collision Detection 5.1.5, as closest_on_triangle in
+// shaders/bvh.glsl
+glm::vec3 closest_on_triangle(glm::vec3 p, glm::vec3 a, glm::vec3 b, glm::vec3 c);
+};
@@ -0,0 +1,182 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Live counters, gauges and latency histograms, kept in a named shared memory
+// segment so executables/metrics can watch a running engine without
+// attaching to it. Every update is one relaxed atomic on a slot the handle
+// points at, there are no locks or checks on the hot path. Readers see each
+// value untorn but not in step with the others, which is all a monitor needs.
+//
+// The layout below is the contract between the engine and its readers, bump
+// METRICS_VERSION on any change.
+constexpr uint64_t METRICS_MAGIC = 0x31534d4d49535047;  // "GPSIMMS1"
+constexpr uint32_t METRICS_VERSION = 1;
+constexpr uint32_t METRICS_CAPACITY = 64;
+constexpr uint32_t METRICS_HISTOGRAMS = 16;
+constexpr uint32_t METRICS_NAME = 48;
+
+// Log-linear buckets as in HdrHistogram: values below HISTOGRAM_SUB_BUCKETS
+// are exact, above that every power of two is split into HISTOGRAM_SUB_BUCKETS
+// buckets, so any uint64_t lands in a bucket within 1/16 of its value.
+constexpr uint32_t HISTOGRAM_SUB_BITS = 4;
+constexpr uint32_t HISTOGRAM_SUB_BUCKETS = 1u << HISTOGRAM_SUB_BITS;
+constexpr uint32_t HISTOGRAM_BUCKETS = (64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS;
+
+enum class MetricKind : uint32_t {
+	Counter = 1,    // monotonic uint64_t
+	Gauge = 2,      // last double stored, as its bits
+	Histogram = 3,  // nanoseconds, see MetricsHistogramSlot
+};
+
+// one cache line, so metrics updated by different threads never share one
+struct alignas(64) MetricsSlot {
+	char name[METRICS_NAME];
+	MetricKind kind;
+	uint32_t histogram;  // index into MetricsSegment::histograms
+	std::atomic<uint64_t> value;
+};
+
+struct alignas(64) MetricsHistogramSlot {
+	std::atomic<uint64_t> buckets[HISTOGRAM_BUCKETS];
+};
+
+// Slots are filled before `count` is raised with release, `magic` is stored
+// last once the header is complete
+struct MetricsSegment {
+	std::atomic<uint64_t> magic;
+	uint32_t version;
+	uint32_t size;  // sizeof(MetricsSegment)
+	uint32_t pid;
+	std::atomic<uint32_t> count;
+	MetricsSlot metrics[METRICS_CAPACITY];
+	MetricsHistogramSlot histograms[METRICS_HISTOGRAMS];
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free && std::atomic<uint32_t>::is_always_lock_free,
+	"shared metrics need address free atomics");
+
+constexpr uint32_t histogram_bucket(uint64_t value)
+{
+	if (value < HISTOGRAM_SUB_BUCKETS) {
+		return uint32_t(value);
+	}
+	uint32_t exponent = uint32_t(std::bit_width(value)) - 1;
+	return (exponent - HISTOGRAM_SUB_BITS) * HISTOGRAM_SUB_BUCKETS + uint32_t(value >> (exponent - HISTOGRAM_SUB_BITS));
+}
+
+// smallest value of `bucket`
+constexpr uint64_t histogram_bucket_min(uint32_t bucket)
+{
+	if (bucket < HISTOGRAM_SUB_BUCKETS) {
+		return bucket;
+	}
+	uint32_t exponent = bucket / HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BITS - 1;
+	return uint64_t(bucket % HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BUCKETS) << (exponent - HISTOGRAM_SUB_BITS);
+}
+
+namespace vkutil {
+// where updates of handles that were never registered go
+MetricsSlot& metrics_sink();
+MetricsHistogramSlot& metrics_histogram_sink();
+};
+
+// Handles are a single pointer, copy them into whatever updates them.
+// They stay valid until MetricsRegistry::cleanup().
+class MetricCounter {
+public:
+	void add(uint64_t n = 1) { _value->fetch_add(n, std::memory_order_relaxed); }
+
+private:
+	friend class MetricsRegistry;
+	std::atomic<uint64_t>* _value{&vkutil::metrics_sink().value};
+};
+
+class MetricGauge {
+public:
+	void set(double value) { _value->store(std::bit_cast<uint64_t>(value), std::memory_order_relaxed); }
+
+private:
+	friend class MetricsRegistry;
+	std::atomic<uint64_t>* _value{&vkutil::metrics_sink().value};
+};
+
+class MetricHistogram {
+public:
+	void record(uint64_t nanoseconds)
+	{
+		_slot->buckets[histogram_bucket(nanoseconds)].fetch_add(1, std::memory_order_relaxed);
+	}
+	void record(std::chrono::nanoseconds duration) { record(uint64_t(std::max<int64_t>(duration.count(), 0))); }
+
+private:
+	friend class MetricsRegistry;
+	MetricsHistogramSlot* _slot{&vkutil::metrics_histogram_sink()};
+};
+
+// Owns the segment. Registering takes a lock and is meant for init time, a
+// name registered twice returns the same metric. When the segment is full the
+// handle writes into the sink instead.
+class MetricsRegistry {
+public:
+	// Creates the segment `name`, "/gpsim_metrics" style. One left behind by
+	// an engine that is no longer running is replaced, while one in use by a
+	// running engine is kept and this one publishes in `name`_<pid> instead,
+	// see name(). An empty name, or a system without shared memory, keeps the
+	// metrics in process memory.
+	void init(const std::string& name);
+	// unlinks the segment, unless another engine has taken over its name
+	void cleanup();
+
+	MetricCounter counter(std::string_view name);
+	MetricGauge gauge(std::string_view name);
+	MetricHistogram histogram(std::string_view name);
+
+	bool shared() const { return _shared; }
+	const std::string& name() const { return _name; }
+
+private:
+	MetricsSlot* add(std::string_view name, MetricKind kind);
+
+	MetricsSegment* _segment{nullptr};
+	std::string _name;
+	bool _shared{false};
+	intptr_t _mapping{-1};  // the Windows mapping handle
+	uint32_t _histograms{0};
+	std::mutex _mutex;
+};
+
+// A copy of one metric, as read from a segment
+struct MetricSnapshot {
+	std::string name;
+	MetricKind kind;
+	uint64_t value{0};  // counter value or gauge bits
+	std::vector<uint64_t> buckets;
+
+	double gauge() const { return std::bit_cast<double>(value); }
+};
+
+struct MetricsSnapshot {
+	uint32_t pid{0};
+	std::vector<MetricSnapshot> metrics;
+};
+
+namespace vkutil {
+// Copies all metrics of the segment `name`, false if it does not exist (yet)
+// or was written by another layout version
+bool read_metrics(const std::string& name, MetricsSnapshot& snapshot);
+
+// Largest value equivalent to the one at `quantile` of the samples, 0 for an
+// empty histogram. Both ends of a bucket round to the same value, so this
+// never understates a latency.
+uint64_t histogram_quantile(const std::vector<uint64_t>& buckets, double quantile);
+uint64_t histogram_count(const std::vector<uint64_t>& buckets);
+};
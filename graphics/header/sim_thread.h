@@ -0,0 +1,79 @@
+#pragma once
+
+#include <checkpoint.h>
+#include <cpu_particles.h>
+#include <metrics.h>
+#include <triple_buffer.h>
+
+// State of the CPU particles after one fixed step, as published to the
+// renderer
+struct ParticleSnapshot {
+	CpuParticleSet particles;
+	uint32_t count{0};
+	uint64_t step{0};
+	// seconds since SimulationThread::start() this state belongs to
+	double time{0.0};
+};
+
+// Steps a CpuParticleSystem on its own thread at a fixed dt, independent of
+// the frame rate. After every step the alive particles are copied into a
+// snapshot and handed over through a triple buffer, so the renderer picks up
+// the newest state without ever waiting for the solver, and the solver never
+// waits for present.
+//
+// Paced, one step is taken per dt of wall time, computed a step ahead of the
+// clock, and the renderer interpolates between the two states around now.
+// Unpaced, the solver runs as fast as it can and the renderer shows the
+// newest step.
+class SimulationThread {
+public:
+	// `fixedDt` is passed to CpuParticleSystem::simulate(), which splits it
+	// into its substeps. Substep passes run on the simulation thread.
+	void start(CpuParticleSystem* particles, float fixedDt, bool paced);
+	void stop();
+	// writes every step to `writer` from the simulation thread, set before
+	// start(). The writer only blocks the solver when the disk falls behind.
+	void record(CheckpointWriter* writer) { _recorder = writer; }
+	// times every step of the solver into `steps`, set before start()
+	void time_steps(MetricHistogram steps) { _stepTime = steps; }
+
+	// newest published snapshot, nullptr before the first step. Stays valid
+	// until the next call.
+	const ParticleSnapshot* latest();
+
+	// Seconds to move a particle of `snapshot` back along its velocity to
+	// land at the present. The integrator moves particles by velocity *
+	// dt, so this interpolates between the snapshot and the step before.
+	float interpolation_offset(const ParticleSnapshot& snapshot) const;
+
+	float fixed_dt() const { return _fixedDt; }
+	uint64_t steps() const { return _steps.load(std::memory_order_relaxed); }
+	bool running() const { return _thread.joinable(); }
+
+private:
+	void loop();
+	double seconds_since_start() const;
+
+	CpuParticleSystem* _particles{nullptr};
+	CheckpointWriter* _recorder{nullptr};
+	MetricHistogram _stepTime;
+	float _fixedDt{1.f / 120.f};
+	bool _paced{true};
+
+	std::thread _thread;
+	std::atomic<bool> _stop{false};
+	std::atomic<uint64_t> _steps{0};
+	std::chrono::steady_clock::time_point _start{};
+
+	TripleBuffer<ParticleSnapshot> _snapshots;
+	bool _published{false};  // renderer side, a snapshot was acquired
+};
+
+namespace vkutil {
+// the arrays of a CpuParticleSet as checkpoint fields
+std::span<const CheckpointField> particle_checkpoint_fields();
+void record_particles(CheckpointWriter& writer, const CpuParticleSystem& particles, uint64_t step, double time);
+// replaces the alive particles with a recorded frame, false if the recording
+// holds other fields or the frame is corrupt
+bool restore_particles(CheckpointReader& reader, size_t frame, CpuParticleSystem& particles);
+}
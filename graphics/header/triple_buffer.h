@@ -0,0 +1,44 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+// Hands values from one producer thread to one consumer thread without locks
+// or waiting. The producer fills write() and publishes it, the consumer
+// switches to the latest published value with acquire(). Three slots let
+// both sides always own one while the third holds the newest value, so a
+// slow consumer only skips values and a slow producer is never waited on.
+template <typename T>
+class TripleBuffer {
+public:
+	// producer side: the slot to fill next, owned until publish()
+	T& write() { return _slots[_write]; }
+	void publish()
+	{
+		uint32_t previous = _shared.exchange(_write | FRESH, std::memory_order_acq_rel);
+		_write = previous & INDEX;
+	}
+
+	// consumer side: switches to the latest published slot, false when
+	// nothing was published since the last call
+	bool acquire()
+	{
+		if (!(_shared.load(std::memory_order_relaxed) & FRESH)) {
+			return false;
+		}
+		uint32_t previous = _shared.exchange(_read, std::memory_order_acq_rel);
+		_read = previous & INDEX;
+		return true;
+	}
+	// the slot of the last acquire(), owned until the next one
+	const T& read() const { return _slots[_read]; }
+
+private:
+	static constexpr uint32_t INDEX = 3;
+	static constexpr uint32_t FRESH = 4;
+
+	T _slots[3]{};
+	uint32_t _write{0};
+	uint32_t _read{1};
+	std::atomic<uint32_t> _shared{2};
+};
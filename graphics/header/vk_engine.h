@@ -1,16 +1,39 @@
 #pragma once
 
+#include "camera.h"
+#include "cpu_gravity.h"
+#include "cpu_sph.h"
+#include "metrics.h"
+#include "sim_thread.h"
 #include "vk_descriptors.h"
+#include "vk_gravity.h"
+#include "vk_indirect.h"
+#include "vk_loader.h"
+#include "vk_memory.h"
+#include "vk_particles.h"
+#include "vk_pipelines.h"
+#include "vk_primitives.h"
+#include "vk_readback.h"
+#include "vk_resolve.h"
+#include "vk_sph.h"
+#include "vk_splat.h"
+#include "vk_streaming.h"
+#include "vk_transient.h"
+#include "vk_tuning.h"
 #include "vk_types.h"
+#include "vk_volume.h"
+#include "vk_xpbd.h"
 
 constexpr unsigned int FRAME_OVERLAP = 2;
 
-struct AllocatedImage {
-	VkImage image;
-	VkImageView imageView;
-	VmaAllocation allocation;
-	VkExtent3D imageExtent;
-	VkFormat imageFormat;
+// Order of the passes recorded by draw(). Transient resources are declared
+// with the range of passes that use them.
+enum FramePass : uint32_t {
+	PASS_SIMULATION, // particle substeps with SPH and gravity, volume and cloth
+	PASS_CULL,       // depth pyramid of the previous frame, instance culling
+	PASS_GEOMETRY,
+	PASS_SPLAT,      // particles and volume over the scene
+	PASS_RESOLVE,
 };
 
 struct DeletionQueue {
@@ -26,16 +49,49 @@ struct FrameData {
 	VkFence _renderFence;
 	VkSemaphore _swapchainSemaphore, _renderSemaphore;
 	DeletionQueue _deletionQueue;
+
+	AllocatedBuffer _sceneDataBuffer; // GPUSceneData, host visible
 };
 
 class VulkanEngine {
 public:
   VmaAllocator _allocator; // Vulkan Memory Allocator
+  GpuMemory _memory;       // tagged allocations, budgets and defragmentation
+
+  // Shader modules, created on demand from the embedded SPIR-V
+  ShaderRegistry _shaders;
+  // graphics pipelines by their fixed state, see GraphicsPipelineCache
+  GraphicsPipelineCache _pipelines;
+  bool _graphicsPipelineLibrary{false};
 
   // Pipelines
-  VkPipeline _gradientPipeline;
+  ComputeKernel _gradientKernel;
   VkPipelineLayout _gradientPipelineLayout;
 
+  // Chooses the fastest workgroup size of every tuned kernel once per device
+  KernelTuner _kernelTuner;
+
+  // scan, reduce, compaction and sort kernels shared by the GPU subsystems
+  GpuPrimitives _primitives;
+
+  // non-blocking GPU to host copies, results arrive FRAME_OVERLAP frames later
+  ReadbackRing _readback;
+
+  // live metrics for executables/metrics, in the shared memory segment
+  // GPSIM_METRICS (default /gpsim_metrics), GPSIM_METRICS=0 keeps them in
+  // the process. Durations are in nanoseconds.
+  MetricsRegistry _metrics;
+  struct FrameMetrics {
+    MetricHistogram interval;     // between the starts of two draw() calls
+    MetricHistogram cpuTime;      // of draw(), without the waits below
+    MetricHistogram fenceWait;    // for the frame FRAME_OVERLAP back
+    MetricHistogram acquireWait;  // for the next swapchain image
+    MetricHistogram particlesGpu; // simulation substeps on the GPU
+    MetricCounter frames;
+    MetricGauge alive;
+    std::chrono::steady_clock::time_point lastDraw{};
+  } _frameMetrics;
+
   // Descriptor Pool
   DescriptorAllocator globalDescriptorAllocator;
 
@@ -43,11 +99,63 @@ public:
   VkDescriptorSetLayout _drawImageDescriptorLayout;
   // draw resources
   AllocatedImage _drawImage;
+  AllocatedImage _depthImage;
   VkExtent2D _drawExtent;
 
+  // per-frame scratch images and buffers, aliased in memory when their passes
+  // do not overlap. Declare them during init, they are built at the end of it.
+  TransientAllocator _transients;
+
+  // GPU driven scene rendering
+  IndirectRenderer _indirect;
+  std::optional<LoadedMeshes> _sceneMeshes;
+  GPUSceneData _sceneData;
+  Camera _camera;
+  // GPSIM_STREAM=1 streams the scene from a cluster file instead, keeping
+  // only what is visible resident
+  GeometryStreamer _streaming;
+
+  // particle simulation, stepped at the start of every frame
+  ParticleSystem _particles;
+  // optional SPH fluid forces on the particles, enabled with GPSIM_SPH=1
+  SphSolver _sph;
+  // optional Barnes-Hut gravity between the particles, GPSIM_GRAVITY=1
+  GravitySolver _gravity;
+  // draws the particles from compute, GPSIM_SPLAT=0 turns it off and
+  // GPSIM_SPLAT=tiled selects the tile binned variant
+  PointSplatter _splatter;
+  bool _splatParticles{false};
+  // 64-bit atomics on buffers and on shared memory, optional device features
+  bool _splatAtomics{false};
+  bool _splatSharedAtomics{false};
+  // GPSIM_VOLUME=1 adds a sparse smoke volume, stepped with the particles and
+  // ray marched over the scene
+  SparseVolume _volume;
+  // GPSIM_CLOTH=1 drapes an XPBD cloth over the center dragon, colliding
+  // with a BVH over its triangles
+  MeshBvh _clothCollider;
+  XpbdSolver _cloth;
+  // GPSIM_BACKEND=cpu runs the simulation (and SPH) on the CPU instead, for
+  // machines without a usable GPU. It steps on _simThread at a fixed dt and
+  // the newest snapshot is uploaded into _particles every frame so drawing
+  // stays the same.
+  bool _cpuSimulation{false};
+  CpuParticleSystem _cpuParticles;
+  CpuSphSolver _cpuSph;
+  CpuGravitySolver _cpuGravity;
+  SimulationThread _simThread;
+  // GPSIM_ANALYTICS=1 reads the alive count and a sample of velocities back
+  // every frame and logs their statistics
+  bool _analytics{false};
+  uint32_t _analyticsAlive{0};
+  std::chrono::steady_clock::time_point _analyticsReport{};
+  // GPSIM_RECORD=file records every CPU step, GPSIM_RESUME=file starts from one
+  CheckpointWriter _recording;
+
   VkInstance _instance;                      // Vulkan library handle
   VkDebugUtilsMessengerEXT _debug_messenger; // Vulkan debug output handle
   VkPhysicalDevice _chosenGPU;               // GPU chosen as the default device
+  VkPhysicalDeviceProperties _gpuProperties; // limits of the chosen GPU
   VkDevice _device;                          // Vulkan device for commands
   VkSurfaceKHR _surface;                     // Vulkan window surface
 
@@ -57,17 +165,32 @@ public:
   std::vector<VkImage> _swapchainImages;
   std::vector<VkImageView> _swapchainImageViews;
   VkExtent2D _swapchainExtent;
+  // swapchain images can be written from compute, see SwapchainResolve
+  bool _swapchainStorage{false};
+  // UNORM images presented as sRGB, the resolve has to encode what it stores
+  bool _swapchainEncodeSrgb{false};
+  bool _storageWriteWithoutFormat{false};
+  SwapchainResolve _resolve;
 
   // Frame Related Things
   FrameData _frames[FRAME_OVERLAP];
   FrameData& get_current_frame();
   VkQueue _graphicsQueue;
   uint32_t _graphicsQueueFamily;
+  uint32_t _timestampValidBits{0};  // of the graphics queue family
+
+  // immediate submit structures
+  VkFence _immFence;
+  VkCommandBuffer _immCommandBuffer;
+  VkCommandPool _immCommandPool;
 
   bool _isInitialized{false};
   int _frameNumber{0};
+  float _deltaTime{0.f}; // seconds since the previous frame
   bool stop_rendering{false};
   VkExtent2D _windowExtent{1700, 900};
+  // set before init(), benchmarks turn them off
+  bool _validationLayers{true};
 
   struct SDL_Window *_window{nullptr};
 
@@ -77,10 +200,31 @@ public:
   void cleanup();
   void draw();
   void draw_background(VkCommandBuffer cmd);
+  void draw_geometry(VkCommandBuffer cmd);
+  void update_scene();
+  void read_analytics();
   void run();
 
+  // per heap budgets, per tag usage and allocation counts of the last frame
+  MemoryStatistics memory_statistics() const { return _memory.statistics(); }
+
+  // records and submits work on the graphics queue and waits for it to finish
+  void immediate_submit(std::function<void(VkCommandBuffer cmd)>&& function);
+
+  // copies all streams through one staging buffer in a single submit. The
+  // caller owns the returned buffers and frees them with destroy_mesh.
+  GPUMeshBuffers upload_mesh(std::span<const uint32_t> indices,
+                             std::span<const glm::vec3> positions,
+                             std::span<const VertexAttributes> attributes);
+  void destroy_mesh(const GPUMeshBuffers &mesh);
+
+  // device local buffer filled through a staging copy
+  AllocatedBuffer upload_buffer(const void *data, size_t size,
+                                VkBufferUsageFlags usage, MemoryTag tag);
+
 private:
 	DeletionQueue _mainDeletionQueue;
+  void init_metrics();
   void init_vulkan();
   void init_swapchain();
   void init_commands();
@@ -89,6 +233,11 @@ private:
 
   void init_pipelines();
   void init_background_pipelines();
+  void init_scene();
+  void init_cloth(const std::filesystem::path &scene, const Bounds &bounds,
+                  const glm::mat4 &transform);
+  void init_simulation();
+  void init_transients();
 
   void create_swapchain(uint32_t width, uint32_t height);
   void destroy_swapchain();
@@ -0,0 +1,179 @@
+#pragma once
+
+#include <vk_particles.h>
+
+// must match shaders/gravity.glsl
+constexpr uint32_t OCTREE_MAX_DEPTH = 10;  // 30 bit Morton codes
+constexpr uint32_t OCTREE_LEVELS = OCTREE_MAX_DEPTH + 1;
+// workgroup size of the per node passes
+constexpr uint32_t OCTREE_NODE_GROUP = 64;
+
+struct GravitySettings {
+	// G times the mass of one body, all bodies weigh the same. Negative values
+	// repel, which models bodies carrying the same charge.
+	float strength{1e-5f};
+	// Plummer softening length, keeps close encounters finite
+	float softening{0.01f};
+	// opening angle: a cell of size s at distance d is used as a whole when
+	// s / d < theta, 0 degenerates into the direct sum
+	float theta{0.5f};
+	// cells with at most this many bodies are not split further
+	uint32_t leafSize{16};
+	// node storage per body of the capacity. Cells that find no room for their
+	// children stay leaves, which is slower but still exact.
+	float nodesPerBody{0.5f};
+};
+
+// Octree node, on the CPU and the GPU. Children of a node are contiguous,
+// bodies are ranges of the Morton sorted order.
+struct GPUOctreeNode {
+	glm::vec4 centerMass;  // center of mass, w = bodies below
+	glm::vec4 quad0;       // xx, xy, xz, yy of the quadrupole about the center of mass
+	glm::vec4 quad1;       // yz, zz, cell edge length, unused
+	uint32_t firstChild;
+	uint32_t childCount;   // 0 for leaves
+	uint32_t firstBody;
+	uint32_t bodyCount;
+};
+
+// CPU mirror of OctreeState in shaders/gravity.glsl
+struct GPUOctreeState {
+	uint32_t count;       // bodies of this build
+	uint32_t nodeCount;
+	uint32_t overflow;    // cells left unsplit for lack of nodes
+	float extent;         // edge length of the root cell
+	uint32_t boundsMin[4];  // order preserving float bits
+	uint32_t boundsMax[4];
+	uint32_t levelStart[OCTREE_LEVELS + 1];  // first node of every level
+	struct {
+		VkDispatchIndirectCommand dispatch;
+		uint32_t pad;
+	} levelDispatch[OCTREE_LEVELS];  // workgroups over the nodes of every level
+};
+
+// CPU mirror of OctreeBuffers in shaders/gravity.glsl
+struct GPUOctreeBuffers {
+	VkDeviceAddress state;
+	VkDeviceAddress nodes;
+	VkDeviceAddress keys;             // Morton code per sorted body
+	VkDeviceAddress values;           // index of every sorted body
+	VkDeviceAddress sortedPositions;
+};
+
+// Bodies in the layout of a ParticleSet: vec4 positions and velocities in
+// the formats of `storage`, with their number at counts[set].
+struct GravityBodies {
+	VkDeviceAddress positions;
+	VkDeviceAddress velocities;
+	VkDeviceAddress counts;
+	uint32_t set;
+	uint32_t storage;  // StorageLayout::packed(), 0 for Float32
+};
+
+// Barnes-Hut gravity over up to `capacity` bodies. Every solve rebuilds the
+// octree from scratch:
+//   bounds     cube around all bodies
+//   morton     30 bit codes, sorted by the engine's GpuPrimitives
+//   build      one pass per level: every cell with more than leafSize bodies
+//              finds its children's ranges by binary search in the sorted
+//              codes and appends them, so the nodes of a level end up
+//              contiguous behind the ones of the level before
+//   multipole  one pass per level from the deepest up: mass, center of mass
+//              and quadrupole from the bodies of leaves or the children
+//   force      a stack based traversal per body in Morton order, so that
+//              neighbouring invocations walk almost the same cells
+// All passes are sized by indirect dispatches written on the GPU, the body
+// count never has to be read back.
+class GravitySolver {
+public:
+	void init(VulkanEngine* engine, uint32_t capacity, const GravitySettings& settings);
+	void cleanup();
+
+	// kicks the particles with the gravity of all of them after every substep
+	void attach(ParticleSystem* particles);
+
+	// accelerations (w = potential) into accelerations(), per body in body
+	// order, and interactions per body into interactions(), in sorted order
+	void solve(VkCommandBuffer cmd, const GravityBodies& bodies);
+	// velocities += accelerations * dt
+	void kick(VkCommandBuffer cmd, const GravityBodies& bodies, float dt);
+	// positions += velocities * dt
+	void drift(VkCommandBuffer cmd, const GravityBodies& bodies, float dt);
+
+	const AllocatedBuffer& accelerations() const { return _accelerations; }
+	const AllocatedBuffer& interactions() const { return _interactions; }
+	const AllocatedBuffer& state() const { return _state; }
+	const GravitySettings& settings() const { return _settings; }
+	void set_theta(float theta) { _settings.theta = theta; }
+
+private:
+	// must match the push constants in shaders/gravity.glsl
+	struct PushConstants {
+		VkDeviceAddress octree;
+		VkDeviceAddress positions;
+		VkDeviceAddress velocities;
+		VkDeviceAddress counts;
+		VkDeviceAddress accelerations;
+		VkDeviceAddress interactions;
+		uint32_t set;
+		uint32_t capacity;
+		uint32_t maxNodes;
+		uint32_t leafSize;
+		uint32_t level;
+		uint32_t mode;
+		float strength;
+		float softening2;
+		float theta;
+		float dt;
+		uint32_t storage;
+		uint32_t pad;
+	};
+
+	PushConstants push_constants(const GravityBodies& bodies) const;
+	void dispatch_bodies(VkCommandBuffer cmd, const ComputeKernel& kernel, const PushConstants& push);
+	void dispatch_level(VkCommandBuffer cmd, const ComputeKernel& kernel, PushConstants& push, uint32_t level);
+	void prepare(VkCommandBuffer cmd, PushConstants& push, uint32_t mode, uint32_t level);
+
+	VulkanEngine* _engine{nullptr};
+	ParticleSystem* _particles{nullptr};
+	GravitySettings _settings;
+	uint32_t _capacity{0};
+	uint32_t _maxNodes{0};
+
+	AllocatedBuffer _state{};
+	AllocatedBuffer _nodes{};
+	AllocatedBuffer _keys{};
+	AllocatedBuffer _values{};
+	AllocatedBuffer _sortedPositions{};
+	AllocatedBuffer _accelerations{};  // vec4 per body
+	AllocatedBuffer _interactions{};   // uint per sorted body
+	AllocatedBuffer _buffersTable{};
+
+	VkPipelineLayout _layout{VK_NULL_HANDLE};
+	ComputeKernel _prepareKernel;
+	ComputeKernel _boundsKernel;
+	ComputeKernel _mortonKernel;
+	ComputeKernel _gatherKernel;
+	ComputeKernel _buildKernel;
+	ComputeKernel _multipoleKernel;
+	ComputeKernel _forceKernel;
+	ComputeKernel _integrateKernel;
+};
+
+namespace vkutil {
+// spreads the low 10 bits of v to every third bit, as in shaders/gravity.glsl
+inline uint32_t expand_bits(uint32_t v)
+{
+	v &= 0x3ffu;
+	v = (v | (v << 16)) & 0x030000ffu;
+	v = (v | (v << 8)) & 0x0300f00fu;
+	v = (v | (v << 4)) & 0x030c30c3u;
+	v = (v | (v << 2)) & 0x09249249u;
+	return v;
+}
+
+inline uint32_t morton3(uint32_t x, uint32_t y, uint32_t z)
+{
+	return (expand_bits(x) << 2) | (expand_bits(y) << 1) | expand_bits(z);
+}
+};
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <vk_pipelines.h>
+#include <vk_storage.h>
+#include <vk_transient.h>
+
+class VulkanEngine;
+
+// CPU mirror of GridBuffers in shaders/grid.glsl
+struct GPUGridBuffers {
+	VkDeviceAddress params;
+	VkDeviceAddress cellCount;
+	VkDeviceAddress cellStart;
+	VkDeviceAddress particleCell;
+	VkDeviceAddress particleRank;
+	VkDeviceAddress sortedIndex;
+	VkDeviceAddress sortedPositions;
+	VkDeviceAddress sortedVelocities;
+	uint32_t storage;  // StorageLayout::packed()
+	uint32_t pad;
+};
+
+// Neighbor search over a uniform grid whose cells are hashed into a fixed
+// size table, rebuilt from scratch with a counting sort:
+//   hash    count the particles per cell, remembering each one's slot
+//   scan    exclusive prefix sum of the counts gives every cell's range,
+//           done by the engine's GpuPrimitives
+//   scatter copy positions and velocities into cell order, in the storage
+//           formats of the particle set
+// Afterwards the particles of a cell are contiguous, so a neighbor query
+// walks the 27 surrounding cells as 27 short linear ranges.
+//
+// Nothing of a build outlives the simulation pass, so the buffers are
+// transients of the engine and only hold the grid from build() until the
+// pass ends.
+class NeighborGrid {
+public:
+	// the cell size should match the interaction radius of the query passes,
+	// `storage` is the layout of the particle sets the grid is built from.
+	// Has to run before the engine builds its transients.
+	void init(VulkanEngine* engine, uint32_t capacity, float cellSize, const StorageLayout& storage = {});
+	void cleanup();
+
+	// `counts` holds one alive count per particle set, `set` selects the one
+	// of the given positions. Leaves the grid ready for compute reads.
+	void build(VkCommandBuffer cmd, VkDeviceAddress positions, VkDeviceAddress velocities, VkDeviceAddress counts,
+		uint32_t set);
+
+	// address of the GPUGridBuffers table, for the query passes
+	VkDeviceAddress buffers() const { return _buffersTable.address; }
+	// indirect dispatch over the particles of the last build, at `params`
+	VkBuffer params_buffer() const { return _params.buffer; }
+	uint32_t capacity() const { return _capacity; }
+	uint32_t table_size() const { return _tableSize; }
+	float cell_size() const { return _cellSize; }
+
+private:
+	struct PushConstants {
+		VkDeviceAddress grid;
+		VkDeviceAddress positions;
+		VkDeviceAddress velocities;
+		VkDeviceAddress counts;
+		float cellSize;
+		uint32_t tableSize;
+		uint32_t set;
+		uint32_t capacity;
+		uint32_t groupSize;
+		uint32_t maxGroups;
+	};
+
+	VulkanEngine* _engine{nullptr};
+	uint32_t _capacity{0};
+	uint32_t _tableSize{0};
+	float _cellSize{1.f};
+
+	AllocatedBuffer _params{};
+	AllocatedBuffer _cellCount{};
+	AllocatedBuffer _cellStart{};
+	AllocatedBuffer _particleCell{};
+	AllocatedBuffer _particleRank{};
+	AllocatedBuffer _sortedIndex{};
+	AllocatedBuffer _sortedPositions{};
+	AllocatedBuffer _sortedVelocities{};
+	AllocatedBuffer _buffersTable{};
+	// of the buffers above, except the table
+	std::array<TransientAllocator::Handle, 8> _scratchHandles{};
+
+	VkPipelineLayout _layout;
+	ComputeKernel _prepareKernel;
+	ComputeKernel _hashKernel;
+	ComputeKernel _scatterKernel;
+};
@@ -0,0 +1,152 @@
+#pragma once
+
+#include <camera.h>
+#include <vk_loader.h>
+#include <vk_pipelines.h>
+#include <vk_transient.h>
+
+class VulkanEngine;
+
+// CPU mirrors of the structs in shaders/scene.glsl
+struct GPUSceneData {
+	glm::mat4 view;
+	glm::mat4 proj;
+	glm::mat4 viewproj;
+	glm::mat4 prevView;
+	glm::vec4 frustum[6];
+	float P00;
+	float P11;
+	float znear;
+	uint32_t occlusion;
+	glm::vec2 pyramidSize;
+	uint32_t instanceCount;
+	float lodScale;  // pixels per unit of error at distance 1, 0 for full detail
+};
+
+struct GPUInstance {
+	glm::mat4 transform;
+	uint32_t surface;
+	float scale;
+	uint32_t pad0;
+	uint32_t pad1;
+};
+
+struct GPUMeshLod {
+	uint32_t firstIndex;
+	uint32_t indexCount;
+	float error;
+	uint32_t pad;
+};
+
+struct GPUSurface {
+	int32_t vertexOffset;
+	uint32_t lodCount;
+	uint32_t pad0;
+	uint32_t pad1;
+	glm::vec4 sphere;
+	GPUMeshLod lods[MAX_MESH_LODS];
+};
+
+// GPU driven rendering of everything in the instance buffer. A compute pass
+// culls every instance against the frustum and against a depth pyramid of
+// the previous frame's depth and appends the survivors to an indirect
+// argument buffer, which one vkCmdDrawIndexedIndirectCount then draws. The
+// recorded command stream is the same no matter how many instances there are.
+// The pyramid is a transient of the cull pass, reduced from the depth image
+// right before the cull.
+//
+// The cull pass also picks the level of detail of every survivor: the
+// coarsest one whose error, projected at the distance of its bounding
+// sphere, stays under lodPixelError pixels.
+class IndirectRenderer {
+public:
+	float lodPixelError{1.f};  // 0 draws everything at full detail
+	// Culls against the frustum on the CPU with vkutil::cull_spheres and
+	// writes the commands into host visible memory instead of running the
+	// compute pass. Without occlusion culling, for drivers where the compute
+	// pass costs more than it saves, like software rasterizers.
+	bool cpuCulling{false};
+
+	void init(VulkanEngine* engine);
+	void cleanup();
+
+	// one instance per surface of every mesh at every transform
+	void set_scene(const LoadedMeshes& meshes, std::span<const glm::mat4> transforms);
+
+	uint32_t instance_count() const { return _instanceCount; }
+	VkExtent2D pyramid_extent() const { return _pyramidExtent; }
+	// whether cull() has a previous depth image to build the pyramid from
+	bool has_pyramid() const { return _previousDepth; }
+
+	// compute pass, or the CPU path with cpuCulling, must be recorded outside
+	// of rendering. `scene` is what `sceneData` holds, the CPU path reads it.
+	// With scene.occlusion the depth image has to be in DEPTH_READ_ONLY_OPTIMAL.
+	void cull(VkCommandBuffer cmd, VkDeviceAddress sceneData, const GPUSceneData& scene, uint32_t frameIndex);
+	// inside a rendering pass on the draw and depth image
+	void draw(VkCommandBuffer cmd, VkDeviceAddress sceneData);
+	// after the geometry pass left the depth image in DEPTH_READ_ONLY_OPTIMAL,
+	// the next cull() tests against it
+	void depth_rendered() { _previousDepth = true; }
+
+private:
+	struct CullPushConstants {
+		VkDeviceAddress scene;
+		VkDeviceAddress instances;
+		VkDeviceAddress surfaces;
+		VkDeviceAddress commands;
+		VkDeviceAddress count;
+	};
+
+	struct DrawPushConstants {
+		VkDeviceAddress scene;
+		VkDeviceAddress instances;
+		VkDeviceAddress positions;
+		VkDeviceAddress attributes;
+	};
+
+	void init_pyramid();
+	void init_pyramid_views();
+	void build_depth_pyramid(VkCommandBuffer cmd);
+	void init_pipelines();
+	void destroy_scene();
+	void cull_cpu(VkCommandBuffer cmd, const GPUSceneData& scene, uint32_t frameIndex);
+
+	VulkanEngine* _engine{nullptr};
+
+	const LoadedMeshes* _meshes{nullptr};
+	uint32_t _instanceCount{0};
+	AllocatedBuffer _instanceBuffer{};
+	AllocatedBuffer _surfaceBuffer{};
+	AllocatedBuffer _drawCommandBuffer{};
+	AllocatedBuffer _drawCountBuffer{};
+	const AllocatedBuffer* _culledCommands{nullptr};  // what cull() wrote this frame
+
+	// host copies for the CPU path, the world space spheres in instance order
+	std::vector<GPUInstance> _instances;
+	std::vector<GPUSurface> _surfaces;
+	SphereBoundsSoA _instanceSpheres;
+	std::vector<uint32_t> _visible;
+	std::vector<AllocatedBuffer> _cpuCommands;  // per frame in flight
+
+	VkSampler _minSampler;
+	TransientAllocator::Handle _pyramid;
+	AllocatedImage _depthPyramid;  // owned by the engine's transients
+	VkExtent2D _pyramidExtent;
+	uint32_t _pyramidLevels;
+	std::vector<VkImageView> _pyramidMips;
+	std::vector<VkDescriptorSet> _reduceSets;
+	VkDescriptorSetLayout _reduceSetLayout;
+	bool _previousDepth{false};
+
+	VkDescriptorSetLayout _cullSetLayout;
+	VkDescriptorSet _cullSet;
+
+	ComputeKernel _cullKernel;
+	ComputeKernel _reduceKernel;
+	VkPipelineLayout _cullLayout;
+	VkPipelineLayout _reduceLayout;
+
+	VkPipelineLayout _meshLayout;
+	GraphicsPipelineDesc _meshPipeline;
+	DynamicGraphicsState _meshState;
+};
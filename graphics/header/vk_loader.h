@@ -1 +1,94 @@
 ﻿#pragma once
+
+#include <vk_types.h>
+
+#include <filesystem>
+
+#include <glm/vec3.hpp>
+
+class VulkanEngine;
+
+// Everything but the position, kept in its own stream so that passes which
+// only need positions (depth, shadows, culling) fetch 12 bytes per vertex.
+struct VertexAttributes {
+	int16_t normal[2]; // octahedral encoded unit normal, snorm16
+	uint16_t uv[2];    // half floats
+};
+
+// The geometry of one load lives in shared buffers, surfaces address it with
+// a first index and a vertex offset so a single indirect draw reaches any mesh.
+struct GPUMeshBuffers {
+	AllocatedBuffer indexBuffer;
+	AllocatedBuffer positionBuffer;  // float x, y, z per vertex
+	AllocatedBuffer attributeBuffer; // VertexAttributes per vertex
+	uint32_t indexCount;
+	uint32_t vertexCount;
+};
+
+struct Bounds {
+	glm::vec3 origin;
+	float sphereRadius;
+	glm::vec3 extents;
+};
+
+constexpr uint32_t MAX_MESH_LODS = 8;
+
+// One level of detail of a surface. All levels index the same vertices.
+struct MeshLod {
+	uint32_t firstIndex;
+	uint32_t indexCount;
+	float error;  // object space distance the level may be off the full surface
+};
+
+struct GeoSurface {
+	uint32_t firstIndex;
+	uint32_t indexCount;
+	int32_t vertexOffset;
+	Bounds bounds;
+	// lods[0] is the full surface, every further level has about half the
+	// triangles of the one before
+	std::vector<MeshLod> lods;
+};
+
+struct MeshAsset {
+	std::string name;
+	std::vector<GeoSurface> surfaces;
+	Bounds bounds;
+};
+
+struct LoadedMeshes {
+	std::vector<std::shared_ptr<MeshAsset>> meshes;
+	GPUMeshBuffers buffers;
+};
+
+struct MeshLoadOptions {
+	// levels per surface including the full one, 1 disables simplification
+	uint32_t maxLods{MAX_MESH_LODS};
+	// keeps the simplified levels in <file>.lods next to the asset, so they
+	// are only generated once per asset
+	bool lodCache{true};
+};
+
+// host side result of a load, the streams GPUMeshBuffers is made of
+struct MeshGeometry {
+	std::vector<std::shared_ptr<MeshAsset>> meshes;
+	std::vector<uint32_t> indices;
+	std::vector<glm::vec3> positions;
+	std::vector<VertexAttributes> attributes;
+};
+
+// Loads every mesh of a .gltf or .glb file. Indices are reordered for the
+// post-transform cache and overdraw, vertices for fetch locality, normals and
+// uvs are quantized. Every surface gets a chain of simplified levels of
+// detail in the same streams.
+std::optional<MeshGeometry> loadGltfGeometry(std::filesystem::path filePath, const MeshLoadOptions& options = {});
+
+// loadGltfGeometry, with all meshes uploaded in one batch
+std::optional<LoadedMeshes> loadGltfMeshes(VulkanEngine* engine, std::filesystem::path filePath,
+	const MeshLoadOptions& options = {});
+
+namespace vkutil {
+// octahedral mapping of a unit vector onto two snorm16 values
+void encode_octahedral(glm::vec3 n, int16_t out[2]);
+glm::vec3 decode_octahedral(const int16_t in[2]);
+};
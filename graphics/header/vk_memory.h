@@ -0,0 +1,131 @@
+#pragma once
+
+#include <vk_types.h>
+
+#include <unordered_map>
+
+// What an allocation is used for, so memory can be accounted per subsystem
+enum class MemoryTag : uint8_t {
+	RenderTarget,
+	Simulation,
+	Geometry,
+	Staging,
+	Readback,
+	Transient,  // blocks shared by the aliased resources of TransientAllocator
+	Other,
+	Count
+};
+
+const char* to_string(MemoryTag tag);
+
+struct HeapUsage {
+	VkDeviceSize budget;          // how much the process may use before the OS starts evicting
+	VkDeviceSize usage;           // how much the process currently uses, including other allocators
+	VkDeviceSize blockBytes;      // VkDeviceMemory allocated by VMA
+	VkDeviceSize allocationBytes; // bytes handed out to resources inside those blocks
+	uint32_t blockCount;
+	uint32_t allocationCount;
+	bool deviceLocal;
+};
+
+struct MemoryStatistics {
+	std::vector<HeapUsage> heaps;
+
+	std::array<VkDeviceSize, size_t(MemoryTag::Count)> taggedBytes{};
+	std::array<uint32_t, size_t(MemoryTag::Count)> taggedAllocations{};
+
+	// allocations and frees done during the last completed frame
+	uint32_t frameAllocations;
+	uint32_t frameFrees;
+
+	// free space inside allocated blocks and how scattered it is:
+	// 0 means all of it is one range, close to 1 means many small holes
+	VkDeviceSize unusedBytes;
+	float fragmentation;
+	bool defragmenting;
+};
+
+// Thin layer over the VMA allocator that tags allocations, tracks budgets and
+// incrementally defragments buffers that were registered as movable.
+class GpuMemory {
+public:
+	// fraction of a heap budget above which defragmentation kicks in by itself
+	float pressureThreshold{0.9f};
+	// fragmentation above which defragmentation kicks in by itself
+	float fragmentationThreshold{0.5f};
+	// how often begin_frame looks at budgets and fragmentation
+	uint32_t pressureCheckInterval{240};
+	// per pass limits so a defragmentation pass never stalls a frame
+	VkDeviceSize maxBytesPerPass{64ull * 1024 * 1024};
+	uint32_t maxMovesPerPass{64};
+
+	void init(VmaAllocator allocator, VkDevice device, uint32_t framesInFlight);
+	void cleanup();
+
+	AllocatedBuffer create_buffer(size_t allocSize, VkBufferUsageFlags usage, VmaMemoryUsage memoryUsage,
+		MemoryTag tag, VmaAllocationCreateFlags flags = 0);
+	void destroy_buffer(const AllocatedBuffer& buffer);
+
+	// raw memory for resources that get bound by hand, e.g. aliased transients
+	VkResult allocate_memory(const VkMemoryRequirements& requirements, const VmaAllocationCreateInfo& allocInfo,
+		MemoryTag tag, VmaAllocation* allocation);
+	void free_memory(VmaAllocation allocation);
+
+	VkResult create_image(const VkImageCreateInfo& imageInfo, const VmaAllocationCreateInfo& allocInfo, MemoryTag tag,
+		VkImage* image, VmaAllocation* allocation);
+	void destroy_image(VkImage image, VmaAllocation allocation);
+
+	// Lets defragmentation relocate the buffer. `buffer` is rewritten in place
+	// when it moves, so it has to stay at the same address until destroyed, and
+	// users must fetch the handle or device address every frame (or refresh
+	// their descriptors from `onMoved`). Only device local, unmapped buffers.
+	void register_movable(AllocatedBuffer* buffer, std::function<void(const AllocatedBuffer&)> onMoved = {});
+
+	// once per frame, after the frame's fence was waited on. Only looks at
+	// budgets and fragmentation while there are movable buffers.
+	void begin_frame(uint64_t frameNumber);
+	// once per frame, at the start of the frame's command buffer. Finishes the
+	// pass whose copies the GPU is done with and records the next one.
+	void defragment_step(VkCommandBuffer cmd, uint64_t frameNumber);
+	void request_defragmentation();
+
+	MemoryStatistics statistics() const;
+
+private:
+	struct Record {
+		MemoryTag tag;
+		VkDeviceSize size;
+		VkBufferUsageFlags usage;
+		AllocatedBuffer* movable;
+		std::function<void(const AllocatedBuffer&)> onMoved;
+	};
+
+	struct PendingMove {
+		VmaAllocation allocation;
+		VkBuffer oldBuffer;
+	};
+
+	void track(VmaAllocation allocation, MemoryTag tag, VkDeviceSize size, VkBufferUsageFlags usage);
+	void untrack(VmaAllocation allocation);
+	void end_pass();
+	void end_defragmentation();
+
+	VmaAllocator _allocator{VK_NULL_HANDLE};
+	VkDevice _device{VK_NULL_HANDLE};
+	uint32_t _framesInFlight{1};
+
+	std::unordered_map<VmaAllocation, Record> _records;
+	uint32_t _movableCount{0};
+	std::array<VkDeviceSize, size_t(MemoryTag::Count)> _taggedBytes{};
+	std::array<uint32_t, size_t(MemoryTag::Count)> _taggedAllocations{};
+
+	uint32_t _frameAllocations{0}, _frameFrees{0};
+	uint32_t _lastFrameAllocations{0}, _lastFrameFrees{0};
+
+	VmaDefragmentationContext _defragContext{VK_NULL_HANDLE};
+	VmaDefragmentationPassMoveInfo _pass{};
+	std::vector<PendingMove> _pendingMoves;
+	bool _passActive{false};
+	uint64_t _passFrame{0};
+	bool _defragRequested{false};
+};
@@ -0,0 +1,161 @@
+#pragma once
+
+#include <vk_pipelines.h>
+#include <vk_storage.h>
+
+#include <chrono>
+
+class VulkanEngine;
+
+struct ParticleSettings {
+	// particles per set, both sets are allocated up front
+	uint32_t capacity{1u << 22};
+	// integrate/kill/emit rounds per frame, each advancing frame time / substeps
+	uint32_t substeps{4};
+	// new particles per second, 0 emits capacity / lifetime which keeps the
+	// buffers about full
+	float emitRate{0.f};
+
+	glm::vec3 emitterPosition{0.f};
+	float emitterRadius{0.5f};
+	float initialSpeed{8.f};
+	float lifetime{4.f};
+	float gravity{-9.81f};
+	float drag{0.1f};
+
+	// formats of the positions and velocities. Float16 for both fits 1.7x the
+	// particles of Float32 into the same memory, Fixed positions with Float16
+	// velocities 1.4x
+	StorageLayout storage{};
+};
+
+// CPU mirror of ParticleState in shaders/particles.glsl
+struct GPUParticleState {
+	uint32_t count[2];
+	VkDispatchIndirectCommand dispatch;
+	uint32_t integrated;
+	uint32_t pad0;
+	uint32_t pad1;
+};
+
+// Positions and velocities are vec4 in the formats of ParticleSettings::storage,
+// passes read and write them through shaders/storage.glsl. The stored w of
+// the positions is unused, ages live in ParticleSystem's fp32 age buffer.
+struct ParticleSet {
+	AllocatedBuffer positions;
+	AllocatedBuffer velocities;  // w = lifetime
+	AllocatedBuffer attributes;  // RGBA8
+};
+
+struct ParticleStats {
+	uint32_t alive{0};
+	uint64_t integrated{0};      // particle updates in the last measured frame
+	double gpuMilliseconds{0.0};
+	double particlesPerSecond{0.0};
+};
+
+// GPU particle simulation over structure-of-arrays storage buffers. Each
+// substep runs three compute passes: prepare sizes an indirect dispatch from
+// the alive count, integrate ages, moves and compacts the survivors into the
+// other set, and emit appends new particles behind them. The alive count
+// never leaves the GPU during simulation, it is only read back for the stats.
+class ParticleSystem {
+public:
+	void init(VulkanEngine* engine, const ParticleSettings& settings);
+	void cleanup();
+
+	// records all substeps of one frame, must be outside of rendering
+	void simulate(VkCommandBuffer cmd, uint32_t frameIndex, float deltaSeconds);
+	// recorded after every substep, when current() is the set it just wrote.
+	// Passes may change velocities, the next substep integrates them.
+	void add_substep_pass(std::function<void(VkCommandBuffer cmd, float dt)>&& pass);
+
+	// reads the timestamps and counts of the last frame recorded in this
+	// frame slot, call after its fence was waited on
+	void collect(uint32_t frameIndex);
+
+	// Replace or copy the alive particles of the current set, blocking on an
+	// immediate submit, so only between frames. Positions and velocities are
+	// encoded and decoded, attributes are the same as in the buffers. The w of
+	// the positions is the age, here and in upload().
+	void load(const glm::vec4* positions, const glm::vec4* velocities, const uint32_t* attributes, uint32_t count);
+	uint32_t download(std::vector<glm::vec4>& positions, std::vector<glm::vec4>& velocities,
+		std::vector<uint32_t>& attributes);
+	// records a copy of `count` particles into the current set, for
+	// simulations running elsewhere. `fill` writes them into staging memory
+	// owned by this frame slot.
+	void upload(VkCommandBuffer cmd, uint32_t frameIndex, uint32_t count,
+		const std::function<void(glm::vec4* positions, glm::vec4* velocities, uint32_t* attributes)>& fill);
+
+	const ParticleStats& stats() const { return _stats; }
+	const ParticleSettings& settings() const { return _settings; }
+	const StorageLayout& storage() const { return _settings.storage; }
+	// bytes per particle and set
+	size_t particle_bytes() const;
+	void set_emit_rate(float rate) { _settings.emitRate = rate; }
+
+	// the set written by the last substep and the state holding its count
+	const ParticleSet& current() const { return _sets[_current]; }
+	uint32_t current_index() const { return _current; }
+	const AllocatedBuffer& state() const { return _stateBuffer; }
+
+private:
+	struct PushConstants {
+		VkDeviceAddress srcPositions;
+		VkDeviceAddress srcVelocities;
+		VkDeviceAddress srcAttributes;
+		VkDeviceAddress dstPositions;
+		VkDeviceAddress dstVelocities;
+		VkDeviceAddress dstAttributes;
+		VkDeviceAddress state;
+		float dt;
+		uint32_t src;
+		glm::vec4 emitter;
+		glm::vec4 motion;
+		uint32_t capacity;
+		uint32_t emitCount;
+		uint32_t seed;
+		uint32_t groupSize;
+		uint32_t maxGroups;
+		uint32_t storage;
+		VkDeviceAddress ages;
+	};
+	// the smallest maxPushConstantsSize a device may have
+	static_assert(sizeof(PushConstants) <= 128);
+
+	void init_buffers();
+	void init_pipelines();
+	void reset(VkCommandBuffer cmd);
+	PushConstants push_constants(uint32_t src, float dt, uint32_t emitCount) const;
+
+	VulkanEngine* _engine{nullptr};
+	ParticleSettings _settings;
+
+	ParticleSet _sets[2];
+	AllocatedBuffer _stateBuffer{};
+	// fp32 age of every particle, set s at [s * capacity]
+	AllocatedBuffer _ageBuffer{};
+	uint32_t _current{0};
+	float _emitAccumulator{0.f};
+	uint32_t _seed{0};
+
+	VkPipelineLayout _layout;
+	ComputeKernel _prepareKernel;
+	ComputeKernel _integrateKernel;
+	ComputeKernel _emitKernel;
+
+	std::vector<std::function<void(VkCommandBuffer cmd, float dt)>> _substepPasses;
+
+	// two timestamps and a copy of the state per frame in flight
+	VkQueryPool _queryPool{VK_NULL_HANDLE};
+	std::vector<AllocatedBuffer> _readback;
+	std::vector<bool> _recorded;
+	std::vector<uint32_t> _recordedSet;
+	std::vector<AllocatedBuffer> _uploads;  // per frame in flight, see upload()
+	std::vector<glm::vec4> _uploadPositions;  // filled before encoding, unless Float32
+	std::vector<glm::vec4> _uploadVelocities;
+	float _timestampPeriod{0.f};
+
+	ParticleStats _stats;
+	std::chrono::steady_clock::time_point _lastReport{};
+};
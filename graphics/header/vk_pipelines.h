@@ -1,9 +1,232 @@
 ﻿#pragma once
 #include <vk_types.h>
 
+#include <future>
+#include <string_view>
+#include <unordered_map>
+
+// SPIR-V compiled at build time and linked into vkengine, see embed_shaders()
+struct EmbeddedShader {
+	const char* name;
+	std::span<const uint32_t> code;
+};
+
+struct WorkgroupSize {
+	uint32_t x{1};
+	uint32_t y{1};
+	uint32_t z{1};
+
+	uint32_t invocations() const { return x * y * z; }
+	bool operator==(const WorkgroupSize&) const = default;
+};
+
+// One pipeline of a compute kernel. The workgroup size is passed through
+// specialization constants 0..2, further kernel parameters start at id 3.
+struct ComputeVariant {
+	WorkgroupSize workgroup;
+	VkPipeline pipeline{VK_NULL_HANDLE};
+};
+
+// A compute shader compiled for several workgroup sizes. Dispatches are given
+// in invocations and divided by the selected variant's workgroup size.
+struct ComputeKernel {
+	std::string name;
+	VkPipelineLayout layout{VK_NULL_HANDLE};
+	std::vector<ComputeVariant> variants;
+	size_t selected{0};
+
+	const ComputeVariant& current() const { return variants[selected]; }
+	bool select(WorkgroupSize workgroup);
+
+	void bind(VkCommandBuffer cmd) const;
+	void dispatch(VkCommandBuffer cmd, uint32_t width, uint32_t height = 1, uint32_t depth = 1) const;
+	void destroy(VkDevice device);
+};
+
+enum class BlendMode : uint8_t {
+	Opaque,
+	Additive,
+	AlphaBlend,
+};
+
+// Graphics pipeline state that stays baked into a pipeline. Everything else
+// a material tends to change is dynamic, see DynamicGraphicsState. Vertices
+// are pulled through buffer device addresses, so there is no vertex layout.
+struct GraphicsPipelineDesc {
+	VkPipelineLayout layout{VK_NULL_HANDLE};
+	VkShaderModule vertexShader{VK_NULL_HANDLE};
+	VkShaderModule fragmentShader{VK_NULL_HANDLE};
+	// only the topology class is baked in, the topology itself is dynamic
+	VkPrimitiveTopology topology{VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST};
+	VkPolygonMode polygonMode{VK_POLYGON_MODE_FILL};
+	VkSampleCountFlagBits samples{VK_SAMPLE_COUNT_1_BIT};
+	BlendMode blend{BlendMode::Opaque};
+	// UNDEFINED for no attachment
+	VkFormat colorFormat{VK_FORMAT_UNDEFINED};
+	VkFormat depthFormat{VK_FORMAT_UNDEFINED};
+
+	bool operator==(const GraphicsPipelineDesc&) const = default;
+};
+
+struct GraphicsPipelineDescHash {
+	size_t operator()(const GraphicsPipelineDesc& desc) const;
+};
+
+// The dynamic part of a material. Every pipeline built from a
+// GraphicsPipelineDesc leaves all of this dynamic, so materials that only
+// differ here share a pipeline. apply() sets all of it, which a draw needs
+// after binding such a pipeline.
+struct DynamicGraphicsState {
+	VkPrimitiveTopology topology{VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST};
+	VkCullModeFlags cullMode{VK_CULL_MODE_NONE};
+	VkFrontFace frontFace{VK_FRONT_FACE_CLOCKWISE};
+	bool depthTest{true};
+	bool depthWrite{true};
+	// reverse-Z
+	VkCompareOp depthCompare{VK_COMPARE_OP_GREATER_OR_EQUAL};
+	bool depthBias{false};
+	float depthBiasConstant{0.f};
+	float depthBiasSlope{0.f};
+
+	// viewport and scissor cover `extent`
+	void apply(VkCommandBuffer cmd, VkExtent2D extent) const;
+};
+
+// Fills in a GraphicsPipelineDesc for dynamic rendering. Hand the desc to
+// GraphicsPipelineCache, or build a standalone pipeline with build_pipeline().
+class PipelineBuilder {
+public:
+	GraphicsPipelineDesc desc;
+
+	void set_shaders(VkShaderModule vertexShader, VkShaderModule fragmentShader);
+	void set_layout(VkPipelineLayout layout);
+	void set_input_topology(VkPrimitiveTopology topology);
+	void set_polygon_mode(VkPolygonMode mode);
+	void set_multisampling_none();
+	void disable_blending();
+	void enable_blending_additive();
+	void enable_blending_alphablend();
+	void set_color_attachment_format(VkFormat format);
+	void set_depth_format(VkFormat format);
+
+	// one monolithic pipeline
+	VkPipeline build_pipeline(VkDevice device, VkPipelineCache cache = VK_NULL_HANDLE) const;
+};
+
+struct GraphicsPipelineStats {
+	uint32_t compiled{0};   // monolithic pipelines
+	uint32_t libraries{0};
+	uint32_t linked{0};     // fast links of libraries
+	uint32_t optimized{0};  // relinks with link time optimization
+};
+
+// Graphics pipelines deduplicated by their GraphicsPipelineDesc.
+//
+// With VK_EXT_graphics_pipeline_library the vertex input, pre-rasterization
+// shader, fragment shader and fragment output parts are compiled into
+// libraries, each cached under the part of the desc it depends on. A new
+// permutation only compiles the parts no other pipeline had, and a pipeline
+// whose parts exist is a fast link instead of a compile. Fast linked
+// pipelines run slower than monolithic ones, so they are relinked with link
+// time optimization on a background thread and swapped in when done.
+//
+// Without the extension a miss compiles a monolithic pipeline on the spot,
+// call precompile() while loading to keep that out of the frame loop.
+class GraphicsPipelineCache {
+public:
+	void init(VkDevice device, bool pipelineLibrary, uint32_t framesInFlight);
+	void cleanup();
+
+	bool uses_libraries() const { return _pipelineLibrary; }
+
+	// compiles the libraries of `desc`, or its whole pipeline without them
+	void precompile(const GraphicsPipelineDesc& desc);
+	// the pipeline for `desc`, linked or compiled on a miss. Fetch it when
+	// recording instead of keeping it, it is replaced once optimized.
+	VkPipeline get(const GraphicsPipelineDesc& desc);
+
+	// once per frame after its fence was waited on: swaps in finished
+	// optimized pipelines, destroys the ones no frame uses anymore and starts
+	// the next relink
+	void begin_frame(uint64_t frameNumber);
+
+	const GraphicsPipelineStats& stats() const { return _stats; }
+
+private:
+	enum LibraryPart {
+		VertexInput,
+		PreRasterization,
+		FragmentShader,
+		FragmentOutput,
+		LibraryPartCount,
+	};
+
+	using DescMap = std::unordered_map<GraphicsPipelineDesc, VkPipeline, GraphicsPipelineDescHash>;
+
+	VkPipeline library(LibraryPart part, const GraphicsPipelineDesc& desc);
+	std::array<VkPipeline, LibraryPartCount> libraries(const GraphicsPipelineDesc& desc);
+
+	VkDevice _device{VK_NULL_HANDLE};
+	bool _pipelineLibrary{false};
+	uint32_t _framesInFlight{0};
+
+	// keyed by the desc with the fields other parts depend on cleared
+	DescMap _libraries[LibraryPartCount];
+	DescMap _pipelines;
+
+	std::deque<GraphicsPipelineDesc> _unoptimized;
+	GraphicsPipelineDesc _optimizingDesc;
+	std::future<VkPipeline> _optimizing;
+	// replaced pipelines and the frame they were replaced in
+	std::deque<std::pair<VkPipeline, uint64_t>> _retired;
+
+	GraphicsPipelineStats _stats;
+};
+
 namespace vkutil {
 
 bool load_shader_module(const char* filePath, VkDevice device, VkShaderModule* outShaderModule);
+bool load_shader_module(std::span<const uint32_t> code, VkDevice device, VkShaderModule* outShaderModule);
+
+// generated by CMake into embedded_shaders.cpp
+std::span<const EmbeddedShader> embedded_shaders();
+
+inline uint32_t group_count(uint32_t invocations, uint32_t groupSize) { return (invocations + groupSize - 1) / groupSize; }
+
+// Nanoseconds from `begin` to `end`, timestamps of a queue family with
+// `validBits` significant bits. The bits above are undefined, and masking the
+// difference also covers a counter that wrapped in between.
+inline double timestamp_nanoseconds(uint64_t begin, uint64_t end, uint32_t validBits, float period)
+{
+    uint64_t mask = validBits >= 64 ? ~uint64_t(0) : (uint64_t(1) << validBits) - 1;
+    return double((end - begin) & mask) * period;
+}
+
+VkPipeline create_compute_pipeline(VkDevice device, VkPipelineLayout layout, VkShaderModule module,
+    WorkgroupSize workgroup, std::span<const uint32_t> parameters = {}, VkPipelineCache cache = VK_NULL_HANDLE);
+
+// builds one variant per candidate that fits the device limits, the first
+// surviving candidate is selected
+ComputeKernel build_compute_kernel(VkDevice device, const VkPhysicalDeviceLimits& limits, std::string name,
+    VkPipelineLayout layout, VkShaderModule module, std::span<const WorkgroupSize> candidates,
+    std::span<const uint32_t> parameters = {});
+
+};
+
+// Name keyed cache of shader modules. Names are the SPIR-V file names without
+// extension, e.g. "gradient_cs". Modules are created on first use from the
+// embedded SPIR-V; if an override directory is set, <dir>/<name>.spv is tried
+// first so shaders can be iterated on without relinking.
+class ShaderRegistry {
+public:
+	void init(VkDevice device, const char* overrideDirectory = nullptr);
+	void cleanup();
+
+	VkShaderModule get(std::string_view name);
 
+private:
+	VkDevice _device{VK_NULL_HANDLE};
+	std::string _overrideDirectory;
+	std::unordered_map<std::string, VkShaderModule> _modules;
 };
 
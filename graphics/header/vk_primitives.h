@@ -0,0 +1,101 @@
+#pragma once
+
+#include <vk_pipelines.h>
+#include <vk_transient.h>
+
+class VulkanEngine;
+
+// Data parallel building blocks over uint32 storage buffers: exclusive scan,
+// sum reduction, stream compaction and radix sort. Everything is recorded
+// into the caller's command buffer; inputs must be visible to compute reads
+// and results are ready for compute reads and indirect commands afterwards.
+//
+// The scan is a single pass decoupled look-back scan. Devices without
+// forward progress between workgroups (CPU implementations like lavapipe),
+// or GPSIM_PRIMITIVES_FALLBACK=1, get the three pass reduce-then-scan.
+//
+// Temporary storage is owned here and shared by all calls, so recordings
+// must not overlap on the GPU. reserve() the largest element count at init;
+// recording more than the reserved count aborts. alias_scratch() moves the
+// radix sort and compaction scratch into transient memory.
+class GpuPrimitives {
+public:
+	// must match GROUP_SIZE and ITEMS in shaders/primitives.glsl
+	static constexpr uint32_t groupSize = 256;
+	static constexpr uint32_t partitionSize = groupSize * 4;
+	static constexpr uint32_t radixBits = 4;
+
+	void init(VulkanEngine* engine);
+	void cleanup();
+
+	// grows the temporary storage to `count` elements
+	void reserve(uint32_t count);
+	// Declares the radix sort and compaction scratch as transients of passes
+	// firstPass to lastPass, before they are built. Sorts and compactions may
+	// then only be recorded in those passes or outside of frames. Growing
+	// with reserve() afterwards moves the scratch back into its own buffers.
+	void alias_scratch(TransientAllocator& transients, uint32_t firstPass, uint32_t lastPass);
+	uint32_t max_elements() const;
+	bool uses_lookback() const { return _lookback; }
+
+	// output[i] = input[0] + ... + input[i - 1], output may be input
+	void exclusive_scan(VkCommandBuffer cmd, const AllocatedBuffer& input, const AllocatedBuffer& output,
+		uint32_t count);
+	// result[0] = sum of input, result needs TRANSFER_DST usage
+	void reduce(VkCommandBuffer cmd, const AllocatedBuffer& input, const AllocatedBuffer& result, uint32_t count);
+	// copies the elements flagged 1 to the front of output, in order, and
+	// their number to outCount[0] (TRANSFER_DST usage). Flags must be 0 or 1,
+	// they are summed into the output slots.
+	void compact(VkCommandBuffer cmd, const AllocatedBuffer& input, const AllocatedBuffer& flags,
+		const AllocatedBuffer& output, const AllocatedBuffer& outCount, uint32_t count);
+	// stable sort of the keys by their low `keyBits` bits, values follow their
+	// keys. Digit passes are rounded up to an even number so the result ends
+	// up back in the given buffers.
+	void radix_sort(VkCommandBuffer cmd, const AllocatedBuffer& keys, const AllocatedBuffer& values, uint32_t count,
+		uint32_t keyBits = 32);
+
+private:
+	// must match the push constants in shaders/primitives.glsl
+	struct PushConstants {
+		VkDeviceAddress src;
+		VkDeviceAddress dst;
+		VkDeviceAddress srcValues;
+		VkDeviceAddress dstValues;
+		VkDeviceAddress scratch;
+		VkDeviceAddress result;
+		uint32_t count;
+		uint32_t partitions;
+		uint32_t pass;
+		uint32_t shift;
+	};
+
+	void scan(VkCommandBuffer cmd, VkDeviceAddress src, VkDeviceAddress dst, uint32_t count);
+	void dispatch(VkCommandBuffer cmd, const ComputeKernel& kernel, const PushConstants& push, uint32_t groups);
+	void check_capacity(uint32_t count) const;
+	std::array<AllocatedBuffer*, 4> radix_scratch() { return {&_histogram, &_digitOffsets, &_keysTemp, &_valuesTemp}; }
+	void acquire_scratch(VkCommandBuffer cmd) const;
+
+	VulkanEngine* _engine{nullptr};
+	bool _lookback{true};
+	uint32_t _capacity{0};
+
+	// look-back state, or the partition totals of the fallback scan
+	AllocatedBuffer _scanState{};
+	// per digit and partition counts of a radix pass, and their scan
+	AllocatedBuffer _histogram{};
+	AllocatedBuffer _digitOffsets{};
+	// ping-pong targets of the radix sort, scanned flags of the compaction
+	AllocatedBuffer _keysTemp{};
+	AllocatedBuffer _valuesTemp{};
+	// set while the four above are transients
+	TransientAllocator* _transients{nullptr};
+	std::array<TransientAllocator::Handle, 4> _scratchHandles{};
+
+	VkPipelineLayout _layout{VK_NULL_HANDLE};
+	ComputeKernel _scanLookbackKernel;
+	ComputeKernel _scanBlocksKernel;
+	ComputeKernel _reduceKernel;
+	ComputeKernel _compactKernel;
+	ComputeKernel _histogramKernel;
+	ComputeKernel _radixScatterKernel;
+};
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <vk_types.h>
+
+#include <deque>
+#include <future>
+#include <span>
+
+class VulkanEngine;
+
+struct ReadbackStats {
+	uint64_t completed{0};
+	uint64_t rejected{0};       // requests refused because the ring was full
+	VkDeviceSize bytesInFlight{0};
+	uint32_t requestsInFlight{0};
+};
+
+// Copies GPU buffers back to the host without stalling a frame. Requests
+// made during a frame are recorded together at its end, into a ring carved
+// out of one persistently mapped, host cached buffer, and complete once the
+// frame's fence was waited on, FRAME_OVERLAP frames later. Results arrive
+// through a callback run from begin_frame() or through a future.
+//
+// When consumers ask for more than the ring holds, or more requests than
+// maxRequests are in flight, new requests are refused rather than waited
+// for, so the frame loop stays pipelined. Callers see that from read()'s
+// return value and should sample less often, pressure() tells how close
+// the ring is to that.
+class ReadbackRing {
+public:
+	using Callback = std::function<void(std::span<const uint8_t> data)>;
+
+	// in flight requests at most, regardless of their size
+	uint32_t maxRequests{1024};
+
+	void init(VulkanEngine* engine, VkDeviceSize capacity);
+	void cleanup();
+
+	// Copies `size` bytes of `source` from `offset` once the frame's commands
+	// ran. `done` gets the data, which is only valid during the call. Call
+	// after GpuMemory::defragment_step, buffers do not move after that.
+	// False when refused, `done` is never called then.
+	bool read(const AllocatedBuffer& source, VkDeviceSize offset, VkDeviceSize size, Callback&& done);
+	// same, with the data copied into a future. Refused requests return a
+	// future without shared state, check valid().
+	std::future<std::vector<uint8_t>> read(const AllocatedBuffer& source, VkDeviceSize offset, VkDeviceSize size);
+
+	// once per frame after its fence was waited on, runs the callbacks of
+	// the requests that completed
+	void begin_frame(uint64_t frameNumber);
+	// once per frame at the end of its command buffer, records the copies of
+	// the requests made since the last call
+	void record(VkCommandBuffer cmd, uint64_t frameNumber);
+
+	// fraction of the ring in use
+	float pressure() const { return float(_head - _tail) / float(_capacity); }
+	const ReadbackStats& stats() const { return _stats; }
+
+private:
+	struct Request {
+		VkBuffer source;
+		VkDeviceSize sourceOffset;
+		VkDeviceSize size;
+		VkDeviceSize ringOffset;
+		uint64_t end;    // ring head after this request, the tail once it retired
+		uint64_t frame;  // recorded in
+		Callback done;
+	};
+
+	VulkanEngine* _engine{nullptr};
+	AllocatedBuffer _ring{};
+	VkDeviceSize _capacity{0};
+	bool _coherent{false};
+
+	// monotonic byte counters, positions are taken modulo the capacity
+	uint64_t _head{0};
+	uint64_t _tail{0};
+
+	std::deque<Request> _unrecorded;
+	std::deque<Request> _inFlight;
+	ReadbackStats _stats;
+};
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <vk_pipelines.h>
+
+class VulkanEngine;
+
+// Final pass of a frame as one compute dispatch: samples the HDR draw image,
+// tonemaps, scales to the swapchain size, dithers and stores straight into
+// the swapchain image. Replaces the layout changes and blit of
+// vkutil::copy_image_to_image, which need the draw image in TRANSFER_SRC and
+// the swapchain image in TRANSFER_DST first.
+//
+// Needs swapchain images with storage usage, which not every surface format
+// has. enabled() is false then and the engine keeps blitting.
+class SwapchainResolve {
+public:
+	float exposure{1.f};
+	bool dither{true};
+
+	void init(VulkanEngine* engine);
+	void cleanup();
+	bool enabled() const { return _enabled; }
+
+	// the draw image must be in GENERAL, the swapchain image is left in
+	// PRESENT_SRC. The acquire semaphore has to be waited on at the compute
+	// stage.
+	void draw(VkCommandBuffer cmd, uint32_t swapchainIndex, uint32_t frameNumber);
+
+private:
+	struct PushConstants {
+		glm::vec2 invSize;
+		uint32_t width;
+		uint32_t height;
+		float exposure;
+		uint32_t frame;
+		uint32_t dither;
+		uint32_t encodeSrgb;
+	};
+
+	VulkanEngine* _engine{nullptr};
+	bool _enabled{false};
+
+	VkSampler _sampler{VK_NULL_HANDLE};
+	VkDescriptorSetLayout _setLayout{VK_NULL_HANDLE};
+	std::vector<VkDescriptorSet> _sets;  // per swapchain image
+	VkPipelineLayout _layout{VK_NULL_HANDLE};
+	ComputeKernel _kernel;
+};
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <vk_grid.h>
+#include <vk_particles.h>
+
+struct SphSettings {
+	// interaction radius, also the grid's cell size
+	float smoothingRadius{0.1f};
+	float particleMass{0.065f};
+	float restDensity{1000.f};
+	// pressure per unit of density above the rest density
+	float stiffness{3.f};
+	float viscosity{0.2f};
+};
+
+// Smoothed particle hydrodynamics on top of the particle system, as an
+// example client of NeighborGrid. After every substep the grid is rebuilt
+// over the freshly written set, densities and pressures are summed over the
+// neighbors, and pressure and viscosity accelerations are added to the
+// velocities that the next substep integrates.
+class SphSolver {
+public:
+	void init(VulkanEngine* engine, ParticleSystem* particles, const SphSettings& settings);
+	void cleanup();
+
+	void step(VkCommandBuffer cmd, float dt);
+
+	const NeighborGrid& grid() const { return _grid; }
+
+private:
+	struct PushConstants {
+		VkDeviceAddress grid;
+		VkDeviceAddress velocities;
+		VkDeviceAddress fluid;
+		float cellSize;
+		uint32_t tableSize;
+		float mass;
+		float restDensity;
+		float stiffness;
+		float viscosity;
+		float poly6;
+		float spikyGradient;
+		float viscosityLaplacian;
+		float dt;
+	};
+
+	VulkanEngine* _engine{nullptr};
+	ParticleSystem* _particles{nullptr};
+	SphSettings _settings;
+
+	NeighborGrid _grid;
+	AllocatedBuffer _fluid{};   // density and pressure per sorted particle
+
+	VkPipelineLayout _layout;
+	ComputeKernel _densityKernel;
+	ComputeKernel _forceKernel;
+};
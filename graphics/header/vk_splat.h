@@ -0,0 +1,94 @@
+#pragma once
+
+#include <vk_particles.h>
+#include <vk_transient.h>
+
+enum class SplatMode {
+	// one global atomic per splat, best when splats spread over the screen
+	Direct,
+	// splats are binned into screen tiles first and every tile is resolved in
+	// shared memory, best for dense clusters
+	Tiled,
+};
+
+// CPU mirror of SplatBins in shaders/splat.glsl
+struct GPUSplatBins {
+	VkDeviceAddress tileCount;
+	VkDeviceAddress tileStart;
+	VkDeviceAddress particleTile;
+	VkDeviceAddress particleRank;
+	VkDeviceAddress binnedValue;
+	VkDeviceAddress binnedPixel;
+};
+
+// Draws every alive particle as a one pixel splat from compute instead of
+// through the raster pipeline. Splats are packed into 64-bit depth and color
+// values and resolved per pixel with atomic max, then the nearest splat of
+// every pixel not hidden by the scene depth is written into the draw image.
+class PointSplatter {
+public:
+	// must match TILE_SIZE in shaders/splat.glsl
+	static constexpr uint32_t tileSize = 16;
+
+	// has to run before the engine builds its transients
+	void init(VulkanEngine* engine, const ParticleSystem* particles, SplatMode mode);
+	void cleanup();
+
+	// splats the particle set written last. The draw image must be in GENERAL
+	// and the depth image in DEPTH_READ_ONLY_OPTIMAL, with the simulation and
+	// the scene rendering made visible to compute by those transitions.
+	void draw(VkCommandBuffer cmd, VkDeviceAddress sceneData);
+
+	SplatMode mode() const { return _mode; }
+	void set_mode(SplatMode mode) { _mode = mode; }
+
+private:
+	struct PushConstants {
+		VkDeviceAddress scene;
+		VkDeviceAddress positions;
+		VkDeviceAddress attributes;
+		VkDeviceAddress counts;
+		VkDeviceAddress framebuffer;
+		VkDeviceAddress bins;
+		uint32_t set;
+		uint32_t width;
+		uint32_t height;
+		uint32_t tilesX;
+		uint32_t storage;
+		uint32_t capacity;
+	};
+
+	void splat_direct(VkCommandBuffer cmd, const PushConstants& push);
+	void splat_tiled(VkCommandBuffer cmd, const PushConstants& push);
+	uint32_t particle_groups(const ComputeKernel& kernel) const;
+
+	VulkanEngine* _engine{nullptr};
+	const ParticleSystem* _particles{nullptr};
+	SplatMode _mode{SplatMode::Direct};
+	VkExtent2D _extent{};
+	uint32_t _tilesX{0};
+	uint32_t _tilesY{0};
+
+	AllocatedBuffer _framebuffer{};  // uint64 per pixel
+	AllocatedBuffer _tileCount{};
+	AllocatedBuffer _tileStart{};
+	AllocatedBuffer _particleTile{};
+	AllocatedBuffer _particleRank{};
+	AllocatedBuffer _binnedValue{};
+	AllocatedBuffer _binnedPixel{};
+	AllocatedBuffer _binsTable{};
+	// of the buffers above, except the table
+	std::array<TransientAllocator::Handle, 7> _scratchHandles{};
+
+	VkDescriptorSetLayout _resolveSetLayout{VK_NULL_HANDLE};
+	VkDescriptorSet _resolveSet{VK_NULL_HANDLE};
+	VkSampler _depthSampler{VK_NULL_HANDLE};
+
+	VkPipelineLayout _layout{VK_NULL_HANDLE};
+	VkPipelineLayout _resolveLayout{VK_NULL_HANDLE};
+	ComputeKernel _directKernel;
+	ComputeKernel _binKernel;
+	ComputeKernel _binScatterKernel;
+	ComputeKernel _tilesKernel;
+	ComputeKernel _resolveKernel;
+};
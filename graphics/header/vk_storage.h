@@ -0,0 +1,47 @@
+#pragma once
+
+#include <vk_types.h>
+
+#include <cmath>
+
+// How a vec4 field is stored, decoded and encoded by the kernels through
+// shaders/storage.glsl. Simulation passes are bandwidth bound, so fields that
+// do not need 32 bits per component can be stored smaller.
+enum class StorageFormat : uint8_t {
+	Float32,  // vec4, 16 bytes
+	Float16,  // four halves, 8 bytes
+	// xyz as cell coordinates of 10 bits plus 16 bit fractions of the cell,
+	// w as a half, 12 bytes. Meant for positions: the precision is the same
+	// everywhere inside [-512, 512) cells around the origin.
+	Fixed,
+};
+
+const char* to_string(StorageFormat format);
+size_t storage_stride(StorageFormat format);
+
+// Formats of the fields of a particle set, shared by every pass that reads or
+// writes the set
+struct StorageLayout {
+	StorageFormat position{StorageFormat::Float32};
+	StorageFormat velocity{StorageFormat::Float32};
+	// Fixed cells are 2^cellExponent wide
+	int8_t cellExponent{0};
+
+	float cell_size() const { return std::ldexp(1.f, cellExponent); }
+	size_t position_stride() const { return storage_stride(position); }
+	size_t velocity_stride() const { return storage_stride(velocity); }
+	// the `storage` word of the push constants, 0 for all Float32
+	uint32_t packed() const
+	{
+		return uint32_t(position) | uint32_t(velocity) << 4 | uint32_t(uint8_t(cellExponent)) << 8;
+	}
+};
+
+namespace vkutil {
+// the smallest cell exponent whose Fixed range covers [-extent, extent]
+int8_t fixed_cell_exponent(float extent);
+
+// host side of storage_load and storage_store in shaders/storage.glsl
+void encode_storage(StorageFormat format, float cellSize, const glm::vec4* values, size_t count, void* out);
+void decode_storage(StorageFormat format, float cellSize, const void* data, size_t count, glm::vec4* out);
+};
@@ -0,0 +1,164 @@
+#pragma once
+
+#include <cluster_pages.h>
+#include <vk_pipelines.h>
+
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <mutex>
+#include <thread>
+
+class VulkanEngine;
+
+struct StreamingOptions {
+	// GPU pool for fine pages, further capped to half of the free device budget
+	VkDeviceSize poolBytes{VkDeviceSize(256) << 20};
+	// pages copied into the pool per frame, bounds the upload cost of a frame
+	uint32_t maxUploadsPerFrame{32};
+	// loads waiting for or done by the I/O thread but not uploaded yet
+	uint32_t maxPendingLoads{256};
+	// page ids the cull pass reports per frame
+	uint32_t maxFeedback{16384};
+	// cluster draws per frame
+	uint32_t maxDraws{1u << 20};
+};
+
+struct StreamingStats {
+	uint32_t pageCount{0};
+	uint32_t poolPages{0};     // fine pages that fit on the GPU at once
+	uint32_t residentPages{0};
+	uint32_t pendingLoads{0};
+	uint32_t requestedLastFrame{0};  // pages the newest feedback reported missing
+	uint64_t loads{0};
+	uint64_t evictions{0};
+	uint64_t uploadedBytes{0};
+	uint64_t feedbackOverflows{0};  // frames that reported more pages than maxFeedback
+	uint64_t deferredUploads{0};    // loads dropped because every slot was in use
+	uint64_t readErrors{0};
+};
+
+// Draws a cluster file (see cluster_pages.h) that may be much larger than
+// device memory, with every cluster group resident or falling back to its
+// coarse clusters.
+//
+// The coarse pages are uploaded once and stay. Fine pages live in fixed
+// size slots of one pool buffer, found through a page table. Each frame a
+// compute pass culls the groups of every instance, draws a group fine when
+// its coarse error would show and its page is resident, coarse otherwise,
+// and reports every page it wanted fine. That feedback comes back through
+// the engine's ReadbackRing: resident pages move to the front of the LRU
+// list, missing ones are queued for a background thread that reads them
+// from disk. Finished loads replace the least recently used slots, at most
+// maxUploadsPerFrame per frame, before the cull pass of the next frame.
+class GeometryStreamer {
+public:
+	bool init(VulkanEngine* engine, const std::filesystem::path& clusterFile, const StreamingOptions& options = {});
+	void cleanup();
+	bool enabled() const { return _engine != nullptr; }
+
+	// every instance draws all groups of the file
+	void set_instances(std::span<const glm::mat4> transforms);
+	glm::vec4 bounds() const { return _file.header().sphere; }
+
+	// Outside rendering: uploads finished loads, updates the page table,
+	// culls and asks for this frame's feedback. Call after
+	// GpuMemory::defragment_step.
+	void update(VkCommandBuffer cmd, VkDeviceAddress sceneData, uint64_t frameNumber);
+	// inside a rendering pass on the draw and depth image
+	void draw(VkCommandBuffer cmd, VkDeviceAddress sceneData);
+
+	const StreamingStats& stats() const { return _stats; }
+
+private:
+	struct CullPushConstants {
+		VkDeviceAddress scene;
+		VkDeviceAddress instances;
+		VkDeviceAddress groups;
+		VkDeviceAddress clusters;
+		VkDeviceAddress pageTable;
+		VkDeviceAddress pageStamps;
+		VkDeviceAddress feedback;
+		VkDeviceAddress commands;
+		VkDeviceAddress draws;
+		VkDeviceAddress count;
+		uint32_t instanceCount;
+		uint32_t groupCount;
+		uint32_t maxFeedback;
+		uint32_t maxDraws;
+		uint32_t frame;
+		uint32_t pad[3];
+	};
+
+	struct DrawPushConstants {
+		VkDeviceAddress scene;
+		VkDeviceAddress instances;
+		VkDeviceAddress clusters;
+		VkDeviceAddress pageTable;
+		VkDeviceAddress pool;
+		VkDeviceAddress draws;
+	};
+
+	struct Slot {
+		uint32_t page{UINT32_MAX};
+		uint64_t lastUsed{0};  // frame whose feedback last reported the page
+		std::list<uint32_t>::iterator lru;
+	};
+
+	struct Load {
+		uint32_t page;
+		std::vector<uint8_t> data;
+		bool ok;
+	};
+
+	void init_pipelines();
+	void upload_coarse_pages();
+	void handle_feedback(std::span<const uint8_t> data, uint64_t frameNumber);
+	void upload_loads(VkCommandBuffer cmd, uint64_t frameNumber);
+	void io_loop();
+
+	VulkanEngine* _engine{nullptr};
+	StreamingOptions _options;
+	ClusterFile _file;
+
+	// GPU data
+	AllocatedBuffer _groupBuffer{};
+	AllocatedBuffer _clusterBuffer{};
+	AllocatedBuffer _instanceBuffer{};
+	AllocatedBuffer _pool{};          // coarse pages first, then the fine slots
+	AllocatedBuffer _pageTable{};     // slot per page, UINT32_MAX when missing
+	AllocatedBuffer _pageStamps{};    // frame a page was last reported in
+	AllocatedBuffer _feedback{};      // count, then page ids
+	AllocatedBuffer _commandBuffer{};
+	AllocatedBuffer _drawBuffer{};    // instance and cluster per command
+	AllocatedBuffer _countBuffer{};
+	AllocatedBuffer _staging{};       // per frame in flight: pages, then page table entries
+	VkDeviceSize _stagingFrameBytes{0};
+	uint32_t _instanceCount{0};
+
+	// residency, all on the render thread
+	uint32_t _coarseSlots{0};
+	std::vector<Slot> _slots;
+	std::list<uint32_t> _lru;            // fine slots, most recently used first
+	std::vector<uint32_t> _pageSlot;     // CPU copy of the page table
+	std::vector<uint8_t> _pagePending;   // queued, loading or loaded
+	uint32_t _pending{0};
+	uint64_t _feedbackFrame{0};          // newest frame whose feedback arrived
+
+	// I/O thread
+	std::thread _thread;
+	std::mutex _mutex;
+	std::condition_variable _wake;
+	std::deque<uint32_t> _requests;
+	std::deque<Load> _loaded;
+	std::vector<std::vector<uint8_t>> _spare;  // page buffers to reuse
+	bool _stop{false};
+
+	VkPipelineLayout _cullLayout{VK_NULL_HANDLE};
+	ComputeKernel _cullKernel;
+	VkPipelineLayout _drawLayout{VK_NULL_HANDLE};
+	GraphicsPipelineDesc _drawPipeline;
+	DynamicGraphicsState _drawState;
+
+	StreamingStats _stats;
+};
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <vk_memory.h>
+
+// Images and buffers that only live for part of a frame. Every resource is
+// declared with the first and last pass (any increasing numbering) that
+// touches it; build() then places resources whose pass ranges do not overlap
+// at the same offset of a shared memory block.
+//
+// Because memory is shared, the contents of a transient are undefined at its
+// first use: acquire() it there, which also orders it after the previous
+// owner of the memory (including the previous frame). Work recorded outside
+// of frames acquires the same way and must not overlap any pass range.
+class TransientAllocator {
+public:
+	using Handle = uint32_t;
+
+	Handle declare_image(std::string name, const VkImageCreateInfo& imageInfo, VkImageAspectFlags aspect,
+		uint32_t firstPass, uint32_t lastPass);
+	Handle declare_buffer(std::string name, VkDeviceSize size, VkBufferUsageFlags usage, uint32_t firstPass,
+		uint32_t lastPass);
+	// runs at the end of build(), for the views, descriptors and address
+	// tables that need the created resources
+	void on_build(std::function<void()> callback);
+
+	// images and buffers share blocks, `bufferImageGranularity` keeps them on
+	// separate pages while they are alive at the same time
+	void build(VkDevice device, VmaAllocator allocator, GpuMemory& memory, VkDeviceSize bufferImageGranularity);
+	void destroy();
+	bool built() const { return _built; }
+
+	// image views cover all mip levels
+	const AllocatedImage& image(Handle handle) const { return _resources[handle].image; }
+	const AllocatedBuffer& buffer(Handle handle) const { return _resources[handle].buffer; }
+
+	// barrier for the first use of transients, images go from UNDEFINED to
+	// `newLayout`
+	void acquire(VkCommandBuffer cmd, std::span<const Handle> handles,
+		VkImageLayout newLayout = VK_IMAGE_LAYOUT_GENERAL) const;
+	void acquire(VkCommandBuffer cmd, Handle handle, VkImageLayout newLayout = VK_IMAGE_LAYOUT_GENERAL) const
+	{
+		acquire(cmd, std::span(&handle, 1), newLayout);
+	}
+
+	// memory the resources would need as dedicated allocations, and what they use
+	VkDeviceSize unaliased_bytes() const { return _unaliasedBytes; }
+	VkDeviceSize allocated_bytes() const { return _allocatedBytes; }
+
+private:
+	struct Resource {
+		std::string name;
+		bool isImage;
+		VkImageCreateInfo imageInfo;
+		VkImageAspectFlags aspect;
+		VkBufferCreateInfo bufferInfo;
+		uint32_t firstPass, lastPass;
+
+		VkMemoryRequirements requirements;
+		VkDeviceSize size;  // rounded up to the buffer-image granularity
+		bool lazy;
+		VkDeviceSize offset;
+		uint32_t block;
+
+		AllocatedImage image;
+		AllocatedBuffer buffer;
+	};
+
+	struct Block {
+		bool lazy;
+		uint32_t memoryTypeBits;  // common to everything placed in it
+		VkDeviceSize size;
+		VkDeviceSize alignment;
+		std::vector<uint32_t> members;
+		VmaAllocation allocation;
+	};
+
+	VkDevice _device{VK_NULL_HANDLE};
+	VmaAllocator _allocator{VK_NULL_HANDLE};
+	GpuMemory* _memory{nullptr};
+	bool _built{false};
+
+	std::vector<Resource> _resources;
+	std::vector<Block> _blocks;
+	std::vector<std::function<void()>> _onBuild;
+	VkDeviceSize _unaliasedBytes{0};
+	VkDeviceSize _allocatedBytes{0};
+};
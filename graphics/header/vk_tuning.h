@@ -0,0 +1,43 @@
+#pragma once
+
+#include <vk_pipelines.h>
+
+#include <map>
+
+// Picks the fastest variant of a ComputeKernel by timing all of them with GPU
+// timestamps, and remembers the choice per device so that tuning only has to
+// run the first time the engine starts on a GPU.
+class KernelTuner {
+public:
+	using SubmitFunction = std::function<void(std::function<void(VkCommandBuffer cmd)>&&)>;
+	using RecordFunction = std::function<void(VkCommandBuffer cmd, const ComputeKernel& kernel)>;
+
+	// time the candidates when no cached choice exists for this device
+	bool enabled{true};
+	// dispatches recorded per variant when timing
+	uint32_t iterations{16};
+
+	void init(VkPhysicalDevice gpu, VkDevice device, uint32_t queueFamily, std::string cachePath);
+	void cleanup();
+
+	// Selects the cached variant for this device if there is one. Otherwise,
+	// when enabled, records every variant through `record`, submits it with
+	// `submit`, keeps the fastest and writes it to the cache file.
+	void tune(ComputeKernel& kernel, const SubmitFunction& submit, const RecordFunction& record);
+
+private:
+	void load_cache();
+	void save_cache() const;
+	std::string cache_key(const ComputeKernel& kernel) const;
+
+	VkDevice _device{VK_NULL_HANDLE};
+	VkQueryPool _queryPool{VK_NULL_HANDLE};
+	uint32_t _queryCount{0};
+	float _timestampPeriod{0.f};
+	uint32_t _timestampValidBits{0};
+	bool _timestampsSupported{false};
+
+	std::string _deviceKey;
+	std::string _cachePath;
+	std::map<std::string, WorkgroupSize> _cache;
+};
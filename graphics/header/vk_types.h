@@ -25,3 +25,18 @@
 VkResult vk_check(
         VkResult result,
         std::source_location loc = std::source_location::current());
+
+struct AllocatedImage {
+	VkImage image;
+	VkImageView imageView;
+	VmaAllocation allocation;
+	VkExtent3D imageExtent;
+	VkFormat imageFormat;
+};
+
+struct AllocatedBuffer {
+	VkBuffer buffer;
+	VmaAllocation allocation;
+	VmaAllocationInfo info;
+	VkDeviceAddress address; // 0 unless created with SHADER_DEVICE_ADDRESS usage
+};
@@ -0,0 +1,195 @@
+#pragma once
+
+#include <vk_pipelines.h>
+#include <vk_types.h>
+
+class VulkanEngine;
+
+// must match shaders/volume.glsl
+constexpr uint32_t VOLUME_BLOCK_SIZE = 8;
+constexpr uint32_t VOLUME_BLOCK_VOXELS = VOLUME_BLOCK_SIZE * VOLUME_BLOCK_SIZE * VOLUME_BLOCK_SIZE;
+constexpr uint32_t VOLUME_LIST_GROUP = 64;
+
+struct VolumeSettings {
+	float voxelSize{0.05f};
+	// pool blocks allocated up front, the pool doubles whenever it gets close
+	// to full, up to maxBlocks
+	uint32_t initialBlocks{1024};
+	uint32_t maxBlocks{1u << 16};
+	// blocks are only activated inside the bounds, which are also ray marched
+	glm::vec3 boundsMin{-6.f, -1.f, -6.f};
+	glm::vec3 boundsMax{6.f, 11.f, 6.f};
+	// spherical source of smoke and heat
+	glm::vec3 emitterCenter{0.f, 0.f, 0.f};
+	float emitterRadius{0.4f};
+	glm::vec3 emitterVelocity{0.f, 1.f, 0.f};
+	float emitDensity{4.f};      // per second
+	float emitHeat{6.f};         // per second
+	float buoyancy{1.5f};        // upward acceleration per unit heat
+	float smokeWeight{0.25f};    // downward acceleration per unit density
+	float densityDecay{0.15f};   // per second
+	float heatDecay{0.6f};       // per second
+	float heatDiffusion{0.002f}; // square metres per second
+	// blocks whose density stays below this are released unless a dense
+	// neighbour still needs them
+	float threshold{1e-3f};
+	float extinction{6.f};       // per metre and unit density
+	float emission{0.4f};        // brightness per unit heat
+	uint32_t maxMarchSteps{512};
+};
+
+// CPU mirror of VolumeState in shaders/volume.glsl
+struct GPUVolumeState {
+	VkDispatchIndirectCommand blockDispatch;
+	uint32_t pad0;
+	VkDispatchIndirectCommand newDispatch;
+	uint32_t pad1;
+	VkDispatchIndirectCommand listDispatch;
+	uint32_t pad2;
+	uint32_t activeCount;
+	uint32_t stepActive;
+	uint32_t allocated;
+	uint32_t freeCount;
+	uint32_t highWater;
+	uint32_t capacity;
+	uint32_t overflow;
+	uint32_t survivors;
+	uint32_t step;
+	uint32_t pad3[3];
+};
+
+// CPU mirror of VolumeBuffers in shaders/volume.glsl
+struct GPUVolumeBuffers {
+	VkDeviceAddress state;
+	VkDeviceAddress keys;
+	VkDeviceAddress values;
+	VkDeviceAddress stamps;
+	VkDeviceAddress blockCoord;
+	VkDeviceAddress blockSlot;
+	VkDeviceAddress blockMax;
+	VkDeviceAddress freeStack;
+	VkDeviceAddress active[2];
+	VkDeviceAddress fields[2];
+	VkDeviceAddress heat[2];
+	uint32_t tableMask;
+	uint32_t pad;
+};
+
+struct VolumeStats {
+	uint32_t activeBlocks{0};
+	uint32_t capacity{0};      // pool blocks
+	uint32_t overflow{0};      // activations dropped because the pool was full
+	VkDeviceSize poolBytes{0}; // everything sized by the pool
+	uint32_t growths{0};
+};
+
+// Sparse volume for smoke and heat: only 8^3 blocks near something dense
+// are active. An open addressing hash table on the GPU maps block
+// coordinates to blocks of a pool, which holds velocity and density plus
+// temperature per voxel, twice for ping-ponging. Each step
+//
+//   activate   dense blocks and the emitter activate their neighbours,
+//              taking pool blocks from a free stack
+//   advect     a workgroup per block looks up its 26 neighbours once, then
+//              advects, diffuses and applies buoyancy across block faces
+//   compact    blocks that stayed empty and that no dense neighbour asked
+//              for go back to the free stack
+//   rehash     the table is cleared and rebuilt from the active list, so
+//              released blocks leave no tombstones behind
+//
+// with every pass sized by indirect dispatches written on the GPU. The
+// active count is read back, and when it gets close to the pool size the
+// pool is doubled, so memory follows the active region instead of the domain.
+class SparseVolume {
+public:
+	void init(VulkanEngine* engine, const VolumeSettings& settings);
+	void cleanup();
+	bool enabled() const { return _engine != nullptr; }
+
+	// outside rendering, before draw in the same frame
+	void step(VkCommandBuffer cmd, float dt);
+	// Ray marches into the draw image, which must be in GENERAL with the depth
+	// image in DEPTH_READ_ONLY_OPTIMAL.
+	void draw(VkCommandBuffer cmd, const glm::mat4& viewProjection);
+
+	const VolumeSettings& settings() const { return _settings; }
+	const VolumeStats& stats() const { return _stats; }
+
+private:
+	struct PushConstants {
+		VkDeviceAddress volume;
+		uint32_t parity;
+		uint32_t mode;
+		float dt;
+		float voxelSize;
+		float threshold;
+		uint32_t pad;
+		glm::vec4 emitter;
+		glm::vec4 emitVelocity;
+		glm::vec4 forces;
+		glm::vec4 boundsMin;
+		glm::vec4 boundsMax;
+	};
+
+	struct RenderPushConstants {
+		VkDeviceAddress volume;
+		uint32_t width;
+		uint32_t height;
+		glm::mat4 invViewProj;
+		glm::vec4 boundsMin;
+		glm::vec4 boundsMax;
+		uint32_t parity;
+		uint32_t maxSteps;
+		float extinction;
+		uint32_t pad;
+	};
+
+	// everything sized by the pool capacity
+	struct Pool {
+		uint32_t capacity{0};
+		uint32_t tableSize{0};
+		AllocatedBuffer keys{};
+		AllocatedBuffer values{};
+		AllocatedBuffer stamps{};
+		AllocatedBuffer blockCoord{};
+		AllocatedBuffer blockSlot{};
+		AllocatedBuffer blockMax{};
+		AllocatedBuffer freeStack{};
+		AllocatedBuffer active[2]{};
+		AllocatedBuffer fields[2]{};
+		AllocatedBuffer heat[2]{};
+	};
+
+	Pool create_pool(uint32_t capacity);
+	void destroy_pool(const Pool& pool);
+	VkDeviceSize pool_bytes(const Pool& pool) const;
+	GPUVolumeBuffers buffer_table() const;
+	void grow(VkCommandBuffer cmd, uint32_t capacity);
+	void rehash(VkCommandBuffer cmd, PushConstants& push);
+	void update(VkCommandBuffer cmd, PushConstants& push, uint32_t mode);
+	PushConstants push_constants(float dt) const;
+
+	VulkanEngine* _engine{nullptr};
+	VolumeSettings _settings;
+	Pool _pool;
+	uint32_t _parity{0};
+	uint32_t _growTo{0};  // set from the readback, applied by the next step
+
+	AllocatedBuffer _state{};   // GPUVolumeState
+	AllocatedBuffer _table{};   // GPUVolumeBuffers
+
+	VkDescriptorSetLayout _renderSetLayout{VK_NULL_HANDLE};
+	VkDescriptorSet _renderSet{VK_NULL_HANDLE};
+	VkSampler _depthSampler{VK_NULL_HANDLE};
+
+	VkPipelineLayout _layout{VK_NULL_HANDLE};
+	VkPipelineLayout _renderLayout{VK_NULL_HANDLE};
+	ComputeKernel _updateKernel;
+	ComputeKernel _activateKernel;
+	ComputeKernel _clearKernel;
+	ComputeKernel _advectKernel;
+	ComputeKernel _compactKernel;
+	ComputeKernel _renderKernel;
+
+	VolumeStats _stats;
+};
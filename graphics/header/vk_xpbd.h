@@ -0,0 +1,204 @@
+#pragma once
+
+#include <mesh_bvh.h>
+#include <vk_pipelines.h>
+
+#include <span>
+
+class VulkanEngine;
+
+// must match shaders/xpbd.glsl
+constexpr uint32_t XPBD_MAX_COLORS = 64;
+constexpr uint32_t XPBD_UNCOLORED = 0xffffffffu;
+
+struct XpbdSettings {
+	// every step is split into this many substeps, each predicts, runs the
+	// constraint batches `iterations` times, collides and updates velocities
+	uint32_t substeps{12};
+	uint32_t iterations{1};
+	glm::vec3 gravity{0.f, -9.81f, 0.f};
+	// share of the velocity lost per second
+	float damping{0.1f};
+	// distance particles keep from the collider
+	float thickness{0.01f};
+	// share of the tangential motion removed while in contact
+	float friction{0.3f};
+};
+
+// Distance constraint between two particles, on the CPU and the GPU
+struct XpbdConstraint {
+	uint32_t a;
+	uint32_t b;
+	float restLength;
+	float compliance;  // inverse stiffness, 0 is rigid
+};
+
+// Particles and distance constraints of the simulated objects. The
+// triangles and uvs are only used for drawing.
+struct XpbdModel {
+	std::vector<glm::vec4> positions;  // w = inverse mass, 0 pins the particle
+	std::vector<XpbdConstraint> constraints;
+	std::vector<uint32_t> triangles;
+	std::vector<glm::vec2> uvs;
+	// constraints [batchStart[c], batchStart[c + 1]) have color c and share
+	// no particle, filled by vkutil::batch_constraints
+	std::vector<uint32_t> batchStart;
+
+	uint32_t color_count() const { return batchStart.empty() ? 0 : uint32_t(batchStart.size() - 1); }
+};
+
+struct ClothSettings {
+	uint32_t resolution{96};  // particles per side
+	float size{1.f};          // edge length
+	float mass{0.5f};         // of the whole cloth
+	float stretchCompliance{0.f};
+	float shearCompliance{1e-6f};
+	float bendCompliance{1e-3f};
+};
+
+// constraints touching every particle
+struct XpbdAdjacency {
+	std::vector<uint32_t> start;  // per particle, plus the total at the end
+	std::vector<uint32_t> constraints;
+};
+
+// CPU mirror of XpbdBuffers in shaders/xpbd.glsl
+struct GPUXpbdBuffers {
+	VkDeviceAddress positions;
+	VkDeviceAddress previous;
+	VkDeviceAddress velocities;
+	VkDeviceAddress constraints;
+	VkDeviceAddress lambdas;
+	VkDeviceAddress colors;
+	VkDeviceAddress tentative;
+	VkDeviceAddress adjacencyStart;
+	VkDeviceAddress adjacency;
+	VkDeviceAddress state;
+	VkDeviceAddress vertexTriangleStart;
+	VkDeviceAddress vertexTriangles;
+	VkDeviceAddress indices;
+	VkDeviceAddress renderPositions;
+	VkDeviceAddress attributes;
+	VkDeviceAddress bvhNodes;
+	VkDeviceAddress bvhTriangles;
+};
+
+struct XpbdStats {
+	uint32_t colors{0};
+	uint32_t coloringRounds{0};
+	double coloringMilliseconds{0.0};
+};
+
+// Extended position based dynamics (Macklin et al. 2016) with small steps
+// (Macklin et al. 2019): one iteration over the constraints per substep.
+//
+// Gauss-Seidel over the constraints is serial by nature. Here the
+// constraint graph, where constraints sharing a particle are neighbours, is
+// colored greedily in parallel on the GPU, and the constraints of a color
+// are solved by one dispatch without atomics since none of them share a
+// particle. Particles are renumbered in the order the batches reach them, so
+// a batch reads them almost sequentially.
+//
+// An optional MeshBvh keeps the particles outside of a static mesh, and the
+// triangles of the model are drawn with the scene's mesh shaders.
+class XpbdSolver {
+public:
+	void init(VulkanEngine* engine, XpbdModel model, const XpbdSettings& settings, const MeshBvh* collider = nullptr);
+	void cleanup();
+	bool enabled() const { return _engine != nullptr; }
+
+	// advances by dt in settings().substeps substeps
+	void step(VkCommandBuffer cmd, float dt);
+	// inside a rendering pass on the draw and depth image
+	void draw(VkCommandBuffer cmd, VkDeviceAddress sceneData);
+
+	// the model as batched and uploaded
+	const XpbdModel& model() const { return _model; }
+	const XpbdSettings& settings() const { return _settings; }
+	const XpbdStats& stats() const { return _stats; }
+	const AllocatedBuffer& positions() const { return _positions; }
+
+private:
+	// must match the push constants in shaders/xpbd.glsl
+	struct PushConstants {
+		VkDeviceAddress buffers;
+		uint32_t particleCount;
+		uint32_t constraintCount;
+		uint32_t first;
+		uint32_t count;
+		uint32_t mode;
+		uint32_t collide;
+		float dt;
+		float damping;
+		float thickness;
+		float friction;
+		float gravityX;
+		float gravityY;
+		float gravityZ;
+		uint32_t pad;
+	};
+
+	struct DrawPushConstants {
+		VkDeviceAddress scene;
+		VkDeviceAddress instances;
+		VkDeviceAddress positions;
+		VkDeviceAddress attributes;
+	};
+
+	std::vector<uint32_t> color_constraints(const XpbdAdjacency& adjacency);
+	void upload_model(const MeshBvh* collider);
+	GPUXpbdBuffers buffers_table() const;
+	void init_pipelines();
+	void dispatch(VkCommandBuffer cmd, const ComputeKernel& kernel, PushConstants& push, uint32_t count);
+
+	VulkanEngine* _engine{nullptr};
+	XpbdModel _model;
+	XpbdSettings _settings;
+	XpbdStats _stats;
+	bool _collide{false};
+
+	AllocatedBuffer _positions{};
+	AllocatedBuffer _previous{};
+	AllocatedBuffer _velocities{};
+	AllocatedBuffer _constraints{};
+	AllocatedBuffer _lambdas{};
+	AllocatedBuffer _vertexTriangleStart{};
+	AllocatedBuffer _vertexTriangles{};
+	AllocatedBuffer _indices{};
+	AllocatedBuffer _renderPositions{};  // float x, y, z per particle
+	AllocatedBuffer _attributes{};       // VertexAttributes per particle
+	AllocatedBuffer _bvhNodes{};
+	AllocatedBuffer _bvhTriangles{};
+	AllocatedBuffer _instance{};
+	AllocatedBuffer _buffersTable{};
+	bool _tableStale{false};  // a buffer in the table was moved by defragmentation
+
+	VkPipelineLayout _layout{VK_NULL_HANDLE};
+	ComputeKernel _colorKernel;
+	ComputeKernel _predictKernel;
+	ComputeKernel _solveKernel;
+	ComputeKernel _collideKernel;
+	ComputeKernel _updateKernel;
+	ComputeKernel _surfaceKernel;
+
+	VkPipelineLayout _drawLayout{VK_NULL_HANDLE};
+	GraphicsPipelineDesc _drawPipeline;
+	DynamicGraphicsState _drawState;
+};
+
+namespace vkutil {
+// a square cloth in the xz plane of `transform`, centered on its origin,
+// with stretch, shear and bending constraints between grid neighbours
+XpbdModel make_cloth(const glm::mat4& transform, const ClothSettings& settings);
+XpbdAdjacency constraint_adjacency(const XpbdModel& model);
+// true when no two constraints of a batch share a particle
+bool valid_batches(const XpbdModel& model);
+// Colors the constraints still XPBD_UNCOLORED one after another, each with
+// the lowest color none of its neighbours has, which may be past
+// XPBD_MAX_COLORS. Returns how many there were.
+uint32_t color_leftovers(const XpbdModel& model, const XpbdAdjacency& adjacency, std::span<uint32_t> colors);
+// Sorts the constraints by color into model.batchStart and renumbers the
+// particles in the order the batches first touch them. Returns the new
+// index of every old particle.
+std::vector<uint32_t> batch_constraints(XpbdModel& model, std::span<const uint32_t> colors);
+};
@@ -1,4 +1,11 @@
-[numthreads(16, 16, 1)]
+// workgroup size and kernel parameters are specialization constants,
+// the ids match gradient.comp
+[[vk::constant_id(0)]] const uint WORKGROUP_X = 16;
+[[vk::constant_id(1)]] const uint WORKGROUP_Y = 16;
+[[vk::constant_id(2)]] const uint WORKGROUP_Z = 1;
+[[vk::constant_id(3)]] const bool HIGHLIGHT_WORKGROUPS = true;
+
+[numthreads(WORKGROUP_X, WORKGROUP_Y, WORKGROUP_Z)]
 void main(uint3 DispatchThreadID : SV_DispatchThreadID,
           uint3 GroupThreadID : SV_GroupThreadID)
 {
@@ -12,7 +19,7 @@ void main(uint3 DispatchThreadID : SV_DispatchThreadID,
     {
         float4 color = float4(0.0, 0.0, 0.0, 1.0);
 
-        if (GroupThreadID.x != 0 && GroupThreadID.y != 0)
+        if (!HIGHLIGHT_WORKGROUPS || (GroupThreadID.x != 0 && GroupThreadID.y != 0))
         {
             color.x = float(texelCoord.x) / size.x;
             color.y = float(texelCoord.y) / size.y;
@@ -0,0 +1,122 @@
+// Closest point queries against a MeshBvh, layouts must match mesh_bvh.h
+#extension GL_EXT_buffer_reference : require
+
+#define BVH_STACK 64
+
+struct BvhNode {
+	vec3 bmin;
+	uint first;   // leaves: first triangle, inner nodes: right child
+	vec3 bmax;
+	uint count;   // 0 for inner nodes
+};
+
+struct BvhTriangle {
+	vec4 v0;
+	vec4 v1;
+	vec4 v2;
+};
+
+layout(buffer_reference, std430) readonly buffer BvhNodes { BvhNode nodes[]; };
+layout(buffer_reference, std430) readonly buffer BvhTriangles { BvhTriangle triangles[]; };
+
+float box_distance2(BvhNode node, vec3 p)
+{
+	vec3 d = max(max(node.bmin - p, p - node.bmax), vec3(0.0));
+	return dot(d, d);
+}
+
+// Ericson, Real-Time Collision Detection 5.1.5, as vkutil::closest_on_triangle
+vec3 closest_on_triangle(vec3 p, vec3 a, vec3 b, vec3 c)
+{
+	vec3 ab = b - a;
+	vec3 ac = c - a;
+	vec3 ap = p - a;
+	float d1 = dot(ab, ap);
+	float d2 = dot(ac, ap);
+	if (d1 <= 0.0 && d2 <= 0.0) {
+		return a;
+	}
+
+	vec3 bp = p - b;
+	float d3 = dot(ab, bp);
+	float d4 = dot(ac, bp);
+	if (d3 >= 0.0 && d4 <= d3) {
+		return b;
+	}
+
+	float vc = d1 * d4 - d3 * d2;
+	if (vc <= 0.0 && d1 >= 0.0 && d3 <= 0.0) {
+		return a + ab * (d1 / (d1 - d3));
+	}
+
+	vec3 cp = p - c;
+	float d5 = dot(ab, cp);
+	float d6 = dot(ac, cp);
+	if (d6 >= 0.0 && d5 <= d6) {
+		return c;
+	}
+
+	float vb = d5 * d2 - d1 * d6;
+	if (vb <= 0.0 && d2 >= 0.0 && d6 <= 0.0) {
+		return a + ac * (d2 / (d2 - d6));
+	}
+
+	float va = d3 * d6 - d5 * d4;
+	if (va <= 0.0 && d4 - d3 >= 0.0 && d5 - d6 >= 0.0) {
+		return b + (c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6)));
+	}
+
+	float denom = 1.0 / (va + vb + vc);
+	return a + ab * (vb * denom) + ac * (vc * denom);
+}
+
+// closest point within maxDistance of p and the normal of its triangle, as
+// MeshBvh::closest_point
+bool bvh_closest_point(BvhNodes tree, BvhTriangles triangles, vec3 p, float maxDistance, out vec3 point,
+	out vec3 normal)
+{
+	float best = maxDistance * maxDistance;
+	bool found = false;
+	point = p;
+	normal = vec3(0.0, 1.0, 0.0);
+
+	uint stack[BVH_STACK];
+	uint top = 0;
+	stack[top++] = 0;
+	while (top > 0) {
+		uint index = stack[--top];
+		BvhNode node = tree.nodes[index];
+		if (box_distance2(node, p) > best) {
+			continue;
+		}
+
+		if (node.count > 0) {
+			for (uint i = node.first; i < node.first + node.count; i++) {
+				BvhTriangle t = triangles.triangles[i];
+				vec3 q = closest_on_triangle(p, t.v0.xyz, t.v1.xyz, t.v2.xyz);
+				float d2 = dot(p - q, p - q);
+				if (d2 <= best) {
+					best = d2;
+					point = q;
+					normal = normalize(cross(t.v1.xyz - t.v0.xyz, t.v2.xyz - t.v0.xyz));
+					found = true;
+				}
+			}
+			continue;
+		}
+
+		// nearer child last, so it is popped first
+		uint a = index + 1;
+		uint b = node.first;
+		if (box_distance2(tree.nodes[a], p) < box_distance2(tree.nodes[b], p)) {
+			uint t = a;
+			a = b;
+			b = t;
+		}
+		if (top + 2 <= BVH_STACK) {
+			stack[top++] = a;
+			stack[top++] = b;
+		}
+	}
+	return found;
+}
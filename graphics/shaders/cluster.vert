@@ -0,0 +1,40 @@
+#version 460
+#extension GL_GOOGLE_include_directive : require
+
+#include "scene.glsl"
+#include "clusters.glsl"
+
+layout(location = 0) out vec3 outNormal;
+layout(location = 1) out vec2 outUV;
+
+layout(push_constant) uniform constants {
+	SceneBuffer scene;
+	InstanceBuffer instances;
+	ClusterBuffer clusters;
+	UintBuffer pageTable;
+	UintBuffer pool;          // resident pages, see cluster_pages.h for their contents
+	ClusterDrawBuffer draws;
+} pc;
+
+void main()
+{
+	// the cull pass stores the index of the draw as firstInstance
+	uvec2 draw = pc.draws.draws[gl_InstanceIndex];
+	Instance instance = pc.instances.instances[draw.x];
+	Cluster cluster = pc.clusters.clusters[draw.y];
+
+	// everything in words from the start of the cluster
+	uint base = pc.pageTable.data[cluster.page] * (CLUSTER_PAGE_SIZE / 4) + cluster.offset / 4;
+	uint corner = uint(gl_VertexIndex);
+	uint indices = pc.pool.data[base + cluster.vertexCount * 5 + corner / 4];
+	uint v = (indices >> (8 * (corner % 4))) & 0xff;
+
+	vec3 position = uintBitsToFloat(uvec3(pc.pool.data[base + v * 3], pc.pool.data[base + v * 3 + 1],
+		pc.pool.data[base + v * 3 + 2]));
+	uint attributes = base + cluster.vertexCount * 3 + v * 2;
+	vec3 normal = decode_octahedral(unpackSnorm2x16(pc.pool.data[attributes]));
+
+	gl_Position = pc.scene.scene.viewproj * instance.transform * vec4(position, 1.0);
+	outNormal = normalize(mat3(instance.transform) * normal);
+	outUV = unpackHalf2x16(pc.pool.data[attributes + 1]);
+}
@@ -0,0 +1,42 @@
+// Streamed cluster geometry. Layouts must match cluster_pages.h and
+// vk_streaming.h.
+#extension GL_EXT_buffer_reference : require
+
+#define CLUSTER_PAGE_SIZE 65536
+#define NOT_RESIDENT 0xffffffffu
+
+struct Cluster {
+	vec4 sphere;      // object space bounding sphere
+	uint page;
+	uint offset;      // bytes into the page
+	uint vertexCount;
+	uint triangleCount;
+};
+
+struct ClusterGroup {
+	vec4 sphere;
+	uint page;        // of the fine clusters
+	uint firstCluster;
+	uint clusterCount;
+	uint firstCoarse;
+	uint coarseCount;
+	float error;      // object space error of the coarse clusters
+	uint pad0;
+	uint pad1;
+};
+
+// VkDrawIndirectCommand, firstInstance indexes the ClusterDraw
+struct ClusterDrawCommand {
+	uint vertexCount;
+	uint instanceCount;
+	uint firstVertex;
+	uint firstInstance;
+};
+
+layout(buffer_reference, std430) readonly buffer ClusterBuffer { Cluster clusters[]; };
+layout(buffer_reference, std430) readonly buffer ClusterGroupBuffer { ClusterGroup groups[]; };
+layout(buffer_reference, std430) writeonly buffer ClusterDrawCommandBuffer { ClusterDrawCommand commands[]; };
+// instance and cluster of every command
+layout(buffer_reference, std430) buffer ClusterDrawBuffer { uvec2 draws[]; };
+layout(buffer_reference, std430) buffer PageStampBuffer { uint stamps[]; };
+layout(buffer_reference, std430) buffer FeedbackBuffer { uint count; uint pages[]; };
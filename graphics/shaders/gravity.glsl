@@ -0,0 +1,111 @@
+// Barnes-Hut octree over Morton ordered bodies, layouts must match
+// vk_gravity.h
+#extension GL_EXT_buffer_reference : require
+
+#include "storage.glsl"
+
+#define OCTREE_MAX_DEPTH 10
+#define OCTREE_LEVELS 11
+#define OCTREE_NODE_GROUP 64
+// a traversal pops one cell per level and pushes at most 8
+#define OCTREE_STACK 80
+
+struct OctreeNode {
+	vec4 centerMass;  // center of mass, w = bodies below
+	vec4 quad0;       // xx, xy, xz, yy of the quadrupole about the center of mass
+	vec4 quad1;       // yz, zz, cell edge length, unused
+	uint firstChild;
+	uint childCount;  // 0 for leaves
+	uint firstBody;
+	uint bodyCount;
+};
+
+struct OctreeState {
+	uint count;
+	uint nodeCount;
+	uint overflow;
+	float extent;
+	uvec4 boundsMin;  // order preserving float bits
+	uvec4 boundsMax;
+	uint levelStart[OCTREE_LEVELS + 1];
+	uvec4 levelDispatch[OCTREE_LEVELS];
+};
+
+layout(buffer_reference, std430) buffer OctreeStateBuffer {
+	OctreeState state;
+};
+
+layout(buffer_reference, std430) buffer OctreeNodes {
+	OctreeNode nodes[];
+};
+
+layout(buffer_reference, std430) buffer GravityUints {
+	uint data[];
+};
+
+layout(buffer_reference, std430) buffer GravityVec4s {
+	vec4 data[];
+};
+
+layout(buffer_reference, std430) readonly buffer OctreeBuffers {
+	OctreeStateBuffer state;
+	OctreeNodes nodes;
+	GravityUints keys;             // Morton code per sorted body
+	GravityUints values;           // index of every sorted body
+	GravityVec4s sortedPositions;
+};
+
+layout(push_constant) uniform constants {
+	OctreeBuffers octree;
+	StorageWords positions;        // in the formats of `storage`
+	StorageWords velocities;
+	GravityUints counts;           // body count per particle set
+	GravityVec4s accelerations;    // per body, w = potential
+	GravityUints interactions;     // per sorted body
+	uint set;
+	uint capacity;
+	uint maxNodes;
+	uint leafSize;
+	uint level;
+	uint mode;
+	float strength;                // G times the mass of a body
+	float softening2;
+	float theta;
+	float dt;
+	uint storage;                  // packed StorageLayout of the bodies
+	uint pad;
+} pc;
+
+uint float_to_ordered(float f)
+{
+	uint u = floatBitsToUint(f);
+	return (u & 0x80000000u) != 0u ? ~u : u | 0x80000000u;
+}
+
+float ordered_to_float(uint u)
+{
+	return uintBitsToFloat((u & 0x80000000u) != 0u ? u & 0x7fffffffu : ~u);
+}
+
+// spreads the low 10 bits of v to every third bit
+uint expand_bits(uint v)
+{
+	v &= 0x3ffu;
+	v = (v | (v << 16)) & 0x030000ffu;
+	v = (v | (v << 8)) & 0x0300f00fu;
+	v = (v | (v << 4)) & 0x030c30c3u;
+	v = (v | (v << 2)) & 0x09249249u;
+	return v;
+}
+
+// child of a level `level` cell that holds `key`
+uint octant(uint key, uint level)
+{
+	return (key >> (3u * (OCTREE_MAX_DEPTH - 1u - level))) & 7u;
+}
+
+// grid stride loops over the bodies cover pc.octree.state.count
+uint body_stride()
+{
+	return gl_NumWorkGroups.x * gl_WorkGroupSize.x;
+}
@@ -0,0 +1,50 @@
+// Uniform grid over a hashed cell table, rebuilt with a counting sort: count
+// particles per cell, exclusive scan of the counts, scatter into cell order.
+// Layouts must match vk_grid.h.
+#extension GL_EXT_buffer_reference : require
+
+#include "storage.glsl"
+
+struct GridParams {
+	uint count;       // particles in the grid, clamped to the capacity
+	uint dispatchX;   // indirect dispatch covering `count`
+	uint dispatchY;
+	uint dispatchZ;
+};
+
+layout(buffer_reference, std430) buffer GridParamsBuffer {
+	GridParams params;
+};
+
+layout(buffer_reference, std430) buffer UintBuffer {
+	uint data[];
+};
+
+layout(buffer_reference, std430) buffer Vec4Buffer {
+	vec4 data[];
+};
+
+layout(buffer_reference, std430) readonly buffer GridBuffers {
+	GridParamsBuffer params;
+	UintBuffer cellCount;      // per table entry
+	UintBuffer cellStart;      // per table entry, exclusive scan of cellCount
+	UintBuffer particleCell;   // per particle, table entry it hashed to
+	UintBuffer particleRank;   // per particle, slot inside its cell
+	UintBuffer sortedIndex;    // per sorted slot, index in the unsorted set
+	StorageWords sortedPositions;   // in the formats of `storage`
+	StorageWords sortedVelocities;
+	uint storage;              // packed StorageLayout, the same as the particle set's
+	uint pad;
+};
+
+ivec3 cell_coord(vec3 position, float cellSize)
+{
+	return ivec3(floor(position / cellSize));
+}
+
+// Teschner et al. 2003, the table size is a power of two
+uint cell_hash(ivec3 cell, uint tableSize)
+{
+	uint h = (uint(cell.x) * 73856093u) ^ (uint(cell.y) * 19349663u) ^ (uint(cell.z) * 83492791u);
+	return h & (tableSize - 1u);
+}
@@ -0,0 +1,15 @@
+// Push constants shared by the passes that rebuild the grid
+#include "grid.glsl"
+
+layout(push_constant) uniform constants {
+	GridBuffers grid;
+	StorageWords positions;  // unsorted particle set
+	StorageWords velocities;
+	UintBuffer counts;       // alive count per particle set
+	float cellSize;
+	uint tableSize;
+	uint set;                // which entry of `counts` holds the particle count
+	uint capacity;
+	uint groupSize;
+	uint maxGroups;
+} pc;
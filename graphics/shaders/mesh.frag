@@ -0,0 +1,15 @@
+#version 460
+
+layout(location = 0) in vec3 inNormal;
+layout(location = 1) in vec2 inUV;
+
+layout(location = 0) out vec4 outColor;
+
+void main()
+{
+	vec3 lightDir = normalize(vec3(0.3, 1.0, 0.4));
+	float diffuse = max(dot(normalize(inNormal), lightDir), 0.0);
+	vec3 albedo = vec3(0.8);
+
+	outColor = vec4(albedo * (0.15 + 0.85 * diffuse), 1.0);
+}
@@ -0,0 +1,29 @@
+#version 460
+#extension GL_GOOGLE_include_directive : require
+
+#include "scene.glsl"
+
+layout(location = 0) out vec3 outNormal;
+layout(location = 1) out vec2 outUV;
+
+layout(push_constant) uniform constants {
+	SceneBuffer scene;
+	InstanceBuffer instances;
+	FloatBuffer positions;   // x, y, z per vertex
+	UintBuffer attributes;   // octahedral normal and half uv, two words per vertex
+} pc;
+
+void main()
+{
+	// the indirect commands store the instance index as firstInstance
+	Instance instance = pc.instances.instances[gl_InstanceIndex];
+
+	// gl_VertexIndex already includes the surface's vertex offset
+	uint v = uint(gl_VertexIndex);
+	vec3 position = vec3(pc.positions.data[v * 3], pc.positions.data[v * 3 + 1], pc.positions.data[v * 3 + 2]);
+	vec3 normal = decode_octahedral(unpackSnorm2x16(pc.attributes.data[v * 2]));
+
+	gl_Position = pc.scene.scene.viewproj * instance.transform * vec4(position, 1.0);
+	outNormal = normalize(mat3(instance.transform) * normal);
+	outUV = unpackHalf2x16(pc.attributes.data[v * 2 + 1]);
+}
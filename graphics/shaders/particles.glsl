@@ -0,0 +1,83 @@
+// Particle storage shared by the simulation passes. Every attribute lives in
+// its own buffer (structure of arrays) and there are two sets of them: each
+// substep reads one set and appends the survivors to the other. Positions
+// and velocities (w = lifetime in seconds) are stored in the formats of
+// pc.storage. Ages are kept apart as fp32: accumulated in a half they stop
+// growing once a substep is below half of its precision. Layouts must match
+// vk_particles.h.
+#extension GL_EXT_buffer_reference : require
+#extension GL_KHR_shader_subgroup_ballot : require
+
+#include "storage.glsl"
+
+struct ParticleState {
+	uint count[2];    // alive particles in each set
+	uint dispatchX;   // indirect dispatch over the set being read
+	uint dispatchY;
+	uint dispatchZ;
+	uint integrated;  // particles integrated this frame, for the stats
+	uint pad0;
+	uint pad1;
+};
+
+layout(buffer_reference, std430) buffer AttributeBuffer {
+	uint attributes[];  // packed RGBA8 color
+};
+
+layout(buffer_reference, std430) buffer AgeBuffer {
+	float ages[];  // seconds, set s at [s * capacity]
+};
+
+layout(buffer_reference, std430) buffer StateBuffer {
+	ParticleState state;
+};
+
+layout(push_constant) uniform constants {
+	StorageWords srcPositions;
+	StorageWords srcVelocities;
+	AttributeBuffer srcAttributes;
+	StorageWords dstPositions;
+	StorageWords dstVelocities;
+	AttributeBuffer dstAttributes;
+	StateBuffer state;
+	float dt;
+	uint src;          // index of the set being read, the other one is written
+	vec4 emitter;      // xyz = position, w = radius
+	vec4 motion;       // x = initial speed, y = lifetime, z = gravity, w = drag
+	uint capacity;
+	uint emitCount;
+	uint seed;
+	uint groupSize;
+	uint maxGroups;
+	uint storage;      // packed StorageLayout of both sets
+	AgeBuffer ages;
+} pc;
+
+// Reserves one slot per invocation with `append` set in the destination set
+// using a single atomic per subgroup. Returns the first slot of the subgroup
+// plus the rank of this invocation.
+uint append_slot(bool append)
+{
+	uvec4 ballot = subgroupBallot(append);
+	uint total = subgroupBallotBitCount(ballot);
+	uint rank = subgroupBallotExclusiveBitCount(ballot);
+
+	uint base = 0;
+	if (subgroupElect() && total > 0) {
+		base = atomicAdd(pc.state.state.count[1 - pc.src], total);
+	}
+	return subgroupBroadcastFirst(base) + rank;
+}
+
+uint pcg_hash(uint v)
+{
+	uint state = v * 747796405u + 2891336453u;
+	uint word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+	return (word >> 22u) ^ word;
+}
+
+float random01(inout uint rng)
+{
+	rng = pcg_hash(rng);
+	return float(rng) / 4294967295.0;
+}
@@ -0,0 +1,87 @@
+// Shared by the parallel primitive kernels. Every workgroup works on one
+// partition of PARTITION consecutive elements, ITEMS per invocation.
+// Constants and the push constant layout must match vk_primitives.h.
+#extension GL_EXT_buffer_reference : require
+#extension GL_KHR_shader_subgroup_basic : require
+#extension GL_KHR_shader_subgroup_arithmetic : require
+
+#define GROUP_SIZE 256
+#define ITEMS 4
+#define PARTITION (GROUP_SIZE * ITEMS)
+
+#define RADIX_BITS 4
+#define RADIX_BINS 16
+
+layout(buffer_reference, std430) buffer Uints {
+	uint data[];
+};
+
+// state shared between workgroups of the single pass scan
+layout(buffer_reference, std430) coherent buffer CoherentUints {
+	uint data[];
+};
+
+layout(push_constant) uniform constants {
+	Uints src;
+	Uints dst;
+	Uints srcValues;
+	Uints dstValues;
+	CoherentUints scratch;
+	Uints result;
+	uint count;
+	uint partitions;
+	uint pass;
+	uint shift;
+} pc;
+
+shared uint subgroupTotals[GROUP_SIZE];
+shared uint groupTotal;
+
+// Exclusive prefix sum of `value` across the workgroup, in invocation order.
+// The total is left in groupTotal. Subgroups scan in registers, then the
+// first subgroup scans the per subgroup totals.
+uint workgroup_exclusive_scan(uint value)
+{
+	// a previous call may still be reading the shared totals
+	barrier();
+
+	uint inclusive = subgroupInclusiveAdd(value);
+	if (gl_SubgroupInvocationID == gl_SubgroupSize - 1) {
+		subgroupTotals[gl_SubgroupID] = inclusive;
+	}
+	barrier();
+
+	if (gl_SubgroupID == 0) {
+		uint carry = 0;
+		for (uint base = 0; base < gl_NumSubgroups; base += gl_SubgroupSize) {
+			uint index = base + gl_SubgroupInvocationID;
+			uint total = index < gl_NumSubgroups ? subgroupTotals[index] : 0;
+			uint scanned = subgroupExclusiveAdd(total);
+			if (index < gl_NumSubgroups) {
+				subgroupTotals[index] = carry + scanned;
+			}
+			carry += subgroupAdd(total);
+		}
+		if (gl_SubgroupInvocationID == 0) {
+			groupTotal = carry;
+		}
+	}
+	barrier();
+
+	return subgroupTotals[gl_SubgroupID] + inclusive - value;
+}
+
+uint workgroup_sum(uint value)
+{
+	workgroup_exclusive_scan(value);
+	return groupTotal;
+}
+
+// loads this invocation's ITEMS consecutive elements of the partition, zero past the end
+void load_items(Uints source, uint partition, out uint items[ITEMS])
+{
+	uint first = partition * PARTITION + gl_LocalInvocationID.x * ITEMS;
+	for (uint i = 0; i < ITEMS; i++) {
+		items[i] = first + i < pc.count ? source.data[first + i] : 0;
+	}
+}
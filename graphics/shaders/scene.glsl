@@ -0,0 +1,70 @@
+// Data shared by the GPU driven passes. Layouts must match the GPU* structs
+// in vk_indirect.h.
+#extension GL_EXT_buffer_reference : require
+
+struct SceneData {
+	mat4 view;
+	mat4 proj;
+	mat4 viewproj;
+	mat4 prevView;    // view the depth pyramid was rendered with
+	vec4 frustum[6];  // world space planes, normals point inside
+	float P00;
+	float P11;
+	float znear;
+	uint occlusion;   // 0 until a depth pyramid exists
+	vec2 pyramidSize;
+	uint instanceCount;
+	float lodScale;   // pixels per unit of error at distance 1, 0 for full detail
+};
+
+struct Instance {
+	mat4 transform;
+	uint surface;
+	float scale;      // largest axis scale of transform, for the bounding sphere
+	uint pad0;
+	uint pad1;
+};
+
+#define MAX_MESH_LODS 8
+
+struct MeshLod {
+	uint firstIndex;
+	uint indexCount;
+	float error;      // object space, 0 for the full surface
+	uint pad;
+};
+
+struct Surface {
+	int vertexOffset;
+	uint lodCount;
+	uint pad0;
+	uint pad1;
+	vec4 sphere;      // object space bounding sphere
+	MeshLod lods[MAX_MESH_LODS];  // finest first
+};
+
+struct DrawCommand {
+	uint indexCount;
+	uint instanceCount;
+	uint firstIndex;
+	int vertexOffset;
+	uint firstInstance;
+};
+
+layout(buffer_reference, std430) readonly buffer SceneBuffer { SceneData scene; };
+layout(buffer_reference, std430) readonly buffer InstanceBuffer { Instance instances[]; };
+layout(buffer_reference, std430) readonly buffer SurfaceBuffer { Surface surfaces[]; };
+layout(buffer_reference, std430) writeonly buffer DrawCommandBuffer { DrawCommand commands[]; };
+layout(buffer_reference, std430) buffer CountBuffer { uint count; };
+layout(buffer_reference, std430) readonly buffer FloatBuffer { float data[]; };
+layout(buffer_reference, std430) readonly buffer UintBuffer { uint data[]; };
+
+// inverse of vkutil::encode_octahedral
+vec3 decode_octahedral(vec2 e)
+{
+	vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+	float t = max(-n.z, 0.0);
+	n.x += n.x >= 0.0 ? -t : t;
+	n.y += n.y >= 0.0 ? -t : t;
+	return normalize(n);
+}
@@ -0,0 +1,19 @@
+// Push constants of the SPH example passes, which iterate over the neighbors
+// found through the grid. Everything is indexed in sorted order.
+#include "grid.glsl"
+
+layout(push_constant) uniform constants {
+	GridBuffers grid;
+	StorageWords velocities; // unsorted particle set, forces are applied here
+	Vec4Buffer fluid;        // per sorted slot: x = density, y = pressure
+	float cellSize;          // equal to the smoothing radius
+	uint tableSize;
+	float mass;
+	float restDensity;
+	float stiffness;
+	float viscosity;
+	float poly6;             // 315 / (64 pi h^9)
+	float spikyGradient;     // -45 / (pi h^6)
+	float viscosityLaplacian; // 45 / (pi h^6)
+	float dt;
+} pc;
@@ -0,0 +1,65 @@
+// Compute point splatting. Every visible particle becomes one 64-bit value:
+// reverse-Z depth in the high half, so the nearest splat of a pixel is the
+// largest, and RGBA8 color in the low half. Layouts must match vk_splat.h.
+#extension GL_EXT_buffer_reference : require
+#extension GL_EXT_shader_explicit_arithmetic_types_int64 : require
+#extension GL_EXT_shader_atomic_int64 : require
+
+#include "scene.glsl"
+#include "storage.glsl"
+
+#define TILE_SIZE 16
+#define NO_TILE 0xffffffffu
+
+layout(buffer_reference, std430) buffer SplatUints { uint data[]; };
+layout(buffer_reference, std430) buffer SplatValues { uint64_t data[]; };
+
+layout(buffer_reference, std430) readonly buffer SplatBins {
+	SplatUints tileCount;     // per tile
+	SplatUints tileStart;     // per tile, exclusive scan of tileCount
+	SplatUints particleTile;  // per particle, NO_TILE when not visible
+	SplatUints particleRank;  // per particle, slot inside its tile
+	SplatValues binnedValue;  // per binned splat, in tile order
+	SplatUints binnedPixel;   // per binned splat, pixel inside the tile
+};
+
+layout(push_constant) uniform constants {
+	SceneBuffer scene;
+	StorageWords positions;   // in the particle set's storage format
+	SplatUints attributes;    // packed RGBA8 color per particle
+	SplatUints counts;        // alive count per particle set
+	SplatValues framebuffer;  // one value per pixel, 0 is empty
+	SplatBins bins;
+	uint set;                 // which entry of `counts` holds the particle count
+	uint width;
+	uint height;
+	uint tilesX;
+	uint storage;             // packed StorageLayout of the set
+	uint capacity;            // particles per set, bounds the alive count
+} pc;
+
+// particles to splat, emission appends without a bound and only the next
+// prepare clamps the count
+uint alive_count()
+{
+	return min(pc.counts.data[pc.set], pc.capacity);
+}
+
+// projects a particle, false when it misses the screen
+bool project(uint id, out uvec2 pixel, out uint64_t value)
+{
+	vec4 clip = pc.scene.scene.viewproj * vec4(load_position(pc.positions, pc.storage, id).xyz, 1.0);
+	if (clip.w <= 0.0) {
+		return false;
+	}
+
+	vec2 screen = (clip.xy / clip.w * 0.5 + 0.5) * vec2(pc.width, pc.height);
+	if (any(lessThan(screen, vec2(0.0))) || screen.x >= float(pc.width) || screen.y >= float(pc.height)) {
+		return false;
+	}
+
+	pixel = uvec2(screen);
+	float depth = clip.z / clip.w;
+	value = (uint64_t(floatBitsToUint(depth)) << 32) | uint64_t(pc.attributes.data[id]);
+	return true;
+}
@@ -0,0 +1,92 @@
+// Field storage formats, decoded on load and encoded on store so passes only
+// see vec4. Must match vk_storage.h. The format is uniform across a dispatch,
+// so the branches cost nothing next to the memory traffic they save.
+#extension GL_EXT_buffer_reference : require
+
+#define STORAGE_FLOAT32 0
+#define STORAGE_FLOAT16 1
+#define STORAGE_FIXED 2
+
+#define FIXED_CELLS 1024
+#define FIXED_FRACTION 65536.0
+
+layout(buffer_reference, std430) buffer StorageWords { uint data[]; };
+layout(buffer_reference, std430) buffer StorageVec4s { vec4 data[]; };
+layout(buffer_reference, std430) buffer StorageUvec2s { uvec2 data[]; };
+
+// fields of the packed StorageLayout
+uint storage_position(uint storage) { return storage & 0xfu; }
+uint storage_velocity(uint storage) { return (storage >> 4) & 0xfu; }
+float storage_cell_size(uint storage) { return exp2(float(bitfieldExtract(int(storage), 8, 8))); }
+
+vec4 storage_load(StorageWords b, uint format, float cellSize, uint i)
+{
+	if (format == STORAGE_FLOAT16) {
+		uvec2 w = StorageUvec2s(b).data[i];
+		return vec4(unpackHalf2x16(w.x), unpackHalf2x16(w.y));
+	}
+	if (format == STORAGE_FIXED) {
+		uint c = b.data[i * 3];
+		uint xy = b.data[i * 3 + 1];
+		uint zw = b.data[i * 3 + 2];
+		vec3 cell = vec3(ivec3(c & 0x3ffu, (c >> 10) & 0x3ffu, (c >> 20) & 0x3ffu) - FIXED_CELLS / 2);
+		vec3 fraction = vec3(xy & 0xffffu, xy >> 16, zw & 0xffffu) / FIXED_FRACTION;
+		return vec4((cell + fraction) * cellSize, unpackHalf2x16(zw >> 16).x);
+	}
+	return StorageVec4s(b).data[i];
+}
+
+void storage_store(StorageWords b, uint format, float cellSize, uint i, vec4 v)
+{
+	if (format == STORAGE_FLOAT16) {
+		StorageUvec2s(b).data[i] = uvec2(packHalf2x16(v.xy), packHalf2x16(v.zw));
+		return;
+	}
+	if (format == STORAGE_FIXED) {
+		int limit = (FIXED_CELLS / 2) * int(FIXED_FRACTION);
+		vec3 scaled = clamp(round(v.xyz / cellSize * FIXED_FRACTION), -float(limit), float(limit));
+		ivec3 q = clamp(ivec3(scaled), ivec3(-limit), ivec3(limit - 1));
+		uvec3 cell = uvec3((q >> 16) + FIXED_CELLS / 2);
+		uvec3 fraction = uvec3(q & 0xffff);
+		b.data[i * 3] = cell.x | (cell.y << 10) | (cell.z << 20);
+		b.data[i * 3 + 1] = fraction.x | (fraction.y << 16);
+		b.data[i * 3 + 2] = fraction.z | (packHalf2x16(vec2(v.w, 0.0)) << 16);
+		return;
+	}
+	StorageVec4s(b).data[i] = v;
+}
+
+// copies element `from` of src to element `to` of dst without decoding
+void storage_copy(StorageWords src, StorageWords dst, uint format, uint from, uint to)
+{
+	if (format == STORAGE_FLOAT16) {
+		StorageUvec2s(dst).data[to] = StorageUvec2s(src).data[from];
+	} else if (format == STORAGE_FIXED) {
+		dst.data[to * 3] = src.data[from * 3];
+		dst.data[to * 3 + 1] = src.data[from * 3 + 1];
+		dst.data[to * 3 + 2] = src.data[from * 3 + 2];
+	} else {
+		StorageVec4s(dst).data[to] = StorageVec4s(src).data[from];
+	}
+}
+
+// shorthands over a packed StorageLayout
+vec4 load_position(StorageWords b, uint storage, uint i)
+{
+	return storage_load(b, storage_position(storage), storage_cell_size(storage), i);
+}
+
+vec4 load_velocity(StorageWords b, uint storage, uint i)
+{
+	return storage_load(b, storage_velocity(storage), storage_cell_size(storage), i);
+}
+
+void store_position(StorageWords b, uint storage, uint i, vec4 v)
+{
+	storage_store(b, storage_position(storage), storage_cell_size(storage), i, v);
+}
+
+void store_velocity(StorageWords b, uint storage, uint i, vec4 v)
+{
+	storage_store(b, storage_velocity(storage), storage_cell_size(storage), i, v);
+}
@@ -0,0 +1,164 @@
+// Sparse volume of 8^3 voxel blocks. Active blocks are found through an open
+// addressing hash table keyed by their block coordinate and keep their voxels
+// in a pool, so memory follows the active region and not the domain.
+// Layouts must match vk_volume.h.
+#extension GL_EXT_buffer_reference : require
+
+#define VOLUME_BLOCK 8
+#define VOLUME_BLOCK_VOXELS 512
+#define VOLUME_LIST_GROUP 64
+#define VOLUME_EMPTY 0xffffffffu
+#define VOLUME_INVALID 0xffffffffu
+#define VOLUME_MAX_PROBES 64
+// block coordinates are packed into keys with 10 bits per axis
+#define VOLUME_COORD_MIN -512
+#define VOLUME_COORD_MAX 511
+
+struct VolumeState {
+	uvec4 blockDispatch;  // a workgroup per active block
+	uvec4 newDispatch;    // a workgroup per block activated this step
+	uvec4 listDispatch;   // an invocation per active block
+	uint activeCount;
+	uint stepActive;      // active blocks before this step's activation
+	uint allocated;       // blocks taken by this step's activation
+	uint freeCount;       // released blocks on the free stack
+	uint highWater;       // pool blocks handed out at least once
+	uint capacity;
+	uint overflow;        // activations dropped for lack of pool blocks
+	uint survivors;
+	uint step;
+	uint pad0;
+	uint pad1;
+	uint pad2;
+};
+
+layout(buffer_reference, std430) buffer VolumeStateBuffer {
+	VolumeState state;
+};
+
+layout(buffer_reference, std430) buffer VolumeUints {
+	uint data[];
+};
+
+layout(buffer_reference, std430) buffer VolumeFloats {
+	float data[];
+};
+
+layout(buffer_reference, std430) buffer VolumeVec4s {
+	vec4 data[];
+};
+
+layout(buffer_reference, std430) buffer VolumeCoords {
+	ivec4 data[];
+};
+
+layout(buffer_reference, std430) readonly buffer VolumeBuffers {
+	VolumeStateBuffer state;
+	VolumeUints keys;         // per table slot, packed block coordinate or VOLUME_EMPTY
+	VolumeUints values;       // per table slot, pool block or VOLUME_INVALID
+	VolumeUints stamps;       // per table slot, last step a neighbour needed the block
+	VolumeCoords blockCoord;  // per pool block
+	VolumeUints blockSlot;    // per pool block, its table slot
+	VolumeFloats blockMax;    // per pool block, largest density after the last advection
+	VolumeUints freeStack;    // released pool blocks
+	VolumeUints active0;      // active pool blocks, swapped every step
+	VolumeUints active1;
+	VolumeVec4s fields0;      // per voxel velocity and density, swapped every step
+	VolumeVec4s fields1;
+	VolumeFloats heat0;       // per voxel temperature, swapped every step
+	VolumeFloats heat1;
+	uint tableMask;
+};
+
+VolumeUints volume_active(VolumeBuffers v, uint parity)
+{
+	if (parity == 0) {
+		return v.active0;
+	}
+	return v.active1;
+}
+
+VolumeVec4s volume_fields(VolumeBuffers v, uint parity)
+{
+	if (parity == 0) {
+		return v.fields0;
+	}
+	return v.fields1;
+}
+
+VolumeFloats volume_heat(VolumeBuffers v, uint parity)
+{
+	if (parity == 0) {
+		return v.heat0;
+	}
+	return v.heat1;
+}
+
+bool volume_in_range(ivec3 block)
+{
+	return all(greaterThanEqual(block, ivec3(VOLUME_COORD_MIN))) && all(lessThanEqual(block, ivec3(VOLUME_COORD_MAX)));
+}
+
+uint volume_key(ivec3 block)
+{
+	uvec3 b = uvec3(block - VOLUME_COORD_MIN);
+	return b.x | (b.y << 10) | (b.z << 20);
+}
+
+// lowbias32 by Chris Wellons, neighbouring keys spread over the whole table
+uint volume_hash(uint key)
+{
+	key ^= key >> 16;
+	key *= 0x7feb352du;
+	key ^= key >> 15;
+	key *= 0x846ca68bu;
+	key ^= key >> 16;
+	return key;
+}
+
+// pool block of `block`, VOLUME_INVALID when it is not active
+uint volume_find(VolumeBuffers v, ivec3 block)
+{
+	if (!volume_in_range(block)) {
+		return VOLUME_INVALID;
+	}
+	uint key = volume_key(block);
+	uint slot = volume_hash(key) & v.tableMask;
+	for (uint i = 0; i < VOLUME_MAX_PROBES; i++) {
+		uint k = v.keys.data[slot];
+		if (k == key) {
+			return v.values.data[slot];
+		}
+		if (k == VOLUME_EMPTY) {
+			break;
+		}
+		slot = (slot + 1) & v.tableMask;
+	}
+	return VOLUME_INVALID;
+}
+
+// Table slot holding `key`, claimed if the key was not in the table yet.
+// `inserted` is only true for the one invocation that added the key.
+uint volume_claim(VolumeBuffers v, uint key, out bool inserted)
+{
+	inserted = false;
+	uint slot = volume_hash(key) & v.tableMask;
+	for (uint i = 0; i < VOLUME_MAX_PROBES; i++) {
+		uint previous = atomicCompSwap(v.keys.data[slot], VOLUME_EMPTY, key);
+		if (previous == VOLUME_EMPTY) {
+			inserted = true;
+			return slot;
+		}
+		if (previous == key) {
+			return slot;
+		}
+		slot = (slot + 1) & v.tableMask;
+	}
+	return VOLUME_INVALID;
+}
+
+// voxel `local` of pool block `block`, x fastest
+uint volume_voxel(uint block, uvec3 local)
+{
+	return block * VOLUME_BLOCK_VOXELS + (local.z * VOLUME_BLOCK + local.y) * VOLUME_BLOCK + local.x;
+}
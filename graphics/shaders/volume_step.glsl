@@ -0,0 +1,29 @@
+// Push constants shared by the passes that step the volume
+#include "volume.glsl"
+
+layout(push_constant) uniform constants {
+	VolumeBuffers volume;
+	uint parity;         // which active list and fields are current
+	uint mode;           // pass specific
+	float dt;
+	float voxelSize;
+	float threshold;     // blocks below this density count as empty
+	uint pad;
+	vec4 emitter;        // xyz center, w radius
+	vec4 emitVelocity;   // xyz velocity, w density per second
+	vec4 forces;         // buoyancy, smoke weight, density decay, heat decay
+	vec4 boundsMin;      // w heat per second
+	vec4 boundsMax;      // w heat diffusion
+} pc;
+
+ivec3 block_of(vec3 position)
+{
+	return ivec3(floor(position / (pc.voxelSize * VOLUME_BLOCK)));
+}
+
+// blocks that may be activated: inside the bounds and representable as keys
+bool block_allowed(ivec3 block)
+{
+	return all(greaterThanEqual(block, max(block_of(pc.boundsMin.xyz), ivec3(VOLUME_COORD_MIN)))) &&
+		all(lessThanEqual(block, min(block_of(pc.boundsMax.xyz), ivec3(VOLUME_COORD_MAX))));
+}
@@ -0,0 +1,66 @@
+// Position based dynamics over batches of independent constraints, layouts
+// must match vk_xpbd.h
+#extension GL_EXT_buffer_reference : require
+
+#define XPBD_MAX_COLORS 64
+#define XPBD_UNCOLORED 0xffffffffu
+
+struct Constraint {
+	uint a;
+	uint b;
+	float restLength;
+	float compliance;
+};
+
+struct XpbdState {
+	uint uncolored;  // constraints whose color conflicted this round
+	uint pad0;
+	uint pad1;
+	uint pad2;
+};
+
+layout(buffer_reference, std430) buffer XpbdVec4s { vec4 data[]; };
+layout(buffer_reference, std430) buffer XpbdFloats { float data[]; };
+layout(buffer_reference, std430) buffer XpbdUints { uint data[]; };
+layout(buffer_reference, std430) readonly buffer XpbdConstraints { Constraint data[]; };
+layout(buffer_reference, std430) buffer XpbdStateBuffer { XpbdState state; };
+
+#include "bvh.glsl"
+
+layout(buffer_reference, std430) readonly buffer XpbdBuffers {
+	XpbdVec4s positions;        // w = inverse mass
+	XpbdVec4s previous;         // positions at the start of the substep
+	XpbdVec4s velocities;
+	XpbdConstraints constraints;
+	XpbdFloats lambdas;         // accumulated multiplier per constraint
+	XpbdUints colors;
+	XpbdUints tentative;
+	XpbdUints adjacencyStart;   // per particle, plus one
+	XpbdUints adjacency;        // constraints touching each particle
+	XpbdStateBuffer state;
+	XpbdUints vertexTriangleStart;
+	XpbdUints vertexTriangles;
+	XpbdUints indices;
+	XpbdFloats renderPositions;
+	XpbdUints attributes;
+	BvhNodes bvhNodes;
+	BvhTriangles bvhTriangles;
+};
+
+layout(push_constant) uniform constants {
+	XpbdBuffers buffers;
+	uint particleCount;
+	uint constraintCount;
+	uint first;             // of the batch being solved
+	uint count;
+	uint mode;
+	uint collide;           // 0 without a collider
+	float dt;
+	float damping;
+	float thickness;
+	float friction;
+	float gravityX;
+	float gravityY;
+	float gravityZ;
+	uint pad;
+} pc;
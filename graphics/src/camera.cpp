@@ -1 +1,368 @@
 #include "camera.h"
+#include "cpu_features.h"
+
+#include <bit>
+#include <cmath>
+
+#include <glm/common.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define CAMERA_SIMD_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define TARGET_AVX2
+#endif
+
+Frustum Frustum::from_matrix(const glm::mat4& viewproj)
+{
+	// Gribb-Hartmann for a [0, 1] depth range
+	glm::vec4 rows[4];
+	for (int i = 0; i < 4; i++) {
+		rows[i] = glm::vec4(viewproj[0][i], viewproj[1][i], viewproj[2][i], viewproj[3][i]);
+	}
+	glm::vec4 planes[6] = {
+		rows[3] + rows[0], rows[3] - rows[0],
+		rows[3] + rows[1], rows[3] - rows[1],
+		rows[2], rows[3] - rows[2],
+	};
+
+	Frustum frustum;
+	for (int i = 0; i < 6; i++) {
+		float length = glm::length(glm::vec3(planes[i]));
+		frustum.planes[i] = length > 1e-6f ? planes[i] / length : glm::vec4(0.f, 0.f, 0.f, 1.f);
+	}
+	return frustum;
+}
+
+void SphereBoundsSoA::push_back(const glm::vec3& center, float r)
+{
+	x.push_back(center.x);
+	y.push_back(center.y);
+	z.push_back(center.z);
+	radius.push_back(r);
+}
+
+void SphereBoundsSoA::clear()
+{
+	x.clear();
+	y.clear();
+	z.clear();
+	radius.clear();
+}
+
+void AabbBoundsSoA::push_back(const glm::vec3& min, const glm::vec3& max)
+{
+	minX.push_back(min.x);
+	minY.push_back(min.y);
+	minZ.push_back(min.z);
+	maxX.push_back(max.x);
+	maxY.push_back(max.y);
+	maxZ.push_back(max.z);
+}
+
+void AabbBoundsSoA::clear()
+{
+	minX.clear();
+	minY.clear();
+	minZ.clear();
+	maxX.clear();
+	maxY.clear();
+	maxZ.clear();
+}
+
+glm::mat4 vkutil::perspective_reverse_z(float fovy, float aspect, float znear)
+{
+	float f = 1.f / std::tan(fovy / 2.f);
+	glm::mat4 proj(0.f);
+	proj[0][0] = f / aspect;
+	// flipped so that +y is up on screen in Vulkan
+	proj[1][1] = -f;
+	proj[2][3] = -1.f;
+	proj[3][2] = znear;
+	return proj;
+}
+
+void Camera::set_position(const glm::vec3& position)
+{
+	_position = position;
+	_viewDirty = true;
+	_frustumDirty = true;
+}
+
+void Camera::set_rotation(float pitch, float yaw)
+{
+	_pitch = glm::clamp(pitch, glm::radians(-89.f), glm::radians(89.f));
+	_yaw = yaw;
+	_viewDirty = true;
+	_frustumDirty = true;
+}
+
+void Camera::look_at(const glm::vec3& eye, const glm::vec3& target)
+{
+	glm::vec3 direction = glm::normalize(target - eye);
+	set_position(eye);
+	set_rotation(std::asin(direction.y), std::atan2(direction.x, -direction.z));
+}
+
+void Camera::set_perspective(float fovy, float aspect, float znear)
+{
+	_fovy = fovy;
+	_aspect = aspect;
+	_znear = znear;
+	_projectionDirty = true;
+	_frustumDirty = true;
+}
+
+void Camera::set_aspect(float aspect)
+{
+	if (aspect != _aspect) {
+		set_perspective(_fovy, aspect, _znear);
+	}
+}
+
+void Camera::process_sdl_event(const SDL_Event& e)
+{
+	if (e.type == SDL_EVENT_KEY_DOWN || e.type == SDL_EVENT_KEY_UP) {
+		float amount = e.type == SDL_EVENT_KEY_DOWN ? 1.f : 0.f;
+		switch (e.key.key) {
+		case SDLK_W: _velocity.z = -amount; break;
+		case SDLK_S: _velocity.z = amount; break;
+		case SDLK_A: _velocity.x = -amount; break;
+		case SDLK_D: _velocity.x = amount; break;
+		case SDLK_E: _velocity.y = amount; break;
+		case SDLK_Q: _velocity.y = -amount; break;
+		default: break;
+		}
+	}
+
+	if (e.type == SDL_EVENT_MOUSE_MOTION && (e.motion.state & SDL_BUTTON_RMASK)) {
+		set_rotation(_pitch - e.motion.yrel / 200.f, _yaw + e.motion.xrel / 200.f);
+	}
+}
+
+void Camera::update(float deltaSeconds)
+{
+	if (_velocity == glm::vec3(0.f)) {
+		return;
+	}
+	glm::vec3 offset = glm::vec3(rotation_matrix() * glm::vec4(_velocity * speed * deltaSeconds, 0.f));
+	set_position(_position + offset);
+}
+
+glm::mat4 Camera::rotation_matrix() const
+{
+	glm::mat4 yawRotation = glm::rotate(glm::mat4(1.f), _yaw, glm::vec3(0.f, -1.f, 0.f));
+	glm::mat4 pitchRotation = glm::rotate(glm::mat4(1.f), _pitch, glm::vec3(1.f, 0.f, 0.f));
+	return yawRotation * pitchRotation;
+}
+
+const glm::mat4& Camera::view() const
+{
+	if (_viewDirty) {
+		// inverse of translation * rotation, the rotation being orthonormal
+		_view = glm::transpose(rotation_matrix()) * glm::translate(glm::mat4(1.f), -_position);
+		_viewDirty = false;
+	}
+	return _view;
+}
+
+const glm::mat4& Camera::projection() const
+{
+	if (_projectionDirty) {
+		_projection = vkutil::perspective_reverse_z(_fovy, _aspect, _znear);
+		_projectionDirty = false;
+	}
+	return _projection;
+}
+
+const glm::mat4& Camera::view_projection() const
+{
+	if (_frustumDirty) {
+		_viewProjection = projection() * view();
+		_frustum = Frustum::from_matrix(_viewProjection);
+		_frustumDirty = false;
+	}
+	return _viewProjection;
+}
+
+const Frustum& Camera::frustum() const
+{
+	view_projection();
+	return _frustum;
+}
+
+bool vkutil::is_visible(const Frustum& frustum, const glm::vec3& center, float radius)
+{
+	bool inside = true;
+	for (const glm::vec4& p : frustum.planes) {
+		inside = inside && glm::dot(glm::vec3(p), center) + p.w >= -radius;
+	}
+	return inside;
+}
+
+bool vkutil::is_visible(const Frustum& frustum, const glm::vec3& min, const glm::vec3& max)
+{
+	glm::vec3 center = (min + max) * 0.5f;
+	glm::vec3 extents = (max - min) * 0.5f;
+
+	bool inside = true;
+	for (const glm::vec4& p : frustum.planes) {
+		// distance of the corner furthest along the plane normal
+		glm::vec3 n(p);
+		inside = inside && glm::dot(n, center) + p.w + glm::dot(glm::abs(n), extents) >= 0.f;
+	}
+	return inside;
+}
+
+static size_t cull_spheres_scalar(const Frustum& frustum, const SphereBoundsSoA& bounds, size_t begin, uint32_t* out)
+{
+	size_t written = 0;
+	for (size_t i = begin; i < bounds.size(); i++) {
+		if (vkutil::is_visible(frustum, glm::vec3(bounds.x[i], bounds.y[i], bounds.z[i]), bounds.radius[i])) {
+			out[written++] = (uint32_t)i;
+		}
+	}
+	return written;
+}
+
+static size_t cull_aabbs_scalar(const Frustum& frustum, const AabbBoundsSoA& bounds, size_t begin, uint32_t* out)
+{
+	size_t written = 0;
+	for (size_t i = begin; i < bounds.size(); i++) {
+		glm::vec3 min(bounds.minX[i], bounds.minY[i], bounds.minZ[i]);
+		glm::vec3 max(bounds.maxX[i], bounds.maxY[i], bounds.maxZ[i]);
+		if (vkutil::is_visible(frustum, min, max)) {
+			out[written++] = (uint32_t)i;
+		}
+	}
+	return written;
+}
+
+#ifdef CAMERA_SIMD_X86
+static size_t append_mask(uint32_t mask, size_t base, uint32_t* out)
+{
+	size_t written = 0;
+	while (mask) {
+		out[written++] = (uint32_t)(base + std::countr_zero(mask));
+		mask &= mask - 1;
+	}
+	return written;
+}
+
+// Returns how many volumes were processed, always a multiple of eight.
+TARGET_AVX2 static size_t cull_spheres_avx2(const Frustum& frustum, const SphereBoundsSoA& bounds, uint32_t* out, size_t& written)
+{
+	__m256 px[6], py[6], pz[6], pw[6];
+	for (int p = 0; p < 6; p++) {
+		px[p] = _mm256_set1_ps(frustum.planes[p].x);
+		py[p] = _mm256_set1_ps(frustum.planes[p].y);
+		pz[p] = _mm256_set1_ps(frustum.planes[p].z);
+		pw[p] = _mm256_set1_ps(frustum.planes[p].w);
+	}
+
+	size_t i = 0;
+	for (; i + 8 <= bounds.size(); i += 8) {
+		__m256 x = _mm256_loadu_ps(bounds.x.data() + i);
+		__m256 y = _mm256_loadu_ps(bounds.y.data() + i);
+		__m256 z = _mm256_loadu_ps(bounds.z.data() + i);
+		__m256 negRadius = _mm256_sub_ps(_mm256_setzero_ps(), _mm256_loadu_ps(bounds.radius.data() + i));
+
+		__m256 inside = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+		for (int p = 0; p < 6; p++) {
+			__m256 d = _mm256_add_ps(_mm256_mul_ps(px[p], x), pw[p]);
+			d = _mm256_add_ps(_mm256_mul_ps(py[p], y), d);
+			d = _mm256_add_ps(_mm256_mul_ps(pz[p], z), d);
+			inside = _mm256_and_ps(inside, _mm256_cmp_ps(d, negRadius, _CMP_GE_OQ));
+		}
+		written += append_mask((uint32_t)_mm256_movemask_ps(inside), i, out + written);
+	}
+	return i;
+}
+
+TARGET_AVX2 static size_t cull_aabbs_avx2(const Frustum& frustum, const AabbBoundsSoA& bounds, uint32_t* out, size_t& written)
+{
+	__m256 px[6], py[6], pz[6], pw[6];
+	__m256 ax[6], ay[6], az[6];
+	for (int p = 0; p < 6; p++) {
+		const glm::vec4& plane = frustum.planes[p];
+		px[p] = _mm256_set1_ps(plane.x);
+		py[p] = _mm256_set1_ps(plane.y);
+		pz[p] = _mm256_set1_ps(plane.z);
+		pw[p] = _mm256_set1_ps(plane.w);
+		ax[p] = _mm256_set1_ps(std::abs(plane.x));
+		ay[p] = _mm256_set1_ps(std::abs(plane.y));
+		az[p] = _mm256_set1_ps(std::abs(plane.z));
+	}
+
+	const __m256 half = _mm256_set1_ps(0.5f);
+	size_t i = 0;
+	for (; i + 8 <= bounds.size(); i += 8) {
+		__m256 minX = _mm256_loadu_ps(bounds.minX.data() + i);
+		__m256 minY = _mm256_loadu_ps(bounds.minY.data() + i);
+		__m256 minZ = _mm256_loadu_ps(bounds.minZ.data() + i);
+		__m256 maxX = _mm256_loadu_ps(bounds.maxX.data() + i);
+		__m256 maxY = _mm256_loadu_ps(bounds.maxY.data() + i);
+		__m256 maxZ = _mm256_loadu_ps(bounds.maxZ.data() + i);
+
+		__m256 cx = _mm256_mul_ps(_mm256_add_ps(minX, maxX), half);
+		__m256 cy = _mm256_mul_ps(_mm256_add_ps(minY, maxY), half);
+		__m256 cz = _mm256_mul_ps(_mm256_add_ps(minZ, maxZ), half);
+		__m256 ex = _mm256_mul_ps(_mm256_sub_ps(maxX, minX), half);
+		__m256 ey = _mm256_mul_ps(_mm256_sub_ps(maxY, minY), half);
+		__m256 ez = _mm256_mul_ps(_mm256_sub_ps(maxZ, minZ), half);
+
+		__m256 inside = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+		for (int p = 0; p < 6; p++) {
+			__m256 d = _mm256_add_ps(_mm256_mul_ps(px[p], cx), pw[p]);
+			d = _mm256_add_ps(_mm256_mul_ps(py[p], cy), d);
+			d = _mm256_add_ps(_mm256_mul_ps(pz[p], cz), d);
+			d = _mm256_add_ps(_mm256_mul_ps(ax[p], ex), d);
+			d = _mm256_add_ps(_mm256_mul_ps(ay[p], ey), d);
+			d = _mm256_add_ps(_mm256_mul_ps(az[p], ez), d);
+			inside = _mm256_and_ps(inside, _mm256_cmp_ps(d, _mm256_setzero_ps(), _CMP_GE_OQ));
+		}
+		written += append_mask((uint32_t)_mm256_movemask_ps(inside), i, out + written);
+	}
+	return i;
+}
+#endif
+
+void vkutil::cull_spheres(const Frustum& frustum, const SphereBoundsSoA& bounds, std::vector<uint32_t>& visible)
+{
+	// reserve the worst case and trim afterwards, the hot loop only stores
+	size_t first = visible.size();
+	visible.resize(first + bounds.size());
+	uint32_t* out = visible.data() + first;
+
+	size_t written = 0;
+	size_t processed = 0;
+#ifdef CAMERA_SIMD_X86
+	if (cpu_features().avx2) {
+		processed = cull_spheres_avx2(frustum, bounds, out, written);
+	}
+#endif
+	written += cull_spheres_scalar(frustum, bounds, processed, out + written);
+	visible.resize(first + written);
+}
+
+void vkutil::cull_aabbs(const Frustum& frustum, const AabbBoundsSoA& bounds, std::vector<uint32_t>& visible)
+{
+	size_t first = visible.size();
+	visible.resize(first + bounds.size());
+	uint32_t* out = visible.data() + first;
+
+	size_t written = 0;
+	size_t processed = 0;
+#ifdef CAMERA_SIMD_X86
+	if (cpu_features().avx2) {
+		processed = cull_aabbs_avx2(frustum, bounds, out, written);
+	}
+#endif
+	written += cull_aabbs_scalar(frustum, bounds, processed, out + written);
+	visible.resize(first + written);
+}
@@ -0,0 +1,793 @@
+#include "checkpoint.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <new>
+
+#include <spdlog/spdlog.h>
+
+#if defined(_WIN32)
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// On disk layout, all little endian. Must stay in sync between writer and
+// reader, bump VERSION on any change.
+static constexpr char MAGIC[8] = {'G', 'P', 'S', 'I', 'M', 'C', 'K', '1'};
+static constexpr uint32_t VERSION = 1;
+static constexpr uint32_t CHUNK_MAGIC = 0x4d415246;  // "FRAM"
+// direct I/O needs block aligned offsets, sizes and memory
+static constexpr size_t BLOCK = 4096;
+static constexpr size_t CHUNK_ALIGN = 64;
+static constexpr size_t DATA_ALIGN = 16;
+
+enum : uint32_t {
+	FRAME_KEY = 1,
+};
+
+enum : uint32_t {
+	ENCODING_XOR = 1,          // XORed with the same element of the previous frame
+	ENCODING_ZERO_GROUPS = 2,  // byte shuffled, then zero groups elided
+};
+
+struct FileHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t fieldCount;
+	uint64_t indexOffset;  // 0 until the writer is closed
+	uint64_t frameCount;
+	uint32_t keyframeInterval;
+	uint32_t blockSize;
+};
+
+struct FieldRecord {
+	char name[24];
+	uint32_t type;
+	uint32_t elementSize;
+};
+
+struct ChunkHeader {
+	uint32_t magic;
+	uint32_t flags;
+	uint64_t step;
+	double time;
+	uint64_t bytes;  // whole chunk, padded
+	uint32_t count;
+	uint32_t fieldCount;
+};
+
+struct FieldChunk {
+	uint64_t bytes;
+	uint32_t encoding;
+	uint32_t pad;
+};
+
+struct IndexRecord {
+	uint64_t step;
+	double time;
+	uint64_t offset;
+	uint64_t bytes;
+	uint32_t count;
+	uint32_t flags;
+};
+
+static constexpr size_t MAX_FIELDS = (BLOCK - sizeof(FileHeader)) / sizeof(FieldRecord);
+
+static size_t align_up(size_t value, size_t alignment)
+{
+	return (value + alignment - 1) / alignment * alignment;
+}
+
+static size_t chunk_header_bytes(size_t fieldCount)
+{
+	return align_up(sizeof(ChunkHeader) + fieldCount * sizeof(FieldChunk), DATA_ALIGN);
+}
+
+static uint8_t* allocate_aligned(size_t size)
+{
+	return static_cast<uint8_t*>(::operator new(size, std::align_val_t(BLOCK)));
+}
+
+static void free_aligned(uint8_t* data)
+{
+	::operator delete(data, std::align_val_t(BLOCK));
+}
+
+// Splits the words into four planes of their bytes, XORing them with the
+// reference first when there is one. Deltas of slowly changing floats are
+// zero in the exponent plane and mostly zero in the one above it.
+static void shuffle(const uint32_t* words, const uint32_t* reference, size_t referenceCount, size_t count,
+	uint8_t* planes)
+{
+	for (size_t i = 0; i < count; i++) {
+		uint32_t w = words[i];
+		if (reference && i < referenceCount) {
+			w ^= reference[i];
+		}
+		planes[i] = uint8_t(w);
+		planes[count + i] = uint8_t(w >> 8);
+		planes[2 * count + i] = uint8_t(w >> 16);
+		planes[3 * count + i] = uint8_t(w >> 24);
+	}
+}
+
+// The bytes are cut into groups of 8, and every 64 groups are stored as a
+// mask of the non-zero ones followed by just those. Coarser than a byte run
+// length code but about twice as fast, and the zero planes of a delta are
+// long runs anyway. Returns SIZE_MAX as soon as the output would not be
+// smaller than the input.
+static size_t zero_groups_encode(const uint8_t* in, size_t size, uint8_t* out)
+{
+	const size_t groups = (size + 7) / 8;
+	size_t o = 0;
+	for (size_t first = 0; first < groups; first += 64) {
+		if (o + 8 >= size) {
+			return SIZE_MAX;
+		}
+		const size_t maskAt = o;
+		o += 8;
+		uint64_t mask = 0;
+		const size_t last = std::min(groups, first + 64);
+		for (size_t g = first; g < last; g++) {
+			uint64_t v = 0;
+			std::memcpy(&v, in + g * 8, std::min<size_t>(8, size - g * 8));
+			if (v != 0) {
+				if (o + 8 >= size) {
+					return SIZE_MAX;
+				}
+				mask |= uint64_t(1) << (g - first);
+				std::memcpy(out + o, &v, 8);
+				o += 8;
+			}
+		}
+		std::memcpy(out + maskAt, &mask, 8);
+	}
+	return o;
+}
+
+static bool zero_groups_decode(const uint8_t* in, size_t inSize, uint8_t* out, size_t outSize)
+{
+	const size_t groups = (outSize + 7) / 8;
+	size_t i = 0;
+	for (size_t first = 0; first < groups; first += 64) {
+		if (i + 8 > inSize) {
+			return false;
+		}
+		uint64_t mask;
+		std::memcpy(&mask, in + i, 8);
+		i += 8;
+		const size_t last = std::min(groups, first + 64);
+		for (size_t g = first; g < last; g++) {
+			size_t bytes = std::min<size_t>(8, outSize - g * 8);
+			if (mask >> (g - first) & 1) {
+				if (i + 8 > inSize) {
+					return false;
+				}
+				std::memcpy(out + g * 8, in + i, bytes);
+				i += 8;
+			} else {
+				std::memset(out + g * 8, 0, bytes);
+			}
+		}
+	}
+	return true;
+}
+
+// platform file access, handles are stored as intptr_t so the header stays
+// free of system includes
+
+static intptr_t open_for_write(const std::string& path, bool direct)
+{
+#if defined(_WIN32)
+	DWORD flags = FILE_ATTRIBUTE_NORMAL | (direct ? FILE_FLAG_NO_BUFFERING | FILE_FLAG_WRITE_THROUGH : 0);
+	HANDLE file = CreateFileA(path.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, flags, nullptr);
+	return file == INVALID_HANDLE_VALUE ? -1 : (intptr_t)file;
+#else
+	int flags = O_WRONLY | O_CREAT | O_TRUNC;
+#if defined(O_DIRECT)
+	if (direct) {
+		flags |= O_DIRECT;
+	}
+#else
+	if (direct) {
+		return -1;
+	}
+#endif
+	return open(path.c_str(), flags, 0644);
+#endif
+}
+
+static bool write_at(intptr_t file, const uint8_t* data, size_t size, uint64_t offset)
+{
+	while (size > 0) {
+#if defined(_WIN32)
+		OVERLAPPED overlapped{};
+		overlapped.Offset = DWORD(offset);
+		overlapped.OffsetHigh = DWORD(offset >> 32);
+		DWORD written = 0;
+		DWORD chunk = DWORD(std::min<size_t>(size, size_t(1) << 30));
+		if (!WriteFile((HANDLE)file, data, chunk, &written, &overlapped) || written == 0) {
+			return false;
+		}
+#else
+		ssize_t written = pwrite((int)file, data, size, (off_t)offset);
+		if (written <= 0) {
+			return false;
+		}
+#endif
+		data += written;
+		size -= written;
+		offset += written;
+	}
+	return true;
+}
+
+static void truncate_file(intptr_t file, uint64_t size)
+{
+#if defined(_WIN32)
+	FILE_END_OF_FILE_INFO info{};
+	info.EndOfFile.QuadPart = (LONGLONG)size;
+	SetFileInformationByHandle((HANDLE)file, FileEndOfFileInfo, &info, sizeof(info));
+#else
+	if (ftruncate((int)file, (off_t)size) != 0) {
+		spdlog::warn("Checkpoint: could not truncate the padding of the last block");
+	}
+#endif
+}
+
+static void close_file(intptr_t file)
+{
+#if defined(_WIN32)
+	CloseHandle((HANDLE)file);
+#else
+	close((int)file);
+#endif
+}
+
+bool CheckpointWriter::open(const std::string& path, std::span<const CheckpointField> fields,
+	const CheckpointOptions& options)
+{
+	if (fields.empty() || fields.size() > MAX_FIELDS) {
+		spdlog::error("Checkpoint: {} fields, at least 1 and at most {} are supported", fields.size(), MAX_FIELDS);
+		return false;
+	}
+
+	_options = options;
+	_options.keyframeInterval = std::max(_options.keyframeInterval, 1u);
+	_options.bufferBytes = align_up(std::max(_options.bufferBytes, BLOCK * 16), BLOCK);
+
+	_direct = false;
+	if (_options.direct) {
+		_file = open_for_write(path, true);
+		_direct = _file != -1;
+	}
+	if (_file == -1) {
+		// e.g. tmpfs does not support direct I/O
+		_file = open_for_write(path, false);
+	}
+	if (_file == -1) {
+		spdlog::error("Checkpoint: could not create {}", path);
+		return false;
+	}
+
+	_path = path;
+	_fields.assign(fields.begin(), fields.end());
+	_previous.assign(_fields.size(), {});
+	_previousCount = 0;
+	_encoded.assign(_fields.size(), {});
+	_shuffled.assign(_fields.size(), {});
+	_index.clear();
+	_stats = {};
+
+	for (IoBuffer& buffer : _buffers) {
+		buffer.data = allocate_aligned(_options.bufferBytes);
+		buffer.bytes = 0;
+		buffer.busy = false;
+	}
+	_fill = 0;
+	_fileOffset = 0;
+	_truncateTo = 0;
+	_stop = false;
+	_failed = false;
+
+	// the whole first block belongs to the header and schema, it is written
+	// again with the index location on close
+	_headerBlock = allocate_aligned(BLOCK);
+	std::memset(_headerBlock, 0, BLOCK);
+	FileHeader header{};
+	std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+	header.version = VERSION;
+	header.fieldCount = (uint32_t)_fields.size();
+	header.keyframeInterval = _options.keyframeInterval;
+	header.blockSize = BLOCK;
+	std::memcpy(_headerBlock, &header, sizeof(header));
+	for (size_t i = 0; i < _fields.size(); i++) {
+		FieldRecord record{};
+		std::strncpy(record.name, _fields[i].name.c_str(), sizeof(record.name) - 1);
+		record.type = (uint32_t)_fields[i].type;
+		record.elementSize = 4;
+		std::memcpy(_headerBlock + sizeof(header) + i * sizeof(record), &record, sizeof(record));
+	}
+	put(_headerBlock, BLOCK);
+
+	_thread = std::thread([this]() { io_loop(); });
+
+	spdlog::info("Checkpoint: recording {} fields to {}{}", _fields.size(), path, _direct ? " with direct I/O" : "");
+	return true;
+}
+
+void CheckpointWriter::write_frame(uint64_t step, double time, uint32_t count, std::span<const void* const> fields)
+{
+	if (!is_open()) {
+		return;
+	}
+	auto start = std::chrono::steady_clock::now();
+
+	const size_t fieldCount = _fields.size();
+	const bool keyframe = !_options.delta || _stats.frames % _options.keyframeInterval == 0;
+	const size_t rawBytes = size_t(count) * 4;
+
+	struct Part {
+		const uint8_t* data;
+		size_t bytes;
+		uint32_t encoding;
+	};
+	std::vector<Part> parts(fieldCount);
+
+	auto encode = [&](size_t f) {
+		const uint32_t* words = static_cast<const uint32_t*>(fields[f]);
+		const uint32_t* reference = keyframe ? nullptr : _previous[f].data();
+		uint32_t encoding = keyframe ? 0u : uint32_t(ENCODING_XOR);
+		Part part{reinterpret_cast<const uint8_t*>(words), rawBytes, encoding};
+
+		if (_options.compress) {
+			std::vector<uint8_t>& planes = _shuffled[f];
+			std::vector<uint8_t>& encoded = _encoded[f];
+			planes.resize(rawBytes);
+			encoded.resize(rawBytes);
+			shuffle(words, reference, _previousCount, count, planes.data());
+			size_t size = zero_groups_encode(planes.data(), rawBytes, encoded.data());
+			if (size != SIZE_MAX) {
+				part = {encoded.data(), size, encoding | ENCODING_ZERO_GROUPS};
+			}
+		}
+		if (reference && !(part.encoding & ENCODING_ZERO_GROUPS)) {
+			// deltas that did not compress are still stored as deltas
+			std::vector<uint8_t>& encoded = _encoded[f];
+			encoded.resize(rawBytes);
+			uint32_t* out = reinterpret_cast<uint32_t*>(encoded.data());
+			for (size_t i = 0; i < count; i++) {
+				out[i] = i < _previousCount ? words[i] ^ reference[i] : words[i];
+			}
+			part.data = encoded.data();
+		}
+		parts[f] = part;
+	};
+	if (_options.jobs && fieldCount > 1) {
+		_options.jobs->parallel_for(fieldCount, 1, [&](size_t begin, size_t end) {
+			for (size_t f = begin; f < end; f++) {
+				encode(f);
+			}
+		});
+	} else {
+		for (size_t f = 0; f < fieldCount; f++) {
+			encode(f);
+		}
+	}
+
+	if (_options.delta) {
+		for (size_t f = 0; f < fieldCount; f++) {
+			_previous[f].resize(count);
+			std::memcpy(_previous[f].data(), fields[f], rawBytes);
+		}
+		_previousCount = count;
+	}
+
+	const size_t headerBytes = chunk_header_bytes(fieldCount);
+	size_t chunkBytes = headerBytes;
+	for (const Part& part : parts) {
+		chunkBytes += align_up(part.bytes, DATA_ALIGN);
+	}
+	chunkBytes = align_up(chunkBytes, CHUNK_ALIGN);
+
+	CheckpointFrameInfo info{};
+	info.step = step;
+	info.time = time;
+	info.offset = _fileOffset + _buffers[_fill].bytes;
+	info.bytes = chunkBytes;
+	info.count = count;
+	info.flags = keyframe ? uint32_t(FRAME_KEY) : 0u;
+
+	ChunkHeader header{};
+	header.magic = CHUNK_MAGIC;
+	header.flags = info.flags;
+	header.step = step;
+	header.time = time;
+	header.bytes = chunkBytes;
+	header.count = count;
+	header.fieldCount = (uint32_t)fieldCount;
+	put(&header, sizeof(header));
+	for (const Part& part : parts) {
+		FieldChunk field{};
+		field.bytes = part.bytes;
+		field.encoding = part.encoding;
+		put(&field, sizeof(field));
+	}
+	pad_to(DATA_ALIGN);
+	for (const Part& part : parts) {
+		put(part.data, part.bytes);
+		pad_to(DATA_ALIGN);
+	}
+	pad_to(CHUNK_ALIGN);
+	_index.push_back(info);
+
+	_stats.frames++;
+	_stats.rawBytes += rawBytes * fieldCount;
+	_stats.encodeMilliseconds +=
+		std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+void CheckpointWriter::close()
+{
+	if (!is_open()) {
+		return;
+	}
+
+	pad_to(CHUNK_ALIGN);
+	const uint64_t indexOffset = _fileOffset + _buffers[_fill].bytes;
+	for (const CheckpointFrameInfo& info : _index) {
+		IndexRecord record{info.step, info.time, info.offset, info.bytes, info.count, info.flags};
+		put(&record, sizeof(record));
+	}
+	submit(true);
+	{
+		std::unique_lock lock(_mutex);
+		_done.wait(lock, [&]() { return !_buffers[0].busy && !_buffers[1].busy; });
+		_stop = true;
+	}
+	_wake.notify_all();
+	_thread.join();
+
+	FileHeader header;
+	std::memcpy(&header, _headerBlock, sizeof(header));
+	header.indexOffset = indexOffset;
+	header.frameCount = _index.size();
+	std::memcpy(_headerBlock, &header, sizeof(header));
+	if (!_failed && !write_at(_file, _headerBlock, BLOCK, 0)) {
+		_failed = true;
+	}
+	truncate_file(_file, _truncateTo);
+	close_file(_file);
+	_file = -1;
+
+	for (IoBuffer& buffer : _buffers) {
+		free_aligned(buffer.data);
+		buffer.data = nullptr;
+	}
+	free_aligned(_headerBlock);
+	_headerBlock = nullptr;
+
+	if (_failed) {
+		spdlog::error("Checkpoint: writing {} failed, the recording is incomplete", _path);
+	}
+	double ratio = _stats.fileBytes ? static_cast<double>(_stats.rawBytes) / static_cast<double>(_stats.fileBytes) : 0.0;
+	spdlog::info("Checkpoint: {} frames, {:.1f} MB of state in {:.1f} MB ({:.2f}x), {} stalls, {:.3f} ms encoding per frame",
+		_stats.frames, static_cast<double>(_stats.rawBytes) / 1e6, static_cast<double>(_stats.fileBytes) / 1e6, ratio,
+		_stats.stalls, _stats.frames ? _stats.encodeMilliseconds / static_cast<double>(_stats.frames) : 0.0);
+}
+
+void CheckpointWriter::put(const void* data, size_t size)
+{
+	const uint8_t* bytes = static_cast<const uint8_t*>(data);
+	while (size > 0) {
+		IoBuffer& buffer = _buffers[_fill];
+		size_t n = std::min(size, _options.bufferBytes - buffer.bytes);
+		std::memcpy(buffer.data + buffer.bytes, bytes, n);
+		buffer.bytes += n;
+		bytes += n;
+		size -= n;
+		if (buffer.bytes == _options.bufferBytes) {
+			submit(false);
+		}
+	}
+}
+
+void CheckpointWriter::pad_to(size_t alignment)
+{
+	static const uint8_t zeros[CHUNK_ALIGN] = {};
+	size_t position = _fileOffset + _buffers[_fill].bytes;
+	put(zeros, align_up(position, alignment) - position);
+}
+
+void CheckpointWriter::submit(bool last)
+{
+	IoBuffer& buffer = _buffers[_fill];
+	size_t used = buffer.bytes;
+	buffer.offset = _fileOffset;
+	if (last) {
+		// direct I/O writes whole blocks, the padding is cut off again on close
+		buffer.bytes = align_up(used, BLOCK);
+		std::memset(buffer.data + used, 0, buffer.bytes - used);
+		_truncateTo = _fileOffset + used;
+	}
+	_fileOffset += used;
+	_stats.fileBytes += used;
+
+	{
+		std::lock_guard lock(_mutex);
+		buffer.busy = true;
+		_queue.push_back(_fill);
+	}
+	_wake.notify_one();
+
+	_fill ^= 1;
+	IoBuffer& next = _buffers[_fill];
+	std::unique_lock lock(_mutex);
+	if (next.busy) {
+		_stats.stalls++;
+		_done.wait(lock, [&]() { return !next.busy; });
+	}
+	next.bytes = 0;
+}
+
+void CheckpointWriter::io_loop()
+{
+	for (;;) {
+		uint32_t index;
+		{
+			std::unique_lock lock(_mutex);
+			_wake.wait(lock, [&]() { return _stop || !_queue.empty(); });
+			if (_queue.empty()) {
+				return;
+			}
+			index = _queue.front();
+			_queue.pop_front();
+		}
+
+		IoBuffer& buffer = _buffers[index];
+		bool ok = write_at(_file, buffer.data, buffer.bytes, buffer.offset);
+		{
+			std::lock_guard lock(_mutex);
+			if (!ok && !_failed) {
+				spdlog::error("Checkpoint: write of {} bytes at {} failed", buffer.bytes, buffer.offset);
+			}
+			_failed = _failed || !ok;
+			buffer.busy = false;
+		}
+		_done.notify_all();
+	}
+}
+
+bool CheckpointReader::open(const std::string& path)
+{
+	close();
+
+#if defined(_WIN32)
+	HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+		FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE) {
+		spdlog::error("Checkpoint: could not open {}", path);
+		return false;
+	}
+	_file = (intptr_t)file;
+	LARGE_INTEGER size{};
+	GetFileSizeEx(file, &size);
+	_size = (size_t)size.QuadPart;
+	HANDLE mapping = _size ? CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr) : nullptr;
+	_mapping = (intptr_t)mapping;
+	_data = mapping ? static_cast<const uint8_t*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0)) : nullptr;
+#else
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd == -1) {
+		spdlog::error("Checkpoint: could not open {}", path);
+		return false;
+	}
+	_file = fd;
+	struct stat info {};
+	fstat(fd, &info);
+	_size = (size_t)info.st_size;
+	if (_size) {
+		void* data = mmap(nullptr, _size, PROT_READ, MAP_SHARED, fd, 0);
+		_data = data == MAP_FAILED ? nullptr : static_cast<const uint8_t*>(data);
+	}
+#endif
+	if (!_data || _size < BLOCK) {
+		spdlog::error("Checkpoint: {} could not be mapped or is too short", path);
+		close();
+		return false;
+	}
+
+	FileHeader header;
+	std::memcpy(&header, _data, sizeof(header));
+	if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 || header.version != VERSION
+		|| header.fieldCount == 0 || header.fieldCount > MAX_FIELDS) {
+		spdlog::error("Checkpoint: {} is not a version {} recording", path, VERSION);
+		close();
+		return false;
+	}
+
+	for (uint32_t i = 0; i < header.fieldCount; i++) {
+		FieldRecord record;
+		std::memcpy(&record, _data + sizeof(header) + i * sizeof(record), sizeof(record));
+		record.name[sizeof(record.name) - 1] = 0;
+		_fields.push_back({record.name, (CheckpointFieldType)record.type});
+	}
+
+	if (!build_index(header.indexOffset, header.frameCount)) {
+		spdlog::warn("Checkpoint: {} has no usable index, recovered {} frames from the chunks", path, _index.size());
+	}
+	_state.assign(_fields.size(), {});
+	_decoded = SIZE_MAX;
+	_decodedCount = 0;
+
+	spdlog::info("Checkpoint: {} frames of {} fields in {}", _index.size(), _fields.size(), path);
+	return true;
+}
+
+void CheckpointReader::close()
+{
+#if defined(_WIN32)
+	if (_data) {
+		UnmapViewOfFile(_data);
+	}
+	if (_mapping) {
+		CloseHandle((HANDLE)_mapping);
+	}
+#else
+	if (_data) {
+		munmap(const_cast<uint8_t*>(_data), _size);
+	}
+#endif
+	if (_file != -1) {
+		close_file(_file);
+	}
+	_file = -1;
+	_mapping = 0;
+	_data = nullptr;
+	_size = 0;
+	_fields.clear();
+	_index.clear();
+	_state.clear();
+	_decoded = SIZE_MAX;
+}
+
+bool CheckpointReader::build_index(uint64_t indexOffset, uint64_t frameCount)
+{
+	_index.clear();
+	if (indexOffset != 0 && indexOffset <= _size && frameCount <= (_size - indexOffset) / sizeof(IndexRecord)) {
+		const uint64_t headerBytes = chunk_header_bytes(_fields.size());
+		_index.resize(frameCount);
+		bool valid = true;
+		for (uint64_t i = 0; i < frameCount && valid; i++) {
+			IndexRecord record;
+			std::memcpy(&record, _data + indexOffset + i * sizeof(record), sizeof(record));
+			// every chunk has to lie between the header block and the index
+			valid = record.offset >= BLOCK && record.offset <= indexOffset && record.bytes >= headerBytes
+				&& record.bytes <= indexOffset - record.offset;
+			_index[i] = {record.step, record.time, record.offset, record.bytes, record.count, record.flags};
+		}
+		if (valid) {
+			return true;
+		}
+		spdlog::warn("Checkpoint: the index points outside of the frames, ignoring it");
+		_index.clear();
+	}
+
+	// the writer did not finish, or its index is damaged: walk the chunks up
+	// to the first torn one
+	uint64_t offset = BLOCK;
+	while (offset + sizeof(ChunkHeader) <= _size) {
+		ChunkHeader header;
+		std::memcpy(&header, _data + offset, sizeof(header));
+		if (header.magic != CHUNK_MAGIC || header.fieldCount != _fields.size() || header.bytes == 0
+			|| header.bytes > _size - offset) {
+			break;
+		}
+		_index.push_back({header.step, header.time, offset, header.bytes, header.count, header.flags});
+		offset += header.bytes;
+	}
+	return false;
+}
+
+size_t CheckpointReader::find(uint64_t step) const
+{
+	auto it = std::upper_bound(_index.begin(), _index.end(), step,
+		[](uint64_t value, const CheckpointFrameInfo& info) { return value < info.step; });
+	return it == _index.begin() ? 0 : size_t(it - _index.begin()) - 1;
+}
+
+bool CheckpointReader::read_frame(size_t index, std::span<void* const> fields)
+{
+	if (index != _decoded) {
+		size_t first = index;
+		if (_decoded == SIZE_MAX || index != _decoded + 1) {
+			while (first > 0 && !(_index[first].flags & FRAME_KEY)) {
+				first--;
+			}
+		}
+		for (size_t i = first; i <= index; i++) {
+			if (!decode(i)) {
+				return false;
+			}
+		}
+	}
+
+	size_t bytes = size_t(_decodedCount) * 4;
+	for (size_t f = 0; f < _fields.size() && f < fields.size(); f++) {
+		std::memcpy(fields[f], _state[f].data(), bytes);
+	}
+	return true;
+}
+
+bool CheckpointReader::decode(size_t index)
+{
+	const CheckpointFrameInfo& info = _index[index];
+	const uint8_t* chunk = _data + info.offset;
+	const uint8_t* end = chunk + info.bytes;
+	const size_t count = info.count;
+	const size_t previousCount = _decodedCount;
+
+	// the state is half overwritten, the next read starts from a keyframe
+	auto corrupt = [&]() {
+		spdlog::error("Checkpoint: frame {} is corrupt", index);
+		_decoded = SIZE_MAX;
+		_decodedCount = 0;
+		return false;
+	};
+
+	if (chunk_header_bytes(_fields.size()) > info.bytes) {
+		return corrupt();
+	}
+	// the index and the chunk have to agree, it may point into other data
+	ChunkHeader header;
+	std::memcpy(&header, chunk, sizeof(header));
+	if (header.magic != CHUNK_MAGIC || header.fieldCount != _fields.size() || header.bytes != info.bytes
+		|| header.count != info.count) {
+		return corrupt();
+	}
+	const uint8_t* data = chunk + chunk_header_bytes(_fields.size());
+	for (size_t f = 0; f < _fields.size(); f++) {
+		FieldChunk field;
+		std::memcpy(&field, chunk + sizeof(ChunkHeader) + f * sizeof(field), sizeof(field));
+		// before sizing anything by the count: raw fields store 4 bytes per
+		// element, zero groups at least an 8 byte mask per 64 groups of 8
+		const uint64_t maxCount = (field.encoding & ENCODING_ZERO_GROUPS) ? field.bytes * 64 / 4 : field.bytes / 4;
+		if (field.bytes > size_t(end - data) || count > maxCount) {
+			return corrupt();
+		}
+
+		std::vector<uint32_t>& state = _state[f];
+		state.resize(std::max(count, previousCount));
+		const size_t reference = (field.encoding & ENCODING_XOR) ? previousCount : 0;
+		if (field.encoding & ENCODING_ZERO_GROUPS) {
+			_shuffled.resize(count * 4);
+			if (!zero_groups_decode(data, field.bytes, _shuffled.data(), count * 4)) {
+				return corrupt();
+			}
+			const uint8_t* planes = _shuffled.data();
+			for (size_t i = 0; i < count; i++) {
+				uint32_t w = uint32_t(planes[i]) | uint32_t(planes[count + i]) << 8
+					| uint32_t(planes[2 * count + i]) << 16 | uint32_t(planes[3 * count + i]) << 24;
+				state[i] = i < reference ? w ^ state[i] : w;
+			}
+		} else {
+			for (size_t i = 0; i < count; i++) {
+				uint32_t w;
+				std::memcpy(&w, data + i * 4, 4);
+				state[i] = i < reference ? w ^ state[i] : w;
+			}
+		}
+		state.resize(count);
+		data += align_up(field.bytes, DATA_ALIGN);
+	}
+
+	_decoded = index;
+	_decodedCount = (uint32_t)count;
+	return true;
+}
@@ -0,0 +1,353 @@
+#include "cluster_pages.h"
+
+#include <meshoptimizer.h>
+
+#include <glm/geometric.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <limits>
+
+#include <spdlog/spdlog.h>
+
+#if defined(_WIN32)
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+static constexpr uint32_t MAGIC = 0x4c435047;  // "GPCL"
+static constexpr uint32_t VERSION = 1;
+
+static size_t cluster_bytes(uint32_t vertexCount, uint32_t triangleCount)
+{
+	return vertexCount * (sizeof(glm::vec3) + sizeof(VertexAttributes)) + (triangleCount * 3 + 3) / 4 * 4;
+}
+
+static void source_stamp(const std::filesystem::path& source, uint64_t& size, int64_t& time)
+{
+	std::error_code ec;
+	size = std::filesystem::file_size(source, ec);
+	time = std::filesystem::last_write_time(source, ec).time_since_epoch().count();
+}
+
+// cluster data appended to fixed size pages
+struct PageWriter {
+	std::vector<std::vector<uint8_t>> pages;
+	size_t used{CLUSTER_PAGE_SIZE};  // of the last page
+
+	// starts a new page unless `bytes` still fit into the current one
+	void reserve(size_t bytes)
+	{
+		if (used + bytes > CLUSTER_PAGE_SIZE) {
+			pages.emplace_back(CLUSTER_PAGE_SIZE, uint8_t(0));
+			used = 0;
+		}
+	}
+	uint32_t page() const { return (uint32_t)pages.size() - 1; }
+};
+
+struct Meshlets {
+	std::vector<meshopt_Meshlet> meshlets;
+	std::vector<uint32_t> vertices;
+	std::vector<uint8_t> triangles;
+};
+
+static Meshlets build_meshlets(std::span<const uint32_t> indices, std::span<const glm::vec3> positions)
+{
+	Meshlets result;
+	size_t bound = meshopt_buildMeshletsBound(indices.size(), CLUSTER_MAX_VERTICES, CLUSTER_MAX_TRIANGLES);
+	result.meshlets.resize(bound);
+	result.vertices.resize(bound * CLUSTER_MAX_VERTICES);
+	result.triangles.resize(bound * CLUSTER_MAX_TRIANGLES * 3);
+	result.meshlets.resize(meshopt_buildMeshlets(result.meshlets.data(), result.vertices.data(),
+		result.triangles.data(), indices.data(), indices.size(), &positions[0].x, positions.size(), sizeof(glm::vec3),
+		CLUSTER_MAX_VERTICES, CLUSTER_MAX_TRIANGLES, 0.f));
+	return result;
+}
+
+static ClusterInfo write_cluster(PageWriter& pages, const Meshlets& meshlets, const meshopt_Meshlet& meshlet,
+	std::span<const glm::vec3> positions, std::span<const VertexAttributes> attributes)
+{
+	size_t bytes = cluster_bytes(meshlet.vertex_count, meshlet.triangle_count);
+	pages.reserve(bytes);
+
+	ClusterInfo info{};
+	info.page = pages.page();
+	info.offset = (uint32_t)pages.used;
+	info.vertexCount = meshlet.vertex_count;
+	info.triangleCount = meshlet.triangle_count;
+
+	const uint32_t* vertices = meshlets.vertices.data() + meshlet.vertex_offset;
+	const uint8_t* triangles = meshlets.triangles.data() + meshlet.triangle_offset;
+	uint8_t* out = pages.pages.back().data() + pages.used;
+	for (uint32_t i = 0; i < meshlet.vertex_count; i++) {
+		std::memcpy(out + i * sizeof(glm::vec3), &positions[vertices[i]], sizeof(glm::vec3));
+	}
+	out += meshlet.vertex_count * sizeof(glm::vec3);
+	for (uint32_t i = 0; i < meshlet.vertex_count; i++) {
+		std::memcpy(out + i * sizeof(VertexAttributes), &attributes[vertices[i]], sizeof(VertexAttributes));
+	}
+	out += meshlet.vertex_count * sizeof(VertexAttributes);
+	std::memcpy(out, triangles, meshlet.triangle_count * 3);
+	pages.used += bytes;
+
+	meshopt_Bounds bounds = meshopt_computeMeshletBounds(vertices, triangles, meshlet.triangle_count,
+		&positions[0].x, positions.size(), sizeof(glm::vec3));
+	info.sphere = glm::vec4(bounds.center[0], bounds.center[1], bounds.center[2], bounds.radius);
+	return info;
+}
+
+// a sphere around spheres, centered on their bounding box
+static glm::vec4 enclosing_sphere(std::span<const ClusterInfo> clusters)
+{
+	glm::vec3 minpos(std::numeric_limits<float>::max());
+	glm::vec3 maxpos(std::numeric_limits<float>::lowest());
+	for (const ClusterInfo& cluster : clusters) {
+		minpos = glm::min(minpos, glm::vec3(cluster.sphere) - cluster.sphere.w);
+		maxpos = glm::max(maxpos, glm::vec3(cluster.sphere) + cluster.sphere.w);
+	}
+	glm::vec3 center = (minpos + maxpos) / 2.f;
+	float radius = 0.f;
+	for (const ClusterInfo& cluster : clusters) {
+		radius = std::max(radius, glm::distance(center, glm::vec3(cluster.sphere)) + cluster.sphere.w);
+	}
+	return glm::vec4(center, radius);
+}
+
+bool build_cluster_file(const std::filesystem::path& source, const std::filesystem::path& path)
+{
+	// groups are simplified on their own, the chain of whole surfaces is not needed
+	MeshLoadOptions options;
+	options.maxLods = 1;
+	options.lodCache = false;
+	std::optional<MeshGeometry> geometry = loadGltfGeometry(source, options);
+	if (!geometry) {
+		return false;
+	}
+	auto start = std::chrono::steady_clock::now();
+
+	PageWriter finePages;
+	PageWriter coarsePages;
+	std::vector<ClusterGroup> groups;
+	std::vector<ClusterInfo> clusters;
+	std::vector<ClusterInfo> coarse;
+
+	// per group scratch, the group's triangles on a compact vertex set
+	std::vector<uint32_t> groupIndices;
+	std::vector<uint32_t> simplified;
+	std::vector<glm::vec3> groupPositions;
+	std::vector<VertexAttributes> groupAttributes;
+	std::vector<uint32_t> remap;
+
+	for (const auto& mesh : geometry->meshes) {
+		for (const GeoSurface& surface : mesh->surfaces) {
+			std::span<const uint32_t> indices(geometry->indices.data() + surface.firstIndex, surface.indexCount);
+			size_t vertexCount = *std::max_element(indices.begin(), indices.end()) + 1;
+			std::span<const glm::vec3> positions(geometry->positions.data() + surface.vertexOffset, vertexCount);
+			std::span<const VertexAttributes> attributes(geometry->attributes.data() + surface.vertexOffset,
+				vertexCount);
+			remap.assign(vertexCount, UINT32_MAX);
+
+			Meshlets meshlets = build_meshlets(indices, positions);
+			for (size_t first = 0; first < meshlets.meshlets.size(); first += CLUSTER_GROUP_SIZE) {
+				std::span<const meshopt_Meshlet> members(meshlets.meshlets.data() + first,
+					std::min<size_t>(CLUSTER_GROUP_SIZE, meshlets.meshlets.size() - first));
+
+				ClusterGroup group{};
+				group.firstCluster = (uint32_t)clusters.size();
+				group.clusterCount = (uint32_t)members.size();
+
+				size_t bytes = 0;
+				for (const meshopt_Meshlet& meshlet : members) {
+					bytes += cluster_bytes(meshlet.vertex_count, meshlet.triangle_count);
+				}
+				finePages.reserve(bytes);
+				group.page = finePages.page();
+
+				groupIndices.clear();
+				groupPositions.clear();
+				groupAttributes.clear();
+				for (const meshopt_Meshlet& meshlet : members) {
+					clusters.push_back(write_cluster(finePages, meshlets, meshlet, positions, attributes));
+					for (uint32_t i = 0; i < meshlet.triangle_count * 3; i++) {
+						uint32_t vertex = meshlets.vertices[meshlet.vertex_offset
+							+ meshlets.triangles[meshlet.triangle_offset + i]];
+						if (remap[vertex] == UINT32_MAX) {
+							remap[vertex] = (uint32_t)groupPositions.size();
+							groupPositions.push_back(positions[vertex]);
+							groupAttributes.push_back(attributes[vertex]);
+						}
+						groupIndices.push_back(remap[vertex]);
+					}
+				}
+				for (const meshopt_Meshlet& meshlet : members) {
+					for (uint32_t i = 0; i < meshlet.vertex_count; i++) {
+						remap[meshlets.vertices[meshlet.vertex_offset + i]] = UINT32_MAX;
+					}
+				}
+				group.sphere = enclosing_sphere(std::span(clusters).subspan(group.firstCluster));
+
+				// a quarter of the triangles, the border stays where the
+				// neighbouring groups expect it
+				float error = 0.f;
+				simplified.resize(groupIndices.size());
+				simplified.resize(meshopt_simplify(simplified.data(), groupIndices.data(), groupIndices.size(),
+					&groupPositions[0].x, groupPositions.size(), sizeof(glm::vec3), groupIndices.size() / 12 * 3,
+					0.1f, meshopt_SimplifyLockBorder, &error));
+				group.error = error * meshopt_simplifyScale(&groupPositions[0].x, groupPositions.size(),
+					sizeof(glm::vec3));
+
+				Meshlets coarseMeshlets = build_meshlets(simplified, groupPositions);
+				group.firstCoarse = (uint32_t)coarse.size();
+				group.coarseCount = (uint32_t)coarseMeshlets.meshlets.size();
+				for (const meshopt_Meshlet& meshlet : coarseMeshlets.meshlets) {
+					coarse.push_back(write_cluster(coarsePages, coarseMeshlets, meshlet, groupPositions,
+						groupAttributes));
+				}
+				groups.push_back(group);
+			}
+		}
+	}
+
+	if (groups.empty()) {
+		spdlog::error("Clusters: nothing to build from {}", source.string());
+		return false;
+	}
+
+	// coarse pages and clusters go after the fine ones
+	ClusterFileHeader header{};
+	header.magic = MAGIC;
+	header.version = VERSION;
+	header.pageSize = CLUSTER_PAGE_SIZE;
+	header.coarsePages = (uint32_t)coarsePages.pages.size();
+	header.pageCount = (uint32_t)(finePages.pages.size() + coarsePages.pages.size());
+	header.groupCount = (uint32_t)groups.size();
+	header.fineClusters = (uint32_t)clusters.size();
+	header.clusterCount = (uint32_t)(clusters.size() + coarse.size());
+	for (ClusterInfo& cluster : coarse) {
+		cluster.page += (uint32_t)finePages.pages.size();
+	}
+	for (ClusterGroup& group : groups) {
+		group.firstCoarse += header.fineClusters;
+	}
+	clusters.insert(clusters.end(), coarse.begin(), coarse.end());
+	header.sphere = enclosing_sphere(clusters);
+	source_stamp(source, header.sourceSize, header.sourceTime);
+
+	size_t metadata = sizeof(header) + groups.size() * sizeof(ClusterGroup) + clusters.size() * sizeof(ClusterInfo);
+	header.pagesOffset = (metadata + CLUSTER_PAGE_SIZE - 1) / CLUSTER_PAGE_SIZE * CLUSTER_PAGE_SIZE;
+
+	std::ofstream file(path, std::ios::binary | std::ios::trunc);
+	file.write((const char*)&header, sizeof(header));
+	file.write((const char*)groups.data(), groups.size() * sizeof(ClusterGroup));
+	file.write((const char*)clusters.data(), clusters.size() * sizeof(ClusterInfo));
+	std::vector<char> padding(header.pagesOffset - metadata, 0);
+	file.write(padding.data(), padding.size());
+	for (const PageWriter* writer : {&finePages, &coarsePages}) {
+		for (const std::vector<uint8_t>& page : writer->pages) {
+			file.write((const char*)page.data(), page.size());
+		}
+	}
+	if (!file) {
+		spdlog::error("Clusters: could not write {}", path.string());
+		return false;
+	}
+
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	spdlog::info("Clusters: {} groups, {} clusters in {} pages ({} MiB, {} coarse pages) built in {:.1f} s",
+		header.groupCount, header.clusterCount, header.pageCount, (uint64_t(header.pageCount) * CLUSTER_PAGE_SIZE) >> 20,
+		header.coarsePages, seconds);
+	return true;
+}
+
+bool cluster_file_current(const std::filesystem::path& source, const std::filesystem::path& path)
+{
+	std::ifstream file(path, std::ios::binary);
+	ClusterFileHeader header{};
+	if (!file.read((char*)&header, sizeof(header))) {
+		return false;
+	}
+	uint64_t size;
+	int64_t time;
+	source_stamp(source, size, time);
+	return header.magic == MAGIC && header.version == VERSION && header.sourceSize == size
+		&& header.sourceTime == time;
+}
+
+bool ClusterFile::open(const std::filesystem::path& path)
+{
+	close();
+
+	std::ifstream file(path, std::ios::binary);
+	if (!file.read((char*)&_header, sizeof(_header)) || _header.magic != MAGIC || _header.version != VERSION
+		|| _header.pageSize != CLUSTER_PAGE_SIZE) {
+		spdlog::error("Clusters: {} is not a version {} cluster file", path.string(), VERSION);
+		return false;
+	}
+	_groups.resize(_header.groupCount);
+	_clusters.resize(_header.clusterCount);
+	file.read((char*)_groups.data(), _groups.size() * sizeof(ClusterGroup));
+	file.read((char*)_clusters.data(), _clusters.size() * sizeof(ClusterInfo));
+	if (!file) {
+		spdlog::error("Clusters: {} is truncated", path.string());
+		return false;
+	}
+
+#if defined(_WIN32)
+	HANDLE handle = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+		FILE_ATTRIBUTE_NORMAL, nullptr);
+	_file = handle == INVALID_HANDLE_VALUE ? -1 : (intptr_t)handle;
+#else
+	_file = ::open(path.c_str(), O_RDONLY);
+#endif
+	if (_file == -1) {
+		spdlog::error("Clusters: could not open {}", path.string());
+		return false;
+	}
+	return true;
+}
+
+void ClusterFile::close()
+{
+	if (_file != -1) {
+#if defined(_WIN32)
+		CloseHandle((HANDLE)_file);
+#else
+		::close((int)_file);
+#endif
+		_file = -1;
+	}
+	_groups.clear();
+	_clusters.clear();
+}
+
+bool ClusterFile::read_page(uint32_t page, uint8_t* out) const
+{
+	uint64_t offset = _header.pagesOffset + uint64_t(page) * CLUSTER_PAGE_SIZE;
+	size_t size = CLUSTER_PAGE_SIZE;
+	while (size > 0) {
+#if defined(_WIN32)
+		OVERLAPPED overlapped{};
+		overlapped.Offset = DWORD(offset);
+		overlapped.OffsetHigh = DWORD(offset >> 32);
+		DWORD read = 0;
+		if (!ReadFile((HANDLE)_file, out, DWORD(size), &read, &overlapped) || read == 0) {
+			return false;
+		}
+#else
+		ssize_t read = pread((int)_file, out, size, (off_t)offset);
+		if (read <= 0) {
+			return false;
+		}
+#endif
+		out += read;
+		size -= read;
+		offset += read;
+	}
+	return true;
+}
@@ -0,0 +1,85 @@
+#include "cpu_features.h"
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#endif
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#elif defined(__linux__)
+#include <unistd.h>
+#endif
+
+static uint32_t detect_l2_cache_bytes()
+{
+	uint64_t bytes = 0;
+#if defined(_WIN32)
+	DWORD length = 0;
+	GetLogicalProcessorInformation(nullptr, &length);
+	std::vector<SYSTEM_LOGICAL_PROCESSOR_INFORMATION> infos(length / sizeof(SYSTEM_LOGICAL_PROCESSOR_INFORMATION));
+	if (!infos.empty() && GetLogicalProcessorInformation(infos.data(), &length)) {
+		for (const auto& info : infos) {
+			if (info.Relationship == RelationCache && info.Cache.Level == 2) {
+				bytes = info.Cache.Size;
+				break;
+			}
+		}
+	}
+#elif defined(__linux__) && defined(_SC_LEVEL2_CACHE_SIZE)
+	long size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+	bytes = size > 0 ? (uint64_t)size : 0;
+#endif
+	// unknown or implausible, assume a common size
+	if (bytes < (64u << 10) || bytes > (64u << 20)) {
+		bytes = 1u << 20;
+	}
+	return (uint32_t)bytes;
+}
+
+static CpuFeatures detect_cpu_features()
+{
+	CpuFeatures features{};
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+	int info[4];
+	__cpuid(info, 0);
+	int maxLeaf = info[0];
+
+	__cpuid(info, 1);
+	features.sse41 = (info[2] & (1 << 19)) != 0;
+	features.fma = (info[2] & (1 << 12)) != 0;
+	bool osxsave = (info[2] & (1 << 27)) != 0;
+
+	// the OS has to save the wide registers on context switches
+	unsigned long long xcr0 = osxsave ? _xgetbv(0) : 0;
+	bool ymm = (xcr0 & 0x6) == 0x6;
+	bool zmm = (xcr0 & 0xe6) == 0xe6;
+
+	if (maxLeaf >= 7) {
+		__cpuidex(info, 7, 0);
+		features.avx2 = ymm && (info[1] & (1 << 5)) != 0;
+		features.avx512f = zmm && (info[1] & (1 << 16)) != 0;
+	}
+	features.fma = features.fma && ymm;
+#elif defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	__builtin_cpu_init();
+	features.sse41 = __builtin_cpu_supports("sse4.1");
+	features.avx2 = __builtin_cpu_supports("avx2");
+	features.fma = __builtin_cpu_supports("fma");
+	features.avx512f = __builtin_cpu_supports("avx512f");
+#endif
+	features.l2CacheBytes = detect_l2_cache_bytes();
+	features.threads = std::max(std::thread::hardware_concurrency(), 1u);
+	return features;
+}
+
+const CpuFeatures& vkutil::cpu_features()
+{
+	static const CpuFeatures features = detect_cpu_features();
+	return features;
+}
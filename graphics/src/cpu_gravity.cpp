@@ -0,0 +1,369 @@
+#include "cpu_gravity.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+
+// nodes of one level per parallel_for chunk
+constexpr size_t NODE_CHUNK = 64;
+
+// child of a level `level` cell that holds `key`, as octant() in shaders/gravity.glsl
+static uint32_t octant(uint32_t key, uint32_t level)
+{
+	return (key >> (3 * (OCTREE_MAX_DEPTH - 1 - level))) & 7u;
+}
+
+static void add_quadrupole(float q[6], float dx, float dy, float dz, float m)
+{
+	float d2 = dx * dx + dy * dy + dz * dz;
+	q[0] += m * (3.f * dx * dx - d2);
+	q[1] += m * (3.f * dx * dy);
+	q[2] += m * (3.f * dx * dz);
+	q[3] += m * (3.f * dy * dy - d2);
+	q[4] += m * (3.f * dy * dz);
+	q[5] += m * (3.f * dz * dz - d2);
+}
+
+void CpuOctree::init(uint32_t capacity, const GravitySettings& settings)
+{
+	_settings = settings;
+	capacity = std::max(capacity, 1u);
+	nodes.resize(std::max(uint32_t(capacity * _settings.nodesPerBody), 1024u));
+	for (std::vector<uint32_t>* v : {&keys, &sortedIndex, &_keysTemp, &_indexTemp}) {
+		v->resize(capacity);
+	}
+	for (std::vector<float>* component : {&x, &y, &z}) {
+		component->resize(capacity);
+	}
+}
+
+void CpuOctree::build(JobPool& jobs, size_t chunk, const float* px, const float* py, const float* pz,
+	uint32_t count)
+{
+	_count = std::min(count, (uint32_t)keys.size());
+	_overflow = 0;
+	size_t chunks = (_count + chunk - 1) / chunk;
+
+	// bounds: one box per chunk, merged serially
+	std::vector<glm::vec3> chunkMin(chunks, glm::vec3(3.4e38f));
+	std::vector<glm::vec3> chunkMax(chunks, glm::vec3(-3.4e38f));
+	jobs.parallel_for(_count, chunk, [&](size_t begin, size_t end) {
+		glm::vec3 lo(3.4e38f), hi(-3.4e38f);
+		for (size_t i = begin; i < end; i++) {
+			glm::vec3 p(px[i], py[i], pz[i]);
+			lo = glm::min(lo, p);
+			hi = glm::max(hi, p);
+		}
+		chunkMin[begin / chunk] = lo;
+		chunkMax[begin / chunk] = hi;
+	});
+	glm::vec3 lo(0.f), hi(0.f);
+	if (_count > 0) {
+		lo = chunkMin[0];
+		hi = chunkMax[0];
+		for (size_t c = 1; c < chunks; c++) {
+			lo = glm::min(lo, chunkMin[c]);
+			hi = glm::max(hi, chunkMax[c]);
+		}
+	}
+	glm::vec3 size = hi - lo;
+	// slightly larger, so the farthest body still quantizes inside
+	_extent = std::max(std::max(size.x, size.y), size.z) * 1.0001f + 1e-6f;
+
+	float scale = 1024.f / _extent;
+	jobs.parallel_for(_count, chunk, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++) {
+			auto quantize = [&](float v, float origin) {
+				return (uint32_t)std::clamp((v - origin) * scale, 0.f, 1023.f);
+			};
+			keys[i] = vkutil::morton3(quantize(px[i], lo.x), quantize(py[i], lo.y), quantize(pz[i], lo.z));
+			sortedIndex[i] = (uint32_t)i;
+		}
+	});
+	sort(jobs, chunk);
+
+	jobs.parallel_for(_count, chunk, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++) {
+			uint32_t body = sortedIndex[i];
+			x[i] = px[body];
+			y[i] = py[body];
+			z[i] = pz[body];
+		}
+	});
+
+	GPUOctreeNode& root = nodes[0];
+	root = {};
+	root.quad1.z = _extent;
+	root.bodyCount = _count;
+	_nodeCount = 1;
+	_levelStart[0] = 0;
+	_levelStart[1] = 1;
+	for (uint32_t level = 0; level < OCTREE_MAX_DEPTH; level++) {
+		split_level(jobs, _levelStart[level], _levelStart[level + 1], level);
+		_levelStart[level + 2] = _nodeCount;
+	}
+
+	for (uint32_t level = OCTREE_LEVELS; level-- > 0;) {
+		multipoles(jobs, _levelStart[level], _levelStart[level + 1]);
+	}
+}
+
+void CpuOctree::sort(JobPool& jobs, size_t chunk)
+{
+	// 30 bit keys, four stable passes of 8 bits that end in keys again
+	constexpr uint32_t bins = 256;
+	size_t chunks = (_count + chunk - 1) / chunk;
+	_histogram.resize(bins * chunks);
+
+	uint32_t* src = keys.data();
+	uint32_t* dst = _keysTemp.data();
+	uint32_t* srcIndex = sortedIndex.data();
+	uint32_t* dstIndex = _indexTemp.data();
+	for (uint32_t shift = 0; shift < 32; shift += 8) {
+		std::fill(_histogram.begin(), _histogram.end(), 0u);
+		jobs.parallel_for(_count, chunk, [&](size_t begin, size_t end) {
+			size_t c = begin / chunk;
+			for (size_t i = begin; i < end; i++) {
+				_histogram[((src[i] >> shift) & (bins - 1)) * chunks + c]++;
+			}
+		});
+
+		uint32_t running = 0;
+		for (uint32_t& offset : _histogram) {
+			uint32_t n = offset;
+			offset = running;
+			running += n;
+		}
+
+		jobs.parallel_for(_count, chunk, [&](size_t begin, size_t end) {
+			size_t c = begin / chunk;
+			for (size_t i = begin; i < end; i++) {
+				uint32_t slot = _histogram[((src[i] >> shift) & (bins - 1)) * chunks + c]++;
+				dst[slot] = src[i];
+				dstIndex[slot] = srcIndex[i];
+			}
+		});
+		std::swap(src, dst);
+		std::swap(srcIndex, dstIndex);
+	}
+}
+
+void CpuOctree::split_level(JobPool& jobs, uint32_t begin, uint32_t end, uint32_t level)
+{
+	// like gravity_build.comp, children are appended through an atomic
+	// counter, so the order of the nodes within a level varies
+	std::atomic<uint32_t> nodeCount{_nodeCount};
+	std::atomic<uint32_t> overflow{0};
+	uint32_t maxNodes = (uint32_t)nodes.size();
+	uint32_t leafSize = std::max(_settings.leafSize, 1u);
+
+	jobs.parallel_for(end - begin, NODE_CHUNK, [&](size_t first, size_t last) {
+		for (size_t n = begin + first; n < begin + last; n++) {
+			GPUOctreeNode& node = nodes[n];
+			if (node.bodyCount <= leafSize) {
+				continue;
+			}
+
+			uint32_t bounds[9];
+			bounds[0] = node.firstBody;
+			bounds[8] = node.firstBody + node.bodyCount;
+			uint32_t children = 0;
+			for (uint32_t digit = 1; digit < 8; digit++) {
+				bounds[digit] = (uint32_t)(std::lower_bound(keys.begin() + bounds[digit - 1], keys.begin() + bounds[8],
+					digit, [&](uint32_t key, uint32_t d) { return octant(key, level) < d; }) - keys.begin());
+			}
+			for (uint32_t digit = 0; digit < 8; digit++) {
+				children += bounds[digit + 1] > bounds[digit] ? 1 : 0;
+			}
+
+			uint32_t base = nodeCount.fetch_add(children, std::memory_order_relaxed);
+			if (base + children > maxNodes) {
+				// stays a leaf, claimed slots below maxNodes become empty nodes
+				overflow.fetch_add(1, std::memory_order_relaxed);
+				for (uint32_t slot = base; slot < maxNodes && slot < base + children; slot++) {
+					nodes[slot] = {};
+				}
+				continue;
+			}
+
+			float size = node.quad1.z * 0.5f;
+			uint32_t child = base;
+			for (uint32_t digit = 0; digit < 8; digit++) {
+				if (bounds[digit + 1] == bounds[digit]) {
+					continue;
+				}
+				GPUOctreeNode& c = nodes[child++];
+				c = {};
+				c.quad1.z = size;
+				c.firstBody = bounds[digit];
+				c.bodyCount = bounds[digit + 1] - bounds[digit];
+			}
+			node.firstChild = base;
+			node.childCount = children;
+		}
+	});
+
+	_nodeCount = std::min(nodeCount.load(), maxNodes);
+	_overflow += overflow.load();
+}
+
+void CpuOctree::multipoles(JobPool& jobs, uint32_t begin, uint32_t end)
+{
+	jobs.parallel_for(end - begin, NODE_CHUNK, [&](size_t first, size_t last) {
+		for (size_t n = begin + first; n < begin + last; n++) {
+			GPUOctreeNode& node = nodes[n];
+			float q[6] = {};
+			glm::vec3 center(0.f);
+			float mass = 0.f;
+
+			if (node.childCount == 0) {
+				mass = (float)node.bodyCount;
+				for (uint32_t i = node.firstBody; i < node.firstBody + node.bodyCount; i++) {
+					center += glm::vec3(x[i], y[i], z[i]);
+				}
+				center /= std::max(mass, 1.f);
+				for (uint32_t i = node.firstBody; i < node.firstBody + node.bodyCount; i++) {
+					add_quadrupole(q, x[i] - center.x, y[i] - center.y, z[i] - center.z, 1.f);
+				}
+			} else {
+				for (uint32_t c = node.firstChild; c < node.firstChild + node.childCount; c++) {
+					center += glm::vec3(nodes[c].centerMass) * nodes[c].centerMass.w;
+					mass += nodes[c].centerMass.w;
+				}
+				center /= std::max(mass, 1.f);
+				for (uint32_t c = node.firstChild; c < node.firstChild + node.childCount; c++) {
+					const GPUOctreeNode& child = nodes[c];
+					q[0] += child.quad0.x;
+					q[1] += child.quad0.y;
+					q[2] += child.quad0.z;
+					q[3] += child.quad0.w;
+					q[4] += child.quad1.x;
+					q[5] += child.quad1.y;
+					glm::vec3 d = glm::vec3(child.centerMass) - center;
+					add_quadrupole(q, d.x, d.y, d.z, child.centerMass.w);
+				}
+			}
+
+			node.centerMass = glm::vec4(center, mass);
+			node.quad0 = glm::vec4(q[0], q[1], q[2], q[3]);
+			node.quad1.x = q[4];
+			node.quad1.y = q[5];
+		}
+	});
+}
+
+void CpuGravitySolver::init(uint32_t capacity, const GravitySettings& settings)
+{
+	_settings = settings;
+	_octree.init(capacity, settings);
+	for (std::vector<float>* component : {&ax, &ay, &az, &potential}) {
+		component->resize(std::max(capacity, 1u));
+	}
+}
+
+void CpuGravitySolver::attach(CpuParticleSystem* particles)
+{
+	_particles = particles;
+	_particles->add_substep_pass([this](float dt) {
+		CpuParticleSet& set = _particles->current();
+		uint32_t count = _particles->alive();
+		solve(_particles->jobs(), _particles->chunk_size(), set.x.data(), set.y.data(), set.z.data(), count);
+		kick(_particles->jobs(), _particles->chunk_size(), set, count, dt);
+	});
+}
+
+void CpuGravitySolver::solve(JobPool& jobs, size_t chunk, const float* px, const float* py, const float* pz,
+	uint32_t count)
+{
+	_octree.build(jobs, chunk, px, py, pz, count);
+
+	const CpuOctree& tree = _octree;
+	float theta2 = _settings.theta * _settings.theta;
+	float softening2 = _settings.softening * _settings.softening;
+	float strength = _settings.strength;
+	std::atomic<uint64_t> total{0};
+
+	// same traversal as gravity_force.comp, bodies in Morton order
+	jobs.parallel_for(tree.count(), chunk, [&](size_t begin, size_t end) {
+		uint64_t chunkInteractions = 0;
+		uint32_t stack[OCTREE_MAX_DEPTH * 8];
+		for (uint32_t i = (uint32_t)begin; i < (uint32_t)end; i++) {
+			glm::vec3 p(tree.x[i], tree.y[i], tree.z[i]);
+			glm::vec3 acc(0.f);
+			float phi = 0.f;
+
+			uint32_t top = 0;
+			stack[top++] = 0;
+			while (top > 0) {
+				const GPUOctreeNode& n = tree.nodes[stack[--top]];
+				if (n.bodyCount == 0) {
+					continue;
+				}
+
+				glm::vec3 r = p - glm::vec3(n.centerMass);
+				float r2 = glm::dot(r, r);
+				bool holdsBody = i >= n.firstBody && i < n.firstBody + n.bodyCount;
+				float size = n.quad1.z;
+				if (!holdsBody && size * size < theta2 * r2) {
+					float inv = 1.f / std::sqrt(r2 + softening2);
+					float inv2 = inv * inv;
+					float inv3 = inv * inv2;
+					float inv5 = inv3 * inv2;
+					glm::vec3 qr(n.quad0.x * r.x + n.quad0.y * r.y + n.quad0.z * r.z,
+						n.quad0.y * r.x + n.quad0.w * r.y + n.quad1.x * r.z,
+						n.quad0.z * r.x + n.quad1.x * r.y + n.quad1.y * r.z);
+					float rqr = glm::dot(r, qr);
+					acc += -n.centerMass.w * inv3 * r + inv5 * qr - 2.5f * rqr * inv5 * inv2 * r;
+					phi += -n.centerMass.w * inv - 0.5f * rqr * inv5;
+					chunkInteractions++;
+				} else if (n.childCount == 0) {
+					for (uint32_t j = n.firstBody; j < n.firstBody + n.bodyCount; j++) {
+						if (j == i) {
+							continue;
+						}
+						glm::vec3 d(tree.x[j] - p.x, tree.y[j] - p.y, tree.z[j] - p.z);
+						float inv = 1.f / std::sqrt(glm::dot(d, d) + softening2);
+						acc += d * (inv * inv * inv);
+						phi -= inv;
+					}
+					chunkInteractions += n.bodyCount - (holdsBody ? 1 : 0);
+				} else if (top + n.childCount <= OCTREE_MAX_DEPTH * 8) {
+					for (uint32_t c = 0; c < n.childCount; c++) {
+						stack[top++] = n.firstChild + c;
+					}
+				}
+			}
+
+			uint32_t body = tree.sortedIndex[i];
+			ax[body] = acc.x * strength;
+			ay[body] = acc.y * strength;
+			az[body] = acc.z * strength;
+			potential[body] = phi * strength;
+		}
+		total.fetch_add(chunkInteractions, std::memory_order_relaxed);
+	});
+	_interactions = total.load();
+}
+
+void CpuGravitySolver::kick(JobPool& jobs, size_t chunk, CpuParticleSet& set, uint32_t count, float dt)
+{
+	count = std::min(count, (uint32_t)ax.size());
+	jobs.parallel_for(count, chunk, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++) {
+			set.vx[i] += ax[i] * dt;
+			set.vy[i] += ay[i] * dt;
+			set.vz[i] += az[i] * dt;
+		}
+	});
+}
+
+void CpuGravitySolver::drift(JobPool& jobs, size_t chunk, CpuParticleSet& set, uint32_t count, float dt)
+{
+	jobs.parallel_for(count, chunk, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++) {
+			set.x[i] += set.vx[i] * dt;
+			set.y[i] += set.vy[i] * dt;
+			set.z[i] += set.vz[i] * dt;
+		}
+	});
+}
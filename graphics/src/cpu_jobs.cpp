@@ -0,0 +1,92 @@
+#include "cpu_jobs.h"
+#include "cpu_features.h"
+
+#include <algorithm>
+
+void JobPool::init(uint32_t threads)
+{
+	if (threads == 0) {
+		threads = vkutil::cpu_features().threads;
+	}
+	_stop = false;
+	for (uint32_t i = 1; i < threads; i++) {
+		_workers.emplace_back([this]() { worker_loop(); });
+	}
+}
+
+void JobPool::cleanup()
+{
+	{
+		std::lock_guard lock{_mutex};
+		_stop = true;
+	}
+	_wake.notify_all();
+	for (std::thread& worker : _workers) {
+		worker.join();
+	}
+	_workers.clear();
+}
+
+void JobPool::run_chunks()
+{
+	for (;;) {
+		size_t begin = _next.fetch_add(_chunk, std::memory_order_relaxed);
+		if (begin >= _count) {
+			return;
+		}
+		(*_job)(begin, std::min(begin + _chunk, _count));
+	}
+}
+
+void JobPool::worker_loop()
+{
+	uint64_t seen = 0;
+	std::unique_lock lock{_mutex};
+	for (;;) {
+		_wake.wait(lock, [&]() { return _stop || _generation != seen; });
+		if (_stop) {
+			return;
+		}
+		seen = _generation;
+
+		// only claims chunks while counted as active, so the caller cannot
+		// return while a chunk is still running here
+		_active++;
+		lock.unlock();
+		run_chunks();
+		lock.lock();
+		if (--_active == 0) {
+			_done.notify_one();
+		}
+	}
+}
+
+void JobPool::parallel_for(size_t count, size_t chunk, const std::function<void(size_t begin, size_t end)>& job)
+{
+	if (count == 0) {
+		return;
+	}
+	chunk = std::max<size_t>(chunk, 1);
+	if (_workers.empty() || count <= chunk) {
+		for (size_t begin = 0; begin < count; begin += chunk) {
+			job(begin, std::min(begin + chunk, count));
+		}
+		return;
+	}
+
+	{
+		std::lock_guard lock{_mutex};
+		_job = &job;
+		_count = count;
+		_chunk = chunk;
+		_next.store(0, std::memory_order_relaxed);
+		_generation++;
+	}
+	_wake.notify_all();
+
+	run_chunks();
+
+	std::unique_lock lock{_mutex};
+	_done.wait(lock, [&]() { return _active == 0; });
+	_job = nullptr;
+}
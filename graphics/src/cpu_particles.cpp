@@ -0,0 +1,384 @@
+#include "cpu_particles.h"
+#include "cpu_features.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include <glm/gtc/packing.hpp>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define PARTICLES_SIMD_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#define TARGET_AVX512 __attribute__((target("avx512f")))
+#else
+#define TARGET_AVX2
+#define TARGET_AVX512
+#endif
+
+// BOUNCE in shaders/particle_integrate.comp
+static constexpr float groundBounce = 0.5f;
+
+uint32_t vkutil::pcg_hash(uint32_t v)
+{
+	uint32_t state = v * 747796405u + 2891336453u;
+	uint32_t word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+	return (word >> 22u) ^ word;
+}
+
+float vkutil::random01(uint32_t& rng)
+{
+	rng = pcg_hash(rng);
+	return float(rng) / 4294967295.f;
+}
+
+void CpuParticleSet::resize(size_t count)
+{
+	for (std::vector<float>* component : {&x, &y, &z, &age, &vx, &vy, &vz, &lifetime}) {
+		component->resize(count);
+	}
+	color.resize(count);
+}
+
+void CpuParticleSet::to_gpu(size_t count, glm::vec4* positions, glm::vec4* velocities, uint32_t* colors) const
+{
+	for (size_t i = 0; i < count; i++) {
+		positions[i] = glm::vec4(x[i], y[i], z[i], age[i]);
+		velocities[i] = glm::vec4(vx[i], vy[i], vz[i], lifetime[i]);
+		colors[i] = color[i];
+	}
+}
+
+void CpuParticleSet::from_gpu(size_t count, const glm::vec4* positions, const glm::vec4* velocities,
+	const uint32_t* colors)
+{
+	for (size_t i = 0; i < count; i++) {
+		x[i] = positions[i].x;
+		y[i] = positions[i].y;
+		z[i] = positions[i].z;
+		age[i] = positions[i].w;
+		vx[i] = velocities[i].x;
+		vy[i] = velocities[i].y;
+		vz[i] = velocities[i].z;
+		lifetime[i] = velocities[i].w;
+		color[i] = colors[i];
+	}
+}
+
+struct IntegrateConstants {
+	float dt;
+	float gravity;
+	float damping;  // velocity scale from the drag over one step
+};
+
+// Same operations in the same order as particle_integrate.comp, so the
+// results agree up to the rounding of the GPU. Every particle is advanced,
+// the dead ones are dropped by the compaction afterwards.
+static void integrate_scalar(CpuParticleSet& s, size_t begin, size_t end, const IntegrateConstants& c,
+	uint8_t* keep)
+{
+	for (size_t i = begin; i < end; i++) {
+		s.age[i] += c.dt;
+		keep[i] = s.age[i] < s.lifetime[i];
+
+		float vx = s.vx[i] * c.damping;
+		float vy = (s.vy[i] + c.gravity * c.dt) * c.damping;
+		float vz = s.vz[i] * c.damping;
+		float px = s.x[i] + vx * c.dt;
+		float py = s.y[i] + vy * c.dt;
+		float pz = s.z[i] + vz * c.dt;
+		if (py < 0.f) {
+			py = -py * groundBounce;
+			vy = -vy * groundBounce;
+		}
+		s.x[i] = px;
+		s.y[i] = py;
+		s.z[i] = pz;
+		s.vx[i] = vx;
+		s.vy[i] = vy;
+		s.vz[i] = vz;
+	}
+}
+
+#ifdef PARTICLES_SIMD_X86
+// Returns the end of the processed range, the rest is left for the scalar loop.
+TARGET_AVX2 static size_t integrate_avx2(CpuParticleSet& s, size_t begin, size_t end, const IntegrateConstants& c,
+	uint8_t* keep)
+{
+	const __m256 dt = _mm256_set1_ps(c.dt);
+	const __m256 gravityStep = _mm256_set1_ps(c.gravity * c.dt);
+	const __m256 damping = _mm256_set1_ps(c.damping);
+	const __m256 bounce = _mm256_set1_ps(-groundBounce);
+	const __m256 zero = _mm256_setzero_ps();
+
+	size_t i = begin;
+	for (; i + 8 <= end; i += 8) {
+		__m256 age = _mm256_add_ps(_mm256_loadu_ps(&s.age[i]), dt);
+		uint32_t alive = (uint32_t)_mm256_movemask_ps(_mm256_cmp_ps(age, _mm256_loadu_ps(&s.lifetime[i]), _CMP_LT_OQ));
+
+		__m256 vx = _mm256_mul_ps(_mm256_loadu_ps(&s.vx[i]), damping);
+		__m256 vy = _mm256_mul_ps(_mm256_add_ps(_mm256_loadu_ps(&s.vy[i]), gravityStep), damping);
+		__m256 vz = _mm256_mul_ps(_mm256_loadu_ps(&s.vz[i]), damping);
+		__m256 px = _mm256_add_ps(_mm256_loadu_ps(&s.x[i]), _mm256_mul_ps(vx, dt));
+		__m256 py = _mm256_add_ps(_mm256_loadu_ps(&s.y[i]), _mm256_mul_ps(vy, dt));
+		__m256 pz = _mm256_add_ps(_mm256_loadu_ps(&s.z[i]), _mm256_mul_ps(vz, dt));
+
+		__m256 below = _mm256_cmp_ps(py, zero, _CMP_LT_OQ);
+		py = _mm256_blendv_ps(py, _mm256_mul_ps(py, bounce), below);
+		vy = _mm256_blendv_ps(vy, _mm256_mul_ps(vy, bounce), below);
+
+		_mm256_storeu_ps(&s.age[i], age);
+		_mm256_storeu_ps(&s.x[i], px);
+		_mm256_storeu_ps(&s.y[i], py);
+		_mm256_storeu_ps(&s.z[i], pz);
+		_mm256_storeu_ps(&s.vx[i], vx);
+		_mm256_storeu_ps(&s.vy[i], vy);
+		_mm256_storeu_ps(&s.vz[i], vz);
+		for (int lane = 0; lane < 8; lane++) {
+			keep[i + lane] = (alive >> lane) & 1;
+		}
+	}
+	return i;
+}
+
+TARGET_AVX512 static size_t integrate_avx512(CpuParticleSet& s, size_t begin, size_t end,
+	const IntegrateConstants& c, uint8_t* keep)
+{
+	const __m512 dt = _mm512_set1_ps(c.dt);
+	const __m512 gravityStep = _mm512_set1_ps(c.gravity * c.dt);
+	const __m512 damping = _mm512_set1_ps(c.damping);
+	const __m512 bounce = _mm512_set1_ps(-groundBounce);
+	const __m512 zero = _mm512_setzero_ps();
+
+	size_t i = begin;
+	for (; i + 16 <= end; i += 16) {
+		__m512 age = _mm512_add_ps(_mm512_loadu_ps(&s.age[i]), dt);
+		__mmask16 alive = _mm512_cmp_ps_mask(age, _mm512_loadu_ps(&s.lifetime[i]), _CMP_LT_OQ);
+
+		__m512 vx = _mm512_mul_ps(_mm512_loadu_ps(&s.vx[i]), damping);
+		__m512 vy = _mm512_mul_ps(_mm512_add_ps(_mm512_loadu_ps(&s.vy[i]), gravityStep), damping);
+		__m512 vz = _mm512_mul_ps(_mm512_loadu_ps(&s.vz[i]), damping);
+		__m512 px = _mm512_add_ps(_mm512_loadu_ps(&s.x[i]), _mm512_mul_ps(vx, dt));
+		__m512 py = _mm512_add_ps(_mm512_loadu_ps(&s.y[i]), _mm512_mul_ps(vy, dt));
+		__m512 pz = _mm512_add_ps(_mm512_loadu_ps(&s.z[i]), _mm512_mul_ps(vz, dt));
+
+		__mmask16 below = _mm512_cmp_ps_mask(py, zero, _CMP_LT_OQ);
+		py = _mm512_mask_mul_ps(py, below, py, bounce);
+		vy = _mm512_mask_mul_ps(vy, below, vy, bounce);
+
+		_mm512_storeu_ps(&s.age[i], age);
+		_mm512_storeu_ps(&s.x[i], px);
+		_mm512_storeu_ps(&s.y[i], py);
+		_mm512_storeu_ps(&s.z[i], pz);
+		_mm512_storeu_ps(&s.vx[i], vx);
+		_mm512_storeu_ps(&s.vy[i], vy);
+		_mm512_storeu_ps(&s.vz[i], vz);
+		// one byte per lane, straight from the mask
+		_mm_storeu_si128((__m128i*)&keep[i], _mm512_cvtepi32_epi8(_mm512_maskz_set1_epi32(alive, 1)));
+	}
+	return i;
+}
+#endif
+
+static void integrate(CpuParticleSet& s, size_t begin, size_t end, const IntegrateConstants& c, uint8_t* keep)
+{
+#ifdef PARTICLES_SIMD_X86
+	const CpuFeatures& features = vkutil::cpu_features();
+	if (features.avx512f) {
+		begin = integrate_avx512(s, begin, end, c, keep);
+	} else if (features.avx2) {
+		begin = integrate_avx2(s, begin, end, c, keep);
+	}
+#endif
+	integrate_scalar(s, begin, end, c, keep);
+}
+
+void CpuParticleSystem::init(const ParticleSettings& settings, uint32_t threads)
+{
+	_settings = settings;
+	if (_settings.emitRate <= 0.f) {
+		_settings.emitRate = _settings.capacity / _settings.lifetime;
+	}
+	_settings.substeps = std::max(_settings.substeps, 1u);
+
+	for (CpuParticleSet& set : _sets) {
+		set.resize(_settings.capacity);
+	}
+	_keep.resize(_settings.capacity);
+	_current = 0;
+	_alive = 0;
+
+	_jobs.init(threads);
+
+	// the integrator streams 32 bytes per particle in and out plus the flag,
+	// half of L2 leaves room for the other thread of the core
+	const CpuFeatures& features = vkutil::cpu_features();
+	_chunk = std::max<size_t>(features.l2CacheBytes / 2 / 68, 1024) & ~size_t(63);
+	_chunkOffsets.resize(_settings.capacity / _chunk + 2);
+
+	const char* simd = features.avx512f ? "AVX-512" : features.avx2 ? "AVX2" : "scalar";
+	spdlog::info("CPU particle system: {} particles per set, {} threads, {} path, {} particles per chunk",
+		_settings.capacity, _jobs.size(), simd, _chunk);
+}
+
+void CpuParticleSystem::cleanup()
+{
+	_jobs.cleanup();
+}
+
+void CpuParticleSystem::add_substep_pass(std::function<void(float dt)>&& pass)
+{
+	_substepPasses.push_back(std::move(pass));
+}
+
+void CpuParticleSystem::simulate(float deltaSeconds)
+{
+	auto start = std::chrono::steady_clock::now();
+
+	// same clamp and emission bookkeeping as ParticleSystem::simulate
+	float dt = std::min(deltaSeconds, 1.f / 30.f) / _settings.substeps;
+	uint64_t integrated = 0;
+	for (uint32_t step = 0; step < _settings.substeps; step++) {
+		_emitAccumulator += _settings.emitRate * dt;
+		float emitted = std::floor(_emitAccumulator);
+		_emitAccumulator -= emitted;
+		uint32_t emitCount = std::min((uint32_t)emitted, _settings.capacity);
+		_seed++;
+
+		integrated += _alive;
+		substep(dt, emitCount);
+
+		for (auto& pass : _substepPasses) {
+			pass(dt);
+		}
+	}
+
+	auto now = std::chrono::steady_clock::now();
+	_stats.alive = _alive;
+	_stats.integrated = integrated;
+	_stats.gpuMilliseconds = std::chrono::duration<double, std::milli>(now - start).count();
+	_stats.particlesPerSecond = double(integrated) / (_stats.gpuMilliseconds / 1e3);
+
+	if (now - _lastReport > std::chrono::seconds(1)) {
+		_lastReport = now;
+		spdlog::info("CPU particles: {} alive, {:.3f} ms, {:.1f} M particles/s", _stats.alive,
+			_stats.gpuMilliseconds, _stats.particlesPerSecond / 1e6);
+	}
+}
+
+void CpuParticleSystem::substep(float dt, uint32_t emitCount)
+{
+	CpuParticleSet& src = _sets[_current];
+	CpuParticleSet& dst = _sets[1 - _current];
+	size_t count = _alive;
+	size_t chunks = (count + _chunk - 1) / _chunk;
+
+	IntegrateConstants constants{};
+	constants.dt = dt;
+	constants.gravity = _settings.gravity;
+	constants.damping = std::max(1.f - _settings.drag * dt, 0.f);
+
+	// integrate in place and count the survivors of every chunk
+	_jobs.parallel_for(count, _chunk, [&](size_t begin, size_t end) {
+		integrate(src, begin, end, constants, _keep.data());
+		uint32_t survivors = 0;
+		for (size_t i = begin; i < end; i++) {
+			survivors += _keep[i];
+		}
+		_chunkOffsets[begin / _chunk] = survivors;
+	});
+
+	uint32_t survivors = 0;
+	for (size_t c = 0; c < chunks; c++) {
+		uint32_t chunkSurvivors = _chunkOffsets[c];
+		_chunkOffsets[c] = survivors;
+		survivors += chunkSurvivors;
+	}
+
+	// stable compaction into the other set
+	_jobs.parallel_for(count, _chunk, [&](size_t begin, size_t end) {
+		size_t out = _chunkOffsets[begin / _chunk];
+		for (size_t i = begin; i < end; i++) {
+			if (!_keep[i]) {
+				continue;
+			}
+			dst.x[out] = src.x[i];
+			dst.y[out] = src.y[i];
+			dst.z[out] = src.z[i];
+			dst.age[out] = src.age[i];
+			dst.vx[out] = src.vx[i];
+			dst.vy[out] = src.vy[i];
+			dst.vz[out] = src.vz[i];
+			dst.lifetime[out] = src.lifetime[i];
+			dst.color[out] = src.color[i];
+			out++;
+		}
+	});
+
+	// particles past the capacity are dropped, like on the GPU
+	uint32_t emitted = std::min(emitCount, _settings.capacity - survivors);
+	emit(dst, survivors, emitted, _seed);
+
+	_alive = survivors + emitted;
+	_current = 1 - _current;
+}
+
+void CpuParticleSystem::emit(CpuParticleSet& set, uint32_t first, uint32_t count, uint32_t seed)
+{
+	const ParticleSettings& s = _settings;
+	const float tau = 6.2831853f;
+
+	// the same random stream per emitted index as particle_emit.comp
+	_jobs.parallel_for(count, _chunk, [&](size_t begin, size_t end) {
+		for (size_t id = begin; id < end; id++) {
+			uint32_t rng = vkutil::pcg_hash(seed ^ vkutil::pcg_hash((uint32_t)id));
+
+			glm::vec3 offset;
+			do {
+				float ox = vkutil::random01(rng);
+				float oy = vkutil::random01(rng);
+				float oz = vkutil::random01(rng);
+				offset = glm::vec3(ox, oy, oz) * 2.f - 1.f;
+			} while (glm::dot(offset, offset) > 1.f);
+
+			float angle = vkutil::random01(rng) * tau;
+			float spread = vkutil::random01(rng) * 0.35f;
+			glm::vec3 direction = glm::normalize(glm::vec3(std::cos(angle) * spread, 1.f, std::sin(angle) * spread));
+			float speed = s.initialSpeed * (0.75f + 0.5f * vkutil::random01(rng));
+			float lifetime = s.lifetime * (0.5f + vkutil::random01(rng));
+
+			float hue = vkutil::random01(rng);
+			glm::vec3 color = 0.5f + 0.5f * glm::cos(tau * (hue + glm::vec3(0.f, 0.33f, 0.67f)));
+
+			size_t slot = first + id;
+			glm::vec3 position = s.emitterPosition + offset * s.emitterRadius;
+			glm::vec3 velocity = direction * speed;
+			set.x[slot] = position.x;
+			set.y[slot] = position.y;
+			set.z[slot] = position.z;
+			set.age[slot] = 0.f;
+			set.vx[slot] = velocity.x;
+			set.vy[slot] = velocity.y;
+			set.vz[slot] = velocity.z;
+			set.lifetime[slot] = lifetime;
+			set.color[slot] = glm::packUnorm4x8(glm::vec4(color, 1.f));
+		}
+	});
+}
+
+void CpuParticleSystem::spawn(uint32_t count)
+{
+	uint32_t emitted = std::min(count, _settings.capacity - _alive);
+	emit(_sets[_current], _alive, emitted, ++_seed);
+	_alive += emitted;
+}
+
+void CpuParticleSystem::load(const glm::vec4* positions, const glm::vec4* velocities, const uint32_t* colors,
+	uint32_t count)
+{
+	_alive = std::min(count, _settings.capacity);
+	_sets[_current].from_gpu(_alive, positions, velocities, colors);
+}
@@ -0,0 +1,265 @@
+#include "cpu_sph.h"
+#include "cpu_features.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+
+#include <glm/gtc/constants.hpp>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define SPH_SIMD_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#define TARGET_AVX512 __attribute__((target("avx512f")))
+#else
+#define TARGET_AVX2
+#define TARGET_AVX512
+#endif
+
+static uint32_t next_pow2(uint32_t v)
+{
+	uint32_t r = 1;
+	while (r < v) {
+		r *= 2;
+	}
+	return r;
+}
+
+void CpuNeighborGrid::init(uint32_t capacity, float cellSize)
+{
+	_cellSize = cellSize;
+	// same table size as NeighborGrid, so both hash into the same entries
+	_tableSize = std::max(next_pow2(capacity), 1024u);
+
+	cellCount.resize(_tableSize);
+	cellStart.resize(_tableSize);
+	sortedIndex.resize(capacity);
+	for (std::vector<float>* component : {&x, &y, &z, &vx, &vy, &vz}) {
+		component->resize(capacity);
+	}
+	_particleCell.resize(capacity);
+	_particleRank.resize(capacity);
+}
+
+void CpuNeighborGrid::build(JobPool& jobs, size_t chunk, const CpuParticleSet& set, uint32_t count)
+{
+	_count = count;
+	std::fill(cellCount.begin(), cellCount.end(), 0u);
+
+	// like grid_hash.comp the rank comes from an atomic increment, so the
+	// order inside a cell depends on the thread timing
+	jobs.parallel_for(count, chunk, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++) {
+			uint32_t hash = vkutil::cell_hash((int32_t)std::floor(set.x[i] / _cellSize),
+				(int32_t)std::floor(set.y[i] / _cellSize), (int32_t)std::floor(set.z[i] / _cellSize), _tableSize);
+			_particleCell[i] = hash;
+			_particleRank[i] = std::atomic_ref<uint32_t>(cellCount[hash]).fetch_add(1, std::memory_order_relaxed);
+		}
+	});
+
+	// one table entry costs a single add, a serial scan keeps up with the
+	// parallel passes around it
+	uint32_t running = 0;
+	for (uint32_t i = 0; i < _tableSize; i++) {
+		cellStart[i] = running;
+		running += cellCount[i];
+	}
+
+	jobs.parallel_for(count, chunk, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++) {
+			uint32_t slot = cellStart[_particleCell[i]] + _particleRank[i];
+			sortedIndex[slot] = (uint32_t)i;
+			x[slot] = set.x[i];
+			y[slot] = set.y[i];
+			z[slot] = set.z[i];
+			vx[slot] = set.vx[i];
+			vy[slot] = set.vy[i];
+			vz[slot] = set.vz[i];
+		}
+	});
+}
+
+// Sum of (h^2 - r^2)^3 over the sorted particles [start, end) within h of p,
+// the inner loop of sph_density.comp.
+static float density_sum_scalar(const CpuNeighborGrid& g, uint32_t start, uint32_t end, float px, float py,
+	float pz, float h2)
+{
+	float sum = 0.f;
+	for (uint32_t j = start; j < end; j++) {
+		float dx = px - g.x[j];
+		float dy = py - g.y[j];
+		float dz = pz - g.z[j];
+		float r2 = dx * dx + dy * dy + dz * dz;
+		if (r2 < h2) {
+			float w = h2 - r2;
+			sum += w * w * w;
+		}
+	}
+	return sum;
+}
+
+#ifdef SPH_SIMD_X86
+TARGET_AVX2 static float density_sum_avx2(const CpuNeighborGrid& g, uint32_t start, uint32_t end, float px,
+	float py, float pz, float h2)
+{
+	const __m256 x = _mm256_set1_ps(px);
+	const __m256 y = _mm256_set1_ps(py);
+	const __m256 z = _mm256_set1_ps(pz);
+	const __m256 radius2 = _mm256_set1_ps(h2);
+	__m256 sum = _mm256_setzero_ps();
+
+	uint32_t j = start;
+	for (; j + 8 <= end; j += 8) {
+		__m256 dx = _mm256_sub_ps(x, _mm256_loadu_ps(&g.x[j]));
+		__m256 dy = _mm256_sub_ps(y, _mm256_loadu_ps(&g.y[j]));
+		__m256 dz = _mm256_sub_ps(z, _mm256_loadu_ps(&g.z[j]));
+		__m256 r2 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)), _mm256_mul_ps(dz, dz));
+		__m256 w = _mm256_sub_ps(radius2, r2);
+		__m256 inside = _mm256_cmp_ps(r2, radius2, _CMP_LT_OQ);
+		sum = _mm256_add_ps(sum, _mm256_and_ps(inside, _mm256_mul_ps(_mm256_mul_ps(w, w), w)));
+	}
+
+	__m128 half = _mm_add_ps(_mm256_castps256_ps128(sum), _mm256_extractf128_ps(sum, 1));
+	half = _mm_add_ps(half, _mm_movehl_ps(half, half));
+	half = _mm_add_ss(half, _mm_movehdup_ps(half));
+	return _mm_cvtss_f32(half) + density_sum_scalar(g, j, end, px, py, pz, h2);
+}
+
+TARGET_AVX512 static float density_sum_avx512(const CpuNeighborGrid& g, uint32_t start, uint32_t end, float px,
+	float py, float pz, float h2)
+{
+	const __m512 x = _mm512_set1_ps(px);
+	const __m512 y = _mm512_set1_ps(py);
+	const __m512 z = _mm512_set1_ps(pz);
+	const __m512 radius2 = _mm512_set1_ps(h2);
+	__m512 sum = _mm512_setzero_ps();
+
+	// the ragged tail of every cell is handled with a masked load instead of
+	// a scalar loop, cells are usually shorter than a register
+	for (uint32_t j = start; j < end; j += 16) {
+		__mmask16 lanes = (__mmask16)(end - j >= 16 ? 0xffffu : (1u << (end - j)) - 1u);
+		__m512 dx = _mm512_sub_ps(x, _mm512_maskz_loadu_ps(lanes, &g.x[j]));
+		__m512 dy = _mm512_sub_ps(y, _mm512_maskz_loadu_ps(lanes, &g.y[j]));
+		__m512 dz = _mm512_sub_ps(z, _mm512_maskz_loadu_ps(lanes, &g.z[j]));
+		__m512 r2 = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(dx, dx), _mm512_mul_ps(dy, dy)), _mm512_mul_ps(dz, dz));
+		__m512 w = _mm512_sub_ps(radius2, r2);
+		__mmask16 inside = _mm512_mask_cmp_ps_mask(lanes, r2, radius2, _CMP_LT_OQ);
+		sum = _mm512_mask_add_ps(sum, inside, sum, _mm512_mul_ps(_mm512_mul_ps(w, w), w));
+	}
+	return _mm512_reduce_add_ps(sum);
+}
+#endif
+
+static float density_sum(const CpuNeighborGrid& g, uint32_t start, uint32_t end, float px, float py, float pz,
+	float h2)
+{
+#ifdef SPH_SIMD_X86
+	const CpuFeatures& features = vkutil::cpu_features();
+	if (features.avx512f) {
+		return density_sum_avx512(g, start, end, px, py, pz, h2);
+	}
+	if (features.avx2) {
+		return density_sum_avx2(g, start, end, px, py, pz, h2);
+	}
+#endif
+	return density_sum_scalar(g, start, end, px, py, pz, h2);
+}
+
+void CpuSphSolver::init(CpuParticleSystem* particles, const SphSettings& settings)
+{
+	_particles = particles;
+	_settings = settings;
+
+	uint32_t capacity = _particles->settings().capacity;
+	_grid.init(capacity, _settings.smoothingRadius);
+	_density.resize(capacity);
+	_pressure.resize(capacity);
+
+	_particles->add_substep_pass([this](float dt) { step(dt); });
+}
+
+void CpuSphSolver::step(float dt)
+{
+	CpuParticleSet& set = _particles->current();
+	JobPool& jobs = _particles->jobs();
+	size_t chunk = _particles->chunk_size();
+	uint32_t count = _particles->alive();
+	_grid.build(jobs, chunk, set, count);
+
+	const float h = _settings.smoothingRadius;
+	const float h2 = h * h;
+	const float pi = glm::pi<float>();
+	const float mass = _settings.particleMass;
+	const float poly6 = 315.f / (64.f * pi * std::pow(h, 9.f));
+	const float spikyGradient = -45.f / (pi * std::pow(h, 6.f));
+	const float viscosityLaplacian = 45.f / (pi * std::pow(h, 6.f));
+	const CpuNeighborGrid& g = _grid;
+	const uint32_t tableSize = g.table_size();
+
+	auto for_each_neighbor_cell = [&](uint32_t i, auto&& visit) {
+		int32_t cx = (int32_t)std::floor(g.x[i] / h);
+		int32_t cy = (int32_t)std::floor(g.y[i] / h);
+		int32_t cz = (int32_t)std::floor(g.z[i] / h);
+		for (int32_t dz = -1; dz <= 1; dz++) {
+			for (int32_t dy = -1; dy <= 1; dy++) {
+				for (int32_t dx = -1; dx <= 1; dx++) {
+					uint32_t hash = vkutil::cell_hash(cx + dx, cy + dy, cz + dz, tableSize);
+					uint32_t start = g.cellStart[hash];
+					visit(start, start + g.cellCount[hash]);
+				}
+			}
+		}
+	};
+
+	jobs.parallel_for(count, chunk, [&](size_t begin, size_t end) {
+		for (uint32_t i = (uint32_t)begin; i < end; i++) {
+			float density = 0.f;
+			for_each_neighbor_cell(i, [&](uint32_t start, uint32_t stop) {
+				density += density_sum(g, start, stop, g.x[i], g.y[i], g.z[i], h2);
+			});
+			density *= mass * poly6;
+			_density[i] = density;
+			_pressure[i] = std::max(_settings.stiffness * (density - _settings.restDensity), 0.f);
+		}
+	});
+
+	// the force gathers per neighbor fluid values and writes back through
+	// sortedIndex, which leaves little for SIMD
+	jobs.parallel_for(count, chunk, [&](size_t begin, size_t end) {
+		for (uint32_t i = (uint32_t)begin; i < end; i++) {
+			if (_density[i] <= 0.f) {
+				continue;
+			}
+			glm::vec3 position{g.x[i], g.y[i], g.z[i]};
+			glm::vec3 velocity{g.vx[i], g.vy[i], g.vz[i]};
+			glm::vec3 pressureForce{0.f};
+			glm::vec3 viscosityForce{0.f};
+
+			for_each_neighbor_cell(i, [&](uint32_t start, uint32_t stop) {
+				for (uint32_t j = start; j < stop; j++) {
+					glm::vec3 d = position - glm::vec3(g.x[j], g.y[j], g.z[j]);
+					float r = std::sqrt(glm::dot(d, d));
+					if (j == i || r >= h || r <= 1e-6f) {
+						continue;
+					}
+					float w = h - r;
+					pressureForce -= (d / r) * mass * (_pressure[i] + _pressure[j]) / (2.f * _density[j])
+						* spikyGradient * w * w;
+					viscosityForce += mass * (glm::vec3(g.vx[j], g.vy[j], g.vz[j]) - velocity) / _density[j]
+						* viscosityLaplacian * w;
+				}
+			});
+
+			glm::vec3 acceleration = (pressureForce + _settings.viscosity * viscosityForce) / _density[i];
+			glm::vec3 result = velocity + acceleration * dt;
+			uint32_t original = g.sortedIndex[i];
+			set.vx[original] = result.x;
+			set.vy[original] = result.y;
+			set.vz[original] = result.z;
+		}
+	});
+}
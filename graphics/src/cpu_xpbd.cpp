@@ -0,0 +1,167 @@
+#include "cpu_xpbd.h"
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+
+// as MAX_COLORING_ROUNDS in vk_xpbd.cpp
+constexpr uint32_t MAX_COLORING_ROUNDS = 256;
+
+void CpuXpbdSolver::init(XpbdModel model, const XpbdSettings& settings, const MeshBvh* collider)
+{
+	_model = std::move(model);
+	_settings = settings;
+	_settings.substeps = std::max(_settings.substeps, 1u);
+	_settings.iterations = std::max(_settings.iterations, 1u);
+	_collider = collider && !collider->empty() ? collider : nullptr;
+
+	_positions = _model.positions;
+	_previous.assign(_positions.size(), glm::vec4(0.f));
+	_velocities.assign(_positions.size(), glm::vec3(0.f));
+	_lambdas.assign(_model.constraints.size(), 0.f);
+}
+
+void CpuXpbdSolver::step(JobPool& jobs, size_t chunk, float dt)
+{
+	size_t particles = _positions.size();
+	if (particles == 0 || dt <= 0.f) {
+		return;
+	}
+	const float h = dt / _settings.substeps;
+
+	for (uint32_t substep = 0; substep < _settings.substeps; substep++) {
+		jobs.parallel_for(particles, chunk, [&](size_t begin, size_t end) {
+			for (size_t i = begin; i < end; i++) {
+				glm::vec4 x = _positions[i];
+				_previous[i] = x;
+				if (x.w == 0.f) {
+					continue;
+				}
+				glm::vec3 v = _velocities[i] + _settings.gravity * h;
+				v *= std::max(1.f - _settings.damping * h, 0.f);
+				_velocities[i] = v;
+				_positions[i] = glm::vec4(glm::vec3(x) + v * h, x.w);
+			}
+		});
+
+		for (uint32_t iteration = 0; iteration < _settings.iterations; iteration++) {
+			for (uint32_t color = 0; color < _model.color_count(); color++) {
+				uint32_t first = _model.batchStart[color];
+				uint32_t count = _model.batchStart[color + 1] - first;
+				jobs.parallel_for(count, chunk, [&](size_t begin, size_t end) {
+					for (size_t c = first + begin; c < first + end; c++) {
+						const XpbdConstraint& constraint = _model.constraints[c];
+						glm::vec4& pa = _positions[constraint.a];
+						glm::vec4& pb = _positions[constraint.b];
+						float w = pa.w + pb.w;
+						glm::vec3 d = glm::vec3(pa) - glm::vec3(pb);
+						float len = glm::length(d);
+						if (w == 0.f || len < 1e-7f) {
+							if (iteration == 0) {
+								_lambdas[c] = 0.f;
+							}
+							continue;
+						}
+
+						float alpha = constraint.compliance / (h * h);
+						float lambda = iteration == 0 ? 0.f : _lambdas[c];
+						float dLambda = (-(len - constraint.restLength) - alpha * lambda) / (w + alpha);
+						_lambdas[c] = lambda + dLambda;
+
+						glm::vec3 n = d / len;
+						pa = glm::vec4(glm::vec3(pa) + pa.w * dLambda * n, pa.w);
+						pb = glm::vec4(glm::vec3(pb) - pb.w * dLambda * n, pb.w);
+					}
+				});
+			}
+		}
+
+		jobs.parallel_for(particles, chunk, [&](size_t begin, size_t end) {
+			for (size_t i = begin; i < end; i++) {
+				glm::vec4 x = _positions[i];
+				if (x.w == 0.f) {
+					continue;
+				}
+				glm::vec3 previous(_previous[i]);
+				glm::vec3 p(x);
+
+				glm::vec3 q, faceNormal;
+				float reach = _settings.thickness + glm::length(p - previous);
+				if (_collider && _collider->closest_point(p, reach, q, faceNormal)) {
+					glm::vec3 offset = p - q;
+					float distance = glm::length(offset);
+					bool behind = glm::dot(offset, faceNormal) < 0.f;
+					if (behind || distance < _settings.thickness) {
+						glm::vec3 n = behind || distance < 1e-7f ? faceNormal : offset / distance;
+						p = q + n * _settings.thickness;
+						glm::vec3 moved = p - previous;
+						p -= _settings.friction * (moved - glm::dot(moved, n) * n);
+						_positions[i] = glm::vec4(p, x.w);
+					}
+				}
+				_velocities[i] = (p - previous) / h;
+			}
+		});
+	}
+}
+
+std::vector<uint32_t> vkutil::color_constraints(JobPool& jobs, size_t chunk, const XpbdModel& model,
+	const XpbdAdjacency& adjacency, uint32_t* rounds)
+{
+	size_t count = model.constraints.size();
+	std::vector<uint32_t> colors(count, XPBD_UNCOLORED);
+	std::vector<uint32_t> tentative(count, XPBD_UNCOLORED);
+
+	std::atomic<uint32_t> uncolored{(uint32_t)count};
+	uint32_t round = 0;
+	while (uncolored.load() > 0 && round < MAX_COLORING_ROUNDS) {
+		uncolored = 0;
+		jobs.parallel_for(count, chunk, [&](size_t begin, size_t end) {
+			for (size_t c = begin; c < end; c++) {
+				if (colors[c] != XPBD_UNCOLORED) {
+					tentative[c] = XPBD_UNCOLORED;
+					continue;
+				}
+				uint64_t used = 0;
+				for (uint32_t p : {model.constraints[c].a, model.constraints[c].b}) {
+					for (uint32_t i = adjacency.start[p]; i < adjacency.start[p + 1]; i++) {
+						uint32_t color = colors[adjacency.constraints[i]];
+						if (color < XPBD_MAX_COLORS) {
+							used |= uint64_t(1) << color;
+						}
+					}
+				}
+				tentative[c] = ~used ? (uint32_t)std::countr_zero(~used) : XPBD_UNCOLORED;
+			}
+		});
+
+		jobs.parallel_for(count, chunk, [&](size_t begin, size_t end) {
+			uint32_t conflicts = 0;
+			for (size_t c = begin; c < end; c++) {
+				if (colors[c] != XPBD_UNCOLORED) {
+					continue;
+				}
+				uint32_t color = tentative[c];
+				bool conflict = color == XPBD_UNCOLORED;
+				for (uint32_t p : {model.constraints[c].a, model.constraints[c].b}) {
+					for (uint32_t i = adjacency.start[p]; i < adjacency.start[p + 1] && !conflict; i++) {
+						uint32_t d = adjacency.constraints[i];
+						conflict = d < c && tentative[d] == color;
+					}
+				}
+				if (conflict) {
+					conflicts++;
+				} else {
+					colors[c] = color;
+				}
+			}
+			uncolored += conflicts;
+		});
+		round++;
+	}
+
+	if (rounds) {
+		*rounds = round;
+	}
+	return colors;
+}
@@ -0,0 +1,252 @@
+#include "mesh_bvh.h"
+
+#include <algorithm>
+#include <array>
+
+// SAH bins per axis and split
+constexpr uint32_t BVH_BINS = 12;
+// traversal stack, a query holds at most one entry per level and the nodes
+// below that are made leaves
+constexpr uint32_t BVH_STACK = 64;
+
+struct Box {
+	glm::vec3 min{3.4e38f};
+	glm::vec3 max{-3.4e38f};
+
+	void grow(glm::vec3 p)
+	{
+		min = glm::min(min, p);
+		max = glm::max(max, p);
+	}
+	void grow(const Box& b)
+	{
+		min = glm::min(min, b.min);
+		max = glm::max(max, b.max);
+	}
+	float area() const
+	{
+		glm::vec3 e = glm::max(max - min, glm::vec3(0.f));
+		return e.x * e.y + e.y * e.z + e.z * e.x;
+	}
+};
+
+static Box triangle_box(const GPUBvhTriangle& t)
+{
+	Box b;
+	b.grow(glm::vec3(t.v0));
+	b.grow(glm::vec3(t.v1));
+	b.grow(glm::vec3(t.v2));
+	return b;
+}
+
+static float box_distance2(const GPUBvhNode& node, glm::vec3 p)
+{
+	glm::vec3 d = glm::max(glm::max(node.min - p, p - node.max), glm::vec3(0.f));
+	return glm::dot(d, d);
+}
+
+void MeshBvh::build(std::span<const glm::vec3> positions, std::span<const uint32_t> indices,
+	const glm::mat4& transform, uint32_t leafSize)
+{
+	_nodes.clear();
+	_triangles.clear();
+	_centroids.clear();
+	for (size_t i = 0; i + 2 < indices.size(); i += 3) {
+		GPUBvhTriangle t;
+		t.v0 = transform * glm::vec4(positions[indices[i + 0]], 1.f);
+		t.v1 = transform * glm::vec4(positions[indices[i + 1]], 1.f);
+		t.v2 = transform * glm::vec4(positions[indices[i + 2]], 1.f);
+		// degenerate triangles have no normal, their neighbours cover them
+		glm::vec3 n = glm::cross(glm::vec3(t.v1 - t.v0), glm::vec3(t.v2 - t.v0));
+		if (glm::dot(n, n) == 0.f) {
+			continue;
+		}
+		_triangles.push_back(t);
+		_centroids.push_back((glm::vec3(t.v0) + glm::vec3(t.v1) + glm::vec3(t.v2)) / 3.f);
+	}
+	if (_triangles.empty()) {
+		return;
+	}
+
+	_nodes.reserve(2 * _triangles.size() / std::max(leafSize, 1u) + 1);
+	build_node(0, (uint32_t)_triangles.size(), std::max(leafSize, 1u), 0);
+	_centroids.clear();
+	_centroids.shrink_to_fit();
+	spdlog::info("Mesh BVH: {} triangles, {} nodes", _triangles.size(), _nodes.size());
+}
+
+uint32_t MeshBvh::build_node(uint32_t first, uint32_t count, uint32_t leafSize, uint32_t depth)
+{
+	uint32_t index = (uint32_t)_nodes.size();
+	_nodes.push_back({});
+
+	Box bounds, centroidBounds;
+	for (uint32_t i = first; i < first + count; i++) {
+		bounds.grow(triangle_box(_triangles[i]));
+		centroidBounds.grow(_centroids[i]);
+	}
+
+	auto make_leaf = [&]() {
+		_nodes[index] = {bounds.min, first, bounds.max, count};
+		return index;
+	};
+	if (count <= leafSize || depth + 2 >= BVH_STACK) {
+		return make_leaf();
+	}
+
+	// binned SAH over the widest centroid axis
+	glm::vec3 extent = centroidBounds.max - centroidBounds.min;
+	int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+	if (extent[axis] <= 0.f) {
+		return make_leaf();
+	}
+	float scale = BVH_BINS / extent[axis];
+	auto bin_of = [&](uint32_t i) {
+		return std::min(uint32_t((_centroids[i][axis] - centroidBounds.min[axis]) * scale), BVH_BINS - 1);
+	};
+
+	std::array<Box, BVH_BINS> bins;
+	std::array<uint32_t, BVH_BINS> binCounts{};
+	for (uint32_t i = first; i < first + count; i++) {
+		uint32_t b = bin_of(i);
+		bins[b].grow(triangle_box(_triangles[i]));
+		binCounts[b]++;
+	}
+
+	std::array<float, BVH_BINS - 1> leftCost;
+	Box left;
+	uint32_t leftCount = 0;
+	for (uint32_t b = 0; b < BVH_BINS - 1; b++) {
+		left.grow(bins[b]);
+		leftCount += binCounts[b];
+		leftCost[b] = left.area() * leftCount;
+	}
+	Box right;
+	uint32_t rightCount = 0;
+	float bestCost = 3.4e38f;
+	uint32_t bestSplit = 0;
+	for (uint32_t b = BVH_BINS - 1; b > 0; b--) {
+		right.grow(bins[b]);
+		rightCount += binCounts[b];
+		float cost = leftCost[b - 1] + right.area() * rightCount;
+		if (cost < bestCost) {
+			bestCost = cost;
+			bestSplit = b;
+		}
+	}
+
+	// leaves cost a triangle test per triangle, splitting has to beat that
+	if (bestCost >= bounds.area() * count && count <= 4 * leafSize) {
+		return make_leaf();
+	}
+
+	auto middle = std::partition(_triangles.begin() + first, _triangles.begin() + first + count,
+		[&](const GPUBvhTriangle& t) {
+			glm::vec3 c = (glm::vec3(t.v0) + glm::vec3(t.v1) + glm::vec3(t.v2)) / 3.f;
+			return std::min(uint32_t((c[axis] - centroidBounds.min[axis]) * scale), BVH_BINS - 1) < bestSplit;
+		});
+	uint32_t leftSize = uint32_t(middle - _triangles.begin()) - first;
+	if (leftSize == 0 || leftSize == count) {
+		return make_leaf();
+	}
+	for (uint32_t i = first; i < first + count; i++) {
+		const GPUBvhTriangle& t = _triangles[i];
+		_centroids[i] = (glm::vec3(t.v0) + glm::vec3(t.v1) + glm::vec3(t.v2)) / 3.f;
+	}
+
+	build_node(first, leftSize, leafSize, depth + 1);
+	uint32_t rightChild = build_node(first + leftSize, count - leftSize, leafSize, depth + 1);
+	_nodes[index] = {bounds.min, rightChild, bounds.max, 0};
+	return index;
+}
+
+bool MeshBvh::closest_point(glm::vec3 p, float maxDistance, glm::vec3& point, glm::vec3& normal) const
+{
+	if (_nodes.empty()) {
+		return false;
+	}
+
+	float best = maxDistance * maxDistance;
+	bool found = false;
+	uint32_t stack[BVH_STACK];
+	uint32_t top = 0;
+	stack[top++] = 0;
+	while (top > 0) {
+		uint32_t index = stack[--top];
+		const GPUBvhNode& node = _nodes[index];
+		if (box_distance2(node, p) > best) {
+			continue;
+		}
+
+		if (node.count > 0) {
+			for (uint32_t i = node.first; i < node.first + node.count; i++) {
+				const GPUBvhTriangle& t = _triangles[i];
+				glm::vec3 q = vkutil::closest_on_triangle(p, glm::vec3(t.v0), glm::vec3(t.v1), glm::vec3(t.v2));
+				float d2 = glm::dot(p - q, p - q);
+				if (d2 <= best) {
+					best = d2;
+					point = q;
+					normal = glm::normalize(glm::cross(glm::vec3(t.v1 - t.v0), glm::vec3(t.v2 - t.v0)));
+					found = true;
+				}
+			}
+			continue;
+		}
+
+		// nearer child last, so it is popped first
+		uint32_t a = index + 1;
+		uint32_t b = node.first;
+		if (box_distance2(_nodes[a], p) < box_distance2(_nodes[b], p)) {
+			std::swap(a, b);
+		}
+		if (top + 2 <= BVH_STACK) {
+			stack[top++] = a;
+			stack[top++] = b;
+		}
+	}
+	return found;
+}
+
+glm::vec3 vkutil::closest_on_triangle(glm::vec3 p, glm::vec3 a, glm::vec3 b, glm::vec3 c)
+{
+	glm::vec3 ab = b - a;
+	glm::vec3 ac = c - a;
+	glm::vec3 ap = p - a;
+	float d1 = glm::dot(ab, ap);
+	float d2 = glm::dot(ac, ap);
+	if (d1 <= 0.f && d2 <= 0.f) {
+		return a;
+	}
+
+	glm::vec3 bp = p - b;
+	float d3 = glm::dot(ab, bp);
+	float d4 = glm::dot(ac, bp);
+	if (d3 >= 0.f && d4 <= d3) {
+		return b;
+	}
+
+	float vc = d1 * d4 - d3 * d2;
+	if (vc <= 0.f && d1 >= 0.f && d3 <= 0.f) {
+		return a + ab * (d1 / (d1 - d3));
+	}
+
+	glm::vec3 cp = p - c;
+	float d5 = glm::dot(ab, cp);
+	float d6 = glm::dot(ac, cp);
+	if (d6 >= 0.f && d5 <= d6) {
+		return c;
+	}
+
+	float vb = d5 * d2 - d1 * d6;
+	if (vb <= 0.f && d2 >= 0.f && d6 <= 0.f) {
+		return a + ac * (d2 / (d2 - d6));
+	}
+
+	float va = d3 * d6 - d5 * d4;
+	if (va <= 0.f && d4 - d3 >= 0.f && d5 - d6 >= 0.f) {
+		return b + (c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6)));
+	}
+
+	float denom = 1.f / (va + vb + vc);
+	return a + ab * (vb * denom) + ac * (vc * denom);
+}
@@ -0,0 +1,352 @@
+#include "metrics.h"
+
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <new>
+
+#include <spdlog/spdlog.h>
+
+#if defined(_WIN32)
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MetricsSlot& vkutil::metrics_sink()
+{
+	static MetricsSlot sink{};
+	return sink;
+}
+
+MetricsHistogramSlot& vkutil::metrics_histogram_sink()
+{
+	static MetricsHistogramSlot sink{};
+	return sink;
+}
+
+static bool valid_segment(const MetricsSegment& segment)
+{
+	return segment.magic.load(std::memory_order_acquire) == METRICS_MAGIC && segment.version == METRICS_VERSION
+		&& segment.size == sizeof(MetricsSegment);
+}
+
+static uint32_t current_pid()
+{
+#if defined(_WIN32)
+	return GetCurrentProcessId();
+#else
+	return (uint32_t)getpid();
+#endif
+}
+
+static bool process_alive(uint32_t pid)
+{
+#if defined(_WIN32)
+	HANDLE process = OpenProcess(SYNCHRONIZE, FALSE, pid);
+	if (!process) {
+		return GetLastError() == ERROR_ACCESS_DENIED;
+	}
+	bool alive = WaitForSingleObject(process, 0) == WAIT_TIMEOUT;
+	CloseHandle(process);
+	return alive;
+#else
+	return kill((pid_t)pid, 0) == 0 || errno == EPERM;
+#endif
+}
+
+// Whether the engine that published `segment` still runs. One that is not
+// complete, or of another layout, may be in the middle of its init and
+// counts as running.
+static bool segment_in_use(const MetricsSegment& segment)
+{
+	return !valid_segment(segment) || process_alive(segment.pid);
+}
+
+#if defined(_WIN32)
+// POSIX names start with a slash, Windows ones live in the session namespace
+static std::string mapping_name(const std::string& name)
+{
+	return "Local\\" + name.substr(name.starts_with('/') ? 1 : 0);
+}
+
+// The mapping goes away with its last handle, so one that already exists is
+// either published by a running engine or only kept open by a reader
+static void* create_segment(const std::string& name, intptr_t& mapping, bool& inUse)
+{
+	HANDLE handle = CreateFileMappingA(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, 0,
+		DWORD(sizeof(MetricsSegment)), mapping_name(name).c_str());
+	if (!handle) {
+		return nullptr;
+	}
+	bool existed = GetLastError() == ERROR_ALREADY_EXISTS;
+	void* memory = MapViewOfFile(handle, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(MetricsSegment));
+	inUse = memory && existed && segment_in_use(*static_cast<const MetricsSegment*>(memory));
+	if (memory && inUse) {
+		UnmapViewOfFile(memory);
+		memory = nullptr;
+	}
+	if (memory) {
+		mapping = (intptr_t)handle;
+	} else {
+		CloseHandle(handle);
+	}
+	return memory;
+}
+#else
+// maps the segment `name` for reading, nullptr if there is none
+static const MetricsSegment* map_segment(const std::string& name)
+{
+	int file = shm_open(name.c_str(), O_RDONLY, 0);
+	if (file < 0) {
+		return nullptr;
+	}
+	void* memory = MAP_FAILED;
+	struct stat info {};
+	if (fstat(file, &info) == 0 && (size_t)info.st_size >= sizeof(MetricsSegment)) {
+		memory = mmap(nullptr, sizeof(MetricsSegment), PROT_READ, MAP_SHARED, file, 0);
+	}
+	close(file);
+	return memory == MAP_FAILED ? nullptr : static_cast<const MetricsSegment*>(memory);
+}
+
+// pid that published the segment `name`, 0 if there is no complete one
+static uint32_t segment_owner(const std::string& name)
+{
+	const MetricsSegment* segment = map_segment(name);
+	if (!segment) {
+		return 0;
+	}
+	uint32_t pid = valid_segment(*segment) ? segment->pid : 0;
+	munmap((void*)segment, sizeof(MetricsSegment));
+	return pid;
+}
+
+// The segment outlives its engine until unlinked, so one left by a run that
+// crashed is replaced. Readers that still map it keep their copy.
+static void* create_segment(const std::string& name, intptr_t&, bool& inUse)
+{
+	int file = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+	if (file < 0 && errno == EEXIST) {
+		const MetricsSegment* existing = map_segment(name);
+		inUse = !existing || segment_in_use(*existing);
+		if (existing) {
+			munmap((void*)existing, sizeof(MetricsSegment));
+		}
+		if (inUse) {
+			return nullptr;
+		}
+		shm_unlink(name.c_str());
+		file = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+	}
+	if (file < 0) {
+		return nullptr;
+	}
+	void* memory = nullptr;
+	if (ftruncate(file, sizeof(MetricsSegment)) == 0) {
+		memory = mmap(nullptr, sizeof(MetricsSegment), PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+		memory = memory == MAP_FAILED ? nullptr : memory;
+	}
+	close(file);
+	if (!memory) {
+		shm_unlink(name.c_str());
+	}
+	return memory;
+}
+#endif
+
+void MetricsRegistry::init(const std::string& name)
+{
+	_name = name;
+	void* memory = nullptr;
+	if (!name.empty()) {
+		bool inUse = false;
+		memory = create_segment(name, _mapping, inUse);
+		if (inUse) {
+			_name = fmt::format("{}_{}", name, current_pid());
+			spdlog::warn("Metrics: {} belongs to a running engine, publishing in {} instead", name, _name);
+			memory = create_segment(_name, _mapping, inUse);
+		}
+		if (!memory) {
+			spdlog::warn("Metrics: cannot create shared memory {}, keeping them in the process", _name);
+		}
+	}
+
+	_shared = memory != nullptr;
+	_segment = _shared ? new (memory) MetricsSegment{} : new MetricsSegment{};
+	_segment->version = METRICS_VERSION;
+	_segment->size = sizeof(MetricsSegment);
+	_segment->pid = current_pid();
+	_segment->magic.store(METRICS_MAGIC, std::memory_order_release);
+
+	if (_shared) {
+		spdlog::info("Metrics: published in {}, {} KiB", _name, sizeof(MetricsSegment) / 1024);
+	}
+}
+
+void MetricsRegistry::cleanup()
+{
+	if (!_segment) {
+		return;
+	}
+	if (_shared) {
+#if defined(_WIN32)
+		UnmapViewOfFile(_segment);
+		CloseHandle((HANDLE)_mapping);
+		_mapping = -1;
+#else
+		munmap(_segment, sizeof(MetricsSegment));
+		// the name may have been taken over since, leave that segment alone
+		if (segment_owner(_name) == current_pid()) {
+			shm_unlink(_name.c_str());
+		}
+#endif
+	} else {
+		delete _segment;
+	}
+	_segment = nullptr;
+	_histograms = 0;
+}
+
+MetricsSlot* MetricsRegistry::add(std::string_view name, MetricKind kind)
+{
+	std::lock_guard lock(_mutex);
+	if (!_segment) {
+		return nullptr;
+	}
+
+	uint32_t count = _segment->count.load(std::memory_order_relaxed);
+	for (uint32_t i = 0; i < count; i++) {
+		MetricsSlot& slot = _segment->metrics[i];
+		if (slot.kind == kind && name == slot.name) {
+			return &slot;
+		}
+	}
+
+	bool histogramsLeft = kind != MetricKind::Histogram || _histograms < METRICS_HISTOGRAMS;
+	if (count == METRICS_CAPACITY || !histogramsLeft || name.size() >= METRICS_NAME) {
+		spdlog::warn("Metrics: no room for {}, its updates are dropped", name);
+		return nullptr;
+	}
+
+	MetricsSlot& slot = _segment->metrics[count];
+	memcpy(slot.name, name.data(), name.size());
+	slot.kind = kind;
+	if (kind == MetricKind::Histogram) {
+		slot.histogram = _histograms++;
+	}
+	_segment->count.store(count + 1, std::memory_order_release);
+	return &slot;
+}
+
+MetricCounter MetricsRegistry::counter(std::string_view name)
+{
+	MetricCounter counter;
+	if (MetricsSlot* slot = add(name, MetricKind::Counter)) {
+		counter._value = &slot->value;
+	}
+	return counter;
+}
+
+MetricGauge MetricsRegistry::gauge(std::string_view name)
+{
+	MetricGauge gauge;
+	if (MetricsSlot* slot = add(name, MetricKind::Gauge)) {
+		gauge._value = &slot->value;
+	}
+	return gauge;
+}
+
+MetricHistogram MetricsRegistry::histogram(std::string_view name)
+{
+	MetricHistogram histogram;
+	if (MetricsSlot* slot = add(name, MetricKind::Histogram)) {
+		histogram._slot = &_segment->histograms[slot->histogram];
+	}
+	return histogram;
+}
+
+static void copy_metrics(const MetricsSegment& segment, MetricsSnapshot& snapshot)
+{
+	snapshot.pid = segment.pid;
+	uint32_t count = std::min(segment.count.load(std::memory_order_acquire), METRICS_CAPACITY);
+	snapshot.metrics.resize(count);
+	for (uint32_t i = 0; i < count; i++) {
+		const MetricsSlot& slot = segment.metrics[i];
+		MetricSnapshot& metric = snapshot.metrics[i];
+		metric.name.assign(slot.name, strnlen(slot.name, METRICS_NAME));
+		metric.kind = slot.kind;
+		metric.value = slot.value.load(std::memory_order_relaxed);
+		metric.buckets.clear();
+		if (slot.kind == MetricKind::Histogram && slot.histogram < METRICS_HISTOGRAMS) {
+			const MetricsHistogramSlot& histogram = segment.histograms[slot.histogram];
+			metric.buckets.resize(HISTOGRAM_BUCKETS);
+			for (uint32_t b = 0; b < HISTOGRAM_BUCKETS; b++) {
+				metric.buckets[b] = histogram.buckets[b].load(std::memory_order_relaxed);
+			}
+		}
+	}
+}
+
+bool vkutil::read_metrics(const std::string& name, MetricsSnapshot& snapshot)
+{
+	bool valid = false;
+#if defined(_WIN32)
+	HANDLE mapping = OpenFileMappingA(FILE_MAP_READ, FALSE, mapping_name(name).c_str());
+	if (!mapping) {
+		return false;
+	}
+	if (const void* memory = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, sizeof(MetricsSegment))) {
+		const MetricsSegment& segment = *static_cast<const MetricsSegment*>(memory);
+		valid = valid_segment(segment);
+		if (valid) {
+			copy_metrics(segment, snapshot);
+		}
+		UnmapViewOfFile(memory);
+	}
+	CloseHandle(mapping);
+#else
+	const MetricsSegment* segment = map_segment(name);
+	if (!segment) {
+		return false;
+	}
+	valid = valid_segment(*segment);
+	if (valid) {
+		copy_metrics(*segment, snapshot);
+	}
+	munmap((void*)segment, sizeof(MetricsSegment));
+#endif
+	return valid;
+}
+
+uint64_t vkutil::histogram_count(const std::vector<uint64_t>& buckets)
+{
+	uint64_t count = 0;
+	for (uint64_t n : buckets) {
+		count += n;
+	}
+	return count;
+}
+
+uint64_t vkutil::histogram_quantile(const std::vector<uint64_t>& buckets, double quantile)
+{
+	uint64_t count = histogram_count(buckets);
+	if (count == 0) {
+		return 0;
+	}
+	// rank of the sample, 1 based, at least the first
+	uint64_t rank = std::max<uint64_t>(uint64_t(std::ceil(std::clamp(quantile, 0.0, 1.0) * double(count))), 1);
+	uint64_t seen = 0;
+	for (uint32_t b = 0; b < buckets.size(); b++) {
+		seen += buckets[b];
+		if (seen >= rank) {
+			return b + 1 < HISTOGRAM_BUCKETS ? histogram_bucket_min(b + 1) - 1 : UINT64_MAX;
+		}
+	}
+	return UINT64_MAX;
+}
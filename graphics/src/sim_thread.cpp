@@ -0,0 +1,141 @@
+#include "sim_thread.h"
+
+#include <algorithm>
+
+static void copy_particles(const CpuParticleSet& src, CpuParticleSet& dst, size_t count)
+{
+	if (dst.capacity() < src.capacity()) {
+		dst.resize(src.capacity());
+	}
+	auto copy = [count](const auto& from, auto& to) { std::copy_n(from.begin(), count, to.begin()); };
+	copy(src.x, dst.x);
+	copy(src.y, dst.y);
+	copy(src.z, dst.z);
+	copy(src.age, dst.age);
+	copy(src.vx, dst.vx);
+	copy(src.vy, dst.vy);
+	copy(src.vz, dst.vz);
+	copy(src.lifetime, dst.lifetime);
+	copy(src.color, dst.color);
+}
+
+void SimulationThread::start(CpuParticleSystem* particles, float fixedDt, bool paced)
+{
+	_particles = particles;
+	// CpuParticleSystem::simulate() clamps longer steps
+	_fixedDt = std::clamp(fixedDt, 1e-4f, 1.f / 30.f);
+	_paced = paced;
+	_stop = false;
+	_start = std::chrono::steady_clock::now();
+	_thread = std::thread([this]() { loop(); });
+
+	spdlog::info("Simulation thread: fixed dt {:.2f} ms, {}", _fixedDt * 1e3f, _paced ? "paced" : "unpaced");
+}
+
+void SimulationThread::stop()
+{
+	if (!_thread.joinable()) {
+		return;
+	}
+	_stop = true;
+	_thread.join();
+}
+
+void SimulationThread::loop()
+{
+	using clock = std::chrono::steady_clock;
+	// never catch up on more than this after a stall, drop the time instead
+	constexpr double maxLag = 0.25;
+
+	double time = 0.0;
+	while (!_stop.load(std::memory_order_relaxed)) {
+		clock::time_point stepStart = clock::now();
+		_particles->simulate(_fixedDt);
+		_stepTime.record(clock::now() - stepStart);
+		time += _fixedDt;
+		uint64_t step = _steps.fetch_add(1, std::memory_order_relaxed) + 1;
+
+		ParticleSnapshot& snapshot = _snapshots.write();
+		snapshot.count = _particles->alive();
+		snapshot.step = step;
+		snapshot.time = _paced ? time : seconds_since_start();
+		copy_particles(_particles->current(), snapshot.particles, snapshot.count);
+		_snapshots.publish();
+
+		if (_recorder) {
+			vkutil::record_particles(*_recorder, *_particles, step, time);
+		}
+
+		if (_paced) {
+			double now = seconds_since_start();
+			if (now - time > maxLag) {
+				time = now;
+			}
+			std::this_thread::sleep_until(_start + std::chrono::duration_cast<clock::duration>(
+				std::chrono::duration<double>(time)));
+		}
+	}
+}
+
+const ParticleSnapshot* SimulationThread::latest()
+{
+	_published |= _snapshots.acquire();
+	return _published ? &_snapshots.read() : nullptr;
+}
+
+float SimulationThread::interpolation_offset(const ParticleSnapshot& snapshot) const
+{
+	if (!_paced) {
+		return 0.f;
+	}
+	double ahead = snapshot.time - seconds_since_start();
+	return (float)std::clamp(ahead, 0.0, (double)_fixedDt);
+}
+
+double SimulationThread::seconds_since_start() const
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - _start).count();
+}
+
+std::span<const CheckpointField> vkutil::particle_checkpoint_fields()
+{
+	static const CheckpointField fields[] = {
+		{"x"}, {"y"}, {"z"}, {"age"},
+		{"vx"}, {"vy"}, {"vz"}, {"lifetime"},
+		{"color", CheckpointFieldType::Uint32},
+	};
+	return fields;
+}
+
+void vkutil::record_particles(CheckpointWriter& writer, const CpuParticleSystem& particles, uint64_t step,
+	double time)
+{
+	const CpuParticleSet& set = particles.current();
+	const void* fields[] = {set.x.data(), set.y.data(), set.z.data(), set.age.data(), set.vx.data(), set.vy.data(),
+		set.vz.data(), set.lifetime.data(), set.color.data()};
+	writer.write_frame(step, time, particles.alive(), fields);
+}
+
+bool vkutil::restore_particles(CheckpointReader& reader, size_t frame, CpuParticleSystem& particles)
+{
+	std::span<const CheckpointField> expected = particle_checkpoint_fields();
+	const std::vector<CheckpointField>& fields = reader.fields();
+	if (frame >= reader.frame_count() || fields.size() != expected.size()
+		|| !std::equal(fields.begin(), fields.end(), expected.begin(),
+			[](const CheckpointField& a, const CheckpointField& b) { return a.name == b.name && a.type == b.type; })) {
+		return false;
+	}
+	// frames larger than the particle capacity are cut off after decoding
+	uint32_t count = reader.frame(frame).count;
+	CpuParticleSet& set = particles.current();
+	if (set.capacity() < count) {
+		set.resize(count);
+	}
+	void* destinations[] = {set.x.data(), set.y.data(), set.z.data(), set.age.data(), set.vx.data(),
+		set.vy.data(), set.vz.data(), set.lifetime.data(), set.color.data()};
+	if (!reader.read_frame(frame, destinations)) {
+		return false;
+	}
+	particles.set_alive(count);
+	return true;
+}
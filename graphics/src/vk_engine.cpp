@@ -7,7 +7,10 @@
 
 #include <VkBootstrap.h>
 
+#include <algorithm>
 #include <chrono>
+#include <cmath>
+#include <cstring>
 #include <thread>
 #include <vulkan/vulkan_core.h>
 
@@ -18,6 +21,8 @@
 #include "vk_images.h"
 #include "vk_types.h"
 
+#include <glm/gtc/matrix_transform.hpp>
+
 void DeletionQueue::add(std::function<void()> function) {
 	_deletionQueue.push_back(function);
 }
@@ -31,8 +36,6 @@ void DeletionQueue::flush(VkDevice device) {
 }
 
 
-constexpr bool bUseValidationLayers = true;
-
 VulkanEngine *loadedEngine = nullptr;
 
 VulkanEngine &VulkanEngine::Get() { return *loadedEngine; }
@@ -50,6 +53,7 @@ void VulkanEngine::init() {
   _window = SDL_CreateWindow("Vulkan Engine", _windowExtent.width,
                              _windowExtent.height, window_flags);
 
+  init_metrics();
   init_vulkan();
   init_swapchain();
 
@@ -57,6 +61,9 @@ void VulkanEngine::init() {
   init_sync_structures();
   init_descriptors();
   init_pipelines();
+  init_scene();
+  init_simulation();
+  init_transients();
 
   // everything went fine
   _isInitialized = true;
@@ -92,12 +99,37 @@ void VulkanEngine::cleanup() {
 }
 
 void VulkanEngine::draw() {
+	using clock = std::chrono::steady_clock;
+	clock::time_point drawStart = clock::now();
+	if (_frameMetrics.lastDraw != clock::time_point{}) {
+		_frameMetrics.interval.record(drawStart - _frameMetrics.lastDraw);
+	}
+	_frameMetrics.lastDraw = drawStart;
+
 	vk_check(vkWaitForFences(this->_device, 1, &get_current_frame()._renderFence, true, 1000000000));
+	clock::duration fenceWait = clock::now() - drawStart;
+	_frameMetrics.fenceWait.record(fenceWait);
 	get_current_frame()._deletionQueue.flush(this->_device);
 	vk_check(vkResetFences(this->_device, 1, &get_current_frame()._renderFence));
+	_memory.begin_frame(_frameNumber);
+	_readback.begin_frame(_frameNumber);
+	_pipelines.begin_frame(_frameNumber);
+	if (!_cpuSimulation) {
+		_particles.collect(_frameNumber % FRAME_OVERLAP);
+		const ParticleStats &stats = _particles.stats();
+		if (stats.gpuMilliseconds > 0.0) {
+			_frameMetrics.particlesGpu.record(uint64_t(stats.gpuMilliseconds * 1e6));
+		}
+		_frameMetrics.alive.set(stats.alive);
+	}
+
+	update_scene();
 
     uint32_t swapchainImageIndex;
+    clock::time_point acquireStart = clock::now();
     vk_check(vkAcquireNextImageKHR(this->_device, this->_swapchain, 1000000000, get_current_frame()._swapchainSemaphore, nullptr, &swapchainImageIndex));
+    clock::duration acquireWait = clock::now() - acquireStart;
+    _frameMetrics.acquireWait.record(acquireWait);
 
 
 	VkCommandBuffer cmd = get_current_frame()._buffer;
@@ -111,29 +143,86 @@ void VulkanEngine::draw() {
 
     vk_check(vkBeginCommandBuffer(cmd, &cmdBeginInfo));
 
+    // move buffers around before anything this frame reads them
+    _memory.defragment_step(cmd, _frameNumber);
+
+    if (_cpuSimulation) {
+      // never waits on the solver, the newest step is interpolated to now
+      if (const ParticleSnapshot *snapshot = _simThread.latest()) {
+        const CpuParticleSet &set = snapshot->particles;
+        float back = _simThread.interpolation_offset(*snapshot);
+        _frameMetrics.alive.set(snapshot->count);
+        _particles.upload(cmd, _frameNumber % FRAME_OVERLAP, snapshot->count,
+                          [&](glm::vec4 *positions, glm::vec4 *velocities,
+                              uint32_t *attributes) {
+                            set.to_gpu(snapshot->count, positions, velocities,
+                                       attributes);
+                            for (uint32_t i = 0; i < snapshot->count; i++) {
+                              positions[i] -= glm::vec4(glm::vec3(velocities[i]) * back, 0.f);
+                            }
+                          });
+      }
+    } else {
+      _particles.simulate(cmd, _frameNumber % FRAME_OVERLAP, _deltaTime);
+    }
+
+    if (_volume.enabled()) {
+      _volume.step(cmd, _deltaTime);
+    }
+    if (_cloth.enabled()) {
+      // long frames would need more substeps than the cloth has
+      _cloth.step(cmd, std::min(_deltaTime, 1.f / 30.f));
+    }
+
+    if (_analytics) {
+      read_analytics();
+    }
+
     // transition our main draw image into general layout so we can write into it
     // we will overwrite it all so we dont care about what was the older layout
     vkutil::transition_image(cmd, _drawImage.image, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL);
 
     draw_background(cmd);
 
-    //transition the draw image and the swapchain image into their correct transfer layouts
-    vkutil::transition_image(cmd, _drawImage.image, VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL);
-    vkutil::transition_image(cmd, _swapchainImages[swapchainImageIndex], VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+    draw_geometry(cmd);
+
+    // the particles are splatted from compute on top of the scene
+    vkutil::transition_image(cmd, _drawImage.image, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, VK_IMAGE_LAYOUT_GENERAL);
+    if (_splatParticles) {
+      _splatter.draw(cmd, get_current_frame()._sceneDataBuffer.address);
+    }
+    if (_volume.enabled()) {
+      _volume.draw(cmd, _sceneData.viewproj);
+    }
+
+    if (_resolve.enabled()) {
+      // one compute pass tonemaps and scales straight into the swapchain
+      _resolve.draw(cmd, swapchainImageIndex, _frameNumber);
+    } else {
+      //transition the draw image and the swapchain image into their correct transfer layouts
+      vkutil::transition_image(cmd, _drawImage.image, VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL);
+      vkutil::transition_image(cmd, _swapchainImages[swapchainImageIndex], VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
 
-    // execute a copy from the draw image into the swapchain
-    vkutil::copy_image_to_image(cmd, _drawImage.image, _swapchainImages[swapchainImageIndex], _drawExtent, _swapchainExtent);
+      // execute a copy from the draw image into the swapchain
+      vkutil::copy_image_to_image(cmd, _drawImage.image, _swapchainImages[swapchainImageIndex], _drawExtent, _swapchainExtent);
+
+      // set swapchain image layout to Present so we can show it on the screen
+      vkutil::transition_image(cmd, _swapchainImages[swapchainImageIndex], VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_PRESENT_SRC_KHR);
+    }
 
-    // set swapchain image layout to Present so we can show it on the screen
-    vkutil::transition_image(cmd, _swapchainImages[swapchainImageIndex], VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_PRESENT_SRC_KHR);
+    // copies for everything read back during this frame
+    _readback.record(cmd, _frameNumber);
 
     //finalize the command buffer (we can no longer add commands, but it can now be executed)
     vk_check(vkEndCommandBuffer(cmd));
 
     VkCommandBufferSubmitInfo cmdinfo = vkinit::command_buffer_submit_info(cmd);
 
-    VkSemaphoreSubmitInfo waitInfo = vkinit::semaphore_submit_info(VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT_KHR, get_current_frame()._swapchainSemaphore);
-    VkSemaphoreSubmitInfo signalInfo = vkinit::semaphore_submit_info(VK_PIPELINE_STAGE_2_ALL_GRAPHICS_BIT, get_current_frame()._renderSemaphore);
+    // the compute resolve writes the swapchain image, so it waits for it and
+    // has to be done before the present
+    VkPipelineStageFlags2 acquireStage = _resolve.enabled() ? VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT : VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT_KHR;
+    VkSemaphoreSubmitInfo waitInfo = vkinit::semaphore_submit_info(acquireStage, get_current_frame()._swapchainSemaphore);
+    VkSemaphoreSubmitInfo signalInfo = vkinit::semaphore_submit_info(VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, get_current_frame()._renderSemaphore);
 
     VkSubmitInfo2 submit = vkinit::submit_info(&cmdinfo, &signalInfo, &waitInfo);
 
@@ -156,6 +245,49 @@ void VulkanEngine::draw() {
 
     //increase the number of frames drawn
     _frameNumber++;
+    _frameMetrics.frames.add();
+    _frameMetrics.cpuTime.record(clock::now() - drawStart - fenceWait - acquireWait);
+}
+
+void VulkanEngine::read_analytics() {
+  // the set the simulation just wrote, the copies run at the end of the frame
+  const uint32_t set = _particles.current_index();
+  const uint32_t sample = std::min(4096u, _particles.settings().capacity);
+
+  // refused requests are dropped, analytics may skip frames under pressure
+  _readback.read(_particles.state(), 0, sizeof(GPUParticleState),
+                 [this, set](std::span<const uint8_t> data) {
+                   GPUParticleState state;
+                   std::memcpy(&state, data.data(), sizeof(state));
+                   _analyticsAlive = state.count[set];
+                 });
+  const StorageLayout storage = _particles.storage();
+  _readback.read(
+      _particles.current().velocities, 0, sample * storage.velocity_stride(),
+      [this, storage](std::span<const uint8_t> data) {
+        // requests complete in order, so the count above is this frame's
+        uint32_t n = std::min<uint32_t>(
+            _analyticsAlive, uint32_t(data.size() / storage.velocity_stride()));
+        std::vector<glm::vec4> velocities(n);
+        vkutil::decode_storage(storage.velocity, storage.cell_size(),
+                               data.data(), n, velocities.data());
+        double speed = 0.0, maxSpeed = 0.0;
+        for (uint32_t i = 0; i < n; i++) {
+          double s = glm::length(glm::vec3(velocities[i]));
+          speed += s;
+          maxSpeed = std::max(maxSpeed, s);
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        if (n > 0 && now - _analyticsReport > std::chrono::seconds(1)) {
+          _analyticsReport = now;
+          const ReadbackStats &stats = _readback.stats();
+          spdlog::info("Analytics: {} alive, mean speed {:.3f}, max {:.3f} over {} samples, "
+                       "readback {:.0f}% full, {} refused",
+                       _analyticsAlive, speed / n, maxSpeed, n,
+                       _readback.pressure() * 100.f, stats.rejected);
+        }
+      });
 }
 
 void VulkanEngine::draw_background(VkCommandBuffer cmd) {
@@ -164,8 +296,7 @@ void VulkanEngine::draw_background(VkCommandBuffer cmd) {
 	vkCmdClearColorImage(cmd, this->_drawImage.image, VK_IMAGE_LAYOUT_GENERAL, &clearColor, 1, &range);
 
         // bind the gradient drawing compute pipeline
-        vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE,
-                          _gradientPipeline);
+        _gradientKernel.bind(cmd);
 
         // bind the descriptor set containing the draw image for the compute
         // pipeline
@@ -173,36 +304,213 @@ void VulkanEngine::draw_background(VkCommandBuffer cmd) {
                                 _gradientPipelineLayout, 0, 1,
                                 &_drawImageDescriptors, 0, nullptr);
 
-        // execute the compute pipeline dispatch. We are using 16x16 workgroup
-        // size so we need to divide by it
-        vkCmdDispatch(cmd, std::ceil(_drawExtent.width / 16.0),
-                      std::ceil(_drawExtent.height / 16.0), 1);
+        // execute the compute pipeline dispatch, the group count follows from
+        // the workgroup size of the selected variant
+        _gradientKernel.dispatch(cmd, _drawExtent.width, _drawExtent.height);
+}
+
+void VulkanEngine::draw_geometry(VkCommandBuffer cmd) {
+  VkDeviceAddress sceneData = get_current_frame()._sceneDataBuffer.address;
+
+  // compacts the visible instances into the indirect commands
+  _indirect.cull(cmd, sceneData, _sceneData, _frameNumber % FRAME_OVERLAP);
+  _streaming.update(cmd, sceneData, _frameNumber);
+
+  vkutil::transition_image(cmd, _drawImage.image, VK_IMAGE_LAYOUT_GENERAL,
+                           VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL);
+  vkutil::transition_image(cmd, _depthImage.image, VK_IMAGE_LAYOUT_UNDEFINED,
+                           VK_IMAGE_LAYOUT_DEPTH_ATTACHMENT_OPTIMAL);
+
+  VkRenderingAttachmentInfo colorAttachment = vkinit::attachment_info(
+      _drawImage.imageView, nullptr, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL);
+  VkRenderingAttachmentInfo depthAttachment = vkinit::depth_attachment_info(
+      _depthImage.imageView, VK_IMAGE_LAYOUT_DEPTH_ATTACHMENT_OPTIMAL);
+  VkRenderingInfo renderInfo =
+      vkinit::rendering_info(_drawExtent, &colorAttachment, &depthAttachment);
+
+  vkCmdBeginRendering(cmd, &renderInfo);
+  _indirect.draw(cmd, sceneData);
+  _streaming.draw(cmd, sceneData);
+  if (_cloth.enabled()) {
+    _cloth.draw(cmd, sceneData);
+  }
+  vkCmdEndRendering(cmd);
+
+  // next frame's occlusion culling tests against this frame's depth
+  vkutil::transition_image(cmd, _depthImage.image,
+                           VK_IMAGE_LAYOUT_DEPTH_ATTACHMENT_OPTIMAL,
+                           VK_IMAGE_LAYOUT_DEPTH_READ_ONLY_OPTIMAL);
+  _indirect.depth_rendered();
+}
+
+void VulkanEngine::update_scene() {
+  _camera.set_aspect((float)_drawExtent.width / _drawExtent.height);
+
+  _sceneData.prevView = _frameNumber == 0 ? _camera.view() : _sceneData.view;
+  _sceneData.view = _camera.view();
+  _sceneData.proj = _camera.projection();
+  _sceneData.viewproj = _camera.view_projection();
+  for (int i = 0; i < 6; i++) {
+    _sceneData.frustum[i] = _camera.frustum().planes[i];
+  }
+
+  _sceneData.P00 = _sceneData.proj[0][0];
+  _sceneData.P11 = std::abs(_sceneData.proj[1][1]);
+  _sceneData.znear = _camera.znear();
+  _sceneData.occlusion = _indirect.has_pyramid() ? 1 : 0;
+  _sceneData.pyramidSize = glm::vec2(_indirect.pyramid_extent().width,
+                                     _indirect.pyramid_extent().height);
+  _sceneData.instanceCount = _indirect.instance_count();
+  // an error of e at distance d covers e / d * P11 * height / 2 pixels
+  _sceneData.lodScale =
+      _indirect.lodPixelError > 0.f
+          ? 0.5f * _sceneData.P11 * _drawExtent.height / _indirect.lodPixelError
+          : 0.f;
+
+  memcpy(get_current_frame()._sceneDataBuffer.info.pMappedData, &_sceneData,
+         sizeof(GPUSceneData));
+}
+
+void VulkanEngine::immediate_submit(
+    std::function<void(VkCommandBuffer cmd)> &&function) {
+  vk_check(vkResetFences(_device, 1, &_immFence));
+  vk_check(vkResetCommandBuffer(_immCommandBuffer, 0));
+
+  VkCommandBuffer cmd = _immCommandBuffer;
+
+  VkCommandBufferBeginInfo cmdBeginInfo = vkinit::command_buffer_begin_info(
+      VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
+
+  vk_check(vkBeginCommandBuffer(cmd, &cmdBeginInfo));
+
+  function(cmd);
+
+  vk_check(vkEndCommandBuffer(cmd));
+
+  VkCommandBufferSubmitInfo cmdinfo = vkinit::command_buffer_submit_info(cmd);
+  VkSubmitInfo2 submit = vkinit::submit_info(&cmdinfo, nullptr, nullptr);
+
+  // _immFence will now block until the commands finish execution
+  vk_check(vkQueueSubmit2(_graphicsQueue, 1, &submit, _immFence));
+
+  vk_check(vkWaitForFences(_device, 1, &_immFence, true, 9999999999));
+}
+
+GPUMeshBuffers
+VulkanEngine::upload_mesh(std::span<const uint32_t> indices,
+                          std::span<const glm::vec3> positions,
+                          std::span<const VertexAttributes> attributes) {
+  const size_t indexBufferSize = indices.size_bytes();
+  const size_t positionBufferSize = positions.size_bytes();
+  const size_t attributeBufferSize = attributes.size_bytes();
+
+  GPUMeshBuffers newSurface;
+  newSurface.indexCount = (uint32_t)indices.size();
+  newSurface.vertexCount = (uint32_t)positions.size();
+
+  // the streams are read through buffer device addresses by the shaders
+  const VkBufferUsageFlags streamUsage =
+      VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT |
+      VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT;
+
+  newSurface.indexBuffer = _memory.create_buffer(
+      indexBufferSize, streamUsage | VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
+      VMA_MEMORY_USAGE_GPU_ONLY, MemoryTag::Geometry);
+  newSurface.positionBuffer =
+      _memory.create_buffer(positionBufferSize, streamUsage,
+                            VMA_MEMORY_USAGE_GPU_ONLY, MemoryTag::Geometry);
+  newSurface.attributeBuffer =
+      _memory.create_buffer(attributeBufferSize, streamUsage,
+                            VMA_MEMORY_USAGE_GPU_ONLY, MemoryTag::Geometry);
+
+  AllocatedBuffer staging = _memory.create_buffer(
+      indexBufferSize + positionBufferSize + attributeBufferSize,
+      VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VMA_MEMORY_USAGE_CPU_ONLY,
+      MemoryTag::Staging, VMA_ALLOCATION_CREATE_MAPPED_BIT);
+
+  char *data = (char *)staging.info.pMappedData;
+  memcpy(data, indices.data(), indexBufferSize);
+  memcpy(data + indexBufferSize, positions.data(), positionBufferSize);
+  memcpy(data + indexBufferSize + positionBufferSize, attributes.data(),
+         attributeBufferSize);
+
+  immediate_submit([&](VkCommandBuffer cmd) {
+    VkBufferCopy indexCopy{0, 0, indexBufferSize};
+    vkCmdCopyBuffer(cmd, staging.buffer, newSurface.indexBuffer.buffer, 1,
+                    &indexCopy);
+
+    VkBufferCopy positionCopy{indexBufferSize, 0, positionBufferSize};
+    vkCmdCopyBuffer(cmd, staging.buffer, newSurface.positionBuffer.buffer, 1,
+                    &positionCopy);
+
+    VkBufferCopy attributeCopy{indexBufferSize + positionBufferSize, 0,
+                               attributeBufferSize};
+    vkCmdCopyBuffer(cmd, staging.buffer, newSurface.attributeBuffer.buffer, 1,
+                    &attributeCopy);
+  });
+
+  _memory.destroy_buffer(staging);
+
+  return newSurface;
+}
+
+AllocatedBuffer VulkanEngine::upload_buffer(const void *data, size_t size,
+                                           VkBufferUsageFlags usage,
+                                           MemoryTag tag) {
+  AllocatedBuffer buffer =
+      _memory.create_buffer(size, usage | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                            VMA_MEMORY_USAGE_GPU_ONLY, tag);
+
+  AllocatedBuffer staging = _memory.create_buffer(
+      size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VMA_MEMORY_USAGE_CPU_ONLY,
+      MemoryTag::Staging, VMA_ALLOCATION_CREATE_MAPPED_BIT);
+  memcpy(staging.info.pMappedData, data, size);
+
+  immediate_submit([&](VkCommandBuffer cmd) {
+    VkBufferCopy copy{0, 0, size};
+    vkCmdCopyBuffer(cmd, staging.buffer, buffer.buffer, 1, &copy);
+  });
+
+  _memory.destroy_buffer(staging);
+  return buffer;
+}
+
+void VulkanEngine::destroy_mesh(const GPUMeshBuffers &mesh) {
+  _memory.destroy_buffer(mesh.indexBuffer);
+  _memory.destroy_buffer(mesh.positionBuffer);
+  _memory.destroy_buffer(mesh.attributeBuffer);
 }
 
 void VulkanEngine::run() {
   SDL_Event e;
   bool bQuit = false;
+  auto lastFrame = std::chrono::steady_clock::now();
 
   // main loop
   while (!bQuit) {
     // Handle events on queue
     while (SDL_PollEvent(&e) != 0) {
+      switch (e.type) {
       // close the window when user alt-f4s or clicks the X button
-      if (e.type == SDL_EVENT_QUIT)
-
-        switch (e.type) {
-        case SDL_EVENT_QUIT:
-          bQuit = true;
-          break;
-        case SDL_EVENT_WINDOW_MINIMIZED:
-          stop_rendering = true;
-          break;
-        case SDL_EVENT_WINDOW_RESTORED:
-          stop_rendering = false;
-          break;
-        }
+      case SDL_EVENT_QUIT:
+        bQuit = true;
+        break;
+      case SDL_EVENT_WINDOW_MINIMIZED:
+        stop_rendering = true;
+        break;
+      case SDL_EVENT_WINDOW_RESTORED:
+        stop_rendering = false;
+        break;
+      }
+
+      _camera.process_sdl_event(e);
     }
 
+    auto now = std::chrono::steady_clock::now();
+    _deltaTime = std::chrono::duration<float>(now - lastFrame).count();
+    _camera.update(_deltaTime);
+    lastFrame = now;
+
     // do not draw if we are minimized
     if (stop_rendering) {
       // throttle the speed to avoid the endless spinning
@@ -214,13 +522,36 @@ void VulkanEngine::run() {
   }
 }
 
+void VulkanEngine::init_metrics() {
+  const char *segment = std::getenv("GPSIM_METRICS");
+  std::string name = segment ? segment : "/gpsim_metrics";
+  _metrics.init(name == "0" ? std::string() : name);
+  // flushed last, after every thread updating the metrics has stopped
+  _mainDeletionQueue.add([&]() { _metrics.cleanup(); });
+
+  _frameMetrics.interval = _metrics.histogram("frame.interval");
+  _frameMetrics.cpuTime = _metrics.histogram("frame.cpu");
+  _frameMetrics.fenceWait = _metrics.histogram("frame.fence_wait");
+  _frameMetrics.acquireWait = _metrics.histogram("frame.acquire_wait");
+  _frameMetrics.particlesGpu = _metrics.histogram("gpu.particles");
+  _frameMetrics.frames = _metrics.counter("frame.count");
+  _frameMetrics.alive = _metrics.gauge("particles.alive");
+}
+
 void VulkanEngine::init_vulkan() {
   // Init Instance
   vkb::InstanceBuilder builder;
 
+  // whatever surface SDL creates, including the headless one of its
+  // offscreen driver
+  Uint32 sdlExtensionCount = 0;
+  const char *const *sdlExtensions =
+      SDL_Vulkan_GetInstanceExtensions(&sdlExtensionCount);
+
   auto inst_ret =
       builder.set_app_name("Simulation Studio")
-          .request_validation_layers()
+          .request_validation_layers(_validationLayers)
+          .enable_extensions(sdlExtensionCount, sdlExtensions)
           .set_debug_callback(
               [](VkDebugUtilsMessageSeverityFlagBitsEXT messageSeverity,
                  VkDebugUtilsMessageTypeFlagsEXT messageType,
@@ -259,34 +590,94 @@ void VulkanEngine::init_vulkan() {
       .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES};
   features12.descriptorIndexing = true;
   features12.bufferDeviceAddress = true;
+  features12.drawIndirectCount = true;
+  features12.samplerFilterMinmax = true;
+
+  VkPhysicalDeviceFeatures features10{};
+  // indirect commands carry the instance index in firstInstance
+  features10.drawIndirectFirstInstance = true;
 
   vkb::PhysicalDeviceSelector selector{vkb_inst};
   vkb::PhysicalDevice physical_device =
       selector.set_minimum_version(1, 3)
           .set_required_features_13(features)
           .set_required_features_12(features12)
+          .set_required_features(features10)
           .set_surface(this->_surface)
           .select()
           .value();
 
+  // packed depth and color splats are resolved with 64-bit atomic max, the
+  // tiled variant also in shared memory. Splatting is off without them.
+  VkPhysicalDeviceFeatures int64Features{};
+  int64Features.shaderInt64 = true;
+  VkPhysicalDeviceVulkan12Features bufferAtomics{
+      .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES};
+  bufferAtomics.shaderBufferInt64Atomics = true;
+  VkPhysicalDeviceVulkan12Features sharedAtomics{
+      .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES};
+  sharedAtomics.shaderSharedInt64Atomics = true;
+  _splatAtomics =
+      physical_device.enable_features_if_present(int64Features) &&
+      physical_device.enable_extension_features_if_present(bufferAtomics);
+  _splatSharedAtomics =
+      _splatAtomics &&
+      physical_device.enable_extension_features_if_present(sharedAtomics);
+
+  // the swapchain resolve stores to formats GLSL has no qualifier for
+  VkPhysicalDeviceFeatures storageFeatures{};
+  storageFeatures.shaderStorageImageWriteWithoutFormat = true;
+  _storageWriteWithoutFormat =
+      physical_device.enable_features_if_present(storageFeatures);
+
+  // graphics pipelines are linked from separately compiled parts, see
+  // GraphicsPipelineCache. GPSIM_PIPELINE_LIBRARY=0 builds them whole.
+  VkPhysicalDeviceGraphicsPipelineLibraryFeaturesEXT libraryFeatures{
+      .sType =
+          VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_GRAPHICS_PIPELINE_LIBRARY_FEATURES_EXT};
+  libraryFeatures.graphicsPipelineLibrary = true;
+  const char *pipelineLibrary = std::getenv("GPSIM_PIPELINE_LIBRARY");
+  _graphicsPipelineLibrary =
+      (pipelineLibrary == nullptr || std::string(pipelineLibrary) != "0") &&
+      physical_device.enable_extension_if_present(
+          VK_KHR_PIPELINE_LIBRARY_EXTENSION_NAME) &&
+      physical_device.enable_extension_if_present(
+          VK_EXT_GRAPHICS_PIPELINE_LIBRARY_EXTENSION_NAME) &&
+      physical_device.enable_extension_features_if_present(libraryFeatures);
+
+  // lets VMA report real per process budgets instead of estimates
+  bool memoryBudget = physical_device.enable_extension_if_present(
+      VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+
   // Create Logical Device
   vkb::DeviceBuilder device_builder{physical_device};
   vkb::Device vkb_device = device_builder.build().value();
 
   this->_device = vkb_device.device;
   this->_chosenGPU = physical_device.physical_device;
+  this->_gpuProperties = physical_device.properties;
 
   _graphicsQueue = vkb_device.get_queue(vkb::QueueType::graphics).value();
   _graphicsQueueFamily =
 	  vkb_device.get_queue_index(vkb::QueueType::graphics).value();
+  _timestampValidBits =
+      physical_device.get_queue_families()[_graphicsQueueFamily].timestampValidBits;
 
   VmaAllocatorCreateInfo allocatorInfo = {};
   allocatorInfo.physicalDevice = this->_chosenGPU;
   allocatorInfo.device = this->_device;
   allocatorInfo.instance = this->_instance;
   allocatorInfo.flags = VMA_ALLOCATOR_CREATE_BUFFER_DEVICE_ADDRESS_BIT;
+  if (memoryBudget) {
+    allocatorInfo.flags |= VMA_ALLOCATOR_CREATE_EXT_MEMORY_BUDGET_BIT;
+  }
   vmaCreateAllocator(&allocatorInfo, &_allocator);
   _mainDeletionQueue.add([=, this]() { vmaDestroyAllocator(_allocator); });
+
+  _memory.init(_allocator, _device, FRAME_OVERLAP);
+  _mainDeletionQueue.add([&]() { _memory.cleanup(); });
+  // after the subsystems whose views and tables point into them
+  _mainDeletionQueue.add([&]() { _transients.destroy(); });
 }
 
 void VulkanEngine::init_swapchain() {
@@ -303,6 +694,7 @@ void VulkanEngine::init_swapchain() {
     drawImageUsages |= VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
 	drawImageUsages |= VK_IMAGE_USAGE_TRANSFER_DST_BIT;
 	drawImageUsages |= VK_IMAGE_USAGE_STORAGE_BIT;
+	drawImageUsages |= VK_IMAGE_USAGE_SAMPLED_BIT;
 	drawImageUsages |= VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
 
     VkImageCreateInfo rimg_info = vkinit::image_create_info(_drawImage.imageFormat, drawImageUsages, drawImageExtent);
@@ -311,22 +703,78 @@ void VulkanEngine::init_swapchain() {
     rimg_alloc_info.usage = VMA_MEMORY_USAGE_GPU_ONLY;
     rimg_alloc_info.requiredFlags = VkMemoryPropertyFlags(VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
 
-	vmaCreateImage(_allocator, &rimg_info, &rimg_alloc_info, &_drawImage.image, &_drawImage.allocation, nullptr);
+	vk_check(_memory.create_image(rimg_info, rimg_alloc_info, MemoryTag::RenderTarget, &_drawImage.image, &_drawImage.allocation));
 
 	VkImageViewCreateInfo rview_info = vkinit::imageview_create_info(_drawImage.imageFormat, _drawImage.image, VK_IMAGE_ASPECT_COLOR_BIT);
 
 	vk_check(vkCreateImageView(this->_device, &rview_info, nullptr, &_drawImage.imageView));
+
+    // reverse-Z depth, sampled afterwards to build the depth pyramid
+    _depthImage.imageFormat = VK_FORMAT_D32_SFLOAT;
+    _depthImage.imageExtent = drawImageExtent;
+    VkImageUsageFlags depthImageUsages = VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
+
+    VkImageCreateInfo dimg_info = vkinit::image_create_info(_depthImage.imageFormat, depthImageUsages, drawImageExtent);
+	vk_check(_memory.create_image(dimg_info, rimg_alloc_info, MemoryTag::RenderTarget, &_depthImage.image, &_depthImage.allocation));
+
+	VkImageViewCreateInfo dview_info = vkinit::imageview_create_info(_depthImage.imageFormat, _depthImage.image, VK_IMAGE_ASPECT_DEPTH_BIT);
+	vk_check(vkCreateImageView(this->_device, &dview_info, nullptr, &_depthImage.imageView));
+
         _mainDeletionQueue.add([=, this]() {
           vkDestroyImageView(this->_device, _drawImage.imageView, nullptr);
-          vmaDestroyImage(_allocator, _drawImage.image, _drawImage.allocation);
+          _memory.destroy_image(_drawImage.image, _drawImage.allocation);
+
+          vkDestroyImageView(this->_device, _depthImage.imageView, nullptr);
+          _memory.destroy_image(_depthImage.image, _depthImage.allocation);
         });
 }
 
+static bool supports_storage(VkPhysicalDevice gpu, VkFormat format) {
+  VkFormatProperties properties;
+  vkGetPhysicalDeviceFormatProperties(gpu, format, &properties);
+  return properties.optimalTilingFeatures & VK_FORMAT_FEATURE_STORAGE_IMAGE_BIT;
+}
+
+// the hardware encodes writes to these, stores from a shader need it done
+static bool is_srgb_format(VkFormat format) {
+  switch (format) {
+  case VK_FORMAT_B8G8R8A8_SRGB:
+  case VK_FORMAT_R8G8B8A8_SRGB:
+  case VK_FORMAT_A8B8G8R8_SRGB_PACK32:
+    return true;
+  default:
+    return false;
+  }
+}
+
 void VulkanEngine::create_swapchain(uint32_t width, uint32_t height) {
   vkb::SwapchainBuilder swapchain_builder{this->_chosenGPU, this->_device,
                                           this->_surface};
   this->_swapchainImageFormat = VK_FORMAT_B8G8R8A8_UNORM;
 
+  // the swapchain images are written from compute when the surface and the
+  // format allow it, GPSIM_RESOLVE=blit keeps the blit either way. Storage
+  // usage is only asked for when our format is on the surface, otherwise
+  // vk-bootstrap falls back to another one that may not support it.
+  VkSurfaceCapabilitiesKHR capabilities;
+  vk_check(vkGetPhysicalDeviceSurfaceCapabilitiesKHR(_chosenGPU, _surface, &capabilities));
+  uint32_t surfaceFormatCount = 0;
+  vk_check(vkGetPhysicalDeviceSurfaceFormatsKHR(_chosenGPU, _surface, &surfaceFormatCount, nullptr));
+  std::vector<VkSurfaceFormatKHR> surfaceFormats(surfaceFormatCount);
+  vk_check(vkGetPhysicalDeviceSurfaceFormatsKHR(_chosenGPU, _surface, &surfaceFormatCount, surfaceFormats.data()));
+  bool formatAvailable = std::ranges::any_of(surfaceFormats, [this](const VkSurfaceFormatKHR &format) {
+    return format.format == _swapchainImageFormat && format.colorSpace == VK_COLOR_SPACE_SRGB_NONLINEAR_KHR;
+  });
+  const char *resolve = std::getenv("GPSIM_RESOLVE");
+  bool storage = _storageWriteWithoutFormat && formatAvailable &&
+                 supports_storage(_chosenGPU, _swapchainImageFormat) &&
+                 (capabilities.supportedUsageFlags & VK_IMAGE_USAGE_STORAGE_BIT) &&
+                 !(resolve && std::string_view(resolve) == "blit");
+  VkImageUsageFlags usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+  if (storage) {
+    usage |= VK_IMAGE_USAGE_STORAGE_BIT;
+  }
+
   vkb::Swapchain vkbSwapchain =
       swapchain_builder
           .set_desired_format(VkSurfaceFormatKHR{
@@ -334,13 +782,23 @@ void VulkanEngine::create_swapchain(uint32_t width, uint32_t height) {
               .colorSpace = VK_COLOR_SPACE_SRGB_NONLINEAR_KHR})
           .set_desired_present_mode(VK_PRESENT_MODE_FIFO_KHR)
           .set_desired_extent(width, height)
-          .add_image_usage_flags(VK_IMAGE_USAGE_TRANSFER_DST_BIT)
+          .add_image_usage_flags(usage)
           .build()
           .value();
+  this->_swapchainImageFormat = vkbSwapchain.image_format;
   this->_swapchainExtent = vkbSwapchain.extent;
   this->_swapchain = vkbSwapchain.swapchain;
   this->_swapchainImages = vkbSwapchain.get_images().value();
   this->_swapchainImageViews = vkbSwapchain.get_image_views().value();
+
+  // decided on the format we got, the blit takes over if it cannot be stored
+  _swapchainStorage = storage && supports_storage(_chosenGPU, vkbSwapchain.image_format);
+  _swapchainEncodeSrgb = vkbSwapchain.color_space == VK_COLOR_SPACE_SRGB_NONLINEAR_KHR &&
+                         !is_srgb_format(vkbSwapchain.image_format);
+  if (storage && !_swapchainStorage) {
+    spdlog::warn("Swapchain format {} has no storage support, blitting instead",
+                 string_VkFormat(vkbSwapchain.image_format));
+  }
 }
 
 void VulkanEngine::destroy_swapchain() {
@@ -357,6 +815,11 @@ void VulkanEngine::init_commands() {
 		VkCommandBufferAllocateInfo cmdAllocInfo = vkinit::command_buffer_allocate_info(_frames[i]._pool, 1);
 		vk_check(vkAllocateCommandBuffers(this->_device, &cmdAllocInfo, &_frames[i]._buffer));
     }
+
+	vk_check(vkCreateCommandPool(this->_device, &commandPoolInfo, nullptr, &_immCommandPool));
+	VkCommandBufferAllocateInfo cmdAllocInfo = vkinit::command_buffer_allocate_info(_immCommandPool, 1);
+	vk_check(vkAllocateCommandBuffers(this->_device, &cmdAllocInfo, &_immCommandBuffer));
+	_mainDeletionQueue.add([=, this]() { vkDestroyCommandPool(this->_device, _immCommandPool, nullptr); });
 }
 
 void VulkanEngine::init_sync_structures() {
@@ -368,13 +831,18 @@ void VulkanEngine::init_sync_structures() {
 		vk_check(vkCreateSemaphore(this->_device, &semaphoreInfo, nullptr, &_frames[i]._swapchainSemaphore));
 		vk_check(vkCreateSemaphore(this->_device, &semaphoreInfo, nullptr, &_frames[i]._renderSemaphore));
 	}
+
+	vk_check(vkCreateFence(this->_device, &fenceInfo, nullptr, &_immFence));
+	_mainDeletionQueue.add([=, this]() { vkDestroyFence(this->_device, _immFence, nullptr); });
 }
 
 void VulkanEngine::init_descriptors() {
   std::vector<DescriptorAllocator::PoolSizeRatio> sizes = {
-      {VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 1}};
+      {VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 1},
+      {VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 1}};
 
-  globalDescriptorAllocator.init_pool(_device, 10, sizes);
+  // room for one set per depth pyramid level and swapchain image
+  globalDescriptorAllocator.init_pool(_device, 48, sizes);
   // make the descriptor set layout for our compute draw
   {
     DescriptorLayoutBuilder builder;
@@ -412,7 +880,35 @@ void VulkanEngine::init_descriptors() {
   });
 }
 
-void VulkanEngine::init_pipelines() { init_background_pipelines(); }
+void VulkanEngine::init_pipelines() {
+  // GPSIM_SHADER_DIR lets a development build pick up freshly compiled .spv
+  // files instead of the ones linked into the binary
+  _shaders.init(_device, std::getenv("GPSIM_SHADER_DIR"));
+  _mainDeletionQueue.add([&]() { _shaders.cleanup(); });
+
+  _pipelines.init(_device, _graphicsPipelineLibrary, FRAME_OVERLAP);
+  _mainDeletionQueue.add([&]() { _pipelines.cleanup(); });
+
+  // the tuning results live next to the other per-user state; set
+  // GPSIM_AUTOTUNE=0 to keep the default workgroup sizes
+  char *prefPath = SDL_GetPrefPath("MrDiver", "GPSimulation");
+  std::string tuningCache =
+      std::string(prefPath ? prefPath : "") + "kernel_tuning.txt";
+  SDL_free(prefPath);
+
+  const char *autotune = std::getenv("GPSIM_AUTOTUNE");
+  _kernelTuner.enabled = autotune == nullptr || std::string(autotune) != "0";
+  _kernelTuner.init(_chosenGPU, _device, _graphicsQueueFamily, tuningCache);
+  _mainDeletionQueue.add([&]() { _kernelTuner.cleanup(); });
+
+  _primitives.init(this);
+  _mainDeletionQueue.add([&]() { _primitives.cleanup(); });
+
+  _resolve.init(this);
+  _mainDeletionQueue.add([&]() { _resolve.cleanup(); });
+
+  init_background_pipelines();
+}
 
 void VulkanEngine::init_background_pipelines() {
   VkPipelineLayoutCreateInfo computeLayout{};
@@ -424,38 +920,325 @@ void VulkanEngine::init_background_pipelines() {
   vk_check(vkCreatePipelineLayout(_device, &computeLayout, nullptr,
                                   &_gradientPipelineLayout));
 
-  VkShaderModule computeDrawShader;
-  if (!vkutil::load_shader_module("build/shaders/gradient_cs.spv",
-                                  _device, // TODO: HLSL Doesn't work
-                                  &computeDrawShader)) {
-    fmt::print("Error when building the compute shader \n");
-    std::abort();
-  }
+  // TODO: HLSL Doesn't work
+  VkShaderModule computeDrawShader = _shaders.get("gradient_cs");
 
-  VkPipelineShaderStageCreateInfo stageinfo{};
-  stageinfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-  stageinfo.pNext = nullptr;
-  stageinfo.stage = VK_SHADER_STAGE_COMPUTE_BIT;
-  stageinfo.module = computeDrawShader;
-  stageinfo.pName = "main";
+  // one pipeline per tile size, the first one is the default when the tuner
+  // is disabled or has no timestamps
+  const WorkgroupSize candidates[] = {
+      {16, 16, 1}, {8, 8, 1}, {32, 8, 1}, {8, 32, 1}, {16, 8, 1}, {32, 32, 1}};
+  const uint32_t highlightWorkgroups = VK_TRUE;
+  _gradientKernel = vkutil::build_compute_kernel(
+      _device, _gpuProperties.limits, "gradient", _gradientPipelineLayout,
+      computeDrawShader, candidates, {&highlightWorkgroups, 1});
 
-  VkComputePipelineCreateInfo computePipelineCreateInfo{};
-  computePipelineCreateInfo.sType =
-      VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
-  computePipelineCreateInfo.pNext = nullptr;
-  computePipelineCreateInfo.layout = _gradientPipelineLayout;
-  computePipelineCreateInfo.stage = stageinfo;
+  _mainDeletionQueue.add([&]() {
+    vkDestroyPipelineLayout(_device, _gradientPipelineLayout, nullptr);
+    _gradientKernel.destroy(_device);
+  });
 
-  vk_check(vkCreateComputePipelines(_device, VK_NULL_HANDLE, 1,
-                                    &computePipelineCreateInfo, nullptr,
-                                    &_gradientPipeline));
+  _kernelTuner.tune(
+      _gradientKernel,
+      [this](std::function<void(VkCommandBuffer cmd)> &&function) {
+        immediate_submit(std::move(function));
+      },
+      [this](VkCommandBuffer cmd, const ComputeKernel &kernel) {
+        vkutil::transition_image(cmd, _drawImage.image,
+                                 VK_IMAGE_LAYOUT_UNDEFINED,
+                                 VK_IMAGE_LAYOUT_GENERAL);
+        kernel.bind(cmd);
+        vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE,
+                                kernel.layout, 0, 1, &_drawImageDescriptors, 0,
+                                nullptr);
+        kernel.dispatch(cmd, _drawImage.imageExtent.width,
+                        _drawImage.imageExtent.height);
+      });
+}
 
-  vkDestroyShaderModule(_device, computeDrawShader, nullptr);
+void VulkanEngine::init_scene() {
+  for (uint32_t i = 0; i < FRAME_OVERLAP; i++) {
+    _frames[i]._sceneDataBuffer = _memory.create_buffer(
+        sizeof(GPUSceneData),
+        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+            VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT,
+        VMA_MEMORY_USAGE_CPU_TO_GPU, MemoryTag::Other,
+        VMA_ALLOCATION_CREATE_MAPPED_BIT);
+  }
 
+  _indirect.init(this);
   _mainDeletionQueue.add([&]() {
-    vkDestroyPipelineLayout(_device, _gradientPipelineLayout, nullptr);
-    vkDestroyPipeline(_device, _gradientPipeline, nullptr);
+    _indirect.cleanup();
+    for (uint32_t i = 0; i < FRAME_OVERLAP; i++) {
+      _memory.destroy_buffer(_frames[i]._sceneDataBuffer);
+    }
   });
+
+  const char *scenePath = std::getenv("GPSIM_SCENE");
+  std::filesystem::path scene = scenePath ? scenePath : "models/dragon.glb";
+
+  Bounds bounds{};
+  const char *stream = std::getenv("GPSIM_STREAM");
+  if (stream && std::string_view(stream) == "1") {
+    // the cluster file is built next to the asset on first use
+    std::filesystem::path clusters = std::filesystem::path(scene).concat(".clusters");
+    StreamingOptions options;
+    if (const char *pool = std::getenv("GPSIM_STREAM_POOL_MB")) {
+      options.poolBytes = VkDeviceSize(std::strtoull(pool, nullptr, 10)) << 20;
+    }
+    if ((!cluster_file_current(scene, clusters) &&
+         !build_cluster_file(scene, clusters)) ||
+        !_streaming.init(this, clusters, options)) {
+      spdlog::warn("No scene streamed, only the background is drawn");
+      return;
+    }
+    _mainDeletionQueue.add([&]() { _streaming.cleanup(); });
+
+    glm::vec4 sphere = _streaming.bounds();
+    bounds.origin = glm::vec3(sphere);
+    bounds.sphereRadius = sphere.w;
+    bounds.extents = glm::vec3(sphere.w);
+  } else {
+    _sceneMeshes = loadGltfMeshes(this, scene);
+    if (!_sceneMeshes) {
+      spdlog::warn("No scene loaded, only the background is drawn");
+      return;
+    }
+    _mainDeletionQueue.add([&]() { destroy_mesh(_sceneMeshes->buffers); });
+    // the indirect renderer reads the streams through their handles every frame
+    GPUMeshBuffers &buffers = _sceneMeshes->buffers;
+    for (AllocatedBuffer *buffer : {&buffers.indexBuffer, &buffers.positionBuffer,
+                                    &buffers.attributeBuffer}) {
+      _memory.register_movable(buffer);
+    }
+    bounds = _sceneMeshes->meshes[0]->bounds;
+  }
+
+  // a grid of copies so there is something to cull
+  constexpr int gridSize = 24;
+  float spacing = bounds.sphereRadius * 2.5f;
+  std::vector<glm::mat4> transforms;
+  transforms.reserve(gridSize * gridSize * gridSize);
+  for (int x = 0; x < gridSize; x++) {
+    for (int y = 0; y < gridSize; y++) {
+      for (int z = 0; z < gridSize; z++) {
+        glm::vec3 offset =
+            glm::vec3(x, y, z) - glm::vec3((gridSize - 1) / 2.f);
+        transforms.push_back(
+            glm::translate(glm::mat4(1.f), offset * spacing));
+      }
+    }
+  }
+  if (_streaming.enabled()) {
+    _streaming.set_instances(transforms);
+  } else {
+    _indirect.set_scene(*_sceneMeshes, transforms);
+  }
+
+  // GPSIM_LOD_PIXEL_ERROR=0 draws every instance at full detail
+  if (const char *pixelError = std::getenv("GPSIM_LOD_PIXEL_ERROR")) {
+    _indirect.lodPixelError = std::max(0.f, (float)std::atof(pixelError));
+  }
+  // GPSIM_CPU_CULL=1 frustum culls on the CPU, without occlusion culling
+  if (const char *cpuCull = std::getenv("GPSIM_CPU_CULL")) {
+    _indirect.cpuCulling = std::string_view(cpuCull) == "1";
+  }
+
+  _camera.speed = spacing * 2.f;
+  _camera.look_at(bounds.origin + glm::vec3(0.f, 0.35f, 1.f) * spacing * gridSize,
+                  bounds.origin);
+
+  const char *cloth = std::getenv("GPSIM_CLOTH");
+  if (cloth && std::string_view(cloth) == "1") {
+    // the copy closest to the middle of the grid
+    int center = gridSize / 2;
+    init_cloth(scene, bounds, transforms[(center * gridSize + center) * gridSize + center]);
+  }
+}
+
+void VulkanEngine::init_cloth(const std::filesystem::path &scene,
+                              const Bounds &bounds, const glm::mat4 &transform) {
+  // the collider needs the triangles on the host, the drawn meshes only
+  // kept them on the GPU
+  MeshLoadOptions options;
+  options.maxLods = 1;
+  std::optional<MeshGeometry> geometry = loadGltfGeometry(scene, options);
+  if (!geometry || geometry->meshes.empty()) {
+    spdlog::warn("No cloth, the scene has no mesh to collide with");
+    return;
+  }
+  const GeoSurface &surface = geometry->meshes[0]->surfaces[0];
+  std::vector<uint32_t> indices(
+      geometry->indices.begin() + surface.firstIndex,
+      geometry->indices.begin() + surface.firstIndex + surface.indexCount);
+  for (uint32_t &index : indices) {
+    index += surface.vertexOffset;
+  }
+  _clothCollider.build(geometry->positions, indices, transform);
+
+  glm::vec3 center = glm::vec3(transform * glm::vec4(bounds.origin, 1.f));
+  ClothSettings settings;
+  settings.size = bounds.sphereRadius * 2.2f;
+  glm::mat4 placement = glm::translate(
+      glm::mat4(1.f), center + glm::vec3(0.f, bounds.sphereRadius * 1.2f, 0.f));
+
+  XpbdSettings xpbd;
+  xpbd.thickness = settings.size / settings.resolution * 0.5f;
+  _cloth.init(this, vkutil::make_cloth(placement, settings), xpbd,
+              &_clothCollider);
+  _mainDeletionQueue.add([&]() { _cloth.cleanup(); });
+
+  _camera.look_at(center + glm::vec3(0.f, 0.5f, 1.5f) * bounds.sphereRadius * 2.f,
+                  center);
+}
+
+void VulkanEngine::init_simulation() {
+  ParticleSettings settings;
+  if (const char *capacity = std::getenv("GPSIM_PARTICLES")) {
+    settings.capacity = (uint32_t)std::strtoul(capacity, nullptr, 10);
+  }
+  if (const char *substeps = std::getenv("GPSIM_SUBSTEPS")) {
+    settings.substeps = (uint32_t)std::strtoul(substeps, nullptr, 10);
+  }
+  // GPSIM_POSITION_FORMAT and GPSIM_VELOCITY_FORMAT pick fp32, fp16 or fixed
+  // storage, fixed point cells are sized so GPSIM_FIXED_EXTENT (metres
+  // around the origin) fits
+  auto storage_format = [](const char *name, StorageFormat fallback) {
+    if (name) {
+      for (StorageFormat format : {StorageFormat::Float32, StorageFormat::Float16,
+                                   StorageFormat::Fixed}) {
+        if (std::string_view(name) == to_string(format)) {
+          return format;
+        }
+      }
+      spdlog::warn("Unknown storage format {}, using {}", name, to_string(fallback));
+    }
+    return fallback;
+  };
+  settings.storage.position = storage_format(
+      std::getenv("GPSIM_POSITION_FORMAT"), settings.storage.position);
+  settings.storage.velocity = storage_format(
+      std::getenv("GPSIM_VELOCITY_FORMAT"), settings.storage.velocity);
+  const char *extent = std::getenv("GPSIM_FIXED_EXTENT");
+  settings.storage.cellExponent =
+      vkutil::fixed_cell_exponent(extent ? (float)std::atof(extent) : 256.f);
+
+  _readback.init(this, 16u << 20);
+  _mainDeletionQueue.add([&]() { _readback.cleanup(); });
+
+  const char *analytics = std::getenv("GPSIM_ANALYTICS");
+  _analytics = analytics && std::string_view(analytics) == "1";
+
+  // the GPU system also holds what the CPU backend uploads for drawing
+  _particles.init(this, settings);
+  _mainDeletionQueue.add([&]() { _particles.cleanup(); });
+
+  const char *backend = std::getenv("GPSIM_BACKEND");
+  _cpuSimulation = backend && std::string_view(backend) == "cpu";
+  if (_cpuSimulation) {
+    _cpuParticles.init(settings);
+    _mainDeletionQueue.add([&]() { _cpuParticles.cleanup(); });
+  }
+
+  const char *sph = std::getenv("GPSIM_SPH");
+  if (sph && std::string_view(sph) == "1") {
+    if (_cpuSimulation) {
+      _cpuSph.init(&_cpuParticles, SphSettings{});
+    } else {
+      _sph.init(this, &_particles, SphSettings{});
+      _mainDeletionQueue.add([&]() { _sph.cleanup(); });
+    }
+  }
+
+  // GPSIM_GRAVITY=1 pulls the particles together with Barnes-Hut gravity,
+  // GPSIM_GRAVITY_THETA sets the opening angle
+  const char *gravity = std::getenv("GPSIM_GRAVITY");
+  if (gravity && std::string_view(gravity) == "1") {
+    GravitySettings gravitySettings;
+    if (const char *theta = std::getenv("GPSIM_GRAVITY_THETA")) {
+      gravitySettings.theta = std::strtof(theta, nullptr);
+    }
+    if (_cpuSimulation) {
+      _cpuGravity.init(settings.capacity, gravitySettings);
+      _cpuGravity.attach(&_cpuParticles);
+    } else {
+      _gravity.init(this, settings.capacity, gravitySettings);
+      _gravity.attach(&_particles);
+      _mainDeletionQueue.add([&]() { _gravity.cleanup(); });
+    }
+  }
+
+  // the CPU solver steps on its own thread at a fixed rate, GPSIM_SIM_HZ
+  // (default 120), 0 runs it unpaced as fast as it goes
+  if (_cpuSimulation) {
+    // GPSIM_RESUME continues from the last frame of a recording, or from the
+    // last one at or before GPSIM_RESUME_STEP
+    if (const char *resume = std::getenv("GPSIM_RESUME")) {
+      CheckpointReader reader;
+      if (reader.open(resume) && reader.frame_count() > 0) {
+        size_t frame = reader.frame_count() - 1;
+        if (const char *step = std::getenv("GPSIM_RESUME_STEP")) {
+          frame = reader.find(std::strtoull(step, nullptr, 10));
+        }
+        if (vkutil::restore_particles(reader, frame, _cpuParticles)) {
+          spdlog::info("Resumed {} particles from step {} of {}", _cpuParticles.alive(),
+                       reader.frame(frame).step, resume);
+        } else {
+          spdlog::error("Could not restore CPU particles from {}", resume);
+        }
+      }
+    }
+
+    // GPSIM_RECORD writes every step into a checkpoint file
+    if (const char *record = std::getenv("GPSIM_RECORD")) {
+      CheckpointOptions options;
+      options.jobs = &_cpuParticles.jobs();
+      if (_recording.open(record, vkutil::particle_checkpoint_fields(), options)) {
+        _simThread.record(&_recording);
+        // flushed after the thread writing into it has stopped
+        _mainDeletionQueue.add([&]() { _recording.close(); });
+      }
+    }
+
+    float rate = 120.f;
+    if (const char *hz = std::getenv("GPSIM_SIM_HZ")) {
+      rate = std::strtof(hz, nullptr);
+    }
+    _simThread.time_steps(_metrics.histogram("sim.step"));
+    _simThread.start(&_cpuParticles, rate > 0.f ? 1.f / rate : 1.f / 120.f, rate > 0.f);
+    // flushed before the particles it steps
+    _mainDeletionQueue.add([&]() { _simThread.stop(); });
+  }
+
+  const char *splat = std::getenv("GPSIM_SPLAT");
+  _splatParticles = !(splat && std::string_view(splat) == "0");
+  if (_splatParticles && !_splatAtomics) {
+    spdlog::warn("Point splatting needs 64-bit buffer atomics, turning it off");
+    _splatParticles = false;
+  }
+  if (_splatParticles) {
+    SplatMode mode = splat && std::string_view(splat) == "tiled"
+                         ? SplatMode::Tiled
+                         : SplatMode::Direct;
+    if (mode == SplatMode::Tiled && !_splatSharedAtomics) {
+      spdlog::warn("Tiled point splatting needs 64-bit shared atomics, using the direct mode");
+      mode = SplatMode::Direct;
+    }
+    _splatter.init(this, &_particles, mode);
+    _mainDeletionQueue.add([&]() { _splatter.cleanup(); });
+  }
+
+  const char *volume = std::getenv("GPSIM_VOLUME");
+  if (volume && std::string_view(volume) == "1") {
+    _volume.init(this, VolumeSettings{});
+    _mainDeletionQueue.add([&]() { _volume.cleanup(); });
+  }
+}
+
+void VulkanEngine::init_transients() {
+  // the only radix sorts of a frame are the gravity tree builds
+  _primitives.alias_scratch(_transients, PASS_SIMULATION, PASS_SIMULATION);
+  _transients.build(_device, _allocator, _memory,
+                    _gpuProperties.limits.bufferImageGranularity);
 }
 
 FrameData& VulkanEngine::get_current_frame() {
@@ -0,0 +1,225 @@
+#include <vk_gravity.h>
+#include <vk_engine.h>
+#include <vk_images.h>
+#include <vk_initializers.h>
+
+#include <algorithm>
+
+// must match the modes in shaders/gravity_prepare.comp and gravity_integrate.comp
+enum : uint32_t {
+	PREPARE_BUILD = 0,
+	PREPARE_ROOT = 1,
+	PREPARE_LEVEL = 2,
+};
+
+enum : uint32_t {
+	INTEGRATE_KICK = 0,
+	INTEGRATE_DRIFT = 1,
+};
+
+// the prepare pass writes the indirect arguments of the passes after it
+static void pass_barrier(VkCommandBuffer cmd)
+{
+	vkutil::memory_barrier(cmd, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+		VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_2_DRAW_INDIRECT_BIT,
+		VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT
+			| VK_ACCESS_2_INDIRECT_COMMAND_READ_BIT);
+}
+
+void GravitySolver::init(VulkanEngine* engine, uint32_t capacity, const GravitySettings& settings)
+{
+	_engine = engine;
+	_capacity = std::max(capacity, 1u);
+	_settings = settings;
+	_maxNodes = std::max(uint32_t(_capacity * _settings.nodesPerBody), 1024u);
+
+	VkDevice device = _engine->_device;
+	const VkPhysicalDeviceLimits& limits = _engine->_gpuProperties.limits;
+	GpuMemory& memory = _engine->_memory;
+
+	const VkBufferUsageFlags usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT;
+	auto create = [&](VkDeviceSize size, VkBufferUsageFlags extra = 0) {
+		return memory.create_buffer(size, usage | extra, VMA_MEMORY_USAGE_GPU_ONLY, MemoryTag::Simulation);
+	};
+	_state = create(sizeof(GPUOctreeState), VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT);
+	_nodes = create(_maxNodes * sizeof(GPUOctreeNode));
+	_keys = create(_capacity * sizeof(uint32_t));
+	_values = create(_capacity * sizeof(uint32_t));
+	_sortedPositions = create(_capacity * sizeof(glm::vec4));
+	_accelerations = create(_capacity * sizeof(glm::vec4), VK_BUFFER_USAGE_TRANSFER_SRC_BIT);
+	_interactions = create(_capacity * sizeof(uint32_t), VK_BUFFER_USAGE_TRANSFER_SRC_BIT);
+	_engine->_primitives.reserve(_capacity);
+
+	GPUOctreeBuffers table{};
+	table.state = _state.address;
+	table.nodes = _nodes.address;
+	table.keys = _keys.address;
+	table.values = _values.address;
+	table.sortedPositions = _sortedPositions.address;
+	_buffersTable = _engine->upload_buffer(&table, sizeof(table), usage, MemoryTag::Simulation);
+
+	VkPushConstantRange range{};
+	range.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+	range.size = sizeof(PushConstants);
+
+	VkPipelineLayoutCreateInfo layoutInfo = vkinit::pipeline_layout_create_info();
+	layoutInfo.pushConstantRangeCount = 1;
+	layoutInfo.pPushConstantRanges = &range;
+	vk_check(vkCreatePipelineLayout(device, &layoutInfo, nullptr, &_layout));
+
+	// the bounds reduction and the per node passes are written for one size,
+	// the traversal is register heavy and prefers small groups
+	const WorkgroupSize single[] = {{1, 1, 1}};
+	const WorkgroupSize nodeSizes[] = {{OCTREE_NODE_GROUP, 1, 1}};
+	const WorkgroupSize bodySizes[] = {{256, 1, 1}, {128, 1, 1}};
+	const WorkgroupSize forceSizes[] = {{64, 1, 1}, {128, 1, 1}, {32, 1, 1}};
+	auto kernel = [&](const char* name, std::span<const WorkgroupSize> sizes) {
+		return vkutil::build_compute_kernel(device, limits, name, _layout,
+			_engine->_shaders.get(std::string(name) + "_cs"), sizes);
+	};
+	_prepareKernel = kernel("gravity_prepare", single);
+	_boundsKernel = kernel("gravity_bounds", nodeSizes);
+	_mortonKernel = kernel("gravity_morton", bodySizes);
+	_gatherKernel = kernel("gravity_gather", bodySizes);
+	_buildKernel = kernel("gravity_build", nodeSizes);
+	_multipoleKernel = kernel("gravity_multipole", nodeSizes);
+	_forceKernel = kernel("gravity_force", forceSizes);
+	_integrateKernel = kernel("gravity_integrate", bodySizes);
+
+	spdlog::info("Gravity: {} bodies, {} octree nodes, theta {}", _capacity, _maxNodes, _settings.theta);
+}
+
+void GravitySolver::cleanup()
+{
+	VkDevice device = _engine->_device;
+	GpuMemory& memory = _engine->_memory;
+
+	for (ComputeKernel* kernel : {&_prepareKernel, &_boundsKernel, &_mortonKernel, &_gatherKernel, &_buildKernel,
+			 &_multipoleKernel, &_forceKernel, &_integrateKernel}) {
+		kernel->destroy(device);
+	}
+	vkDestroyPipelineLayout(device, _layout, nullptr);
+
+	for (AllocatedBuffer* buffer : {&_state, &_nodes, &_keys, &_values, &_sortedPositions, &_accelerations,
+			 &_interactions, &_buffersTable}) {
+		memory.destroy_buffer(*buffer);
+	}
+}
+
+void GravitySolver::attach(ParticleSystem* particles)
+{
+	_particles = particles;
+	_particles->add_substep_pass([this](VkCommandBuffer cmd, float dt) {
+		const ParticleSet& set = _particles->current();
+		GravityBodies bodies{};
+		bodies.positions = set.positions.address;
+		bodies.velocities = set.velocities.address;
+		bodies.counts = _particles->state().address;
+		bodies.set = _particles->current_index();
+		bodies.storage = _particles->storage().packed();
+		solve(cmd, bodies);
+		kick(cmd, bodies, dt);
+	});
+}
+
+GravitySolver::PushConstants GravitySolver::push_constants(const GravityBodies& bodies) const
+{
+	PushConstants push{};
+	push.octree = _buffersTable.address;
+	push.positions = bodies.positions;
+	push.velocities = bodies.velocities;
+	push.counts = bodies.counts;
+	push.accelerations = _accelerations.address;
+	push.interactions = _interactions.address;
+	push.set = bodies.set;
+	push.storage = bodies.storage;
+	push.capacity = _capacity;
+	push.maxNodes = _maxNodes;
+	push.leafSize = std::max(_settings.leafSize, 1u);
+	push.strength = _settings.strength;
+	push.softening2 = _settings.softening * _settings.softening;
+	push.theta = _settings.theta;
+	return push;
+}
+
+void GravitySolver::dispatch_bodies(VkCommandBuffer cmd, const ComputeKernel& kernel, const PushConstants& push)
+{
+	// grid stride loops over the body count, which only the GPU knows
+	uint32_t groups = std::min(vkutil::group_count(_capacity, kernel.current().workgroup.x),
+		_engine->_gpuProperties.limits.maxComputeWorkGroupCount[0]);
+	kernel.bind(cmd);
+	vkCmdPushConstants(cmd, _layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(PushConstants), &push);
+	vkCmdDispatch(cmd, groups, 1, 1);
+}
+
+void GravitySolver::dispatch_level(VkCommandBuffer cmd, const ComputeKernel& kernel, PushConstants& push,
+	uint32_t level)
+{
+	push.level = level;
+	kernel.bind(cmd);
+	vkCmdPushConstants(cmd, _layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(PushConstants), &push);
+	vkCmdDispatchIndirect(cmd, _state.buffer,
+		offsetof(GPUOctreeState, levelDispatch) + level * sizeof(GPUOctreeState::levelDispatch[0]));
+}
+
+void GravitySolver::prepare(VkCommandBuffer cmd, PushConstants& push, uint32_t mode, uint32_t level)
+{
+	push.mode = mode;
+	push.level = level;
+	_prepareKernel.bind(cmd);
+	vkCmdPushConstants(cmd, _layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(PushConstants), &push);
+	vkCmdDispatch(cmd, 1, 1, 1);
+	pass_barrier(cmd);
+}
+
+void GravitySolver::solve(VkCommandBuffer cmd, const GravityBodies& bodies)
+{
+	PushConstants push = push_constants(bodies);
+
+	prepare(cmd, push, PREPARE_BUILD, 0);
+	dispatch_bodies(cmd, _boundsKernel, push);
+	pass_barrier(cmd);
+	prepare(cmd, push, PREPARE_ROOT, 0);
+
+	dispatch_bodies(cmd, _mortonKernel, push);
+	pass_barrier(cmd);
+	// the whole capacity is sorted, empty slots carry the largest key
+	_engine->_primitives.radix_sort(cmd, _keys, _values, _capacity, 32);
+	dispatch_bodies(cmd, _gatherKernel, push);
+	pass_barrier(cmd);
+
+	// top down: each level's build appends the next level, whose range and
+	// dispatch the prepare pass then closes
+	for (uint32_t level = 0; level < OCTREE_MAX_DEPTH; level++) {
+		dispatch_level(cmd, _buildKernel, push, level);
+		pass_barrier(cmd);
+		prepare(cmd, push, PREPARE_LEVEL, level);
+	}
+
+	// bottom up: children are complete before their parents read them
+	for (uint32_t level = OCTREE_LEVELS; level-- > 0;) {
+		dispatch_level(cmd, _multipoleKernel, push, level);
+		pass_barrier(cmd);
+	}
+
+	dispatch_bodies(cmd, _forceKernel, push);
+	pass_barrier(cmd);
+}
+
+void GravitySolver::kick(VkCommandBuffer cmd, const GravityBodies& bodies, float dt)
+{
+	PushConstants push = push_constants(bodies);
+	push.mode = INTEGRATE_KICK;
+	push.dt = dt;
+	dispatch_bodies(cmd, _integrateKernel, push);
+	pass_barrier(cmd);
+}
+
+void GravitySolver::drift(VkCommandBuffer cmd, const GravityBodies& bodies, float dt)
+{
+	PushConstants push = push_constants(bodies);
+	push.mode = INTEGRATE_DRIFT;
+	push.dt = dt;
+	dispatch_bodies(cmd, _integrateKernel, push);
+	pass_barrier(cmd);
+}
@@ -0,0 +1,146 @@
+#include <vk_grid.h>
+#include <vk_engine.h>
+#include <vk_images.h>
+#include <vk_initializers.h>
+
+static uint32_t next_pow2(uint32_t v)
+{
+	uint32_t r = 1;
+	while (r < v) {
+		r *= 2;
+	}
+	return r;
+}
+
+static void pass_barrier(VkCommandBuffer cmd)
+{
+	vkutil::memory_barrier(cmd, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+		VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_2_DRAW_INDIRECT_BIT,
+		VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT
+			| VK_ACCESS_2_INDIRECT_COMMAND_READ_BIT);
+}
+
+void NeighborGrid::init(VulkanEngine* engine, uint32_t capacity, float cellSize, const StorageLayout& storage)
+{
+	_engine = engine;
+	_capacity = capacity;
+	_cellSize = cellSize;
+	// about one table entry per particle keeps hash collisions rare
+	_tableSize = std::max(next_pow2(capacity), 1024u);
+
+	VkDevice device = _engine->_device;
+	const VkPhysicalDeviceLimits& limits = _engine->_gpuProperties.limits;
+
+	const VkBufferUsageFlags usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT;
+	TransientAllocator& transients = _engine->_transients;
+	auto declare = [&](const char* name, VkDeviceSize size, VkBufferUsageFlags extra = 0) {
+		return transients.declare_buffer(name, size, usage | extra, PASS_SIMULATION, PASS_SIMULATION);
+	};
+	_scratchHandles = {
+		declare("grid params", sizeof(uint32_t) * 4, VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT),
+		declare("grid cell counts", _tableSize * sizeof(uint32_t), VK_BUFFER_USAGE_TRANSFER_DST_BIT),
+		declare("grid cell starts", _tableSize * sizeof(uint32_t)),
+		declare("grid particle cells", capacity * sizeof(uint32_t)),
+		declare("grid particle ranks", capacity * sizeof(uint32_t)),
+		declare("grid sorted indices", capacity * sizeof(uint32_t)),
+		declare("grid sorted positions", capacity * storage.position_stride()),
+		declare("grid sorted velocities", capacity * storage.velocity_stride()),
+	};
+	_engine->_primitives.reserve(_tableSize);
+
+	// the table points at the transients, so it is filled once they exist
+	transients.on_build([this, &transients, usage, storage]() {
+		AllocatedBuffer* buffers[] = {&_params, &_cellCount, &_cellStart, &_particleCell, &_particleRank,
+			&_sortedIndex, &_sortedPositions, &_sortedVelocities};
+		for (size_t i = 0; i < _scratchHandles.size(); i++) {
+			*buffers[i] = transients.buffer(_scratchHandles[i]);
+		}
+
+		GPUGridBuffers table{};
+		table.params = _params.address;
+		table.cellCount = _cellCount.address;
+		table.cellStart = _cellStart.address;
+		table.particleCell = _particleCell.address;
+		table.particleRank = _particleRank.address;
+		table.sortedIndex = _sortedIndex.address;
+		table.sortedPositions = _sortedPositions.address;
+		table.sortedVelocities = _sortedVelocities.address;
+		table.storage = storage.packed();
+		_buffersTable = _engine->upload_buffer(&table, sizeof(table), usage, MemoryTag::Simulation);
+	});
+
+	VkPushConstantRange range{};
+	range.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+	range.size = sizeof(PushConstants);
+
+	VkPipelineLayoutCreateInfo layoutInfo = vkinit::pipeline_layout_create_info();
+	layoutInfo.pushConstantRangeCount = 1;
+	layoutInfo.pPushConstantRanges = &range;
+	vk_check(vkCreatePipelineLayout(device, &layoutInfo, nullptr, &_layout));
+
+	const WorkgroupSize single[] = {{1, 1, 1}};
+	const WorkgroupSize particleSizes[] = {{256, 1, 1}};
+	_prepareKernel = vkutil::build_compute_kernel(device, limits, "grid_prepare", _layout,
+		_engine->_shaders.get("grid_prepare_cs"), single);
+	_hashKernel = vkutil::build_compute_kernel(device, limits, "grid_hash", _layout,
+		_engine->_shaders.get("grid_hash_cs"), particleSizes);
+	_scatterKernel = vkutil::build_compute_kernel(device, limits, "grid_scatter", _layout,
+		_engine->_shaders.get("grid_scatter_cs"), particleSizes);
+
+	spdlog::info("Neighbor grid: {} table entries, cell size {}", _tableSize, _cellSize);
+}
+
+void NeighborGrid::cleanup()
+{
+	VkDevice device = _engine->_device;
+	GpuMemory& memory = _engine->_memory;
+
+	_prepareKernel.destroy(device);
+	_hashKernel.destroy(device);
+	_scatterKernel.destroy(device);
+	vkDestroyPipelineLayout(device, _layout, nullptr);
+
+	// the others belong to the engine's transients
+	memory.destroy_buffer(_buffersTable);
+}
+
+void NeighborGrid::build(VkCommandBuffer cmd, VkDeviceAddress positions, VkDeviceAddress velocities,
+	VkDeviceAddress counts, uint32_t set)
+{
+	PushConstants push{};
+	push.grid = _buffersTable.address;
+	push.positions = positions;
+	push.velocities = velocities;
+	push.counts = counts;
+	push.cellSize = _cellSize;
+	push.tableSize = _tableSize;
+	push.set = set;
+	push.capacity = _capacity;
+	push.groupSize = _hashKernel.current().workgroup.x;
+	push.maxGroups = _engine->_gpuProperties.limits.maxComputeWorkGroupCount[0];
+	vkCmdPushConstants(cmd, _layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(PushConstants), &push);
+
+	// the buffers share memory with other passes, every build starts over
+	_engine->_transients.acquire(cmd, _scratchHandles);
+	vkCmdFillBuffer(cmd, _cellCount.buffer, 0, VK_WHOLE_SIZE, 0);
+	_prepareKernel.bind(cmd);
+	vkCmdDispatch(cmd, 1, 1, 1);
+	vkutil::memory_barrier(cmd, VK_PIPELINE_STAGE_2_CLEAR_BIT | VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+		VK_ACCESS_2_TRANSFER_WRITE_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+		VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_2_DRAW_INDIRECT_BIT,
+		VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT
+			| VK_ACCESS_2_INDIRECT_COMMAND_READ_BIT);
+
+	_hashKernel.bind(cmd);
+	vkCmdDispatchIndirect(cmd, _params.buffer, sizeof(uint32_t));
+	pass_barrier(cmd);
+
+	// the table size is fixed, so the scan never needs indirect arguments
+	_engine->_primitives.exclusive_scan(cmd, _cellCount, _cellStart, _tableSize);
+
+	// the scan bound its own pipeline and push constants
+	_scatterKernel.bind(cmd);
+	vkCmdPushConstants(cmd, _layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(PushConstants), &push);
+	vkCmdDispatchIndirect(cmd, _params.buffer, sizeof(uint32_t));
+	pass_barrier(cmd);
+}
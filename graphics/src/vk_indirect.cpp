@@ -0,0 +1,445 @@
+#include <vk_indirect.h>
+#include <vk_engine.h>
+#include <vk_images.h>
+#include <vk_initializers.h>
+
+#include <glm/geometric.hpp>
+
+static uint32_t previous_pow2(uint32_t v)
+{
+	uint32_t r = 1;
+	while (r * 2 <= v) {
+		r *= 2;
+	}
+	return r;
+}
+
+void IndirectRenderer::init(VulkanEngine* engine)
+{
+	_engine = engine;
+	init_pyramid();
+	init_pipelines();
+}
+
+void IndirectRenderer::init_pyramid()
+{
+	VkDevice device = _engine->_device;
+
+	// the pyramid is a power of two so every level halves cleanly, the
+	// reduction sampler then takes care of the odd edges of the depth image
+	_pyramidExtent.width = previous_pow2(_engine->_drawImage.imageExtent.width);
+	_pyramidExtent.height = previous_pow2(_engine->_drawImage.imageExtent.height);
+	_pyramidLevels = 1;
+	while ((std::max(_pyramidExtent.width, _pyramidExtent.height) >> _pyramidLevels) > 0) {
+		_pyramidLevels++;
+	}
+
+	_depthPyramid.imageFormat = VK_FORMAT_R32_SFLOAT;
+	_depthPyramid.imageExtent = {_pyramidExtent.width, _pyramidExtent.height, 1};
+
+	// it is rebuilt right before every cull, so it shares its memory with
+	// the scratch of the other passes
+	VkImageCreateInfo pyramidInfo = vkinit::image_create_info(_depthPyramid.imageFormat,
+		VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_STORAGE_BIT, _depthPyramid.imageExtent);
+	pyramidInfo.mipLevels = _pyramidLevels;
+	_pyramid = _engine->_transients.declare_image("depth pyramid", pyramidInfo, VK_IMAGE_ASPECT_COLOR_BIT, PASS_CULL,
+		PASS_CULL);
+
+	// min of every footprint: with reverse-Z that is the farthest depth
+	VkSamplerReductionModeCreateInfo reduction = {.sType = VK_STRUCTURE_TYPE_SAMPLER_REDUCTION_MODE_CREATE_INFO};
+	reduction.reductionMode = VK_SAMPLER_REDUCTION_MODE_MIN;
+
+	VkSamplerCreateInfo samplerInfo = {.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO};
+	samplerInfo.pNext = &reduction;
+	samplerInfo.magFilter = VK_FILTER_LINEAR;
+	samplerInfo.minFilter = VK_FILTER_LINEAR;
+	samplerInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+	samplerInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+	samplerInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+	samplerInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+	samplerInfo.minLod = 0;
+	samplerInfo.maxLod = VK_LOD_CLAMP_NONE;
+	vk_check(vkCreateSampler(device, &samplerInfo, nullptr, &_minSampler));
+
+	{
+		DescriptorLayoutBuilder builder;
+		builder.add_binding(0, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE);
+		builder.add_binding(1, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER);
+		_reduceSetLayout = builder.build(device, VK_SHADER_STAGE_COMPUTE_BIT);
+	}
+	{
+		DescriptorLayoutBuilder builder;
+		builder.add_binding(0, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER);
+		_cullSetLayout = builder.build(device, VK_SHADER_STAGE_COMPUTE_BIT);
+	}
+
+	_engine->_transients.on_build([this]() { init_pyramid_views(); });
+}
+
+void IndirectRenderer::init_pyramid_views()
+{
+	VkDevice device = _engine->_device;
+	_depthPyramid = _engine->_transients.image(_pyramid);
+
+	VkImageViewCreateInfo viewInfo = vkinit::imageview_create_info(_depthPyramid.imageFormat, _depthPyramid.image,
+		VK_IMAGE_ASPECT_COLOR_BIT);
+	for (uint32_t i = 0; i < _pyramidLevels; i++) {
+		viewInfo.subresourceRange.baseMipLevel = i;
+		VkImageView mip;
+		vk_check(vkCreateImageView(device, &viewInfo, nullptr, &mip));
+		_pyramidMips.push_back(mip);
+	}
+
+	for (uint32_t i = 0; i < _pyramidLevels; i++) {
+		VkDescriptorSet set = _engine->globalDescriptorAllocator.allocate(device, _reduceSetLayout);
+
+		VkDescriptorImageInfo outInfo{};
+		outInfo.imageView = _pyramidMips[i];
+		outInfo.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+
+		// level 0 reduces the depth buffer itself
+		VkDescriptorImageInfo inInfo{};
+		inInfo.sampler = _minSampler;
+		inInfo.imageView = i == 0 ? _engine->_depthImage.imageView : _pyramidMips[i - 1];
+		inInfo.imageLayout = i == 0 ? VK_IMAGE_LAYOUT_DEPTH_READ_ONLY_OPTIMAL : VK_IMAGE_LAYOUT_GENERAL;
+
+		VkWriteDescriptorSet writes[] = {
+			vkinit::write_descriptor_image(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, set, &outInfo, 0),
+			vkinit::write_descriptor_image(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, set, &inInfo, 1),
+		};
+		vkUpdateDescriptorSets(device, 2, writes, 0, nullptr);
+		_reduceSets.push_back(set);
+	}
+
+	_cullSet = _engine->globalDescriptorAllocator.allocate(device, _cullSetLayout);
+	VkDescriptorImageInfo pyramidInfoDesc{};
+	pyramidInfoDesc.sampler = _minSampler;
+	pyramidInfoDesc.imageView = _depthPyramid.imageView;
+	pyramidInfoDesc.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+	VkWriteDescriptorSet cullWrite = vkinit::write_descriptor_image(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+		_cullSet, &pyramidInfoDesc, 0);
+	vkUpdateDescriptorSets(device, 1, &cullWrite, 0, nullptr);
+}
+
+void IndirectRenderer::init_pipelines()
+{
+	VkDevice device = _engine->_device;
+	const VkPhysicalDeviceLimits& limits = _engine->_gpuProperties.limits;
+
+	// culling
+	VkPushConstantRange cullRange{};
+	cullRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+	cullRange.size = sizeof(CullPushConstants);
+
+	VkPipelineLayoutCreateInfo layoutInfo = vkinit::pipeline_layout_create_info();
+	layoutInfo.setLayoutCount = 1;
+	layoutInfo.pSetLayouts = &_cullSetLayout;
+	layoutInfo.pushConstantRangeCount = 1;
+	layoutInfo.pPushConstantRanges = &cullRange;
+	vk_check(vkCreatePipelineLayout(device, &layoutInfo, nullptr, &_cullLayout));
+
+	const WorkgroupSize cullSizes[] = {{64, 1, 1}};
+	_cullKernel = vkutil::build_compute_kernel(device, limits, "drawcull", _cullLayout,
+		_engine->_shaders.get("drawcull_cs"), cullSizes);
+
+	// depth pyramid
+	VkPushConstantRange reduceRange{};
+	reduceRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+	reduceRange.size = sizeof(glm::vec2);
+
+	layoutInfo.pSetLayouts = &_reduceSetLayout;
+	layoutInfo.pPushConstantRanges = &reduceRange;
+	vk_check(vkCreatePipelineLayout(device, &layoutInfo, nullptr, &_reduceLayout));
+
+	const WorkgroupSize reduceSizes[] = {{8, 8, 1}};
+	_reduceKernel = vkutil::build_compute_kernel(device, limits, "depthreduce", _reduceLayout,
+		_engine->_shaders.get("depthreduce_cs"), reduceSizes);
+
+	// mesh drawing, all vertex data comes in through buffer device addresses
+	VkPushConstantRange meshRange{};
+	meshRange.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+	meshRange.size = sizeof(DrawPushConstants);
+
+	VkPipelineLayoutCreateInfo meshLayoutInfo = vkinit::pipeline_layout_create_info();
+	meshLayoutInfo.pushConstantRangeCount = 1;
+	meshLayoutInfo.pPushConstantRanges = &meshRange;
+	vk_check(vkCreatePipelineLayout(device, &meshLayoutInfo, nullptr, &_meshLayout));
+
+	PipelineBuilder builder;
+	builder.set_shaders(_engine->_shaders.get("mesh_vs"), _engine->_shaders.get("mesh_fs"));
+	builder.set_layout(_meshLayout);
+	builder.set_input_topology(VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST);
+	builder.set_polygon_mode(VK_POLYGON_MODE_FILL);
+	builder.set_multisampling_none();
+	builder.disable_blending();
+	builder.set_color_attachment_format(_engine->_drawImage.imageFormat);
+	builder.set_depth_format(_engine->_depthImage.imageFormat);
+	_meshPipeline = builder.desc;
+	_engine->_pipelines.precompile(_meshPipeline);
+
+	// reverse-Z, both sides
+	_meshState.cullMode = VK_CULL_MODE_NONE;
+	_meshState.frontFace = VK_FRONT_FACE_CLOCKWISE;
+	_meshState.depthTest = true;
+	_meshState.depthWrite = true;
+	_meshState.depthCompare = VK_COMPARE_OP_GREATER_OR_EQUAL;
+}
+
+void IndirectRenderer::cleanup()
+{
+	VkDevice device = _engine->_device;
+
+	destroy_scene();
+
+	vkDestroyPipelineLayout(device, _meshLayout, nullptr);
+	_cullKernel.destroy(device);
+	_reduceKernel.destroy(device);
+	vkDestroyPipelineLayout(device, _cullLayout, nullptr);
+	vkDestroyPipelineLayout(device, _reduceLayout, nullptr);
+
+	vkDestroyDescriptorSetLayout(device, _cullSetLayout, nullptr);
+	vkDestroyDescriptorSetLayout(device, _reduceSetLayout, nullptr);
+	vkDestroySampler(device, _minSampler, nullptr);
+
+	for (VkImageView mip : _pyramidMips) {
+		vkDestroyImageView(device, mip, nullptr);
+	}
+	_pyramidMips.clear();
+}
+
+void IndirectRenderer::destroy_scene()
+{
+	if (_instanceBuffer.buffer == VK_NULL_HANDLE) {
+		return;
+	}
+	_engine->_memory.destroy_buffer(_instanceBuffer);
+	_engine->_memory.destroy_buffer(_surfaceBuffer);
+	_engine->_memory.destroy_buffer(_drawCommandBuffer);
+	_engine->_memory.destroy_buffer(_drawCountBuffer);
+	for (const AllocatedBuffer& buffer : _cpuCommands) {
+		_engine->_memory.destroy_buffer(buffer);
+	}
+	_cpuCommands.clear();
+	_culledCommands = nullptr;
+	_instances.clear();
+	_surfaces.clear();
+	_instanceSpheres.clear();
+	_instanceBuffer = {};
+	_instanceCount = 0;
+	_meshes = nullptr;
+}
+
+void IndirectRenderer::set_scene(const LoadedMeshes& meshes, std::span<const glm::mat4> transforms)
+{
+	destroy_scene();
+	_meshes = &meshes;
+
+	std::vector<GPUSurface> surfaces;
+	for (const auto& mesh : meshes.meshes) {
+		for (const GeoSurface& s : mesh->surfaces) {
+			GPUSurface surface{};
+			surface.vertexOffset = s.vertexOffset;
+			surface.lodCount = std::min((uint32_t)s.lods.size(), MAX_MESH_LODS);
+			for (uint32_t i = 0; i < surface.lodCount; i++) {
+				surface.lods[i] = GPUMeshLod{s.lods[i].firstIndex, s.lods[i].indexCount, s.lods[i].error, 0};
+			}
+			if (surface.lodCount == 0) {
+				surface.lodCount = 1;
+				surface.lods[0] = GPUMeshLod{s.firstIndex, s.indexCount, 0.f, 0};
+			}
+			surface.sphere = glm::vec4(s.bounds.origin, s.bounds.sphereRadius);
+			surfaces.push_back(surface);
+		}
+	}
+
+	std::vector<GPUInstance> instances;
+	instances.reserve(transforms.size() * surfaces.size());
+	for (const glm::mat4& transform : transforms) {
+		float scale = std::max({glm::length(glm::vec3(transform[0])), glm::length(glm::vec3(transform[1])),
+			glm::length(glm::vec3(transform[2]))});
+		for (uint32_t s = 0; s < surfaces.size(); s++) {
+			instances.push_back(GPUInstance{transform, s, scale, 0, 0});
+		}
+	}
+	_instanceCount = (uint32_t)instances.size();
+	if (_instanceCount == 0) {
+		return;
+	}
+
+	for (const GPUInstance& instance : instances) {
+		const glm::vec4& sphere = surfaces[instance.surface].sphere;
+		_instanceSpheres.push_back(glm::vec3(instance.transform * glm::vec4(glm::vec3(sphere), 1.f)),
+			sphere.w * instance.scale);
+	}
+
+	const VkBufferUsageFlags usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT;
+	_instanceBuffer = _engine->upload_buffer(instances.data(), instances.size() * sizeof(GPUInstance), usage,
+		MemoryTag::Geometry);
+	_surfaceBuffer = _engine->upload_buffer(surfaces.data(), surfaces.size() * sizeof(GPUSurface), usage,
+		MemoryTag::Geometry);
+
+	_drawCommandBuffer = _engine->_memory.create_buffer(_instanceCount * sizeof(VkDrawIndexedIndirectCommand),
+		usage | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT, VMA_MEMORY_USAGE_GPU_ONLY, MemoryTag::Geometry);
+	_drawCountBuffer = _engine->_memory.create_buffer(sizeof(uint32_t),
+		usage | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_ONLY,
+		MemoryTag::Geometry);
+	// cull() and draw() take the addresses and handles when they record
+	for (AllocatedBuffer* buffer : {&_instanceBuffer, &_surfaceBuffer, &_drawCommandBuffer, &_drawCountBuffer}) {
+		_engine->_memory.register_movable(buffer);
+	}
+
+	spdlog::info("GPU driven scene: {} instances of {} surfaces", _instanceCount, surfaces.size());
+	_instances = std::move(instances);
+	_surfaces = std::move(surfaces);
+}
+
+void IndirectRenderer::cull(VkCommandBuffer cmd, VkDeviceAddress sceneData, const GPUSceneData& scene,
+	uint32_t frameIndex)
+{
+	if (_instanceCount == 0) {
+		return;
+	}
+	if (cpuCulling) {
+		cull_cpu(cmd, scene, frameIndex);
+		return;
+	}
+	_culledCommands = &_drawCommandBuffer;
+
+	// the pyramid is only bound while culling and left in GENERAL for it,
+	// built when there is a previous depth image to build it from
+	_engine->_transients.acquire(cmd, _pyramid);
+	if (scene.occlusion) {
+		build_depth_pyramid(cmd);
+	}
+
+	vkCmdFillBuffer(cmd, _drawCountBuffer.buffer, 0, sizeof(uint32_t), 0);
+
+	VkMemoryBarrier2 barrier = {.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER_2};
+	barrier.srcStageMask = VK_PIPELINE_STAGE_2_CLEAR_BIT;
+	barrier.srcAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT;
+	barrier.dstStageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT;
+	barrier.dstAccessMask = VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT;
+
+	VkDependencyInfo depInfo = {.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO};
+	depInfo.memoryBarrierCount = 1;
+	depInfo.pMemoryBarriers = &barrier;
+	vkCmdPipelineBarrier2(cmd, &depInfo);
+
+	CullPushConstants push{};
+	push.scene = sceneData;
+	push.instances = _instanceBuffer.address;
+	push.surfaces = _surfaceBuffer.address;
+	push.commands = _drawCommandBuffer.address;
+	push.count = _drawCountBuffer.address;
+
+	_cullKernel.bind(cmd);
+	vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _cullLayout, 0, 1, &_cullSet, 0, nullptr);
+	vkCmdPushConstants(cmd, _cullLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(CullPushConstants), &push);
+	_cullKernel.dispatch(cmd, _instanceCount);
+
+	// the draw reads the compacted commands and the count
+	barrier.srcStageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT;
+	barrier.srcAccessMask = VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT;
+	barrier.dstStageMask = VK_PIPELINE_STAGE_2_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_2_VERTEX_SHADER_BIT;
+	barrier.dstAccessMask = VK_ACCESS_2_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_READ_BIT;
+	vkCmdPipelineBarrier2(cmd, &depInfo);
+}
+
+void IndirectRenderer::draw(VkCommandBuffer cmd, VkDeviceAddress sceneData)
+{
+	if (_instanceCount == 0) {
+		return;
+	}
+
+	vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, _engine->_pipelines.get(_meshPipeline));
+	_meshState.apply(cmd, _engine->_drawExtent);
+
+	DrawPushConstants push{};
+	push.scene = sceneData;
+	push.instances = _instanceBuffer.address;
+	push.positions = _meshes->buffers.positionBuffer.address;
+	push.attributes = _meshes->buffers.attributeBuffer.address;
+	vkCmdPushConstants(cmd, _meshLayout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(DrawPushConstants), &push);
+
+	vkCmdBindIndexBuffer(cmd, _meshes->buffers.indexBuffer.buffer, 0, VK_INDEX_TYPE_UINT32);
+	vkCmdDrawIndexedIndirectCount(cmd, _culledCommands->buffer, 0, _drawCountBuffer.buffer, 0, _instanceCount,
+		sizeof(VkDrawIndexedIndirectCommand));
+}
+
+void IndirectRenderer::cull_cpu(VkCommandBuffer cmd, const GPUSceneData& scene, uint32_t frameIndex)
+{
+	if (_cpuCommands.empty()) {
+		for (uint32_t i = 0; i < FRAME_OVERLAP; i++) {
+			_cpuCommands.push_back(_engine->_memory.create_buffer(
+				_instanceCount * sizeof(VkDrawIndexedIndirectCommand), VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT,
+				VMA_MEMORY_USAGE_CPU_TO_GPU, MemoryTag::Geometry, VMA_ALLOCATION_CREATE_MAPPED_BIT));
+		}
+	}
+
+	Frustum frustum;
+	std::copy(std::begin(scene.frustum), std::end(scene.frustum), frustum.planes);
+	_visible.clear();
+	vkutil::cull_spheres(frustum, _instanceSpheres, _visible);
+
+	// the frame that used these commands last has been waited on
+	const AllocatedBuffer& commands = _cpuCommands[frameIndex];
+	auto* out = static_cast<VkDrawIndexedIndirectCommand*>(commands.info.pMappedData);
+	for (size_t i = 0; i < _visible.size(); i++) {
+		uint32_t id = _visible[i];
+		const GPUInstance& instance = _instances[id];
+		const GPUSurface& surface = _surfaces[instance.surface];
+
+		// the same level selection as drawcull.comp
+		uint32_t lod = 0;
+		if (scene.lodScale > 0.f) {
+			glm::vec3 center(_instanceSpheres.x[id], _instanceSpheres.y[id], _instanceSpheres.z[id]);
+			float distance = std::max(glm::length(glm::vec3(scene.view * glm::vec4(center, 1.f)))
+					- _instanceSpheres.radius[id],
+				scene.znear);
+			float threshold = distance / (scene.lodScale * instance.scale);
+			for (uint32_t l = 1; l < surface.lodCount; l++) {
+				if (surface.lods[l].error <= threshold) {
+					lod = l;
+				}
+			}
+		}
+
+		const GPUMeshLod& level = surface.lods[lod];
+		out[i] = VkDrawIndexedIndirectCommand{level.indexCount, 1, level.firstIndex, surface.vertexOffset, id};
+	}
+	vk_check(vmaFlushAllocation(_engine->_allocator, commands.allocation, 0, VK_WHOLE_SIZE));
+	_culledCommands = &commands;
+
+	uint32_t count = (uint32_t)_visible.size();
+	vkCmdUpdateBuffer(cmd, _drawCountBuffer.buffer, 0, sizeof(count), &count);
+	vkutil::memory_barrier(cmd, VK_PIPELINE_STAGE_2_CLEAR_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT,
+		VK_PIPELINE_STAGE_2_DRAW_INDIRECT_BIT, VK_ACCESS_2_INDIRECT_COMMAND_READ_BIT);
+}
+
+void IndirectRenderer::build_depth_pyramid(VkCommandBuffer cmd)
+{
+	VkMemoryBarrier2 barrier = {.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER_2};
+	barrier.srcStageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT;
+	barrier.srcAccessMask = VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT;
+	barrier.dstStageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT;
+	barrier.dstAccessMask = VK_ACCESS_2_SHADER_SAMPLED_READ_BIT;
+
+	VkDependencyInfo depInfo = {.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO};
+	depInfo.memoryBarrierCount = 1;
+	depInfo.pMemoryBarriers = &barrier;
+
+	_reduceKernel.bind(cmd);
+	for (uint32_t i = 0; i < _pyramidLevels; i++) {
+		uint32_t width = std::max(_pyramidExtent.width >> i, 1u);
+		uint32_t height = std::max(_pyramidExtent.height >> i, 1u);
+		glm::vec2 outSize(width, height);
+
+		vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _reduceLayout, 0, 1, &_reduceSets[i], 0,
+			nullptr);
+		vkCmdPushConstants(cmd, _reduceLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(glm::vec2), &outSize);
+		_reduceKernel.dispatch(cmd, width, height);
+
+		// the next level samples this one, the cull pass samples all of them
+		vkCmdPipelineBarrier2(cmd, &depInfo);
+	}
+}
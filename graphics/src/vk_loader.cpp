@@ -1,2 +1,424 @@
-﻿
-#include <vk_loader.h>
\ No newline at end of file
+﻿#include <vk_loader.h>
+#include <vk_engine.h>
+
+#include <fastgltf/core.hpp>
+#include <fastgltf/glm_element_traits.hpp>
+#include <fastgltf/tools.hpp>
+
+#include <meshoptimizer.h>
+
+#include <glm/geometric.hpp>
+#include <glm/vec2.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+
+void vkutil::encode_octahedral(glm::vec3 n, int16_t out[2])
+{
+    // project onto the octahedron, then fold the lower half over the upper one
+    n /= std::abs(n.x) + std::abs(n.y) + std::abs(n.z);
+    glm::vec2 p(n.x, n.y);
+    if (n.z < 0.f) {
+        p = glm::vec2((1.f - std::abs(n.y)) * (n.x >= 0.f ? 1.f : -1.f),
+            (1.f - std::abs(n.x)) * (n.y >= 0.f ? 1.f : -1.f));
+    }
+    out[0] = int16_t(meshopt_quantizeSnorm(p.x, 16));
+    out[1] = int16_t(meshopt_quantizeSnorm(p.y, 16));
+}
+
+glm::vec3 vkutil::decode_octahedral(const int16_t in[2])
+{
+    glm::vec3 n(std::max(in[0] / 32767.f, -1.f), std::max(in[1] / 32767.f, -1.f), 0.f);
+    n.z = 1.f - std::abs(n.x) - std::abs(n.y);
+    float t = std::max(-n.z, 0.f);
+    n.x += n.x >= 0.f ? -t : t;
+    n.y += n.y >= 0.f ? -t : t;
+    return glm::normalize(n);
+}
+
+// Rewrites strip and fan indices as a triangle list in place, dropping the
+// degenerate triangles strips use for restarts. False for points and lines.
+static bool to_triangle_list(fastgltf::PrimitiveType type, std::vector<uint32_t>& indices)
+{
+    if (type == fastgltf::PrimitiveType::Triangles) {
+        indices.resize(indices.size() - indices.size() % 3);
+        return true;
+    }
+    if (type != fastgltf::PrimitiveType::TriangleStrip && type != fastgltf::PrimitiveType::TriangleFan) {
+        return false;
+    }
+
+    std::vector<uint32_t> list;
+    list.reserve(indices.size() >= 3 ? (indices.size() - 2) * 3 : 0);
+    for (size_t i = 2; i < indices.size(); i++) {
+        uint32_t a, b, c = indices[i];
+        if (type == fastgltf::PrimitiveType::TriangleFan) {
+            a = indices[0];
+            b = indices[i - 1];
+        } else {
+            // every other strip triangle is flipped to keep the winding
+            a = indices[i - 2 + (i & 1)];
+            b = indices[i - 1 - (i & 1)];
+        }
+        if (a != b && b != c && a != c) {
+            list.insert(list.end(), {a, b, c});
+        }
+    }
+    indices = std::move(list);
+    return true;
+}
+
+static Bounds compute_bounds(std::span<const glm::vec3> positions)
+{
+    glm::vec3 minpos = positions[0];
+    glm::vec3 maxpos = positions[0];
+    for (const glm::vec3& p : positions) {
+        minpos = glm::min(minpos, p);
+        maxpos = glm::max(maxpos, p);
+    }
+
+    Bounds bounds;
+    bounds.origin = (maxpos + minpos) / 2.f;
+    bounds.extents = (maxpos - minpos) / 2.f;
+    bounds.sphereRadius = glm::length(bounds.extents);
+    return bounds;
+}
+
+// simplified levels of one surface, the full one is not included
+struct SurfaceLods {
+    uint32_t baseIndexCount;  // of the full surface, to match cache entries
+    std::vector<std::vector<uint32_t>> levels;
+    std::vector<float> errors;
+};
+
+// Halves the triangle count per level. Each level is simplified from the one
+// before, much faster than starting over from the full surface, so the
+// recorded errors are the sums of the steps. Stops once a level barely
+// shrinks, e.g. when the locked borders are all that is left.
+static SurfaceLods build_lods(std::span<const uint32_t> indices, std::span<const glm::vec3> positions,
+    uint32_t maxLods)
+{
+    SurfaceLods lods;
+    lods.baseIndexCount = (uint32_t)indices.size();
+
+    // meshopt reports errors relative to the mesh extent
+    const float scale = meshopt_simplifyScale(&positions[0].x, positions.size(), sizeof(glm::vec3));
+    const size_t minIndices = 3 * 64;
+
+    std::vector<uint32_t> source(indices.begin(), indices.end());
+    float error = 0.f;
+    while (lods.levels.size() + 1 < maxLods && source.size() >= 2 * minIndices) {
+        std::vector<uint32_t> level(source.size());
+        float levelError = 0.f;
+        size_t target = source.size() / 6 * 3;
+        // borders stay put so surfaces sharing them do not crack apart
+        level.resize(meshopt_simplify(level.data(), source.data(), source.size(), &positions[0].x,
+            positions.size(), sizeof(glm::vec3), target, 0.1f, meshopt_SimplifyLockBorder, &levelError));
+        if (level.size() > source.size() * 3 / 4) {
+            break;
+        }
+        meshopt_optimizeVertexCache(level.data(), level.data(), level.size(), positions.size());
+
+        error += levelError * scale;
+        lods.levels.push_back(level);
+        lods.errors.push_back(error);
+        source = std::move(level);
+    }
+    return lods;
+}
+
+// <asset>.lods: this header, then per surface its full index count, the
+// number of levels and per level the index count, error and indices
+struct LodCacheHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t sourceSize;
+    int64_t sourceTime;
+    uint32_t maxLods;
+    uint32_t surfaceCount;
+};
+
+static constexpr uint32_t LOD_CACHE_MAGIC = 0x53444f4c;  // "LODS"
+static constexpr uint32_t LOD_CACHE_VERSION = 1;
+
+// what a cache has to carry to belong to the asset as it is now
+static LodCacheHeader lod_cache_stamp(const std::filesystem::path& source, uint32_t maxLods)
+{
+    std::error_code ec;
+    LodCacheHeader stamp{LOD_CACHE_MAGIC, LOD_CACHE_VERSION, 0, 0, maxLods, 0};
+    stamp.sourceSize = std::filesystem::file_size(source, ec);
+    stamp.sourceTime = std::filesystem::last_write_time(source, ec).time_since_epoch().count();
+    return stamp;
+}
+
+static std::vector<SurfaceLods> read_lod_cache(const std::filesystem::path& path, const LodCacheHeader& stamp)
+{
+    std::ifstream file(path, std::ios::binary);
+    LodCacheHeader header{};
+    if (!file.read((char*)&header, sizeof(header)) || header.magic != stamp.magic || header.version != stamp.version
+        || header.sourceSize != stamp.sourceSize || header.sourceTime != stamp.sourceTime
+        || header.maxLods != stamp.maxLods) {
+        return {};
+    }
+
+    std::vector<SurfaceLods> surfaces(header.surfaceCount);
+    for (SurfaceLods& lods : surfaces) {
+        uint32_t levelCount = 0;
+        file.read((char*)&lods.baseIndexCount, sizeof(uint32_t));
+        file.read((char*)&levelCount, sizeof(uint32_t));
+        if (!file || levelCount >= header.maxLods) {
+            return {};
+        }
+        lods.levels.resize(levelCount);
+        lods.errors.resize(levelCount);
+        for (uint32_t i = 0; i < levelCount; i++) {
+            uint32_t indexCount = 0;
+            file.read((char*)&indexCount, sizeof(uint32_t));
+            file.read((char*)&lods.errors[i], sizeof(float));
+            if (!file || indexCount > lods.baseIndexCount) {
+                return {};
+            }
+            lods.levels[i].resize(indexCount);
+            file.read((char*)lods.levels[i].data(), indexCount * sizeof(uint32_t));
+        }
+        if (!file) {
+            return {};
+        }
+    }
+    return surfaces;
+}
+
+static void write_lod_cache(const std::filesystem::path& path, LodCacheHeader header,
+    std::span<const SurfaceLods> surfaces)
+{
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    header.surfaceCount = (uint32_t)surfaces.size();
+    file.write((const char*)&header, sizeof(header));
+    for (const SurfaceLods& lods : surfaces) {
+        uint32_t levelCount = (uint32_t)lods.levels.size();
+        file.write((const char*)&lods.baseIndexCount, sizeof(uint32_t));
+        file.write((const char*)&levelCount, sizeof(uint32_t));
+        for (uint32_t i = 0; i < levelCount; i++) {
+            uint32_t indexCount = (uint32_t)lods.levels[i].size();
+            file.write((const char*)&indexCount, sizeof(uint32_t));
+            file.write((const char*)&lods.errors[i], sizeof(float));
+            file.write((const char*)lods.levels[i].data(), indexCount * sizeof(uint32_t));
+        }
+    }
+    if (!file) {
+        spdlog::warn("Could not write the level of detail cache {}", path.string());
+    }
+}
+
+std::optional<MeshGeometry> loadGltfGeometry(std::filesystem::path filePath, const MeshLoadOptions& options)
+{
+    spdlog::info("Loading GLTF: {}", filePath.string());
+
+    auto data = fastgltf::GltfDataBuffer::FromPath(filePath);
+    if (data.error() != fastgltf::Error::None) {
+        spdlog::error("Failed to open glTF {}: {}", filePath.string(), fastgltf::getErrorMessage(data.error()));
+        return {};
+    }
+
+    constexpr auto gltfOptions = fastgltf::Options::LoadExternalBuffers;
+
+    fastgltf::Parser parser {};
+    auto load = parser.loadGltf(data.get(), filePath.parent_path(), gltfOptions);
+    if (load.error() != fastgltf::Error::None) {
+        spdlog::error("Failed to load glTF {}: {}", filePath.string(), fastgltf::getErrorMessage(load.error()));
+        return {};
+    }
+    fastgltf::Asset& gltf = load.get();
+
+    MeshGeometry loaded;
+
+    // all meshes end up in the same three streams
+    std::vector<uint32_t>& indices = loaded.indices;
+    std::vector<glm::vec3>& positions = loaded.positions;
+    std::vector<VertexAttributes>& attributes = loaded.attributes;
+
+    // per primitive scratch
+    std::vector<uint32_t> localIndices;
+    std::vector<glm::vec3> localPositions;
+    std::vector<glm::vec3> localNormals;
+    std::vector<glm::vec2> localUVs;
+    std::vector<uint32_t> remap;
+
+    // levels of detail come from the cache when it matches the asset
+    const std::filesystem::path lodCachePath = std::filesystem::path(filePath).concat(".lods");
+    const LodCacheHeader lodStamp = lod_cache_stamp(filePath, options.maxLods);
+    std::vector<SurfaceLods> cachedLods;
+    if (options.lodCache && options.maxLods > 1) {
+        cachedLods = read_lod_cache(lodCachePath, lodStamp);
+    }
+    std::vector<SurfaceLods> surfaceLods;
+    uint32_t generatedLods = 0;
+    auto lodStart = std::chrono::steady_clock::now();
+    size_t fullIndexCount = 0;
+
+    for (fastgltf::Mesh& mesh : gltf.meshes) {
+        auto newmesh = std::make_shared<MeshAsset>();
+        newmesh->name = mesh.name.c_str();
+
+        for (auto&& p : mesh.primitives) {
+            auto posAttribute = p.findAttribute("POSITION");
+            if (!p.indicesAccessor.has_value() || posAttribute == p.attributes.end()) {
+                spdlog::warn("Skipping primitive of {} without indices or positions", newmesh->name);
+                continue;
+            }
+
+            localIndices.clear();
+            localPositions.clear();
+            localNormals.clear();
+            localUVs.clear();
+
+            fastgltf::Accessor& indexaccessor = gltf.accessors[p.indicesAccessor.value()];
+            localIndices.reserve(indexaccessor.count);
+            fastgltf::iterateAccessor<std::uint32_t>(gltf, indexaccessor,
+                [&](std::uint32_t idx) { localIndices.push_back(idx); });
+            // meshoptimizer and the renderer only know triangle lists
+            if (!to_triangle_list(p.type, localIndices) || localIndices.empty()) {
+                spdlog::warn("Skipping primitive of {} without triangles", newmesh->name);
+                continue;
+            }
+            if (p.type != fastgltf::PrimitiveType::Triangles) {
+                spdlog::info("Converted a triangle {} of {} into {} triangles",
+                    p.type == fastgltf::PrimitiveType::TriangleFan ? "fan" : "strip", newmesh->name,
+                    localIndices.size() / 3);
+            }
+
+            fastgltf::Accessor& posAccessor = gltf.accessors[posAttribute->accessorIndex];
+            localPositions.resize(posAccessor.count);
+            fastgltf::iterateAccessorWithIndex<glm::vec3>(gltf, posAccessor,
+                [&](glm::vec3 v, size_t index) { localPositions[index] = v; });
+            // a malformed file can index past its vertices, which meshoptimizer
+            // and the shaders would read out of bounds
+            if (std::ranges::any_of(localIndices, [&](uint32_t index) { return index >= localPositions.size(); })) {
+                spdlog::warn("Skipping primitive of {} with indices past its {} vertices", newmesh->name,
+                    localPositions.size());
+                continue;
+            }
+
+            localNormals.assign(localPositions.size(), glm::vec3(0.f, 0.f, 1.f));
+            // attributes of another length than the positions are left out
+            auto normals = p.findAttribute("NORMAL");
+            if (normals != p.attributes.end()
+                && gltf.accessors[normals->accessorIndex].count == localPositions.size()) {
+                fastgltf::iterateAccessorWithIndex<glm::vec3>(gltf, gltf.accessors[normals->accessorIndex],
+                    [&](glm::vec3 v, size_t index) { localNormals[index] = v; });
+            }
+
+            localUVs.assign(localPositions.size(), glm::vec2(0.f));
+            auto uv = p.findAttribute("TEXCOORD_0");
+            if (uv != p.attributes.end() && gltf.accessors[uv->accessorIndex].count == localPositions.size()) {
+                fastgltf::iterateAccessorWithIndex<glm::vec2>(gltf, gltf.accessors[uv->accessorIndex],
+                    [&](glm::vec2 v, size_t index) { localUVs[index] = v; });
+            }
+
+            size_t indexCount = localIndices.size();
+            size_t vertexCount = localPositions.size();
+
+            // triangle order for the post-transform cache first, then trade a
+            // little of it for less overdraw
+            meshopt_optimizeVertexCache(localIndices.data(), localIndices.data(), indexCount, vertexCount);
+            meshopt_optimizeOverdraw(localIndices.data(), localIndices.data(), indexCount,
+                &localPositions[0].x, vertexCount, sizeof(glm::vec3), 1.05f);
+
+            // vertices in the order they are first referenced, drops unused ones
+            remap.resize(vertexCount);
+            vertexCount = meshopt_optimizeVertexFetchRemap(remap.data(), localIndices.data(), indexCount, vertexCount);
+            meshopt_remapIndexBuffer(localIndices.data(), localIndices.data(), indexCount, remap.data());
+            meshopt_remapVertexBuffer(localPositions.data(), localPositions.data(), localPositions.size(),
+                sizeof(glm::vec3), remap.data());
+            meshopt_remapVertexBuffer(localNormals.data(), localNormals.data(), localNormals.size(),
+                sizeof(glm::vec3), remap.data());
+            meshopt_remapVertexBuffer(localUVs.data(), localUVs.data(), localUVs.size(),
+                sizeof(glm::vec2), remap.data());
+            localPositions.resize(vertexCount);
+
+            GeoSurface newSurface;
+            newSurface.firstIndex = (uint32_t)indices.size();
+            newSurface.indexCount = (uint32_t)indexCount;
+            newSurface.vertexOffset = (int32_t)positions.size();
+            newSurface.bounds = compute_bounds(localPositions);
+
+            size_t surface = surfaceLods.size();
+            if (surface < cachedLods.size() && cachedLods[surface].baseIndexCount == indexCount) {
+                surfaceLods.push_back(std::move(cachedLods[surface]));
+            } else {
+                surfaceLods.push_back(build_lods(localIndices, localPositions, options.maxLods));
+                generatedLods++;
+            }
+            const SurfaceLods& lods = surfaceLods.back();
+
+            indices.insert(indices.end(), localIndices.begin(), localIndices.end());
+            fullIndexCount += indexCount;
+            newSurface.lods.push_back(MeshLod{newSurface.firstIndex, newSurface.indexCount, 0.f});
+            for (size_t i = 0; i < lods.levels.size(); i++) {
+                newSurface.lods.push_back(MeshLod{(uint32_t)indices.size(), (uint32_t)lods.levels[i].size(),
+                    lods.errors[i]});
+                indices.insert(indices.end(), lods.levels[i].begin(), lods.levels[i].end());
+            }
+            positions.insert(positions.end(), localPositions.begin(), localPositions.end());
+            for (size_t i = 0; i < vertexCount; i++) {
+                VertexAttributes attr;
+                vkutil::encode_octahedral(glm::normalize(localNormals[i]), attr.normal);
+                attr.uv[0] = meshopt_quantizeHalf(localUVs[i].x);
+                attr.uv[1] = meshopt_quantizeHalf(localUVs[i].y);
+                attributes.push_back(attr);
+            }
+
+            newmesh->surfaces.push_back(newSurface);
+        }
+
+        if (newmesh->surfaces.empty()) {
+            continue;
+        }
+
+        // mesh bounds enclose the bounds of all surfaces
+        glm::vec3 minpos(std::numeric_limits<float>::max());
+        glm::vec3 maxpos(std::numeric_limits<float>::lowest());
+        for (const GeoSurface& surface : newmesh->surfaces) {
+            minpos = glm::min(minpos, surface.bounds.origin - surface.bounds.extents);
+            maxpos = glm::max(maxpos, surface.bounds.origin + surface.bounds.extents);
+        }
+        newmesh->bounds.origin = (maxpos + minpos) / 2.f;
+        newmesh->bounds.extents = (maxpos - minpos) / 2.f;
+        newmesh->bounds.sphereRadius = glm::length(newmesh->bounds.extents);
+
+        loaded.meshes.push_back(std::move(newmesh));
+    }
+
+    if (loaded.meshes.empty()) {
+        spdlog::error("No drawable meshes in {}", filePath.string());
+        return {};
+    }
+
+    if (generatedLods > 0) {
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - lodStart).count();
+        spdlog::info("Simplified {} surfaces in {:.2f} s", generatedLods, seconds);
+        if (options.lodCache && options.maxLods > 1) {
+            write_lod_cache(lodCachePath, lodStamp, surfaceLods);
+        }
+    }
+
+    spdlog::info("Loaded {} meshes, {} triangles, {} more in levels of detail, {} KiB of vertex data",
+        loaded.meshes.size(), fullIndexCount / 3, (indices.size() - fullIndexCount) / 3,
+        (positions.size() * sizeof(glm::vec3) + attributes.size() * sizeof(VertexAttributes)) >> 10);
+    return loaded;
+}
+
+std::optional<LoadedMeshes> loadGltfMeshes(VulkanEngine* engine, std::filesystem::path filePath,
+    const MeshLoadOptions& options)
+{
+    std::optional<MeshGeometry> geometry = loadGltfGeometry(filePath, options);
+    if (!geometry) {
+        return {};
+    }
+
+    LoadedMeshes loaded;
+    loaded.meshes = std::move(geometry->meshes);
+    loaded.buffers = engine->upload_mesh(geometry->indices, geometry->positions, geometry->attributes);
+    return loaded;
+}
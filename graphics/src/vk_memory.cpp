@@ -0,0 +1,369 @@
+#include <vk_memory.h>
+
+const char* to_string(MemoryTag tag)
+{
+	switch (tag) {
+	case MemoryTag::RenderTarget: return "render target";
+	case MemoryTag::Simulation: return "simulation";
+	case MemoryTag::Geometry: return "geometry";
+	case MemoryTag::Staging: return "staging";
+	case MemoryTag::Readback: return "readback";
+	case MemoryTag::Transient: return "transient";
+	case MemoryTag::Other: return "other";
+	default: return "unknown";
+	}
+}
+
+void GpuMemory::init(VmaAllocator allocator, VkDevice device, uint32_t framesInFlight)
+{
+	_allocator = allocator;
+	_device = device;
+	_framesInFlight = framesInFlight;
+}
+
+void GpuMemory::cleanup()
+{
+	if (_defragContext != VK_NULL_HANDLE) {
+		if (_passActive) {
+			end_pass();
+		}
+		end_defragmentation();
+	}
+
+	for (const auto& [allocation, record] : _records) {
+		spdlog::warn("Leaked {} allocation of {} bytes", to_string(record.tag), record.size);
+	}
+	_records.clear();
+}
+
+void GpuMemory::track(VmaAllocation allocation, MemoryTag tag, VkDeviceSize size, VkBufferUsageFlags usage)
+{
+	_records[allocation] = Record{tag, size, usage, nullptr, {}};
+	_taggedBytes[size_t(tag)] += size;
+	_taggedAllocations[size_t(tag)]++;
+	_frameAllocations++;
+}
+
+void GpuMemory::untrack(VmaAllocation allocation)
+{
+	auto it = _records.find(allocation);
+	if (it == _records.end()) {
+		return;
+	}
+	_taggedBytes[size_t(it->second.tag)] -= it->second.size;
+	_taggedAllocations[size_t(it->second.tag)]--;
+	_frameFrees++;
+	if (it->second.movable) {
+		_movableCount--;
+	}
+	_records.erase(it);
+}
+
+AllocatedBuffer GpuMemory::create_buffer(size_t allocSize, VkBufferUsageFlags usage, VmaMemoryUsage memoryUsage,
+	MemoryTag tag, VmaAllocationCreateFlags flags)
+{
+	VkBufferCreateInfo bufferInfo = {.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO};
+	bufferInfo.pNext = nullptr;
+	bufferInfo.size = allocSize;
+	bufferInfo.usage = usage;
+
+	VmaAllocationCreateInfo vmaallocInfo = {};
+	vmaallocInfo.usage = memoryUsage;
+	vmaallocInfo.flags = flags;
+
+	AllocatedBuffer newBuffer{};
+	vk_check(vmaCreateBuffer(_allocator, &bufferInfo, &vmaallocInfo, &newBuffer.buffer, &newBuffer.allocation,
+		&newBuffer.info));
+
+	if (usage & VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT) {
+		VkBufferDeviceAddressInfo addressInfo = {.sType = VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO};
+		addressInfo.buffer = newBuffer.buffer;
+		newBuffer.address = vkGetBufferDeviceAddress(_device, &addressInfo);
+	}
+
+	track(newBuffer.allocation, tag, newBuffer.info.size, usage);
+	return newBuffer;
+}
+
+void GpuMemory::destroy_buffer(const AllocatedBuffer& buffer)
+{
+	if (_passActive) {
+		for (uint32_t i = 0; i < _pass.moveCount; i++) {
+			VmaDefragmentationMove& move = _pass.pMoves[i];
+			if (move.srcAllocation == buffer.allocation
+				&& move.operation == VMA_DEFRAGMENTATION_MOVE_OPERATION_COPY) {
+				// VMA frees both places when the pass ends, only the buffers are ours
+				move.operation = VMA_DEFRAGMENTATION_MOVE_OPERATION_DESTROY;
+				vkDestroyBuffer(_device, buffer.buffer, nullptr);
+				untrack(buffer.allocation);
+				return;
+			}
+		}
+	}
+
+	untrack(buffer.allocation);
+	vmaDestroyBuffer(_allocator, buffer.buffer, buffer.allocation);
+}
+
+VkResult GpuMemory::allocate_memory(const VkMemoryRequirements& requirements, const VmaAllocationCreateInfo& allocInfo,
+	MemoryTag tag, VmaAllocation* allocation)
+{
+	VmaAllocationInfo info;
+	VkResult result = vmaAllocateMemory(_allocator, &requirements, &allocInfo, allocation, &info);
+	if (result == VK_SUCCESS) {
+		track(*allocation, tag, info.size, 0);
+	}
+	return result;
+}
+
+void GpuMemory::free_memory(VmaAllocation allocation)
+{
+	untrack(allocation);
+	vmaFreeMemory(_allocator, allocation);
+}
+
+VkResult GpuMemory::create_image(const VkImageCreateInfo& imageInfo, const VmaAllocationCreateInfo& allocInfo,
+	MemoryTag tag, VkImage* image, VmaAllocation* allocation)
+{
+	VmaAllocationInfo info;
+	VkResult result = vmaCreateImage(_allocator, &imageInfo, &allocInfo, image, allocation, &info);
+	if (result == VK_SUCCESS) {
+		track(*allocation, tag, info.size, 0);
+	}
+	return result;
+}
+
+void GpuMemory::destroy_image(VkImage image, VmaAllocation allocation)
+{
+	untrack(allocation);
+	vmaDestroyImage(_allocator, image, allocation);
+}
+
+void GpuMemory::register_movable(AllocatedBuffer* buffer, std::function<void(const AllocatedBuffer&)> onMoved)
+{
+	auto it = _records.find(buffer->allocation);
+	if (it == _records.end()) {
+		spdlog::error("register_movable called with a buffer that was not created by GpuMemory");
+		return;
+	}
+	if (buffer->info.pMappedData != nullptr) {
+		spdlog::warn("Mapped {} buffer can not be moved", to_string(it->second.tag));
+		return;
+	}
+	if (!it->second.movable) {
+		_movableCount++;
+	}
+	it->second.movable = buffer;
+	it->second.onMoved = std::move(onMoved);
+}
+
+void GpuMemory::begin_frame(uint64_t frameNumber)
+{
+	vmaSetCurrentFrameIndex(_allocator, uint32_t(frameNumber));
+
+	_lastFrameAllocations = _frameAllocations;
+	_lastFrameFrees = _frameFrees;
+	_frameAllocations = 0;
+	_frameFrees = 0;
+
+	// without movable buffers a pass could not relocate anything
+	if (pressureCheckInterval == 0 || frameNumber % pressureCheckInterval != 0 || _defragContext != VK_NULL_HANDLE
+		|| _movableCount == 0) {
+		return;
+	}
+
+	VmaBudget budgets[VK_MAX_MEMORY_HEAPS];
+	vmaGetHeapBudgets(_allocator, budgets);
+
+	const VkPhysicalDeviceMemoryProperties* memoryProperties;
+	vmaGetMemoryProperties(_allocator, &memoryProperties);
+
+	for (uint32_t heap = 0; heap < memoryProperties->memoryHeapCount; heap++) {
+		if (budgets[heap].budget > 0 && budgets[heap].usage > VkDeviceSize(budgets[heap].budget * pressureThreshold)) {
+			spdlog::warn("Memory heap {} at {} of {} MiB budget, defragmenting", heap, budgets[heap].usage >> 20,
+				budgets[heap].budget >> 20);
+			_defragRequested = true;
+			return;
+		}
+	}
+
+	// compacting only pays off when most of the unused space is scattered
+	MemoryStatistics stats = statistics();
+	if (stats.fragmentation > fragmentationThreshold && stats.unusedBytes > maxBytesPerPass) {
+		spdlog::info("Memory fragmentation at {:.2f}, defragmenting", stats.fragmentation);
+		_defragRequested = true;
+	}
+}
+
+void GpuMemory::request_defragmentation()
+{
+	_defragRequested = true;
+}
+
+void GpuMemory::defragment_step(VkCommandBuffer cmd, uint64_t frameNumber)
+{
+	if (_defragContext == VK_NULL_HANDLE) {
+		if (!_defragRequested) {
+			return;
+		}
+		_defragRequested = false;
+
+		VmaDefragmentationInfo defragInfo = {};
+		defragInfo.flags = VMA_DEFRAGMENTATION_FLAG_ALGORITHM_BALANCED_BIT;
+		defragInfo.maxBytesPerPass = maxBytesPerPass;
+		defragInfo.maxAllocationsPerPass = maxMovesPerPass;
+		vk_check(vmaBeginDefragmentation(_allocator, &defragInfo, &_defragContext));
+	}
+
+	if (_passActive) {
+		// copies recorded in frame N are done once frame N's fence was waited on
+		if (frameNumber < _passFrame + _framesInFlight) {
+			return;
+		}
+		end_pass();
+	}
+
+	VkResult result = vmaBeginDefragmentationPass(_allocator, _defragContext, &_pass);
+	if (result == VK_SUCCESS) {
+		// nothing left to move
+		end_defragmentation();
+		return;
+	}
+	if (result != VK_INCOMPLETE) {
+		vk_check(result);
+	}
+
+	std::vector<VkBuffer> sources, destinations;
+	std::vector<VkBufferCopy> regions;
+	for (uint32_t i = 0; i < _pass.moveCount; i++) {
+		VmaDefragmentationMove& move = _pass.pMoves[i];
+
+		auto it = _records.find(move.srcAllocation);
+		if (it == _records.end() || it->second.movable == nullptr) {
+			move.operation = VMA_DEFRAGMENTATION_MOVE_OPERATION_IGNORE;
+			continue;
+		}
+		Record& record = it->second;
+
+		VkBufferCreateInfo bufferInfo = {.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO};
+		bufferInfo.size = record.movable->info.size;
+		bufferInfo.usage = record.usage;
+
+		VkBuffer newBuffer;
+		vk_check(vkCreateBuffer(_device, &bufferInfo, nullptr, &newBuffer));
+		vk_check(vmaBindBufferMemory(_allocator, move.dstTmpAllocation, newBuffer));
+
+		sources.push_back(record.movable->buffer);
+		destinations.push_back(newBuffer);
+		regions.push_back(VkBufferCopy{0, 0, bufferInfo.size});
+		_pendingMoves.push_back(PendingMove{move.srcAllocation, record.movable->buffer});
+
+		// everything recorded from here on uses the new location
+		record.movable->buffer = newBuffer;
+		if (record.usage & VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT) {
+			VkBufferDeviceAddressInfo addressInfo = {.sType = VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO};
+			addressInfo.buffer = newBuffer;
+			record.movable->address = vkGetBufferDeviceAddress(_device, &addressInfo);
+		}
+		if (record.onMoved) {
+			record.onMoved(*record.movable);
+		}
+	}
+
+	_passActive = true;
+	_passFrame = frameNumber;
+
+	if (regions.empty()) {
+		return;
+	}
+
+	// previous frames may still be writing the old buffers
+	VkMemoryBarrier2 barrier = {.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER_2};
+	barrier.srcStageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT;
+	barrier.srcAccessMask = VK_ACCESS_2_MEMORY_WRITE_BIT;
+	barrier.dstStageMask = VK_PIPELINE_STAGE_2_COPY_BIT;
+	barrier.dstAccessMask = VK_ACCESS_2_TRANSFER_READ_BIT;
+
+	VkDependencyInfo depInfo = {.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO};
+	depInfo.memoryBarrierCount = 1;
+	depInfo.pMemoryBarriers = &barrier;
+	vkCmdPipelineBarrier2(cmd, &depInfo);
+
+	for (size_t i = 0; i < regions.size(); i++) {
+		vkCmdCopyBuffer(cmd, sources[i], destinations[i], 1, &regions[i]);
+	}
+
+	barrier.srcStageMask = VK_PIPELINE_STAGE_2_COPY_BIT;
+	barrier.srcAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT;
+	barrier.dstStageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT;
+	barrier.dstAccessMask = VK_ACCESS_2_MEMORY_READ_BIT | VK_ACCESS_2_MEMORY_WRITE_BIT;
+	vkCmdPipelineBarrier2(cmd, &depInfo);
+}
+
+void GpuMemory::end_pass()
+{
+	vmaEndDefragmentationPass(_allocator, _defragContext, &_pass);
+
+	for (const PendingMove& pending : _pendingMoves) {
+		vkDestroyBuffer(_device, pending.oldBuffer, nullptr);
+
+		// the allocation handle stays the same but now describes the new place
+		if (auto it = _records.find(pending.allocation); it != _records.end() && it->second.movable) {
+			vmaGetAllocationInfo(_allocator, pending.allocation, &it->second.movable->info);
+		}
+	}
+	_pendingMoves.clear();
+	_passActive = false;
+}
+
+void GpuMemory::end_defragmentation()
+{
+	VmaDefragmentationStats stats = {};
+	vmaEndDefragmentation(_allocator, _defragContext, &stats);
+	_defragContext = VK_NULL_HANDLE;
+
+	if (stats.allocationsMoved > 0 || stats.deviceMemoryBlocksFreed > 0) {
+		spdlog::info("Defragmentation moved {} allocations ({} KiB) and freed {} blocks ({} KiB)",
+			stats.allocationsMoved, stats.bytesMoved >> 10, stats.deviceMemoryBlocksFreed, stats.bytesFreed >> 10);
+	}
+}
+
+MemoryStatistics GpuMemory::statistics() const
+{
+	MemoryStatistics stats{};
+
+	const VkPhysicalDeviceMemoryProperties* memoryProperties;
+	vmaGetMemoryProperties(_allocator, &memoryProperties);
+
+	VmaBudget budgets[VK_MAX_MEMORY_HEAPS];
+	vmaGetHeapBudgets(_allocator, budgets);
+
+	for (uint32_t heap = 0; heap < memoryProperties->memoryHeapCount; heap++) {
+		HeapUsage usage{};
+		usage.budget = budgets[heap].budget;
+		usage.usage = budgets[heap].usage;
+		usage.blockBytes = budgets[heap].statistics.blockBytes;
+		usage.allocationBytes = budgets[heap].statistics.allocationBytes;
+		usage.blockCount = budgets[heap].statistics.blockCount;
+		usage.allocationCount = budgets[heap].statistics.allocationCount;
+		usage.deviceLocal = memoryProperties->memoryHeaps[heap].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT;
+		stats.heaps.push_back(usage);
+	}
+
+	stats.taggedBytes = _taggedBytes;
+	stats.taggedAllocations = _taggedAllocations;
+	stats.frameAllocations = _lastFrameAllocations;
+	stats.frameFrees = _lastFrameFrees;
+
+	// walks every block, so this is not meant to be called every frame
+	VmaTotalStatistics total;
+	vmaCalculateStatistics(_allocator, &total);
+	const VmaDetailedStatistics& all = total.total;
+	stats.unusedBytes = all.statistics.blockBytes - all.statistics.allocationBytes;
+	if (stats.unusedBytes > 0 && all.unusedRangeCount > 0) {
+		stats.fragmentation = 1.f - float(double(all.unusedRangeSizeMax) / double(stats.unusedBytes));
+	}
+	stats.defragmenting = _defragContext != VK_NULL_HANDLE;
+
+	return stats;
+}
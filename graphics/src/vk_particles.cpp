@@ -0,0 +1,489 @@
+#include <vk_particles.h>
+#include <vk_engine.h>
+#include <vk_images.h>
+#include <vk_initializers.h>
+
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+
+// the next pass reads what this one wrote, including the indirect arguments
+static void pass_barrier(VkCommandBuffer cmd)
+{
+	vkutil::memory_barrier(cmd, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+		VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_2_DRAW_INDIRECT_BIT,
+		VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT
+			| VK_ACCESS_2_INDIRECT_COMMAND_READ_BIT);
+}
+
+void ParticleSystem::init(VulkanEngine* engine, const ParticleSettings& settings)
+{
+	_engine = engine;
+	_settings = settings;
+	if (_settings.emitRate <= 0.f) {
+		_settings.emitRate = _settings.capacity / _settings.lifetime;
+	}
+	_settings.substeps = std::max(_settings.substeps, 1u);
+
+	init_buffers();
+	init_pipelines();
+}
+
+void ParticleSystem::init_buffers()
+{
+	GpuMemory& memory = _engine->_memory;
+	const VkBufferUsageFlags usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT;
+	const VkDeviceSize capacity = _settings.capacity;
+	const StorageLayout& storage = _settings.storage;
+
+	// sets can be loaded and read back with copies
+	const VkBufferUsageFlags setUsage = usage | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+	for (ParticleSet& set : _sets) {
+		set.positions = memory.create_buffer(capacity * storage.position_stride(), setUsage,
+			VMA_MEMORY_USAGE_GPU_ONLY, MemoryTag::Simulation);
+		set.velocities = memory.create_buffer(capacity * storage.velocity_stride(), setUsage,
+			VMA_MEMORY_USAGE_GPU_ONLY, MemoryTag::Simulation);
+		set.attributes = memory.create_buffer(capacity * sizeof(uint32_t), setUsage, VMA_MEMORY_USAGE_GPU_ONLY,
+			MemoryTag::Simulation);
+	}
+
+	_ageBuffer = memory.create_buffer(2 * capacity * sizeof(float), setUsage, VMA_MEMORY_USAGE_GPU_ONLY,
+		MemoryTag::Simulation);
+
+	_stateBuffer = memory.create_buffer(sizeof(GPUParticleState),
+		usage | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT
+			| VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+		VMA_MEMORY_USAGE_GPU_ONLY, MemoryTag::Simulation);
+
+	// every pass takes the addresses from current() and state() when it is
+	// recorded, so a move only has to rewrite the handles
+	for (ParticleSet& set : _sets) {
+		for (AllocatedBuffer* buffer : {&set.positions, &set.velocities, &set.attributes}) {
+			memory.register_movable(buffer);
+		}
+	}
+	memory.register_movable(&_ageBuffer);
+	memory.register_movable(&_stateBuffer);
+
+	for (uint32_t i = 0; i < FRAME_OVERLAP; i++) {
+		_readback.push_back(memory.create_buffer(sizeof(GPUParticleState), VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+			VMA_MEMORY_USAGE_GPU_TO_CPU, MemoryTag::Readback, VMA_ALLOCATION_CREATE_MAPPED_BIT));
+	}
+	_recorded.assign(FRAME_OVERLAP, false);
+	_recordedSet.assign(FRAME_OVERLAP, 0);
+
+	const VkPhysicalDeviceLimits& limits = _engine->_gpuProperties.limits;
+	if (limits.timestampComputeAndGraphics && _engine->_timestampValidBits != 0) {
+		VkQueryPoolCreateInfo poolInfo = {.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO};
+		poolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+		poolInfo.queryCount = FRAME_OVERLAP * 2;
+		vk_check(vkCreateQueryPool(_engine->_device, &poolInfo, nullptr, &_queryPool));
+		_timestampPeriod = limits.timestampPeriod;
+	}
+
+	double mib = double(capacity * particle_bytes() * 2) / (1024.0 * 1024.0);
+	spdlog::info("Particle system: {} particles per set, {} substeps, {:.1f} MiB, {} positions, {} velocities",
+		_settings.capacity, _settings.substeps, mib, to_string(storage.position), to_string(storage.velocity));
+	if (storage.position == StorageFormat::Fixed) {
+		spdlog::info("Particle system: fixed point cells of {} cover +-{}", storage.cell_size(),
+			storage.cell_size() * 512.f);
+	}
+}
+
+void ParticleSystem::init_pipelines()
+{
+	VkDevice device = _engine->_device;
+	const VkPhysicalDeviceLimits& limits = _engine->_gpuProperties.limits;
+
+	VkPushConstantRange range{};
+	range.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+	range.size = sizeof(PushConstants);
+
+	VkPipelineLayoutCreateInfo layoutInfo = vkinit::pipeline_layout_create_info();
+	layoutInfo.pushConstantRangeCount = 1;
+	layoutInfo.pPushConstantRanges = &range;
+	vk_check(vkCreatePipelineLayout(device, &layoutInfo, nullptr, &_layout));
+
+	const WorkgroupSize prepareSizes[] = {{1, 1, 1}};
+	_prepareKernel = vkutil::build_compute_kernel(device, limits, "particle_prepare", _layout,
+		_engine->_shaders.get("particle_prepare_cs"), prepareSizes);
+
+	const WorkgroupSize integrateSizes[] = {{256, 1, 1}, {128, 1, 1}, {64, 1, 1}, {512, 1, 1}};
+	_integrateKernel = vkutil::build_compute_kernel(device, limits, "particle_integrate", _layout,
+		_engine->_shaders.get("particle_integrate_cs"), integrateSizes);
+
+	const WorkgroupSize emitSizes[] = {{64, 1, 1}};
+	_emitKernel = vkutil::build_compute_kernel(device, limits, "particle_emit", _layout,
+		_engine->_shaders.get("particle_emit_cs"), emitSizes);
+
+	// time the integrator over a completely full source set
+	_engine->_kernelTuner.tune(
+		_integrateKernel,
+		[this](std::function<void(VkCommandBuffer cmd)>&& function) { _engine->immediate_submit(std::move(function)); },
+		[this](VkCommandBuffer cmd, const ComputeKernel& kernel) {
+			vkCmdFillBuffer(cmd, _stateBuffer.buffer, offsetof(GPUParticleState, count), sizeof(uint32_t),
+				_settings.capacity);
+			vkCmdFillBuffer(cmd, _stateBuffer.buffer, offsetof(GPUParticleState, count) + sizeof(uint32_t),
+				sizeof(uint32_t), 0);
+			vkutil::memory_barrier(cmd, VK_PIPELINE_STAGE_2_CLEAR_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT,
+				VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_READ_BIT);
+
+			PushConstants push = push_constants(0, 0.f, 0);
+			uint32_t groupSize = kernel.current().workgroup.x;
+			uint32_t groups = std::min((_settings.capacity + groupSize - 1) / groupSize, push.maxGroups);
+
+			kernel.bind(cmd);
+			vkCmdPushConstants(cmd, _layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(PushConstants), &push);
+			vkCmdDispatch(cmd, groups, 1, 1);
+		});
+
+	// tuning leaves garbage in the sets
+	_engine->immediate_submit([&](VkCommandBuffer cmd) { reset(cmd); });
+}
+
+void ParticleSystem::cleanup()
+{
+	VkDevice device = _engine->_device;
+	GpuMemory& memory = _engine->_memory;
+
+	_prepareKernel.destroy(device);
+	_integrateKernel.destroy(device);
+	_emitKernel.destroy(device);
+	vkDestroyPipelineLayout(device, _layout, nullptr);
+
+	if (_queryPool != VK_NULL_HANDLE) {
+		vkDestroyQueryPool(device, _queryPool, nullptr);
+	}
+	for (AllocatedBuffer& buffer : _readback) {
+		memory.destroy_buffer(buffer);
+	}
+	_readback.clear();
+	for (AllocatedBuffer& buffer : _uploads) {
+		memory.destroy_buffer(buffer);
+	}
+	_uploads.clear();
+
+	for (ParticleSet& set : _sets) {
+		memory.destroy_buffer(set.positions);
+		memory.destroy_buffer(set.velocities);
+		memory.destroy_buffer(set.attributes);
+	}
+	memory.destroy_buffer(_ageBuffer);
+	memory.destroy_buffer(_stateBuffer);
+}
+
+void ParticleSystem::load(const glm::vec4* positions, const glm::vec4* velocities, const uint32_t* attributes,
+	uint32_t count)
+{
+	count = std::min(count, _settings.capacity);
+	const StorageLayout& storage = _settings.storage;
+	const size_t positionBytes = count * storage.position_stride();
+	const size_t velocityBytes = count * storage.velocity_stride();
+	const size_t attributeBytes = count * sizeof(uint32_t);
+	const size_t ageBytes = count * sizeof(float);
+
+	AllocatedBuffer staging = _engine->_memory.create_buffer(
+		std::max<size_t>(positionBytes + velocityBytes + attributeBytes + ageBytes, 4),
+		VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VMA_MEMORY_USAGE_CPU_ONLY, MemoryTag::Staging,
+		VMA_ALLOCATION_CREATE_MAPPED_BIT);
+	char* data = (char*)staging.info.pMappedData;
+	vkutil::encode_storage(storage.position, storage.cell_size(), positions, count, data);
+	vkutil::encode_storage(storage.velocity, storage.cell_size(), velocities, count, data + positionBytes);
+	memcpy(data + positionBytes + velocityBytes, attributes, attributeBytes);
+	float* ages = (float*)(data + positionBytes + velocityBytes + attributeBytes);
+	for (uint32_t i = 0; i < count; i++) {
+		ages[i] = positions[i].w;
+	}
+
+	const ParticleSet& set = _sets[_current];
+	uint32_t counts[2] = {};
+	counts[_current] = count;
+	_engine->immediate_submit([&](VkCommandBuffer cmd) {
+		if (count > 0) {
+			VkBufferCopy copy{0, 0, positionBytes};
+			vkCmdCopyBuffer(cmd, staging.buffer, set.positions.buffer, 1, &copy);
+			copy.srcOffset = positionBytes;
+			copy.size = velocityBytes;
+			vkCmdCopyBuffer(cmd, staging.buffer, set.velocities.buffer, 1, &copy);
+			copy.srcOffset = positionBytes + velocityBytes;
+			copy.size = attributeBytes;
+			vkCmdCopyBuffer(cmd, staging.buffer, set.attributes.buffer, 1, &copy);
+			copy.srcOffset = positionBytes + velocityBytes + attributeBytes;
+			copy.dstOffset = _current * _settings.capacity * sizeof(float);
+			copy.size = ageBytes;
+			vkCmdCopyBuffer(cmd, staging.buffer, _ageBuffer.buffer, 1, &copy);
+		}
+		vkCmdUpdateBuffer(cmd, _stateBuffer.buffer, offsetof(GPUParticleState, count), sizeof(counts), counts);
+	});
+	_engine->_memory.destroy_buffer(staging);
+}
+
+void ParticleSystem::upload(VkCommandBuffer cmd, uint32_t frameIndex, uint32_t count,
+	const std::function<void(glm::vec4* positions, glm::vec4* velocities, uint32_t* attributes)>& fill)
+{
+	count = std::min(count, _settings.capacity);
+	const StorageLayout& storage = _settings.storage;
+	const VkDeviceSize positionBytes = _settings.capacity * storage.position_stride();
+	const VkDeviceSize velocityBytes = _settings.capacity * storage.velocity_stride();
+	const VkDeviceSize attributeBytes = _settings.capacity * sizeof(uint32_t);
+	const VkDeviceSize ageBytes = _settings.capacity * sizeof(float);
+
+	// only simulations off the GPU upload, so the staging is made on demand
+	if (_uploads.empty()) {
+		for (uint32_t i = 0; i < FRAME_OVERLAP; i++) {
+			_uploads.push_back(_engine->_memory.create_buffer(positionBytes + velocityBytes + attributeBytes + ageBytes,
+				VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VMA_MEMORY_USAGE_CPU_ONLY, MemoryTag::Staging,
+				VMA_ALLOCATION_CREATE_MAPPED_BIT));
+		}
+	}
+
+	const AllocatedBuffer& staging = _uploads[frameIndex];
+	char* data = (char*)staging.info.pMappedData;
+	// Float32 fields are filled in place, the others encoded from a copy
+	bool encodePositions = storage.position != StorageFormat::Float32;
+	bool encodeVelocities = storage.velocity != StorageFormat::Float32;
+	if (encodePositions) {
+		_uploadPositions.resize(_settings.capacity);
+	}
+	if (encodeVelocities) {
+		_uploadVelocities.resize(_settings.capacity);
+	}
+	fill(encodePositions ? _uploadPositions.data() : (glm::vec4*)data,
+		encodeVelocities ? _uploadVelocities.data() : (glm::vec4*)(data + positionBytes),
+		(uint32_t*)(data + positionBytes + velocityBytes));
+	// the ages are taken from the positions before they are encoded
+	const glm::vec4* filled = encodePositions ? _uploadPositions.data() : (const glm::vec4*)data;
+	float* ages = (float*)(data + positionBytes + velocityBytes + attributeBytes);
+	for (uint32_t i = 0; i < count; i++) {
+		ages[i] = filled[i].w;
+	}
+	if (encodePositions) {
+		vkutil::encode_storage(storage.position, storage.cell_size(), _uploadPositions.data(), count, data);
+	}
+	if (encodeVelocities) {
+		vkutil::encode_storage(storage.velocity, storage.cell_size(), _uploadVelocities.data(), count,
+			data + positionBytes);
+	}
+	vk_check(vmaFlushAllocation(_engine->_allocator, staging.allocation, 0, VK_WHOLE_SIZE));
+
+	// the previous frame may still be drawing the set
+	vkutil::memory_barrier(cmd, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, VK_ACCESS_2_MEMORY_READ_BIT,
+		VK_PIPELINE_STAGE_2_COPY_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT);
+
+	const ParticleSet& set = _sets[_current];
+	if (count > 0) {
+		VkBufferCopy copy{0, 0, count * storage.position_stride()};
+		vkCmdCopyBuffer(cmd, staging.buffer, set.positions.buffer, 1, &copy);
+		copy.srcOffset = positionBytes;
+		copy.size = count * storage.velocity_stride();
+		vkCmdCopyBuffer(cmd, staging.buffer, set.velocities.buffer, 1, &copy);
+		copy.srcOffset = positionBytes + velocityBytes;
+		copy.size = count * sizeof(uint32_t);
+		vkCmdCopyBuffer(cmd, staging.buffer, set.attributes.buffer, 1, &copy);
+		copy.srcOffset = positionBytes + velocityBytes + attributeBytes;
+		copy.dstOffset = _current * ageBytes;
+		copy.size = count * sizeof(float);
+		vkCmdCopyBuffer(cmd, staging.buffer, _ageBuffer.buffer, 1, &copy);
+	}
+	vkCmdUpdateBuffer(cmd, _stateBuffer.buffer, offsetof(GPUParticleState, count) + _current * sizeof(uint32_t),
+		sizeof(uint32_t), &count);
+
+	vkutil::memory_barrier(cmd, VK_PIPELINE_STAGE_2_COPY_BIT | VK_PIPELINE_STAGE_2_CLEAR_BIT,
+		VK_ACCESS_2_TRANSFER_WRITE_BIT, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_2_VERTEX_SHADER_BIT,
+		VK_ACCESS_2_SHADER_STORAGE_READ_BIT);
+}
+
+uint32_t ParticleSystem::download(std::vector<glm::vec4>& positions, std::vector<glm::vec4>& velocities,
+	std::vector<uint32_t>& attributes)
+{
+	const StorageLayout& storage = _settings.storage;
+	const size_t positionBytes = _settings.capacity * storage.position_stride();
+	const size_t velocityBytes = _settings.capacity * storage.velocity_stride();
+	const size_t attributeBytes = _settings.capacity * sizeof(uint32_t);
+	const size_t ageBytes = _settings.capacity * sizeof(float);
+
+	AllocatedBuffer readback = _engine->_memory.create_buffer(sizeof(GPUParticleState) + positionBytes
+			+ velocityBytes + attributeBytes + ageBytes,
+		VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_TO_CPU, MemoryTag::Readback,
+		VMA_ALLOCATION_CREATE_MAPPED_BIT);
+
+	// the whole set is copied, the count is only known afterwards
+	const ParticleSet& set = _sets[_current];
+	_engine->immediate_submit([&](VkCommandBuffer cmd) {
+		VkBufferCopy copy{0, 0, sizeof(GPUParticleState)};
+		vkCmdCopyBuffer(cmd, _stateBuffer.buffer, readback.buffer, 1, &copy);
+		copy.dstOffset = sizeof(GPUParticleState);
+		copy.size = positionBytes;
+		vkCmdCopyBuffer(cmd, set.positions.buffer, readback.buffer, 1, &copy);
+		copy.dstOffset += positionBytes;
+		copy.size = velocityBytes;
+		vkCmdCopyBuffer(cmd, set.velocities.buffer, readback.buffer, 1, &copy);
+		copy.dstOffset += velocityBytes;
+		copy.size = attributeBytes;
+		vkCmdCopyBuffer(cmd, set.attributes.buffer, readback.buffer, 1, &copy);
+		copy.srcOffset = _current * ageBytes;
+		copy.dstOffset += attributeBytes;
+		copy.size = ageBytes;
+		vkCmdCopyBuffer(cmd, _ageBuffer.buffer, readback.buffer, 1, &copy);
+	});
+	vk_check(vmaInvalidateAllocation(_engine->_allocator, readback.allocation, 0, VK_WHOLE_SIZE));
+
+	const char* data = (const char*)readback.info.pMappedData;
+	GPUParticleState state;
+	memcpy(&state, data, sizeof(GPUParticleState));
+	uint32_t count = std::min(state.count[_current], _settings.capacity);
+
+	data += sizeof(GPUParticleState);
+	positions.resize(count);
+	velocities.resize(count);
+	vkutil::decode_storage(storage.position, storage.cell_size(), data, count, positions.data());
+	vkutil::decode_storage(storage.velocity, storage.cell_size(), data + positionBytes, count, velocities.data());
+	data += positionBytes + velocityBytes;
+	attributes.assign((const uint32_t*)data, (const uint32_t*)data + count);
+	const float* ages = (const float*)(data + attributeBytes);
+	for (uint32_t i = 0; i < count; i++) {
+		positions[i].w = ages[i];
+	}
+
+	_engine->_memory.destroy_buffer(readback);
+	return count;
+}
+
+void ParticleSystem::reset(VkCommandBuffer cmd)
+{
+	vkCmdFillBuffer(cmd, _stateBuffer.buffer, 0, VK_WHOLE_SIZE, 0);
+	_current = 0;
+	_emitAccumulator = 0.f;
+}
+
+ParticleSystem::PushConstants ParticleSystem::push_constants(uint32_t src, float dt, uint32_t emitCount) const
+{
+	const ParticleSet& from = _sets[src];
+	const ParticleSet& to = _sets[1 - src];
+
+	PushConstants push{};
+	push.srcPositions = from.positions.address;
+	push.srcVelocities = from.velocities.address;
+	push.srcAttributes = from.attributes.address;
+	push.dstPositions = to.positions.address;
+	push.dstVelocities = to.velocities.address;
+	push.dstAttributes = to.attributes.address;
+	push.state = _stateBuffer.address;
+	push.dt = dt;
+	push.src = src;
+	push.emitter = glm::vec4(_settings.emitterPosition, _settings.emitterRadius);
+	push.motion = glm::vec4(_settings.initialSpeed, _settings.lifetime, _settings.gravity, _settings.drag);
+	push.capacity = _settings.capacity;
+	push.emitCount = emitCount;
+	push.seed = _seed;
+	push.groupSize = _integrateKernel.current().workgroup.x;
+	push.maxGroups = _engine->_gpuProperties.limits.maxComputeWorkGroupCount[0];
+	push.storage = _settings.storage.packed();
+	push.ages = _ageBuffer.address;
+	return push;
+}
+
+void ParticleSystem::simulate(VkCommandBuffer cmd, uint32_t frameIndex, float deltaSeconds)
+{
+	// a long hitch would otherwise fire one huge, unstable step
+	float dt = std::min(deltaSeconds, 1.f / 30.f) / _settings.substeps;
+
+	if (_queryPool != VK_NULL_HANDLE) {
+		vkCmdResetQueryPool(cmd, _queryPool, frameIndex * 2, 2);
+		vkCmdWriteTimestamp2(cmd, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, _queryPool, frameIndex * 2);
+	}
+
+	vkCmdFillBuffer(cmd, _stateBuffer.buffer, offsetof(GPUParticleState, integrated), sizeof(uint32_t), 0);
+	vkutil::memory_barrier(cmd, VK_PIPELINE_STAGE_2_CLEAR_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT,
+		VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+		VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT);
+
+	for (uint32_t step = 0; step < _settings.substeps; step++) {
+		_emitAccumulator += _settings.emitRate * dt;
+		float emitted = std::floor(_emitAccumulator);
+		_emitAccumulator -= emitted;
+		uint32_t emitCount = std::min((uint32_t)emitted, _settings.capacity);
+		_seed++;
+
+		// push constants survive the pipeline switches, all kernels share the layout
+		PushConstants push = push_constants(_current, dt, emitCount);
+		vkCmdPushConstants(cmd, _layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(PushConstants), &push);
+
+		_prepareKernel.bind(cmd);
+		vkCmdDispatch(cmd, 1, 1, 1);
+		pass_barrier(cmd);
+
+		_integrateKernel.bind(cmd);
+		vkCmdDispatchIndirect(cmd, _stateBuffer.buffer, offsetof(GPUParticleState, dispatch));
+		pass_barrier(cmd);
+
+		if (emitCount > 0) {
+			_emitKernel.bind(cmd);
+			_emitKernel.dispatch(cmd, emitCount);
+			pass_barrier(cmd);
+		}
+
+		_current = 1 - _current;
+
+		for (auto& pass : _substepPasses) {
+			pass(cmd, dt);
+		}
+	}
+
+	if (_queryPool != VK_NULL_HANDLE) {
+		vkCmdWriteTimestamp2(cmd, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, _queryPool, frameIndex * 2 + 1);
+	}
+
+	vkutil::memory_barrier(cmd, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+		VK_PIPELINE_STAGE_2_COPY_BIT, VK_ACCESS_2_TRANSFER_READ_BIT);
+	VkBufferCopy copy{0, 0, sizeof(GPUParticleState)};
+	vkCmdCopyBuffer(cmd, _stateBuffer.buffer, _readback[frameIndex].buffer, 1, &copy);
+
+	_recorded[frameIndex] = true;
+	_recordedSet[frameIndex] = _current;
+}
+
+size_t ParticleSystem::particle_bytes() const
+{
+	return _settings.storage.position_stride() + _settings.storage.velocity_stride() + sizeof(uint32_t) + sizeof(float);
+}
+
+void ParticleSystem::add_substep_pass(std::function<void(VkCommandBuffer cmd, float dt)>&& pass)
+{
+	_substepPasses.push_back(std::move(pass));
+}
+
+void ParticleSystem::collect(uint32_t frameIndex)
+{
+	if (!_recorded[frameIndex]) {
+		return;
+	}
+	_recorded[frameIndex] = false;
+
+	const AllocatedBuffer& readback = _readback[frameIndex];
+	vk_check(vmaInvalidateAllocation(_engine->_allocator, readback.allocation, 0, VK_WHOLE_SIZE));
+	GPUParticleState state;
+	memcpy(&state, readback.info.pMappedData, sizeof(GPUParticleState));
+
+	_stats.alive = std::min(state.count[_recordedSet[frameIndex]], _settings.capacity);
+	_stats.integrated = state.integrated;
+
+	if (_queryPool != VK_NULL_HANDLE) {
+		uint64_t timestamps[2];
+		VkResult result = vkGetQueryPoolResults(_engine->_device, _queryPool, frameIndex * 2, 2, sizeof(timestamps),
+			timestamps, sizeof(uint64_t), VK_QUERY_RESULT_64_BIT);
+		double nanoseconds = vkutil::timestamp_nanoseconds(timestamps[0], timestamps[1],
+			_engine->_timestampValidBits, _timestampPeriod);
+		if (result == VK_SUCCESS && nanoseconds > 0.0) {
+			_stats.gpuMilliseconds = nanoseconds / 1e6;
+			_stats.particlesPerSecond = double(_stats.integrated) / (_stats.gpuMilliseconds / 1e3);
+		}
+	}
+
+	auto now = std::chrono::steady_clock::now();
+	if (now - _lastReport > std::chrono::seconds(1)) {
+		_lastReport = now;
+		spdlog::info("Particles: {} alive, {:.3f} ms GPU, {:.1f} M particles/s", _stats.alive,
+			_stats.gpuMilliseconds, _stats.particlesPerSecond / 1e6);
+	}
+}
@@ -28,6 +28,11 @@ bool vkutil::load_shader_module(const char* filePath, VkDevice device, VkShaderM
     // now that the file is loaded into the buffer, we can close it
     file.close();
 
+    return load_shader_module(std::span<const uint32_t>(buffer), device, outShaderModule);
+}
+
+bool vkutil::load_shader_module(std::span<const uint32_t> code, VkDevice device, VkShaderModule* outShaderModule)
+{
     // create a new shader module, using the buffer we loaded
     VkShaderModuleCreateInfo createInfo = {};
     createInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
@@ -35,8 +40,8 @@ bool vkutil::load_shader_module(const char* filePath, VkDevice device, VkShaderM
 
     // codeSize has to be in bytes, so multply the ints in the buffer by size of
     // int to know the real size of the buffer
-    createInfo.codeSize = buffer.size() * sizeof(uint32_t);
-    createInfo.pCode = buffer.data();
+    createInfo.codeSize = code.size() * sizeof(uint32_t);
+    createInfo.pCode = code.data();
 
     // check that the creation goes well.
     VkShaderModule shaderModule;
@@ -46,3 +51,584 @@ bool vkutil::load_shader_module(const char* filePath, VkDevice device, VkShaderM
     *outShaderModule = shaderModule;
     return true;
 }
+
+VkPipeline vkutil::create_compute_pipeline(VkDevice device, VkPipelineLayout layout, VkShaderModule module,
+    WorkgroupSize workgroup, std::span<const uint32_t> parameters, VkPipelineCache cache)
+{
+    // constant ids 0..2 are the workgroup size, the kernel parameters follow
+    std::vector<uint32_t> constants = { workgroup.x, workgroup.y, workgroup.z };
+    constants.insert(constants.end(), parameters.begin(), parameters.end());
+
+    std::vector<VkSpecializationMapEntry> entries(constants.size());
+    for (uint32_t i = 0; i < entries.size(); i++) {
+        entries[i].constantID = i;
+        entries[i].offset = i * sizeof(uint32_t);
+        entries[i].size = sizeof(uint32_t);
+    }
+
+    VkSpecializationInfo specInfo = {};
+    specInfo.mapEntryCount = (uint32_t)entries.size();
+    specInfo.pMapEntries = entries.data();
+    specInfo.dataSize = constants.size() * sizeof(uint32_t);
+    specInfo.pData = constants.data();
+
+    VkPipelineShaderStageCreateInfo stageinfo = vkinit::pipeline_shader_stage_create_info(VK_SHADER_STAGE_COMPUTE_BIT, module);
+    stageinfo.pSpecializationInfo = &specInfo;
+
+    VkComputePipelineCreateInfo computePipelineCreateInfo = {};
+    computePipelineCreateInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+    computePipelineCreateInfo.pNext = nullptr;
+    computePipelineCreateInfo.layout = layout;
+    computePipelineCreateInfo.stage = stageinfo;
+
+    VkPipeline pipeline;
+    vk_check(vkCreateComputePipelines(device, cache, 1, &computePipelineCreateInfo, nullptr, &pipeline));
+    return pipeline;
+}
+
+ComputeKernel vkutil::build_compute_kernel(VkDevice device, const VkPhysicalDeviceLimits& limits, std::string name,
+    VkPipelineLayout layout, VkShaderModule module, std::span<const WorkgroupSize> candidates,
+    std::span<const uint32_t> parameters)
+{
+    ComputeKernel kernel;
+    kernel.name = std::move(name);
+    kernel.layout = layout;
+
+    for (const WorkgroupSize& workgroup : candidates) {
+        bool fits = workgroup.invocations() <= limits.maxComputeWorkGroupInvocations
+            && workgroup.x <= limits.maxComputeWorkGroupSize[0]
+            && workgroup.y <= limits.maxComputeWorkGroupSize[1]
+            && workgroup.z <= limits.maxComputeWorkGroupSize[2];
+        if (!fits) {
+            continue;
+        }
+        kernel.variants.push_back({ workgroup, create_compute_pipeline(device, layout, module, workgroup, parameters) });
+    }
+
+    if (kernel.variants.empty()) {
+        spdlog::error("No workgroup size of {} fits the device limits", kernel.name);
+        std::abort();
+    }
+    return kernel;
+}
+
+bool ComputeKernel::select(WorkgroupSize workgroup)
+{
+    for (size_t i = 0; i < variants.size(); i++) {
+        if (variants[i].workgroup == workgroup) {
+            selected = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+void ComputeKernel::bind(VkCommandBuffer cmd) const
+{
+    vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, current().pipeline);
+}
+
+void ComputeKernel::dispatch(VkCommandBuffer cmd, uint32_t width, uint32_t height, uint32_t depth) const
+{
+    const WorkgroupSize& workgroup = current().workgroup;
+    vkCmdDispatch(cmd, vkutil::group_count(width, workgroup.x), vkutil::group_count(height, workgroup.y),
+        vkutil::group_count(depth, workgroup.z));
+}
+
+void ComputeKernel::destroy(VkDevice device)
+{
+    for (ComputeVariant& variant : variants) {
+        vkDestroyPipeline(device, variant.pipeline, nullptr);
+    }
+    variants.clear();
+    selected = 0;
+}
+
+void ShaderRegistry::init(VkDevice device, const char* overrideDirectory)
+{
+    _device = device;
+    _overrideDirectory = overrideDirectory ? overrideDirectory : "";
+    if (!_overrideDirectory.empty()) {
+        spdlog::info("Loading shaders from {} before falling back to embedded SPIR-V", _overrideDirectory);
+    }
+}
+
+void ShaderRegistry::cleanup()
+{
+    for (auto& [name, module] : _modules) {
+        vkDestroyShaderModule(_device, module, nullptr);
+    }
+    _modules.clear();
+}
+
+VkShaderModule ShaderRegistry::get(std::string_view name)
+{
+    std::string key(name);
+    if (auto it = _modules.find(key); it != _modules.end()) {
+        return it->second;
+    }
+
+    VkShaderModule module = VK_NULL_HANDLE;
+    if (!_overrideDirectory.empty()) {
+        std::string path = _overrideDirectory + "/" + key + ".spv";
+        if (!vkutil::load_shader_module(path.c_str(), _device, &module)) {
+            module = VK_NULL_HANDLE;
+        }
+    }
+
+    if (module == VK_NULL_HANDLE) {
+        for (const EmbeddedShader& shader : vkutil::embedded_shaders()) {
+            if (name == shader.name) {
+                if (!vkutil::load_shader_module(shader.code, _device, &module)) {
+                    module = VK_NULL_HANDLE;
+                }
+                break;
+            }
+        }
+    }
+
+    if (module == VK_NULL_HANDLE) {
+        spdlog::error("Shader {} not found", key);
+        std::abort();
+    }
+
+    _modules.emplace(std::move(key), module);
+    return module;
+}
+
+// dynamic state of each pipeline part. A library has to declare the dynamic
+// state of the part it holds, the linked pipeline gets all of it.
+static constexpr VkDynamicState VERTEX_INPUT_DYNAMIC_STATES[] = {
+    VK_DYNAMIC_STATE_PRIMITIVE_TOPOLOGY,
+    VK_DYNAMIC_STATE_PRIMITIVE_RESTART_ENABLE,
+};
+
+static constexpr VkDynamicState PRE_RASTERIZATION_DYNAMIC_STATES[] = {
+    VK_DYNAMIC_STATE_VIEWPORT_WITH_COUNT,
+    VK_DYNAMIC_STATE_SCISSOR_WITH_COUNT,
+    VK_DYNAMIC_STATE_LINE_WIDTH,
+    VK_DYNAMIC_STATE_DEPTH_BIAS,
+    VK_DYNAMIC_STATE_CULL_MODE,
+    VK_DYNAMIC_STATE_FRONT_FACE,
+    VK_DYNAMIC_STATE_RASTERIZER_DISCARD_ENABLE,
+    VK_DYNAMIC_STATE_DEPTH_BIAS_ENABLE,
+};
+
+static constexpr VkDynamicState FRAGMENT_SHADER_DYNAMIC_STATES[] = {
+    VK_DYNAMIC_STATE_DEPTH_TEST_ENABLE,
+    VK_DYNAMIC_STATE_DEPTH_WRITE_ENABLE,
+    VK_DYNAMIC_STATE_DEPTH_COMPARE_OP,
+    VK_DYNAMIC_STATE_DEPTH_BOUNDS_TEST_ENABLE,
+    VK_DYNAMIC_STATE_DEPTH_BOUNDS,
+    VK_DYNAMIC_STATE_STENCIL_TEST_ENABLE,
+    VK_DYNAMIC_STATE_STENCIL_OP,
+    VK_DYNAMIC_STATE_STENCIL_COMPARE_MASK,
+    VK_DYNAMIC_STATE_STENCIL_WRITE_MASK,
+    VK_DYNAMIC_STATE_STENCIL_REFERENCE,
+};
+
+static constexpr VkGraphicsPipelineLibraryFlagsEXT ALL_LIBRARY_PARTS =
+    VK_GRAPHICS_PIPELINE_LIBRARY_VERTEX_INPUT_INTERFACE_BIT_EXT
+    | VK_GRAPHICS_PIPELINE_LIBRARY_PRE_RASTERIZATION_SHADERS_BIT_EXT
+    | VK_GRAPHICS_PIPELINE_LIBRARY_FRAGMENT_SHADER_BIT_EXT
+    | VK_GRAPHICS_PIPELINE_LIBRARY_FRAGMENT_OUTPUT_INTERFACE_BIT_EXT;
+
+static void hash_combine(size_t& seed, uint64_t value)
+{
+    seed ^= std::hash<uint64_t>{}(value) + 0x9e3779b97f4a7c15ull + (seed << 6) + (seed >> 2);
+}
+
+// with dynamic topology the pipeline only has to agree on the class
+static VkPrimitiveTopology topology_class(VkPrimitiveTopology topology)
+{
+    switch (topology) {
+    case VK_PRIMITIVE_TOPOLOGY_POINT_LIST:
+        return VK_PRIMITIVE_TOPOLOGY_POINT_LIST;
+    case VK_PRIMITIVE_TOPOLOGY_LINE_LIST:
+    case VK_PRIMITIVE_TOPOLOGY_LINE_STRIP:
+    case VK_PRIMITIVE_TOPOLOGY_LINE_LIST_WITH_ADJACENCY:
+    case VK_PRIMITIVE_TOPOLOGY_LINE_STRIP_WITH_ADJACENCY:
+        return VK_PRIMITIVE_TOPOLOGY_LINE_LIST;
+    case VK_PRIMITIVE_TOPOLOGY_PATCH_LIST:
+        return VK_PRIMITIVE_TOPOLOGY_PATCH_LIST;
+    default:
+        return VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+    }
+}
+
+size_t GraphicsPipelineDescHash::operator()(const GraphicsPipelineDesc& desc) const
+{
+    size_t seed = 0;
+    hash_combine(seed, (uint64_t)desc.layout);
+    hash_combine(seed, (uint64_t)desc.vertexShader);
+    hash_combine(seed, (uint64_t)desc.fragmentShader);
+    hash_combine(seed, desc.topology);
+    hash_combine(seed, desc.polygonMode);
+    hash_combine(seed, desc.samples);
+    hash_combine(seed, (uint64_t)desc.blend);
+    hash_combine(seed, desc.colorFormat);
+    hash_combine(seed, desc.depthFormat);
+    return seed;
+}
+
+// Creates the parts of `desc` named by `parts`, as a library or as a whole
+// pipeline. State of parts that are not included is left out, the library
+// extension requires that.
+static VkPipeline create_graphics_pipeline(VkDevice device, VkPipelineCache cache, const GraphicsPipelineDesc& desc,
+    VkGraphicsPipelineLibraryFlagsEXT parts, bool library)
+{
+    const bool vertexInput = parts & VK_GRAPHICS_PIPELINE_LIBRARY_VERTEX_INPUT_INTERFACE_BIT_EXT;
+    const bool preRasterization = parts & VK_GRAPHICS_PIPELINE_LIBRARY_PRE_RASTERIZATION_SHADERS_BIT_EXT;
+    const bool fragmentShader = parts & VK_GRAPHICS_PIPELINE_LIBRARY_FRAGMENT_SHADER_BIT_EXT;
+    const bool fragmentOutput = parts & VK_GRAPHICS_PIPELINE_LIBRARY_FRAGMENT_OUTPUT_INTERFACE_BIT_EXT;
+
+    std::vector<VkPipelineShaderStageCreateInfo> stages;
+    if (preRasterization) {
+        stages.push_back(vkinit::pipeline_shader_stage_create_info(VK_SHADER_STAGE_VERTEX_BIT, desc.vertexShader));
+    }
+    if (fragmentShader && desc.fragmentShader != VK_NULL_HANDLE) {
+        stages.push_back(vkinit::pipeline_shader_stage_create_info(VK_SHADER_STAGE_FRAGMENT_BIT, desc.fragmentShader));
+    }
+
+    std::vector<VkDynamicState> dynamicStates;
+    if (vertexInput) {
+        dynamicStates.insert(dynamicStates.end(), std::begin(VERTEX_INPUT_DYNAMIC_STATES), std::end(VERTEX_INPUT_DYNAMIC_STATES));
+    }
+    if (preRasterization) {
+        dynamicStates.insert(dynamicStates.end(), std::begin(PRE_RASTERIZATION_DYNAMIC_STATES), std::end(PRE_RASTERIZATION_DYNAMIC_STATES));
+    }
+    if (fragmentShader) {
+        dynamicStates.insert(dynamicStates.end(), std::begin(FRAGMENT_SHADER_DYNAMIC_STATES), std::end(FRAGMENT_SHADER_DYNAMIC_STATES));
+    }
+
+    VkPipelineVertexInputStateCreateInfo vertexInputState = { .sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO };
+
+    VkPipelineInputAssemblyStateCreateInfo inputAssembly = { .sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO };
+    inputAssembly.topology = topology_class(desc.topology);
+
+    // counts come with vkCmdSetViewportWithCount and vkCmdSetScissorWithCount
+    VkPipelineViewportStateCreateInfo viewportState = { .sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO };
+
+    VkPipelineRasterizationStateCreateInfo rasterizer = { .sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO };
+    rasterizer.polygonMode = desc.polygonMode;
+    rasterizer.lineWidth = 1.f;
+
+    VkPipelineMultisampleStateCreateInfo multisampling = { .sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO };
+    multisampling.rasterizationSamples = desc.samples;
+    multisampling.minSampleShading = 1.0f;
+
+    VkPipelineDepthStencilStateCreateInfo depthStencil = { .sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO };
+    depthStencil.maxDepthBounds = 1.f;
+
+    VkPipelineColorBlendAttachmentState blendAttachment = {};
+    blendAttachment.colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT
+        | VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
+    if (desc.blend != BlendMode::Opaque) {
+        blendAttachment.blendEnable = VK_TRUE;
+        blendAttachment.srcColorBlendFactor = VK_BLEND_FACTOR_SRC_ALPHA;
+        blendAttachment.dstColorBlendFactor = desc.blend == BlendMode::Additive
+            ? VK_BLEND_FACTOR_ONE : VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
+        blendAttachment.colorBlendOp = VK_BLEND_OP_ADD;
+        blendAttachment.srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE;
+        blendAttachment.dstAlphaBlendFactor = VK_BLEND_FACTOR_ZERO;
+        blendAttachment.alphaBlendOp = VK_BLEND_OP_ADD;
+    }
+
+    VkPipelineColorBlendStateCreateInfo colorBlending = { .sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO };
+    colorBlending.attachmentCount = desc.colorFormat != VK_FORMAT_UNDEFINED ? 1 : 0;
+    colorBlending.pAttachments = &blendAttachment;
+
+    VkPipelineDynamicStateCreateInfo dynamicInfo = { .sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO };
+    dynamicInfo.dynamicStateCount = (uint32_t)dynamicStates.size();
+    dynamicInfo.pDynamicStates = dynamicStates.data();
+
+    // the shader parts only read the view mask, the formats belong to the
+    // fragment output
+    VkPipelineRenderingCreateInfo renderInfo = { .sType = VK_STRUCTURE_TYPE_PIPELINE_RENDERING_CREATE_INFO };
+    if (fragmentOutput) {
+        renderInfo.colorAttachmentCount = colorBlending.attachmentCount;
+        renderInfo.pColorAttachmentFormats = &desc.colorFormat;
+        renderInfo.depthAttachmentFormat = desc.depthFormat;
+    }
+
+    VkGraphicsPipelineLibraryCreateInfoEXT libraryInfo = { .sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_LIBRARY_CREATE_INFO_EXT };
+    libraryInfo.pNext = &renderInfo;
+    libraryInfo.flags = parts;
+
+    VkGraphicsPipelineCreateInfo pipelineInfo = { .sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO };
+    pipelineInfo.pNext = library ? (const void*)&libraryInfo : (const void*)&renderInfo;
+    if (library) {
+        pipelineInfo.flags = VK_PIPELINE_CREATE_LIBRARY_BIT_KHR | VK_PIPELINE_CREATE_RETAIN_LINK_TIME_OPTIMIZATION_INFO_BIT_EXT;
+    }
+    pipelineInfo.stageCount = (uint32_t)stages.size();
+    pipelineInfo.pStages = stages.data();
+    if (vertexInput) {
+        pipelineInfo.pVertexInputState = &vertexInputState;
+        pipelineInfo.pInputAssemblyState = &inputAssembly;
+    }
+    if (preRasterization) {
+        pipelineInfo.pViewportState = &viewportState;
+        pipelineInfo.pRasterizationState = &rasterizer;
+    }
+    if (fragmentShader) {
+        pipelineInfo.pDepthStencilState = &depthStencil;
+    }
+    if (fragmentShader || fragmentOutput) {
+        pipelineInfo.pMultisampleState = &multisampling;
+    }
+    if (fragmentOutput) {
+        pipelineInfo.pColorBlendState = &colorBlending;
+    }
+    pipelineInfo.pDynamicState = dynamicStates.empty() ? nullptr : &dynamicInfo;
+    if (preRasterization || fragmentShader) {
+        pipelineInfo.layout = desc.layout;
+    }
+
+    VkPipeline pipeline;
+    vk_check(vkCreateGraphicsPipelines(device, cache, 1, &pipelineInfo, nullptr, &pipeline));
+    return pipeline;
+}
+
+// Links the four part libraries into a complete pipeline. Without link time
+// optimization this is the fast path the libraries exist for.
+static VkPipeline link_libraries(VkDevice device, std::span<const VkPipeline> libraries, VkPipelineLayout layout,
+    bool optimize)
+{
+    VkPipelineLibraryCreateInfoKHR linkInfo = { .sType = VK_STRUCTURE_TYPE_PIPELINE_LIBRARY_CREATE_INFO_KHR };
+    linkInfo.libraryCount = (uint32_t)libraries.size();
+    linkInfo.pLibraries = libraries.data();
+
+    VkGraphicsPipelineCreateInfo pipelineInfo = { .sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO };
+    pipelineInfo.pNext = &linkInfo;
+    pipelineInfo.flags = optimize ? VK_PIPELINE_CREATE_LINK_TIME_OPTIMIZATION_BIT_EXT : 0;
+    pipelineInfo.layout = layout;
+
+    VkPipeline pipeline;
+    vk_check(vkCreateGraphicsPipelines(device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &pipeline));
+    return pipeline;
+}
+
+void DynamicGraphicsState::apply(VkCommandBuffer cmd, VkExtent2D extent) const
+{
+    VkViewport viewport = { 0, 0, (float)extent.width, (float)extent.height, 0.f, 1.f };
+    vkCmdSetViewportWithCount(cmd, 1, &viewport);
+    VkRect2D scissor = { { 0, 0 }, extent };
+    vkCmdSetScissorWithCount(cmd, 1, &scissor);
+
+    vkCmdSetPrimitiveTopology(cmd, topology);
+    vkCmdSetPrimitiveRestartEnable(cmd, VK_FALSE);
+    vkCmdSetRasterizerDiscardEnable(cmd, VK_FALSE);
+    vkCmdSetCullMode(cmd, cullMode);
+    vkCmdSetFrontFace(cmd, frontFace);
+    vkCmdSetLineWidth(cmd, 1.f);
+    vkCmdSetDepthBiasEnable(cmd, depthBias);
+    vkCmdSetDepthBias(cmd, depthBiasConstant, 0.f, depthBiasSlope);
+
+    vkCmdSetDepthTestEnable(cmd, depthTest);
+    vkCmdSetDepthWriteEnable(cmd, depthWrite);
+    vkCmdSetDepthCompareOp(cmd, depthCompare);
+    vkCmdSetDepthBoundsTestEnable(cmd, VK_FALSE);
+    vkCmdSetDepthBounds(cmd, 0.f, 1.f);
+    vkCmdSetStencilTestEnable(cmd, VK_FALSE);
+    vkCmdSetStencilOp(cmd, VK_STENCIL_FACE_FRONT_AND_BACK, VK_STENCIL_OP_KEEP, VK_STENCIL_OP_KEEP,
+        VK_STENCIL_OP_KEEP, VK_COMPARE_OP_ALWAYS);
+    vkCmdSetStencilCompareMask(cmd, VK_STENCIL_FACE_FRONT_AND_BACK, 0);
+    vkCmdSetStencilWriteMask(cmd, VK_STENCIL_FACE_FRONT_AND_BACK, 0);
+    vkCmdSetStencilReference(cmd, VK_STENCIL_FACE_FRONT_AND_BACK, 0);
+}
+
+void PipelineBuilder::set_shaders(VkShaderModule vertexShader, VkShaderModule fragmentShader)
+{
+    desc.vertexShader = vertexShader;
+    desc.fragmentShader = fragmentShader;
+}
+
+void PipelineBuilder::set_layout(VkPipelineLayout layout)
+{
+    desc.layout = layout;
+}
+
+void PipelineBuilder::set_input_topology(VkPrimitiveTopology topology)
+{
+    desc.topology = topology;
+}
+
+void PipelineBuilder::set_polygon_mode(VkPolygonMode mode)
+{
+    desc.polygonMode = mode;
+}
+
+void PipelineBuilder::set_multisampling_none()
+{
+    desc.samples = VK_SAMPLE_COUNT_1_BIT;
+}
+
+void PipelineBuilder::disable_blending()
+{
+    desc.blend = BlendMode::Opaque;
+}
+
+void PipelineBuilder::enable_blending_additive()
+{
+    desc.blend = BlendMode::Additive;
+}
+
+void PipelineBuilder::enable_blending_alphablend()
+{
+    desc.blend = BlendMode::AlphaBlend;
+}
+
+void PipelineBuilder::set_color_attachment_format(VkFormat format)
+{
+    desc.colorFormat = format;
+}
+
+void PipelineBuilder::set_depth_format(VkFormat format)
+{
+    desc.depthFormat = format;
+}
+
+VkPipeline PipelineBuilder::build_pipeline(VkDevice device, VkPipelineCache cache) const
+{
+    return create_graphics_pipeline(device, cache, desc, ALL_LIBRARY_PARTS, false);
+}
+
+void GraphicsPipelineCache::init(VkDevice device, bool pipelineLibrary, uint32_t framesInFlight)
+{
+    _device = device;
+    _pipelineLibrary = pipelineLibrary;
+    _framesInFlight = framesInFlight;
+    spdlog::info("Graphics pipelines: {}", _pipelineLibrary ? "linked from pipeline libraries" : "monolithic");
+}
+
+void GraphicsPipelineCache::cleanup()
+{
+    if (_optimizing.valid()) {
+        vkDestroyPipeline(_device, _optimizing.get(), nullptr);
+    }
+    for (auto& [pipeline, frame] : _retired) {
+        vkDestroyPipeline(_device, pipeline, nullptr);
+    }
+    _retired.clear();
+    _unoptimized.clear();
+    for (auto& [desc, pipeline] : _pipelines) {
+        vkDestroyPipeline(_device, pipeline, nullptr);
+    }
+    _pipelines.clear();
+    for (DescMap& part : _libraries) {
+        for (auto& [desc, library] : part) {
+            vkDestroyPipeline(_device, library, nullptr);
+        }
+        part.clear();
+    }
+}
+
+VkPipeline GraphicsPipelineCache::library(LibraryPart part, const GraphicsPipelineDesc& desc)
+{
+    static constexpr VkGraphicsPipelineLibraryFlagsEXT PART_FLAGS[] = {
+        VK_GRAPHICS_PIPELINE_LIBRARY_VERTEX_INPUT_INTERFACE_BIT_EXT,
+        VK_GRAPHICS_PIPELINE_LIBRARY_PRE_RASTERIZATION_SHADERS_BIT_EXT,
+        VK_GRAPHICS_PIPELINE_LIBRARY_FRAGMENT_SHADER_BIT_EXT,
+        VK_GRAPHICS_PIPELINE_LIBRARY_FRAGMENT_OUTPUT_INTERFACE_BIT_EXT,
+    };
+
+    // only what the part depends on stays in its key
+    GraphicsPipelineDesc key{};
+    switch (part) {
+    case VertexInput:
+        key.topology = desc.topology;
+        break;
+    case PreRasterization:
+        key.layout = desc.layout;
+        key.vertexShader = desc.vertexShader;
+        key.polygonMode = desc.polygonMode;
+        break;
+    case FragmentShader:
+        key.layout = desc.layout;
+        key.fragmentShader = desc.fragmentShader;
+        key.samples = desc.samples;
+        break;
+    default:
+        key.samples = desc.samples;
+        key.blend = desc.blend;
+        key.colorFormat = desc.colorFormat;
+        key.depthFormat = desc.depthFormat;
+        break;
+    }
+
+    auto [it, inserted] = _libraries[part].try_emplace(key, VK_NULL_HANDLE);
+    if (inserted) {
+        it->second = create_graphics_pipeline(_device, VK_NULL_HANDLE, key, PART_FLAGS[part], true);
+        _stats.libraries++;
+    }
+    return it->second;
+}
+
+std::array<VkPipeline, GraphicsPipelineCache::LibraryPartCount> GraphicsPipelineCache::libraries(const GraphicsPipelineDesc& desc)
+{
+    std::array<VkPipeline, LibraryPartCount> parts;
+    for (uint32_t part = 0; part < LibraryPartCount; part++) {
+        parts[part] = library(LibraryPart(part), desc);
+    }
+    return parts;
+}
+
+void GraphicsPipelineCache::precompile(const GraphicsPipelineDesc& desc)
+{
+    GraphicsPipelineDesc key = desc;
+    key.topology = topology_class(desc.topology);
+    if (!_pipelineLibrary) {
+        get(key);
+        return;
+    }
+    libraries(key);
+}
+
+VkPipeline GraphicsPipelineCache::get(const GraphicsPipelineDesc& desc)
+{
+    GraphicsPipelineDesc key = desc;
+    key.topology = topology_class(desc.topology);
+    if (auto it = _pipelines.find(key); it != _pipelines.end()) {
+        return it->second;
+    }
+
+    VkPipeline pipeline;
+    if (_pipelineLibrary) {
+        pipeline = link_libraries(_device, libraries(key), key.layout, false);
+        _unoptimized.push_back(key);
+        _stats.linked++;
+    } else {
+        pipeline = create_graphics_pipeline(_device, VK_NULL_HANDLE, key, ALL_LIBRARY_PARTS, false);
+        _stats.compiled++;
+    }
+    _pipelines.emplace(key, pipeline);
+    return pipeline;
+}
+
+void GraphicsPipelineCache::begin_frame(uint64_t frameNumber)
+{
+    using namespace std::chrono_literals;
+    if (_optimizing.valid() && _optimizing.wait_for(0s) == std::future_status::ready) {
+        VkPipeline& pipeline = _pipelines.at(_optimizingDesc);
+        _retired.emplace_back(pipeline, frameNumber);
+        pipeline = _optimizing.get();
+        _stats.optimized++;
+    }
+
+    // frames before this one may still have the old pipeline bound
+    while (!_retired.empty() && _retired.front().second + _framesInFlight <= frameNumber) {
+        vkDestroyPipeline(_device, _retired.front().first, nullptr);
+        _retired.pop_front();
+    }
+
+    // one relink at a time, it is a full compile. The libraries it reads
+    // are only destroyed in cleanup(), after it finished.
+    if (!_optimizing.valid() && !_unoptimized.empty()) {
+        _optimizingDesc = _unoptimized.front();
+        _unoptimized.pop_front();
+        auto parts = libraries(_optimizingDesc);
+        _optimizing = std::async(std::launch::async, [device = _device, parts, layout = _optimizingDesc.layout]() {
+            return link_libraries(device, parts, layout, true);
+        });
+    }
+}
@@ -0,0 +1,321 @@
+#include <vk_primitives.h>
+#include <vk_engine.h>
+#include <vk_images.h>
+#include <vk_initializers.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <string_view>
+
+static constexpr uint32_t radixBins = 1u << GpuPrimitives::radixBits;
+
+static uint32_t partition_count(uint32_t count)
+{
+	return vkutil::group_count(count, GpuPrimitives::partitionSize);
+}
+
+// histogram, digit offsets, and the key and value ping-pong targets
+static std::array<VkDeviceSize, 4> radix_scratch_sizes(uint32_t count)
+{
+	VkDeviceSize histogramSize = radixBins * partition_count(count);
+	return {histogramSize * sizeof(uint32_t), histogramSize * sizeof(uint32_t), count * sizeof(uint32_t),
+		count * sizeof(uint32_t)};
+}
+
+static void pass_barrier(VkCommandBuffer cmd)
+{
+	vkutil::memory_barrier(cmd, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+		VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_2_DRAW_INDIRECT_BIT,
+		VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT
+			| VK_ACCESS_2_INDIRECT_COMMAND_READ_BIT);
+}
+
+static void fill_barrier(VkCommandBuffer cmd)
+{
+	vkutil::memory_barrier(cmd, VK_PIPELINE_STAGE_2_CLEAR_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT,
+		VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+		VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT);
+}
+
+void GpuPrimitives::init(VulkanEngine* engine)
+{
+	_engine = engine;
+	VkDevice device = _engine->_device;
+	const VkPhysicalDeviceLimits& limits = _engine->_gpuProperties.limits;
+
+	VkPhysicalDeviceVulkan11Properties subgroup{.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_1_PROPERTIES};
+	VkPhysicalDeviceProperties2 properties{.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2, .pNext = &subgroup};
+	vkGetPhysicalDeviceProperties2(_engine->_chosenGPU, &properties);
+
+	const VkSubgroupFeatureFlags required = VK_SUBGROUP_FEATURE_BASIC_BIT | VK_SUBGROUP_FEATURE_ARITHMETIC_BIT;
+	if ((subgroup.subgroupSupportedStages & VK_SHADER_STAGE_COMPUTE_BIT) == 0
+		|| (subgroup.subgroupSupportedOperations & required) != required) {
+		spdlog::error("GPU primitives need subgroup arithmetic in compute shaders");
+		abort();
+	}
+
+	// the look-back spins on other workgroups, which only terminates when
+	// the device keeps running them meanwhile
+	const char* fallback = std::getenv("GPSIM_PRIMITIVES_FALLBACK");
+	_lookback = _engine->_gpuProperties.deviceType != VK_PHYSICAL_DEVICE_TYPE_CPU
+		&& !(fallback && std::string_view(fallback) == "1");
+
+	VkPushConstantRange range{};
+	range.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+	range.size = sizeof(PushConstants);
+
+	VkPipelineLayoutCreateInfo layoutInfo = vkinit::pipeline_layout_create_info();
+	layoutInfo.pushConstantRangeCount = 1;
+	layoutInfo.pPushConstantRanges = &range;
+	vk_check(vkCreatePipelineLayout(device, &layoutInfo, nullptr, &_layout));
+
+	// the partition layout is baked into the shaders, so is the group size
+	const WorkgroupSize sizes[] = {{groupSize, 1, 1}};
+	auto build = [&](const char* name, const char* shader) {
+		return vkutil::build_compute_kernel(device, limits, name, _layout, _engine->_shaders.get(shader), sizes);
+	};
+	_scanLookbackKernel = build("scan_lookback", "scan_lookback_cs");
+	_scanBlocksKernel = build("scan_blocks", "scan_blocks_cs");
+	_reduceKernel = build("reduce", "reduce_cs");
+	_compactKernel = build("compact", "compact_cs");
+	_histogramKernel = build("radix_histogram", "radix_histogram_cs");
+	_radixScatterKernel = build("radix_scatter", "radix_scatter_cs");
+
+	spdlog::info("GPU primitives: {} scan, subgroup size {}", _lookback ? "look-back" : "reduce-then-scan",
+		subgroup.subgroupSize);
+}
+
+void GpuPrimitives::cleanup()
+{
+	VkDevice device = _engine->_device;
+	GpuMemory& memory = _engine->_memory;
+
+	for (ComputeKernel* kernel : {&_scanLookbackKernel, &_scanBlocksKernel, &_reduceKernel, &_compactKernel,
+			 &_histogramKernel, &_radixScatterKernel}) {
+		kernel->destroy(device);
+	}
+	vkDestroyPipelineLayout(device, _layout, nullptr);
+
+	if (_capacity > 0) {
+		memory.destroy_buffer(_scanState);
+		if (_transients == nullptr) {
+			for (AllocatedBuffer* buffer : radix_scratch()) {
+				memory.destroy_buffer(*buffer);
+			}
+		}
+	}
+	_capacity = 0;
+}
+
+uint32_t GpuPrimitives::max_elements() const
+{
+	return _engine->_gpuProperties.limits.maxComputeWorkGroupCount[0] * partitionSize;
+}
+
+void GpuPrimitives::reserve(uint32_t count)
+{
+	if (count <= _capacity) {
+		return;
+	}
+	if (count > max_elements()) {
+		spdlog::error("GPU primitives: {} elements exceed the dispatch limit of {}", count, max_elements());
+		abort();
+	}
+
+	GpuMemory& memory = _engine->_memory;
+	if (_capacity > 0) {
+		// only grows during init or between benchmarks, nothing can be in flight
+		vkDeviceWaitIdle(_engine->_device);
+		memory.destroy_buffer(_scanState);
+		// aliased scratch is sized for the old count, it stays unused
+		if (_transients == nullptr) {
+			for (AllocatedBuffer* buffer : radix_scratch()) {
+				memory.destroy_buffer(*buffer);
+			}
+		}
+		_transients = nullptr;
+	}
+	_capacity = count;
+
+	// the largest scan is either the elements or the radix histogram
+	uint32_t partitions = partition_count(count);
+	uint32_t histogramSize = radixBins * partitions;
+	uint32_t scanPartitions = std::max(partitions, partition_count(histogramSize));
+
+	const VkBufferUsageFlags usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT;
+	_scanState = memory.create_buffer((1 + 3 * scanPartitions) * sizeof(uint32_t),
+		usage | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_ONLY, MemoryTag::Other);
+
+	std::array<VkDeviceSize, 4> sizes = radix_scratch_sizes(count);
+	std::array<AllocatedBuffer*, 4> scratch = radix_scratch();
+	for (size_t i = 0; i < scratch.size(); i++) {
+		*scratch[i] = memory.create_buffer(sizes[i], usage, VMA_MEMORY_USAGE_GPU_ONLY, MemoryTag::Other);
+	}
+}
+
+void GpuPrimitives::alias_scratch(TransientAllocator& transients, uint32_t firstPass, uint32_t lastPass)
+{
+	if (_capacity == 0) {
+		return;
+	}
+
+	// still during init, nothing can be in flight
+	vkDeviceWaitIdle(_engine->_device);
+	const VkBufferUsageFlags usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT;
+	const char* names[] = {"radix histogram", "radix digit offsets", "radix keys", "radix values"};
+	std::array<VkDeviceSize, 4> sizes = radix_scratch_sizes(_capacity);
+	std::array<AllocatedBuffer*, 4> scratch = radix_scratch();
+	for (size_t i = 0; i < scratch.size(); i++) {
+		_engine->_memory.destroy_buffer(*scratch[i]);
+		_scratchHandles[i] = transients.declare_buffer(names[i], sizes[i], usage, firstPass, lastPass);
+	}
+	_transients = &transients;
+
+	transients.on_build([this]() {
+		if (_transients == nullptr) {
+			return;
+		}
+		std::array<AllocatedBuffer*, 4> scratch = radix_scratch();
+		for (size_t i = 0; i < scratch.size(); i++) {
+			*scratch[i] = _transients->buffer(_scratchHandles[i]);
+		}
+	});
+}
+
+void GpuPrimitives::acquire_scratch(VkCommandBuffer cmd) const
+{
+	// whatever shares the memory left it undefined
+	if (_transients != nullptr) {
+		_transients->acquire(cmd, _scratchHandles);
+	}
+}
+
+void GpuPrimitives::check_capacity(uint32_t count) const
+{
+	if (count > _capacity) {
+		spdlog::error("GPU primitives: {} elements recorded but only {} reserved", count, _capacity);
+		abort();
+	}
+}
+
+void GpuPrimitives::dispatch(VkCommandBuffer cmd, const ComputeKernel& kernel, const PushConstants& push,
+	uint32_t groups)
+{
+	kernel.bind(cmd);
+	vkCmdPushConstants(cmd, _layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(PushConstants), &push);
+	vkCmdDispatch(cmd, groups, 1, 1);
+	pass_barrier(cmd);
+}
+
+void GpuPrimitives::scan(VkCommandBuffer cmd, VkDeviceAddress src, VkDeviceAddress dst, uint32_t count)
+{
+	PushConstants push{};
+	push.src = src;
+	push.dst = dst;
+	push.scratch = _scanState.address;
+	push.count = count;
+	push.partitions = partition_count(count);
+
+	if (_lookback) {
+		vkCmdFillBuffer(cmd, _scanState.buffer, 0, (1 + 3 * push.partitions) * sizeof(uint32_t), 0);
+		fill_barrier(cmd);
+		dispatch(cmd, _scanLookbackKernel, push, push.partitions);
+		return;
+	}
+
+	for (uint32_t pass = 0; pass < 3; pass++) {
+		push.pass = pass;
+		dispatch(cmd, _scanBlocksKernel, push, pass == 1 ? 1 : push.partitions);
+	}
+}
+
+void GpuPrimitives::exclusive_scan(VkCommandBuffer cmd, const AllocatedBuffer& input, const AllocatedBuffer& output,
+	uint32_t count)
+{
+	if (count == 0) {
+		return;
+	}
+	check_capacity(count);
+	scan(cmd, input.address, output.address, count);
+}
+
+void GpuPrimitives::reduce(VkCommandBuffer cmd, const AllocatedBuffer& input, const AllocatedBuffer& result,
+	uint32_t count)
+{
+	check_capacity(count);
+	vkCmdFillBuffer(cmd, result.buffer, 0, sizeof(uint32_t), 0);
+	fill_barrier(cmd);
+	if (count == 0) {
+		return;
+	}
+
+	PushConstants push{};
+	push.src = input.address;
+	push.result = result.address;
+	push.count = count;
+	push.partitions = partition_count(count);
+	dispatch(cmd, _reduceKernel, push, push.partitions);
+}
+
+void GpuPrimitives::compact(VkCommandBuffer cmd, const AllocatedBuffer& input, const AllocatedBuffer& flags,
+	const AllocatedBuffer& output, const AllocatedBuffer& outCount, uint32_t count)
+{
+	check_capacity(count);
+	if (count == 0) {
+		vkCmdFillBuffer(cmd, outCount.buffer, 0, sizeof(uint32_t), 0);
+		fill_barrier(cmd);
+		return;
+	}
+
+	// a stable scan of the flags gives every survivor its output slot
+	acquire_scratch(cmd);
+	scan(cmd, flags.address, _keysTemp.address, count);
+
+	PushConstants push{};
+	push.src = input.address;
+	push.dst = output.address;
+	push.srcValues = flags.address;
+	push.dstValues = _keysTemp.address;
+	push.result = outCount.address;
+	push.count = count;
+	push.partitions = partition_count(count);
+	dispatch(cmd, _compactKernel, push, push.partitions);
+}
+
+void GpuPrimitives::radix_sort(VkCommandBuffer cmd, const AllocatedBuffer& keys, const AllocatedBuffer& values,
+	uint32_t count, uint32_t keyBits)
+{
+	if (count <= 1) {
+		return;
+	}
+	check_capacity(count);
+
+	uint32_t passes = (std::min(keyBits, 32u) + radixBits - 1) / radixBits;
+	passes += passes % 2;
+
+	uint32_t partitions = partition_count(count);
+	acquire_scratch(cmd);
+	VkDeviceAddress keyBuffers[2] = {keys.address, _keysTemp.address};
+	VkDeviceAddress valueBuffers[2] = {values.address, _valuesTemp.address};
+
+	for (uint32_t pass = 0; pass < passes; pass++) {
+		PushConstants push{};
+		push.src = keyBuffers[pass % 2];
+		push.dst = keyBuffers[(pass + 1) % 2];
+		push.srcValues = valueBuffers[pass % 2];
+		push.dstValues = valueBuffers[(pass + 1) % 2];
+		push.count = count;
+		push.partitions = partitions;
+		push.shift = pass * radixBits;
+
+		push.scratch = _histogram.address;
+		dispatch(cmd, _histogramKernel, push, partitions);
+
+		// digit major counts, so the scan orders by digit, then partition
+		scan(cmd, _histogram.address, _digitOffsets.address, radixBins * partitions);
+
+		push.scratch = 0;
+		push.result = _digitOffsets.address;
+		dispatch(cmd, _radixScatterKernel, push, partitions);
+	}
+}
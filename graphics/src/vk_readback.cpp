@@ -0,0 +1,123 @@
+#include <vk_readback.h>
+#include <vk_engine.h>
+#include <vk_images.h>
+
+#include <cstring>
+
+// copy offsets into the ring, also keeps requests apart for invalidation
+static constexpr VkDeviceSize RING_ALIGNMENT = 64;
+
+void ReadbackRing::init(VulkanEngine* engine, VkDeviceSize capacity)
+{
+	_engine = engine;
+	_capacity = (capacity + RING_ALIGNMENT - 1) / RING_ALIGNMENT * RING_ALIGNMENT;
+	_head = 0;
+	_tail = 0;
+
+	// random host access asks VMA for cached memory, reads from write
+	// combined memory would be uncached
+	_ring = _engine->_memory.create_buffer(_capacity, VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_AUTO,
+		MemoryTag::Readback, VMA_ALLOCATION_CREATE_HOST_ACCESS_RANDOM_BIT | VMA_ALLOCATION_CREATE_MAPPED_BIT);
+
+	VkMemoryPropertyFlags properties;
+	vmaGetAllocationMemoryProperties(_engine->_allocator, _ring.allocation, &properties);
+	_coherent = properties & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+	if (!(properties & VK_MEMORY_PROPERTY_HOST_CACHED_BIT)) {
+		spdlog::warn("Readback ring: no host cached memory, reads will be slow");
+	}
+	spdlog::info("Readback ring: {} KB", _capacity / 1024);
+}
+
+void ReadbackRing::cleanup()
+{
+	// the device is idle, but results of unfinished frames were never written
+	_unrecorded.clear();
+	_inFlight.clear();
+	_engine->_memory.destroy_buffer(_ring);
+}
+
+bool ReadbackRing::read(const AllocatedBuffer& source, VkDeviceSize offset, VkDeviceSize size, Callback&& done)
+{
+	const VkDeviceSize aligned = (size + RING_ALIGNMENT - 1) / RING_ALIGNMENT * RING_ALIGNMENT;
+	const uint32_t requests = uint32_t(_unrecorded.size() + _inFlight.size());
+
+	// a request never wraps, the rest of the ring is skipped instead
+	VkDeviceSize position = _head % _capacity;
+	VkDeviceSize skip = position + aligned > _capacity ? _capacity - position : 0;
+	if (size == 0 || requests >= maxRequests || _head + skip + aligned - _tail > _capacity) {
+		_stats.rejected++;
+		return false;
+	}
+
+	Request request{};
+	request.source = source.buffer;
+	request.sourceOffset = offset;
+	request.size = size;
+	request.ringOffset = (_head + skip) % _capacity;
+	_head += skip + aligned;
+	request.end = _head;
+	request.done = std::move(done);
+	_unrecorded.push_back(std::move(request));
+	return true;
+}
+
+std::future<std::vector<uint8_t>> ReadbackRing::read(const AllocatedBuffer& source, VkDeviceSize offset,
+	VkDeviceSize size)
+{
+	// std::function needs a copyable target
+	auto promise = std::make_shared<std::promise<std::vector<uint8_t>>>();
+	std::future<std::vector<uint8_t>> future = promise->get_future();
+	bool accepted = read(source, offset, size, [promise](std::span<const uint8_t> data) {
+		promise->set_value(std::vector<uint8_t>(data.begin(), data.end()));
+	});
+	return accepted ? std::move(future) : std::future<std::vector<uint8_t>>{};
+}
+
+void ReadbackRing::record(VkCommandBuffer cmd, uint64_t frameNumber)
+{
+	if (_unrecorded.empty()) {
+		return;
+	}
+
+	// whatever wrote the sources this frame
+	vkutil::memory_barrier(cmd, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, VK_ACCESS_2_MEMORY_WRITE_BIT,
+		VK_PIPELINE_STAGE_2_COPY_BIT, VK_ACCESS_2_TRANSFER_READ_BIT);
+	for (Request& request : _unrecorded) {
+		VkBufferCopy copy{};
+		copy.srcOffset = request.sourceOffset;
+		copy.dstOffset = request.ringOffset;
+		copy.size = request.size;
+		vkCmdCopyBuffer(cmd, request.source, _ring.buffer, 1, &copy);
+
+		request.frame = frameNumber;
+		_stats.bytesInFlight += request.size;
+		_inFlight.push_back(std::move(request));
+	}
+	_unrecorded.clear();
+	vkutil::memory_barrier(cmd, VK_PIPELINE_STAGE_2_COPY_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT,
+		VK_PIPELINE_STAGE_2_HOST_BIT, VK_ACCESS_2_HOST_READ_BIT);
+	_stats.requestsInFlight = (uint32_t)_inFlight.size();
+}
+
+void ReadbackRing::begin_frame(uint64_t frameNumber)
+{
+	// the fence of this frame slot was signaled by frame - FRAME_OVERLAP
+	while (!_inFlight.empty() && _inFlight.front().frame + FRAME_OVERLAP <= frameNumber) {
+		Request& request = _inFlight.front();
+		if (!_coherent) {
+			vk_check(vmaInvalidateAllocation(_engine->_allocator, _ring.allocation, request.ringOffset, request.size));
+		}
+		const uint8_t* data = static_cast<const uint8_t*>(_ring.info.pMappedData) + request.ringOffset;
+		request.done(std::span<const uint8_t>(data, request.size));
+
+		_tail = request.end;
+		_stats.completed++;
+		_stats.bytesInFlight -= request.size;
+		_inFlight.pop_front();
+	}
+	_stats.requestsInFlight = (uint32_t)_inFlight.size();
+	if (_inFlight.empty() && _unrecorded.empty()) {
+		// nothing to keep apart, start over at the beginning of the ring
+		_head = _tail = 0;
+	}
+}
@@ -0,0 +1,136 @@
+#include <vk_resolve.h>
+#include <vk_descriptors.h>
+#include <vk_engine.h>
+#include <vk_initializers.h>
+
+void SwapchainResolve::init(VulkanEngine* engine)
+{
+	_engine = engine;
+	_enabled = _engine->_swapchainStorage;
+	if (!_enabled) {
+		spdlog::info("Swapchain resolve: swapchain images are not storage images, blitting instead");
+		return;
+	}
+
+	VkDevice device = _engine->_device;
+
+	VkSamplerCreateInfo samplerInfo = {.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO};
+	samplerInfo.magFilter = VK_FILTER_LINEAR;
+	samplerInfo.minFilter = VK_FILTER_LINEAR;
+	samplerInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+	samplerInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+	samplerInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+	vk_check(vkCreateSampler(device, &samplerInfo, nullptr, &_sampler));
+
+	DescriptorLayoutBuilder builder;
+	builder.add_binding(0, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER);
+	builder.add_binding(1, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE);
+	_setLayout = builder.build(device, VK_SHADER_STAGE_COMPUTE_BIT);
+
+	// the draw image stays in GENERAL, sampling from it there is allowed
+	VkDescriptorImageInfo hdrInfo{};
+	hdrInfo.sampler = _sampler;
+	hdrInfo.imageView = _engine->_drawImage.imageView;
+	hdrInfo.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+	for (VkImageView view : _engine->_swapchainImageViews) {
+		VkDescriptorSet set = _engine->globalDescriptorAllocator.allocate(device, _setLayout);
+		VkDescriptorImageInfo swapchainInfo{};
+		swapchainInfo.imageView = view;
+		swapchainInfo.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+		VkWriteDescriptorSet writes[] = {
+			vkinit::write_descriptor_image(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, set, &hdrInfo, 0),
+			vkinit::write_descriptor_image(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, set, &swapchainInfo, 1),
+		};
+		vkUpdateDescriptorSets(device, 2, writes, 0, nullptr);
+		_sets.push_back(set);
+	}
+
+	VkPushConstantRange range{};
+	range.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+	range.size = sizeof(PushConstants);
+
+	VkPipelineLayoutCreateInfo layoutInfo = vkinit::pipeline_layout_create_info();
+	layoutInfo.setLayoutCount = 1;
+	layoutInfo.pSetLayouts = &_setLayout;
+	layoutInfo.pushConstantRangeCount = 1;
+	layoutInfo.pPushConstantRanges = &range;
+	vk_check(vkCreatePipelineLayout(device, &layoutInfo, nullptr, &_layout));
+
+	const WorkgroupSize imageSizes[] = {{16, 16, 1}, {8, 8, 1}, {32, 8, 1}};
+	_kernel = vkutil::build_compute_kernel(device, _engine->_gpuProperties.limits, "resolve", _layout,
+		_engine->_shaders.get("resolve_cs"), imageSizes);
+
+	spdlog::info("Swapchain resolve: compute into {} swapchain images", _sets.size());
+}
+
+void SwapchainResolve::cleanup()
+{
+	if (!_enabled) {
+		return;
+	}
+	VkDevice device = _engine->_device;
+	_kernel.destroy(device);
+	vkDestroyPipelineLayout(device, _layout, nullptr);
+	vkDestroyDescriptorSetLayout(device, _setLayout, nullptr);
+	vkDestroySampler(device, _sampler, nullptr);
+}
+
+void SwapchainResolve::draw(VkCommandBuffer cmd, uint32_t swapchainIndex, uint32_t frameNumber)
+{
+	VkImage swapchainImage = _engine->_swapchainImages[swapchainIndex];
+	VkExtent2D extent = _engine->_swapchainExtent;
+
+	// One dependency for both images: the scene writes before the reads of
+	// this pass, and the swapchain image into GENERAL, its old contents are
+	// dropped. Chains with the acquire semaphore waited on at compute.
+	VkMemoryBarrier2 sceneBarrier = {.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER_2};
+	sceneBarrier.srcStageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT;
+	sceneBarrier.srcAccessMask = VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT | VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT;
+	sceneBarrier.dstStageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT;
+	sceneBarrier.dstAccessMask = VK_ACCESS_2_SHADER_SAMPLED_READ_BIT;
+
+	VkImageMemoryBarrier2 acquireBarrier = {.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2};
+	acquireBarrier.srcStageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT;
+	acquireBarrier.srcAccessMask = VK_ACCESS_2_NONE;
+	acquireBarrier.dstStageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT;
+	acquireBarrier.dstAccessMask = VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT;
+	acquireBarrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+	acquireBarrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+	acquireBarrier.subresourceRange = vkinit::image_subresource_range(VK_IMAGE_ASPECT_COLOR_BIT);
+	acquireBarrier.image = swapchainImage;
+
+	VkDependencyInfo dependency = {.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO};
+	dependency.memoryBarrierCount = 1;
+	dependency.pMemoryBarriers = &sceneBarrier;
+	dependency.imageMemoryBarrierCount = 1;
+	dependency.pImageMemoryBarriers = &acquireBarrier;
+	vkCmdPipelineBarrier2(cmd, &dependency);
+
+	PushConstants push{};
+	push.invSize = glm::vec2(1.f / extent.width, 1.f / extent.height);
+	push.width = extent.width;
+	push.height = extent.height;
+	push.exposure = exposure;
+	push.frame = frameNumber;
+	push.dither = dither ? 1 : 0;
+	push.encodeSrgb = _engine->_swapchainEncodeSrgb ? 1 : 0;
+
+	_kernel.bind(cmd);
+	vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _layout, 0, 1, &_sets[swapchainIndex], 0, nullptr);
+	vkCmdPushConstants(cmd, _layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(PushConstants), &push);
+	_kernel.dispatch(cmd, extent.width, extent.height);
+
+	// presentation engine reads are made visible by the present itself
+	VkImageMemoryBarrier2 presentBarrier = acquireBarrier;
+	presentBarrier.srcStageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT;
+	presentBarrier.srcAccessMask = VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT;
+	presentBarrier.dstStageMask = VK_PIPELINE_STAGE_2_NONE;
+	presentBarrier.dstAccessMask = VK_ACCESS_2_NONE;
+	presentBarrier.oldLayout = VK_IMAGE_LAYOUT_GENERAL;
+	presentBarrier.newLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+
+	VkDependencyInfo presentDependency = {.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO};
+	presentDependency.imageMemoryBarrierCount = 1;
+	presentDependency.pImageMemoryBarriers = &presentBarrier;
+	vkCmdPipelineBarrier2(cmd, &presentDependency);
+}
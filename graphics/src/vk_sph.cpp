@@ -0,0 +1,91 @@
+#include <vk_sph.h>
+#include <vk_engine.h>
+#include <vk_images.h>
+#include <vk_initializers.h>
+
+#include <cmath>
+
+#include <glm/gtc/constants.hpp>
+
+void SphSolver::init(VulkanEngine* engine, ParticleSystem* particles, const SphSettings& settings)
+{
+	_engine = engine;
+	_particles = particles;
+	_settings = settings;
+
+	VkDevice device = _engine->_device;
+	const VkPhysicalDeviceLimits& limits = _engine->_gpuProperties.limits;
+	uint32_t capacity = _particles->settings().capacity;
+
+	_grid.init(engine, capacity, _settings.smoothingRadius, _particles->storage());
+	_fluid = _engine->_memory.create_buffer(capacity * sizeof(glm::vec4),
+		VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT, VMA_MEMORY_USAGE_GPU_ONLY,
+		MemoryTag::Simulation);
+
+	VkPushConstantRange range{};
+	range.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+	range.size = sizeof(PushConstants);
+
+	VkPipelineLayoutCreateInfo layoutInfo = vkinit::pipeline_layout_create_info();
+	layoutInfo.pushConstantRangeCount = 1;
+	layoutInfo.pPushConstantRanges = &range;
+	vk_check(vkCreatePipelineLayout(device, &layoutInfo, nullptr, &_layout));
+
+	const WorkgroupSize sizes[] = {{128, 1, 1}, {64, 1, 1}, {256, 1, 1}};
+	_densityKernel = vkutil::build_compute_kernel(device, limits, "sph_density", _layout,
+		_engine->_shaders.get("sph_density_cs"), sizes);
+	_forceKernel = vkutil::build_compute_kernel(device, limits, "sph_force", _layout,
+		_engine->_shaders.get("sph_force_cs"), sizes);
+
+	_particles->add_substep_pass([this](VkCommandBuffer cmd, float dt) { step(cmd, dt); });
+}
+
+void SphSolver::cleanup()
+{
+	VkDevice device = _engine->_device;
+
+	_densityKernel.destroy(device);
+	_forceKernel.destroy(device);
+	vkDestroyPipelineLayout(device, _layout, nullptr);
+	_engine->_memory.destroy_buffer(_fluid);
+	_grid.cleanup();
+}
+
+void SphSolver::step(VkCommandBuffer cmd, float dt)
+{
+	const ParticleSet& set = _particles->current();
+	_grid.build(cmd, set.positions.address, set.velocities.address, _particles->state().address,
+		_particles->current_index());
+
+	float h = _settings.smoothingRadius;
+	float pi = glm::pi<float>();
+
+	PushConstants push{};
+	push.grid = _grid.buffers();
+	push.velocities = set.velocities.address;
+	push.fluid = _fluid.address;
+	push.cellSize = h;
+	push.tableSize = _grid.table_size();
+	push.mass = _settings.particleMass;
+	push.restDensity = _settings.restDensity;
+	push.stiffness = _settings.stiffness;
+	push.viscosity = _settings.viscosity;
+	push.poly6 = 315.f / (64.f * pi * std::pow(h, 9.f));
+	push.spikyGradient = -45.f / (pi * std::pow(h, 6.f));
+	push.viscosityLaplacian = 45.f / (pi * std::pow(h, 6.f));
+	push.dt = dt;
+	vkCmdPushConstants(cmd, _layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(PushConstants), &push);
+
+	// both passes walk the sorted particles with the grid's indirect dispatch
+	_densityKernel.bind(cmd);
+	vkCmdDispatchIndirect(cmd, _grid.params_buffer(), sizeof(uint32_t));
+	vkutil::memory_barrier(cmd, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+		VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_READ_BIT);
+
+	_forceKernel.bind(cmd);
+	vkCmdDispatchIndirect(cmd, _grid.params_buffer(), sizeof(uint32_t));
+	vkutil::memory_barrier(cmd, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+		VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_2_DRAW_INDIRECT_BIT,
+		VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT
+			| VK_ACCESS_2_INDIRECT_COMMAND_READ_BIT);
+}
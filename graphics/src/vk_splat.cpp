@@ -0,0 +1,225 @@
+#include <vk_splat.h>
+#include <vk_descriptors.h>
+#include <vk_engine.h>
+#include <vk_images.h>
+#include <vk_initializers.h>
+
+#include <algorithm>
+
+static void pass_barrier(VkCommandBuffer cmd)
+{
+	vkutil::memory_barrier(cmd, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+		VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+		VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT);
+}
+
+static void fill_barrier(VkCommandBuffer cmd)
+{
+	vkutil::memory_barrier(cmd, VK_PIPELINE_STAGE_2_CLEAR_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT,
+		VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+		VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT);
+}
+
+void PointSplatter::init(VulkanEngine* engine, const ParticleSystem* particles, SplatMode mode)
+{
+	_engine = engine;
+	_particles = particles;
+	_mode = mode;
+
+	VkDevice device = _engine->_device;
+	const VkPhysicalDeviceLimits& limits = _engine->_gpuProperties.limits;
+	uint32_t capacity = _particles->settings().capacity;
+
+	_extent = {_engine->_drawImage.imageExtent.width, _engine->_drawImage.imageExtent.height};
+	_tilesX = vkutil::group_count(_extent.width, tileSize);
+	_tilesY = vkutil::group_count(_extent.height, tileSize);
+	uint32_t tiles = _tilesX * _tilesY;
+
+	// nothing is kept between frames, the buffers share memory with the
+	// scratch of the other passes
+	const VkBufferUsageFlags usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT;
+	TransientAllocator& transients = _engine->_transients;
+	auto declare = [&](const char* name, VkDeviceSize size, VkBufferUsageFlags extra = 0) {
+		return transients.declare_buffer(name, size, usage | extra, PASS_SPLAT, PASS_SPLAT);
+	};
+	_scratchHandles = {
+		declare("splat framebuffer", VkDeviceSize(_extent.width) * _extent.height * sizeof(uint64_t),
+			VK_BUFFER_USAGE_TRANSFER_DST_BIT),
+		declare("splat tile counts", tiles * sizeof(uint32_t), VK_BUFFER_USAGE_TRANSFER_DST_BIT),
+		declare("splat tile starts", tiles * sizeof(uint32_t)),
+		declare("splat particle tiles", capacity * sizeof(uint32_t)),
+		declare("splat particle ranks", capacity * sizeof(uint32_t)),
+		declare("splat binned values", capacity * sizeof(uint64_t)),
+		declare("splat binned pixels", capacity * sizeof(uint32_t)),
+	};
+	_engine->_primitives.reserve(tiles);
+
+	transients.on_build([this, &transients, usage]() {
+		AllocatedBuffer* buffers[] = {&_framebuffer, &_tileCount, &_tileStart, &_particleTile, &_particleRank,
+			&_binnedValue, &_binnedPixel};
+		for (size_t i = 0; i < _scratchHandles.size(); i++) {
+			*buffers[i] = transients.buffer(_scratchHandles[i]);
+		}
+
+		GPUSplatBins table{};
+		table.tileCount = _tileCount.address;
+		table.tileStart = _tileStart.address;
+		table.particleTile = _particleTile.address;
+		table.particleRank = _particleRank.address;
+		table.binnedValue = _binnedValue.address;
+		table.binnedPixel = _binnedPixel.address;
+		_binsTable = _engine->upload_buffer(&table, sizeof(table), usage, MemoryTag::RenderTarget);
+	});
+
+	// the scene depth is only fetched texel by texel
+	VkSamplerCreateInfo samplerInfo = {.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO};
+	samplerInfo.magFilter = VK_FILTER_NEAREST;
+	samplerInfo.minFilter = VK_FILTER_NEAREST;
+	samplerInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+	samplerInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+	samplerInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+	vk_check(vkCreateSampler(device, &samplerInfo, nullptr, &_depthSampler));
+
+	DescriptorLayoutBuilder builder;
+	builder.add_binding(0, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE);
+	builder.add_binding(1, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER);
+	_resolveSetLayout = builder.build(device, VK_SHADER_STAGE_COMPUTE_BIT);
+
+	_resolveSet = _engine->globalDescriptorAllocator.allocate(device, _resolveSetLayout);
+	VkDescriptorImageInfo colorInfo{};
+	colorInfo.imageView = _engine->_drawImage.imageView;
+	colorInfo.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+	VkDescriptorImageInfo depthInfo{};
+	depthInfo.sampler = _depthSampler;
+	depthInfo.imageView = _engine->_depthImage.imageView;
+	depthInfo.imageLayout = VK_IMAGE_LAYOUT_DEPTH_READ_ONLY_OPTIMAL;
+	VkWriteDescriptorSet writes[] = {
+		vkinit::write_descriptor_image(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, _resolveSet, &colorInfo, 0),
+		vkinit::write_descriptor_image(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, _resolveSet, &depthInfo, 1),
+	};
+	vkUpdateDescriptorSets(device, 2, writes, 0, nullptr);
+
+	VkPushConstantRange range{};
+	range.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+	range.size = sizeof(PushConstants);
+
+	VkPipelineLayoutCreateInfo layoutInfo = vkinit::pipeline_layout_create_info();
+	layoutInfo.pushConstantRangeCount = 1;
+	layoutInfo.pPushConstantRanges = &range;
+	vk_check(vkCreatePipelineLayout(device, &layoutInfo, nullptr, &_layout));
+	layoutInfo.setLayoutCount = 1;
+	layoutInfo.pSetLayouts = &_resolveSetLayout;
+	vk_check(vkCreatePipelineLayout(device, &layoutInfo, nullptr, &_resolveLayout));
+
+	const WorkgroupSize particleSizes[] = {{256, 1, 1}, {128, 1, 1}, {64, 1, 1}};
+	const WorkgroupSize tileSizes[] = {{tileSize, tileSize, 1}};
+	const WorkgroupSize imageSizes[] = {{16, 16, 1}, {8, 8, 1}, {32, 8, 1}};
+	_directKernel = vkutil::build_compute_kernel(device, limits, "splat_direct", _layout,
+		_engine->_shaders.get("splat_direct_cs"), particleSizes);
+	_binKernel = vkutil::build_compute_kernel(device, limits, "splat_bin", _layout,
+		_engine->_shaders.get("splat_bin_cs"), particleSizes);
+	_binScatterKernel = vkutil::build_compute_kernel(device, limits, "splat_bin_scatter", _layout,
+		_engine->_shaders.get("splat_bin_scatter_cs"), particleSizes);
+	// the tile pass needs 64-bit atomics on shared memory, which the device
+	// may not have enabled, so it is only built for the tiled mode
+	if (_mode == SplatMode::Tiled) {
+		_tilesKernel = vkutil::build_compute_kernel(device, limits, "splat_tiles", _layout,
+			_engine->_shaders.get("splat_tiles_cs"), tileSizes);
+	}
+	_resolveKernel = vkutil::build_compute_kernel(device, limits, "splat_resolve", _resolveLayout,
+		_engine->_shaders.get("splat_resolve_cs"), imageSizes);
+
+	spdlog::info("Point splatting: {}x{} pixels, {} tiles, {} mode", _extent.width, _extent.height, tiles,
+		_mode == SplatMode::Tiled ? "tiled" : "direct");
+}
+
+void PointSplatter::cleanup()
+{
+	VkDevice device = _engine->_device;
+	GpuMemory& memory = _engine->_memory;
+
+	for (ComputeKernel* kernel : {&_directKernel, &_binKernel, &_binScatterKernel, &_tilesKernel, &_resolveKernel}) {
+		kernel->destroy(device);
+	}
+	vkDestroyPipelineLayout(device, _layout, nullptr);
+	vkDestroyPipelineLayout(device, _resolveLayout, nullptr);
+	vkDestroyDescriptorSetLayout(device, _resolveSetLayout, nullptr);
+	vkDestroySampler(device, _depthSampler, nullptr);
+
+	// the others belong to the engine's transients
+	memory.destroy_buffer(_binsTable);
+}
+
+uint32_t PointSplatter::particle_groups(const ComputeKernel& kernel) const
+{
+	// the passes loop over the alive count, which only the GPU knows
+	uint32_t groupSize = kernel.current().workgroup.x;
+	return std::min(vkutil::group_count(_particles->settings().capacity, groupSize),
+		_engine->_gpuProperties.limits.maxComputeWorkGroupCount[0]);
+}
+
+void PointSplatter::draw(VkCommandBuffer cmd, VkDeviceAddress sceneData)
+{
+	const ParticleSet& set = _particles->current();
+
+	PushConstants push{};
+	push.scene = sceneData;
+	push.positions = set.positions.address;
+	push.attributes = set.attributes.address;
+	push.counts = _particles->state().address;
+	push.framebuffer = _framebuffer.address;
+	push.bins = _binsTable.address;
+	push.set = _particles->current_index();
+	push.width = _extent.width;
+	push.height = _extent.height;
+	push.tilesX = _tilesX;
+	push.storage = _particles->storage().packed();
+	push.capacity = _particles->settings().capacity;
+
+	_engine->_transients.acquire(cmd, _scratchHandles);
+	if (_mode == SplatMode::Tiled) {
+		splat_tiled(cmd, push);
+	} else {
+		splat_direct(cmd, push);
+	}
+
+	_resolveKernel.bind(cmd);
+	vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _resolveLayout, 0, 1, &_resolveSet, 0, nullptr);
+	vkCmdPushConstants(cmd, _resolveLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(PushConstants), &push);
+	_resolveKernel.dispatch(cmd, _extent.width, _extent.height);
+}
+
+void PointSplatter::splat_direct(VkCommandBuffer cmd, const PushConstants& push)
+{
+	vkCmdFillBuffer(cmd, _framebuffer.buffer, 0, VK_WHOLE_SIZE, 0);
+	fill_barrier(cmd);
+
+	_directKernel.bind(cmd);
+	vkCmdPushConstants(cmd, _layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(PushConstants), &push);
+	vkCmdDispatch(cmd, particle_groups(_directKernel), 1, 1);
+	pass_barrier(cmd);
+}
+
+void PointSplatter::splat_tiled(VkCommandBuffer cmd, const PushConstants& push)
+{
+	vkCmdFillBuffer(cmd, _tileCount.buffer, 0, VK_WHOLE_SIZE, 0);
+	fill_barrier(cmd);
+
+	_binKernel.bind(cmd);
+	vkCmdPushConstants(cmd, _layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(PushConstants), &push);
+	vkCmdDispatch(cmd, particle_groups(_binKernel), 1, 1);
+	pass_barrier(cmd);
+
+	_engine->_primitives.exclusive_scan(cmd, _tileCount, _tileStart, _tilesX * _tilesY);
+
+	// the scan bound its own pipeline and push constants
+	_binScatterKernel.bind(cmd);
+	vkCmdPushConstants(cmd, _layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(PushConstants), &push);
+	vkCmdDispatch(cmd, particle_groups(_binScatterKernel), 1, 1);
+	pass_barrier(cmd);
+
+	// every tile writes all of its pixels, so the framebuffer needs no clear
+	_tilesKernel.bind(cmd);
+	vkCmdDispatch(cmd, _tilesX, _tilesY, 1);
+	pass_barrier(cmd);
+}
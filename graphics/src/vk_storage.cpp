@@ -0,0 +1,98 @@
+#include <vk_storage.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#include <glm/gtc/packing.hpp>
+
+// must match shaders/storage.glsl
+constexpr int FIXED_CELLS = 1024;
+constexpr int FIXED_FRACTION_BITS = 16;
+constexpr int32_t FIXED_LIMIT = (FIXED_CELLS / 2) << FIXED_FRACTION_BITS;
+
+const char* to_string(StorageFormat format)
+{
+	switch (format) {
+	case StorageFormat::Float32:
+		return "fp32";
+	case StorageFormat::Float16:
+		return "fp16";
+	case StorageFormat::Fixed:
+		return "fixed";
+	}
+	return "unknown";
+}
+
+size_t storage_stride(StorageFormat format)
+{
+	switch (format) {
+	case StorageFormat::Float16:
+		return 2 * sizeof(uint32_t);
+	case StorageFormat::Fixed:
+		return 3 * sizeof(uint32_t);
+	default:
+		return 4 * sizeof(uint32_t);
+	}
+}
+
+int8_t vkutil::fixed_cell_exponent(float extent)
+{
+	int exponent = (int)std::ceil(std::log2(std::max(extent, 1e-30f) / (FIXED_CELLS / 2)));
+	return (int8_t)std::clamp(exponent, -128, 127);
+}
+
+void vkutil::encode_storage(StorageFormat format, float cellSize, const glm::vec4* values, size_t count, void* out)
+{
+	uint32_t* words = static_cast<uint32_t*>(out);
+	switch (format) {
+	case StorageFormat::Float32:
+		memcpy(out, values, count * sizeof(glm::vec4));
+		break;
+	case StorageFormat::Float16:
+		for (size_t i = 0; i < count; i++) {
+			words[i * 2 + 0] = glm::packHalf2x16(glm::vec2(values[i].x, values[i].y));
+			words[i * 2 + 1] = glm::packHalf2x16(glm::vec2(values[i].z, values[i].w));
+		}
+		break;
+	case StorageFormat::Fixed:
+		for (size_t i = 0; i < count; i++) {
+			uint32_t cell[3], fraction[3];
+			for (int axis = 0; axis < 3; axis++) {
+				float scaled = std::round(values[i][axis] / cellSize * float(1 << FIXED_FRACTION_BITS));
+				scaled = std::clamp(scaled, -float(FIXED_LIMIT), float(FIXED_LIMIT));
+				int32_t q = std::clamp((int32_t)scaled, -FIXED_LIMIT, FIXED_LIMIT - 1);
+				cell[axis] = uint32_t((q >> FIXED_FRACTION_BITS) + FIXED_CELLS / 2);
+				fraction[axis] = uint32_t(q) & 0xffffu;
+			}
+			words[i * 3 + 0] = cell[0] | cell[1] << 10 | cell[2] << 20;
+			words[i * 3 + 1] = fraction[0] | fraction[1] << 16;
+			words[i * 3 + 2] = fraction[2] | (glm::packHalf2x16(glm::vec2(values[i].w, 0.f)) << 16);
+		}
+		break;
+	}
+}
+
+void vkutil::decode_storage(StorageFormat format, float cellSize, const void* data, size_t count, glm::vec4* out)
+{
+	const uint32_t* words = static_cast<const uint32_t*>(data);
+	switch (format) {
+	case StorageFormat::Float32:
+		memcpy(out, data, count * sizeof(glm::vec4));
+		break;
+	case StorageFormat::Float16:
+		for (size_t i = 0; i < count; i++) {
+			out[i] = glm::vec4(glm::unpackHalf2x16(words[i * 2]), glm::unpackHalf2x16(words[i * 2 + 1]));
+		}
+		break;
+	case StorageFormat::Fixed:
+		for (size_t i = 0; i < count; i++) {
+			uint32_t c = words[i * 3];
+			glm::vec3 cell = glm::vec3(glm::ivec3(c & 0x3ff, (c >> 10) & 0x3ff, (c >> 20) & 0x3ff) - FIXED_CELLS / 2);
+			glm::vec3 fraction = glm::vec3(words[i * 3 + 1] & 0xffff, words[i * 3 + 1] >> 16, words[i * 3 + 2] & 0xffff)
+				/ float(1 << FIXED_FRACTION_BITS);
+			out[i] = glm::vec4((cell + fraction) * cellSize, glm::unpackHalf2x16(words[i * 3 + 2] >> 16).x);
+		}
+		break;
+	}
+}
@@ -0,0 +1,454 @@
+#include <vk_streaming.h>
+#include <vk_engine.h>
+#include <vk_images.h>
+#include <vk_initializers.h>
+
+#include <glm/geometric.hpp>
+
+#include <cstring>
+
+// coarse pages are uploaded through a staging buffer of this many pages
+static constexpr uint32_t COARSE_BATCH = 64;
+
+bool GeometryStreamer::init(VulkanEngine* engine, const std::filesystem::path& clusterFile,
+	const StreamingOptions& options)
+{
+	if (!_file.open(clusterFile)) {
+		return false;
+	}
+	_engine = engine;
+	_options = options;
+	_options.maxUploadsPerFrame = std::max(_options.maxUploadsPerFrame, 1u);
+
+	const ClusterFileHeader& header = _file.header();
+	_coarseSlots = header.coarsePages;
+	const uint32_t finePages = header.pageCount - header.coarsePages;
+
+	// whatever the options say, leave half of the free memory of the
+	// largest device local heap to the rest of the engine
+	VkDeviceSize freeBytes = 0;
+	for (const HeapUsage& heap : _engine->_memory.statistics().heaps) {
+		if (heap.deviceLocal && heap.budget > heap.usage) {
+			freeBytes = std::max(freeBytes, heap.budget - heap.usage);
+		}
+	}
+	VkDeviceSize poolBytes = std::min(_options.poolBytes, freeBytes / 2);
+	const uint32_t fineSlots = std::clamp(uint32_t(poolBytes / CLUSTER_PAGE_SIZE), 1u, std::max(finePages, 1u));
+	_stats.pageCount = header.pageCount;
+	_stats.poolPages = fineSlots;
+
+	const VkBufferUsageFlags usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT;
+	_groupBuffer = _engine->upload_buffer(_file.groups().data(), _file.groups().size_bytes(), usage,
+		MemoryTag::Geometry);
+	_clusterBuffer = _engine->upload_buffer(_file.clusters().data(), _file.clusters().size_bytes(), usage,
+		MemoryTag::Geometry);
+	_pool = _engine->_memory.create_buffer(VkDeviceSize(_coarseSlots + fineSlots) * CLUSTER_PAGE_SIZE,
+		usage | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_ONLY, MemoryTag::Geometry);
+	_pageStamps = _engine->_memory.create_buffer(header.pageCount * sizeof(uint32_t),
+		usage | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_ONLY, MemoryTag::Geometry);
+	_feedback = _engine->_memory.create_buffer((1 + _options.maxFeedback) * sizeof(uint32_t),
+		usage | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_ONLY,
+		MemoryTag::Geometry);
+	_commandBuffer = _engine->_memory.create_buffer(_options.maxDraws * sizeof(VkDrawIndirectCommand),
+		usage | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT, VMA_MEMORY_USAGE_GPU_ONLY, MemoryTag::Geometry);
+	_drawBuffer = _engine->_memory.create_buffer(_options.maxDraws * 2 * sizeof(uint32_t), usage,
+		VMA_MEMORY_USAGE_GPU_ONLY, MemoryTag::Geometry);
+	_countBuffer = _engine->_memory.create_buffer(sizeof(uint32_t),
+		usage | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_ONLY,
+		MemoryTag::Geometry);
+
+	// an upload can evict a page, so two page table entries per upload
+	_stagingFrameBytes = VkDeviceSize(_options.maxUploadsPerFrame) * (CLUSTER_PAGE_SIZE + 2 * sizeof(uint32_t));
+	_staging = _engine->_memory.create_buffer(FRAME_OVERLAP * _stagingFrameBytes, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+		VMA_MEMORY_USAGE_CPU_ONLY, MemoryTag::Staging, VMA_ALLOCATION_CREATE_MAPPED_BIT);
+
+	_slots.resize(_coarseSlots + fineSlots);
+	for (uint32_t slot = _coarseSlots; slot < _slots.size(); slot++) {
+		_slots[slot].lru = _lru.insert(_lru.end(), slot);
+	}
+	_pagePending.assign(header.pageCount, 0);
+	upload_coarse_pages();
+	init_pipelines();
+
+	_stop = false;
+	_thread = std::thread(&GeometryStreamer::io_loop, this);
+
+	spdlog::info("Streaming {}: {} groups in {} pages ({} MiB), {} coarse pages resident, {} slots ({} MiB) for "
+				 "the rest",
+		clusterFile.string(), header.groupCount, header.pageCount,
+		(uint64_t(header.pageCount) * CLUSTER_PAGE_SIZE) >> 20, _coarseSlots, fineSlots,
+		(uint64_t(fineSlots) * CLUSTER_PAGE_SIZE) >> 20);
+	return true;
+}
+
+void GeometryStreamer::upload_coarse_pages()
+{
+	const uint32_t firstCoarse = _file.page_count() - _coarseSlots;
+	_pageSlot.assign(_file.page_count(), UINT32_MAX);
+
+	AllocatedBuffer staging = _engine->_memory.create_buffer(COARSE_BATCH * CLUSTER_PAGE_SIZE,
+		VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VMA_MEMORY_USAGE_CPU_ONLY, MemoryTag::Staging,
+		VMA_ALLOCATION_CREATE_MAPPED_BIT);
+	for (uint32_t first = 0; first < _coarseSlots; first += COARSE_BATCH) {
+		uint32_t count = std::min(COARSE_BATCH, _coarseSlots - first);
+		uint8_t* data = static_cast<uint8_t*>(staging.info.pMappedData);
+		for (uint32_t i = 0; i < count; i++) {
+			uint32_t slot = first + i;
+			if (!_file.read_page(firstCoarse + slot, data + i * CLUSTER_PAGE_SIZE)) {
+				_stats.readErrors++;
+				std::memset(data + i * CLUSTER_PAGE_SIZE, 0, CLUSTER_PAGE_SIZE);
+			}
+			_pageSlot[firstCoarse + slot] = slot;
+			_slots[slot].page = firstCoarse + slot;
+		}
+		_engine->immediate_submit([&](VkCommandBuffer cmd) {
+			VkBufferCopy copy{0, VkDeviceSize(first) * CLUSTER_PAGE_SIZE, VkDeviceSize(count) * CLUSTER_PAGE_SIZE};
+			vkCmdCopyBuffer(cmd, staging.buffer, _pool.buffer, 1, &copy);
+		});
+	}
+	_engine->_memory.destroy_buffer(staging);
+	if (_stats.readErrors > 0) {
+		spdlog::error("Streaming: {} coarse pages could not be read", _stats.readErrors);
+	}
+
+	const VkBufferUsageFlags usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT;
+	_pageTable = _engine->upload_buffer(_pageSlot.data(), _pageSlot.size() * sizeof(uint32_t), usage,
+		MemoryTag::Geometry);
+	_engine->immediate_submit([&](VkCommandBuffer cmd) {
+		vkCmdFillBuffer(cmd, _pageStamps.buffer, 0, VK_WHOLE_SIZE, UINT32_MAX);
+	});
+}
+
+void GeometryStreamer::init_pipelines()
+{
+	VkDevice device = _engine->_device;
+
+	VkPushConstantRange cullRange{};
+	cullRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+	cullRange.size = sizeof(CullPushConstants);
+
+	VkPipelineLayoutCreateInfo layoutInfo = vkinit::pipeline_layout_create_info();
+	layoutInfo.pushConstantRangeCount = 1;
+	layoutInfo.pPushConstantRanges = &cullRange;
+	vk_check(vkCreatePipelineLayout(device, &layoutInfo, nullptr, &_cullLayout));
+
+	const WorkgroupSize cullSizes[] = {{64, 1, 1}, {128, 1, 1}, {32, 1, 1}};
+	_cullKernel = vkutil::build_compute_kernel(device, _engine->_gpuProperties.limits, "clustercull", _cullLayout,
+		_engine->_shaders.get("clustercull_cs"), cullSizes);
+
+	VkPushConstantRange drawRange{};
+	drawRange.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+	drawRange.size = sizeof(DrawPushConstants);
+	layoutInfo.pPushConstantRanges = &drawRange;
+	vk_check(vkCreatePipelineLayout(device, &layoutInfo, nullptr, &_drawLayout));
+
+	// the clusters are shaded like the other meshes
+	PipelineBuilder builder;
+	builder.set_shaders(_engine->_shaders.get("cluster_vs"), _engine->_shaders.get("mesh_fs"));
+	builder.set_layout(_drawLayout);
+	builder.set_input_topology(VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST);
+	builder.set_polygon_mode(VK_POLYGON_MODE_FILL);
+	builder.set_multisampling_none();
+	builder.disable_blending();
+	builder.set_color_attachment_format(_engine->_drawImage.imageFormat);
+	builder.set_depth_format(_engine->_depthImage.imageFormat);
+	_drawPipeline = builder.desc;
+	_engine->_pipelines.precompile(_drawPipeline);
+
+	_drawState.cullMode = VK_CULL_MODE_NONE;
+	_drawState.frontFace = VK_FRONT_FACE_CLOCKWISE;
+	_drawState.depthTest = true;
+	_drawState.depthWrite = true;
+	_drawState.depthCompare = VK_COMPARE_OP_GREATER_OR_EQUAL;
+}
+
+void GeometryStreamer::cleanup()
+{
+	if (!enabled()) {
+		return;
+	}
+	{
+		std::lock_guard lock(_mutex);
+		_stop = true;
+	}
+	_wake.notify_all();
+	if (_thread.joinable()) {
+		_thread.join();
+	}
+	_requests.clear();
+	_loaded.clear();
+	_spare.clear();
+
+	VkDevice device = _engine->_device;
+	_cullKernel.destroy(device);
+	vkDestroyPipelineLayout(device, _cullLayout, nullptr);
+	vkDestroyPipelineLayout(device, _drawLayout, nullptr);
+
+	GpuMemory& memory = _engine->_memory;
+	for (AllocatedBuffer* buffer : {&_groupBuffer, &_clusterBuffer, &_pool, &_pageTable, &_pageStamps, &_feedback,
+			 &_commandBuffer, &_drawBuffer, &_countBuffer, &_staging}) {
+		memory.destroy_buffer(*buffer);
+		*buffer = {};
+	}
+	if (_instanceBuffer.buffer != VK_NULL_HANDLE) {
+		memory.destroy_buffer(_instanceBuffer);
+		_instanceBuffer = {};
+	}
+	_instanceCount = 0;
+	_slots.clear();
+	_lru.clear();
+	_file.close();
+	_engine = nullptr;
+}
+
+void GeometryStreamer::set_instances(std::span<const glm::mat4> transforms)
+{
+	if (_instanceBuffer.buffer != VK_NULL_HANDLE) {
+		_engine->_memory.destroy_buffer(_instanceBuffer);
+		_instanceBuffer = {};
+	}
+
+	// one workgroup row per instance
+	uint32_t maxInstances = _engine->_gpuProperties.limits.maxComputeWorkGroupCount[1];
+	if (transforms.size() > maxInstances) {
+		spdlog::warn("Streaming: only the first {} of {} instances are drawn", maxInstances, transforms.size());
+		transforms = transforms.first(maxInstances);
+	}
+	_instanceCount = (uint32_t)transforms.size();
+	if (_instanceCount == 0) {
+		return;
+	}
+
+	std::vector<GPUInstance> instances;
+	instances.reserve(transforms.size());
+	for (const glm::mat4& transform : transforms) {
+		float scale = std::max({glm::length(glm::vec3(transform[0])), glm::length(glm::vec3(transform[1])),
+			glm::length(glm::vec3(transform[2]))});
+		instances.push_back(GPUInstance{transform, 0, scale, 0, 0});
+	}
+	_instanceBuffer = _engine->upload_buffer(instances.data(), instances.size() * sizeof(GPUInstance),
+		VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT, MemoryTag::Geometry);
+}
+
+void GeometryStreamer::handle_feedback(std::span<const uint8_t> data, uint64_t frameNumber)
+{
+	uint32_t count;
+	std::memcpy(&count, data.data(), sizeof(uint32_t));
+	if (count > _options.maxFeedback) {
+		_stats.feedbackOverflows++;
+		count = _options.maxFeedback;
+	}
+	const uint32_t* pages = reinterpret_cast<const uint32_t*>(data.data() + sizeof(uint32_t));
+	_feedbackFrame = std::max(_feedbackFrame, frameNumber);
+
+	uint32_t requested = 0;
+	std::vector<uint32_t> loads;
+	for (uint32_t i = 0; i < count; i++) {
+		uint32_t page = pages[i];
+		if (page >= _pageSlot.size()) {
+			continue;
+		}
+		uint32_t slot = _pageSlot[page];
+		if (slot != UINT32_MAX) {
+			if (slot >= _coarseSlots) {
+				_slots[slot].lastUsed = frameNumber;
+				_lru.splice(_lru.begin(), _lru, _slots[slot].lru);
+			}
+		} else if (!_pagePending[page]) {
+			// the rest is asked for again by later feedback
+			requested++;
+			if (_pending < _options.maxPendingLoads) {
+				_pagePending[page] = 1;
+				_pending++;
+				loads.push_back(page);
+			}
+		}
+	}
+	_stats.requestedLastFrame = requested;
+
+	if (!loads.empty()) {
+		{
+			std::lock_guard lock(_mutex);
+			_requests.insert(_requests.end(), loads.begin(), loads.end());
+		}
+		_wake.notify_one();
+	}
+}
+
+void GeometryStreamer::upload_loads(VkCommandBuffer cmd, uint64_t frameNumber)
+{
+	std::vector<Load> loads;
+	{
+		std::lock_guard lock(_mutex);
+		while (!_loaded.empty() && loads.size() < _options.maxUploadsPerFrame) {
+			loads.push_back(std::move(_loaded.front()));
+			_loaded.pop_front();
+		}
+	}
+
+	// this frame's part of the staging buffer, its previous copies are done
+	const VkDeviceSize base = (frameNumber % FRAME_OVERLAP) * _stagingFrameBytes;
+	uint8_t* pages = static_cast<uint8_t*>(_staging.info.pMappedData) + base;
+	const VkDeviceSize entryBase = base + VkDeviceSize(_options.maxUploadsPerFrame) * CLUSTER_PAGE_SIZE;
+	uint32_t* entries = reinterpret_cast<uint32_t*>(pages + VkDeviceSize(_options.maxUploadsPerFrame) * CLUSTER_PAGE_SIZE);
+
+	std::vector<VkBufferCopy> pageCopies;
+	std::vector<VkBufferCopy> entryCopies;
+	auto set_entry = [&](uint32_t page, uint32_t slot) {
+		_pageSlot[page] = slot;
+		entries[entryCopies.size()] = slot;
+		entryCopies.push_back(VkBufferCopy{entryBase + entryCopies.size() * sizeof(uint32_t),
+			page * sizeof(uint32_t), sizeof(uint32_t)});
+	};
+
+	for (Load& load : loads) {
+		_pagePending[load.page] = 0;
+		_pending--;
+		if (!load.ok) {
+			_stats.readErrors++;
+			continue;
+		}
+
+		// Least recently used slot, unless the newest feedback still used
+		// it. Everything in the pool is then wanted, the load is dropped and
+		// the page asked for again later.
+		uint32_t slot = _lru.back();
+		Slot& victim = _slots[slot];
+		if (victim.page != UINT32_MAX && victim.lastUsed >= _feedbackFrame) {
+			_stats.deferredUploads++;
+			continue;
+		}
+		if (victim.page != UINT32_MAX) {
+			set_entry(victim.page, UINT32_MAX);
+			_stats.evictions++;
+			_stats.residentPages--;
+		}
+
+		std::memcpy(pages + pageCopies.size() * CLUSTER_PAGE_SIZE, load.data.data(), CLUSTER_PAGE_SIZE);
+		pageCopies.push_back(VkBufferCopy{base + pageCopies.size() * CLUSTER_PAGE_SIZE,
+			VkDeviceSize(slot) * CLUSTER_PAGE_SIZE, CLUSTER_PAGE_SIZE});
+
+		// not evictable until feedback of this frame came back
+		victim.page = load.page;
+		victim.lastUsed = frameNumber;
+		_lru.splice(_lru.begin(), _lru, victim.lru);
+		set_entry(load.page, slot);
+		_stats.loads++;
+		_stats.residentPages++;
+		_stats.uploadedBytes += CLUSTER_PAGE_SIZE;
+	}
+
+	{
+		std::lock_guard lock(_mutex);
+		for (Load& load : loads) {
+			_spare.push_back(std::move(load.data));
+		}
+	}
+	_stats.pendingLoads = _pending;
+
+	if (!pageCopies.empty()) {
+		vkCmdCopyBuffer(cmd, _staging.buffer, _pool.buffer, (uint32_t)pageCopies.size(), pageCopies.data());
+	}
+	if (!entryCopies.empty()) {
+		vkCmdCopyBuffer(cmd, _staging.buffer, _pageTable.buffer, (uint32_t)entryCopies.size(), entryCopies.data());
+	}
+}
+
+void GeometryStreamer::update(VkCommandBuffer cmd, VkDeviceAddress sceneData, uint64_t frameNumber)
+{
+	if (!enabled() || _instanceCount == 0) {
+		return;
+	}
+
+	// slots and feedback may still be read by the previous frame
+	vkutil::memory_barrier(cmd, VK_PIPELINE_STAGE_2_VERTEX_SHADER_BIT | VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT
+			| VK_PIPELINE_STAGE_2_COPY_BIT, VK_ACCESS_2_NONE,
+		VK_PIPELINE_STAGE_2_COPY_BIT | VK_PIPELINE_STAGE_2_CLEAR_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT);
+
+	upload_loads(cmd, frameNumber);
+	vkCmdFillBuffer(cmd, _feedback.buffer, 0, sizeof(uint32_t), 0);
+	vkCmdFillBuffer(cmd, _countBuffer.buffer, 0, sizeof(uint32_t), 0);
+
+	vkutil::memory_barrier(cmd, VK_PIPELINE_STAGE_2_COPY_BIT | VK_PIPELINE_STAGE_2_CLEAR_BIT,
+		VK_ACCESS_2_TRANSFER_WRITE_BIT, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_2_VERTEX_SHADER_BIT,
+		VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT);
+
+	CullPushConstants push{};
+	push.scene = sceneData;
+	push.instances = _instanceBuffer.address;
+	push.groups = _groupBuffer.address;
+	push.clusters = _clusterBuffer.address;
+	push.pageTable = _pageTable.address;
+	push.pageStamps = _pageStamps.address;
+	push.feedback = _feedback.address;
+	push.commands = _commandBuffer.address;
+	push.draws = _drawBuffer.address;
+	push.count = _countBuffer.address;
+	push.instanceCount = _instanceCount;
+	push.groupCount = _file.header().groupCount;
+	push.maxFeedback = _options.maxFeedback;
+	push.maxDraws = _options.maxDraws;
+	push.frame = uint32_t(frameNumber);
+
+	_cullKernel.bind(cmd);
+	vkCmdPushConstants(cmd, _cullLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(CullPushConstants), &push);
+	_cullKernel.dispatch(cmd, push.groupCount, _instanceCount);
+
+	vkutil::memory_barrier(cmd, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+		VK_PIPELINE_STAGE_2_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_2_VERTEX_SHADER_BIT,
+		VK_ACCESS_2_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_READ_BIT);
+
+	// the ring refuses when it is full, the next frame reports again
+	_engine->_readback.read(_feedback, 0, (1 + _options.maxFeedback) * sizeof(uint32_t),
+		[this, frameNumber](std::span<const uint8_t> data) { handle_feedback(data, frameNumber); });
+}
+
+void GeometryStreamer::draw(VkCommandBuffer cmd, VkDeviceAddress sceneData)
+{
+	if (!enabled() || _instanceCount == 0) {
+		return;
+	}
+
+	vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, _engine->_pipelines.get(_drawPipeline));
+	_drawState.apply(cmd, _engine->_drawExtent);
+
+	DrawPushConstants push{};
+	push.scene = sceneData;
+	push.instances = _instanceBuffer.address;
+	push.clusters = _clusterBuffer.address;
+	push.pageTable = _pageTable.address;
+	push.pool = _pool.address;
+	push.draws = _drawBuffer.address;
+	vkCmdPushConstants(cmd, _drawLayout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(DrawPushConstants), &push);
+
+	vkCmdDrawIndirectCount(cmd, _commandBuffer.buffer, 0, _countBuffer.buffer, 0, _options.maxDraws,
+		sizeof(VkDrawIndirectCommand));
+}
+
+void GeometryStreamer::io_loop()
+{
+	for (;;) {
+		uint32_t page;
+		std::vector<uint8_t> data;
+		{
+			std::unique_lock lock(_mutex);
+			_wake.wait(lock, [&]() { return _stop || !_requests.empty(); });
+			if (_stop) {
+				return;
+			}
+			page = _requests.front();
+			_requests.pop_front();
+			if (!_spare.empty()) {
+				data = std::move(_spare.back());
+				_spare.pop_back();
+			}
+		}
+
+		data.resize(CLUSTER_PAGE_SIZE);
+		bool ok = _file.read_page(page, data.data());
+		{
+			std::lock_guard lock(_mutex);
+			_loaded.push_back(Load{page, std::move(data), ok});
+		}
+	}
+}
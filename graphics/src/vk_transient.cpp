@@ -0,0 +1,235 @@
+#include <vk_transient.h>
+#include <vk_initializers.h>
+
+#include <algorithm>
+#include <numeric>
+
+static VkDeviceSize align_up(VkDeviceSize value, VkDeviceSize alignment)
+{
+	return (value + alignment - 1) / alignment * alignment;
+}
+
+TransientAllocator::Handle TransientAllocator::declare_image(std::string name, const VkImageCreateInfo& imageInfo,
+	VkImageAspectFlags aspect, uint32_t firstPass, uint32_t lastPass)
+{
+	if (_built) {
+		spdlog::error("Transient image {} declared after the transients were built", name);
+		abort();
+	}
+	Resource resource{};
+	resource.name = std::move(name);
+	resource.isImage = true;
+	resource.imageInfo = imageInfo;
+	resource.aspect = aspect;
+	resource.firstPass = firstPass;
+	resource.lastPass = lastPass;
+	_resources.push_back(std::move(resource));
+	return Handle(_resources.size() - 1);
+}
+
+TransientAllocator::Handle TransientAllocator::declare_buffer(std::string name, VkDeviceSize size,
+	VkBufferUsageFlags usage, uint32_t firstPass, uint32_t lastPass)
+{
+	if (_built) {
+		spdlog::error("Transient buffer {} declared after the transients were built", name);
+		abort();
+	}
+	Resource resource{};
+	resource.name = std::move(name);
+	resource.isImage = false;
+	resource.bufferInfo = {.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO};
+	resource.bufferInfo.size = size;
+	resource.bufferInfo.usage = usage;
+	resource.firstPass = firstPass;
+	resource.lastPass = lastPass;
+	_resources.push_back(std::move(resource));
+	return Handle(_resources.size() - 1);
+}
+
+void TransientAllocator::on_build(std::function<void()> callback)
+{
+	_onBuild.push_back(std::move(callback));
+}
+
+void TransientAllocator::build(VkDevice device, VmaAllocator allocator, GpuMemory& memory,
+	VkDeviceSize bufferImageGranularity)
+{
+	_device = device;
+	_allocator = allocator;
+	_memory = &memory;
+	_unaliasedBytes = 0;
+	_allocatedBytes = 0;
+
+	for (Resource& resource : _resources) {
+		if (resource.isImage) {
+			vk_check(vkCreateImage(_device, &resource.imageInfo, nullptr, &resource.image.image));
+			vkGetImageMemoryRequirements(_device, resource.image.image, &resource.requirements);
+			resource.image.imageExtent = resource.imageInfo.extent;
+			resource.image.imageFormat = resource.imageInfo.format;
+			// attachments that never leave tile memory only need backing if the driver spills
+			resource.lazy = resource.imageInfo.usage & VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT;
+		} else {
+			vk_check(vkCreateBuffer(_device, &resource.bufferInfo, nullptr, &resource.buffer.buffer));
+			vkGetBufferMemoryRequirements(_device, resource.buffer.buffer, &resource.requirements);
+			resource.lazy = false;
+		}
+		// with every offset and size on a granularity boundary, a buffer and an
+		// image alive at the same time never share a page
+		resource.size = align_up(resource.requirements.size, bufferImageGranularity);
+		_unaliasedBytes += resource.requirements.size;
+	}
+
+	// biggest first keeps the packing tight
+	std::vector<uint32_t> order(_resources.size());
+	std::iota(order.begin(), order.end(), 0u);
+	std::sort(order.begin(), order.end(),
+		[&](uint32_t a, uint32_t b) { return _resources[a].size > _resources[b].size; });
+
+	for (uint32_t index : order) {
+		Resource& resource = _resources[index];
+
+		// first block with a memory type this resource can live in
+		auto block = std::find_if(_blocks.begin(), _blocks.end(), [&](const Block& b) {
+			return b.lazy == resource.lazy && (b.memoryTypeBits & resource.requirements.memoryTypeBits) != 0;
+		});
+		if (block == _blocks.end()) {
+			_blocks.push_back(Block{resource.lazy, resource.requirements.memoryTypeBits, 0, 1, {}, VK_NULL_HANDLE});
+			block = _blocks.end() - 1;
+		}
+
+		// byte ranges of everything already placed that is alive at the same time
+		std::vector<std::pair<VkDeviceSize, VkDeviceSize>> occupied;
+		for (uint32_t other : block->members) {
+			const Resource& o = _resources[other];
+			if (o.firstPass <= resource.lastPass && resource.firstPass <= o.lastPass) {
+				occupied.emplace_back(o.offset, o.offset + o.size);
+			}
+		}
+		std::sort(occupied.begin(), occupied.end());
+
+		// lowest aligned offset that fits in a gap
+		VkDeviceSize alignment = std::max(resource.requirements.alignment, bufferImageGranularity);
+		VkDeviceSize offset = 0;
+		for (auto [begin, end] : occupied) {
+			if (offset + resource.size <= begin) {
+				break;
+			}
+			offset = std::max(offset, align_up(end, alignment));
+		}
+
+		resource.offset = offset;
+		resource.block = uint32_t(block - _blocks.begin());
+		block->memoryTypeBits &= resource.requirements.memoryTypeBits;
+		block->size = std::max(block->size, offset + resource.size);
+		block->alignment = std::max(block->alignment, alignment);
+		block->members.push_back(index);
+	}
+
+	for (Block& block : _blocks) {
+		VkMemoryRequirements blockRequirements = {};
+		blockRequirements.size = block.size;
+		blockRequirements.alignment = block.alignment;
+		blockRequirements.memoryTypeBits = block.memoryTypeBits;
+
+		VmaAllocationCreateInfo allocInfo = {};
+		allocInfo.usage = block.lazy ? VMA_MEMORY_USAGE_GPU_LAZILY_ALLOCATED : VMA_MEMORY_USAGE_GPU_ONLY;
+
+		VkResult result = memory.allocate_memory(blockRequirements, allocInfo, MemoryTag::Transient,
+			&block.allocation);
+		if (result != VK_SUCCESS && block.lazy) {
+			// no lazily allocated memory type on this device
+			allocInfo.usage = VMA_MEMORY_USAGE_GPU_ONLY;
+			result = memory.allocate_memory(blockRequirements, allocInfo, MemoryTag::Transient, &block.allocation);
+		}
+		vk_check(result);
+		_allocatedBytes += block.size;
+	}
+
+	for (Resource& resource : _resources) {
+		VmaAllocation allocation = _blocks[resource.block].allocation;
+		if (resource.isImage) {
+			vk_check(vmaBindImageMemory2(_allocator, allocation, resource.offset, resource.image.image, nullptr));
+			resource.image.allocation = allocation;
+
+			VkImageViewCreateInfo viewInfo = vkinit::imageview_create_info(resource.imageInfo.format,
+				resource.image.image, resource.aspect);
+			viewInfo.subresourceRange.levelCount = resource.imageInfo.mipLevels;
+			vk_check(vkCreateImageView(_device, &viewInfo, nullptr, &resource.image.imageView));
+		} else {
+			vk_check(vmaBindBufferMemory2(_allocator, allocation, resource.offset, resource.buffer.buffer, nullptr));
+			resource.buffer.allocation = allocation;
+			vmaGetAllocationInfo(_allocator, allocation, &resource.buffer.info);
+
+			if (resource.bufferInfo.usage & VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT) {
+				VkBufferDeviceAddressInfo addressInfo = {.sType = VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO};
+				addressInfo.buffer = resource.buffer.buffer;
+				resource.buffer.address = vkGetBufferDeviceAddress(_device, &addressInfo);
+			}
+		}
+	}
+	_built = true;
+
+	if (!_resources.empty()) {
+		spdlog::info("Transient resources: {} in {} blocks, {} MiB aliased into {} MiB", _resources.size(),
+			_blocks.size(), _unaliasedBytes >> 20, _allocatedBytes >> 20);
+	}
+
+	for (const std::function<void()>& callback : _onBuild) {
+		callback();
+	}
+	_onBuild.clear();
+}
+
+void TransientAllocator::destroy()
+{
+	for (Resource& resource : _resources) {
+		if (resource.isImage) {
+			vkDestroyImageView(_device, resource.image.imageView, nullptr);
+			vkDestroyImage(_device, resource.image.image, nullptr);
+		} else {
+			vkDestroyBuffer(_device, resource.buffer.buffer, nullptr);
+		}
+	}
+	for (Block& block : _blocks) {
+		_memory->free_memory(block.allocation);
+	}
+	_resources.clear();
+	_blocks.clear();
+	_built = false;
+}
+
+void TransientAllocator::acquire(VkCommandBuffer cmd, std::span<const Handle> handles, VkImageLayout newLayout) const
+{
+	// whatever used the memory before, in this frame or the previous one and
+	// through whichever resource, has to be done with it
+	VkMemoryBarrier2 memoryBarrier = {.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER_2};
+	memoryBarrier.srcStageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT;
+	memoryBarrier.srcAccessMask = VK_ACCESS_2_MEMORY_WRITE_BIT | VK_ACCESS_2_MEMORY_READ_BIT;
+	memoryBarrier.dstStageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT;
+	memoryBarrier.dstAccessMask = VK_ACCESS_2_MEMORY_WRITE_BIT | VK_ACCESS_2_MEMORY_READ_BIT;
+
+	std::vector<VkImageMemoryBarrier2> imageBarriers;
+	for (Handle handle : handles) {
+		const Resource& resource = _resources[handle];
+		if (!resource.isImage) {
+			continue;
+		}
+		VkImageMemoryBarrier2 imageBarrier = {.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2};
+		imageBarrier.srcStageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT;
+		imageBarrier.srcAccessMask = VK_ACCESS_2_MEMORY_WRITE_BIT;
+		imageBarrier.dstStageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT;
+		imageBarrier.dstAccessMask = VK_ACCESS_2_MEMORY_WRITE_BIT | VK_ACCESS_2_MEMORY_READ_BIT;
+		imageBarrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+		imageBarrier.newLayout = newLayout;
+		imageBarrier.subresourceRange = vkinit::image_subresource_range(resource.aspect);
+		imageBarrier.image = resource.image.image;
+		imageBarriers.push_back(imageBarrier);
+	}
+
+	VkDependencyInfo depInfo = {.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO};
+	depInfo.memoryBarrierCount = 1;
+	depInfo.pMemoryBarriers = &memoryBarrier;
+	depInfo.imageMemoryBarrierCount = uint32_t(imageBarriers.size());
+	depInfo.pImageMemoryBarriers = imageBarriers.data();
+	vkCmdPipelineBarrier2(cmd, &depInfo);
+}
@@ -0,0 +1,154 @@
+#include <vk_tuning.h>
+
+#include <fstream>
+#include <limits>
+#include <sstream>
+
+void KernelTuner::init(VkPhysicalDevice gpu, VkDevice device, uint32_t queueFamily, std::string cachePath)
+{
+	_device = device;
+	_cachePath = std::move(cachePath);
+
+	VkPhysicalDeviceProperties properties;
+	vkGetPhysicalDeviceProperties(gpu, &properties);
+
+	uint32_t familyCount = 0;
+	vkGetPhysicalDeviceQueueFamilyProperties(gpu, &familyCount, nullptr);
+	std::vector<VkQueueFamilyProperties> families(familyCount);
+	vkGetPhysicalDeviceQueueFamilyProperties(gpu, &familyCount, families.data());
+
+	_timestampPeriod = properties.limits.timestampPeriod;
+	_timestampValidBits = queueFamily < familyCount ? families[queueFamily].timestampValidBits : 0;
+	_timestampsSupported = properties.limits.timestampComputeAndGraphics && _timestampValidBits != 0;
+
+	// the driver version is part of the key, a driver update can change the winner
+	_deviceKey = fmt::format("{:04x}:{:04x}:{:08x}", properties.vendorID, properties.deviceID,
+		properties.driverVersion);
+
+	load_cache();
+}
+
+void KernelTuner::cleanup()
+{
+	if (_queryPool != VK_NULL_HANDLE) {
+		vkDestroyQueryPool(_device, _queryPool, nullptr);
+		_queryPool = VK_NULL_HANDLE;
+		_queryCount = 0;
+	}
+}
+
+std::string KernelTuner::cache_key(const ComputeKernel& kernel) const
+{
+	return _deviceKey + " " + kernel.name;
+}
+
+void KernelTuner::tune(ComputeKernel& kernel, const SubmitFunction& submit, const RecordFunction& record)
+{
+	if (auto it = _cache.find(cache_key(kernel)); it != _cache.end() && kernel.select(it->second)) {
+		const WorkgroupSize& wg = it->second;
+		spdlog::info("Using cached workgroup size {}x{}x{} for {}", wg.x, wg.y, wg.z, kernel.name);
+		return;
+	}
+
+	if (!enabled || kernel.variants.size() < 2) {
+		return;
+	}
+	if (!_timestampsSupported) {
+		spdlog::warn("Queue has no timestamp support, keeping the default variant of {}", kernel.name);
+		return;
+	}
+
+	uint32_t queryCount = (uint32_t)kernel.variants.size() * 2;
+	if (queryCount > _queryCount) {
+		cleanup();
+		VkQueryPoolCreateInfo poolInfo = {.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO};
+		poolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+		poolInfo.queryCount = queryCount;
+		vk_check(vkCreateQueryPool(_device, &poolInfo, nullptr, &_queryPool));
+		_queryCount = queryCount;
+	}
+
+	VkMemoryBarrier2 serialize = {.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER_2};
+	serialize.srcStageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT;
+	serialize.srcAccessMask = VK_ACCESS_2_MEMORY_WRITE_BIT;
+	serialize.dstStageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT;
+	serialize.dstAccessMask = VK_ACCESS_2_MEMORY_WRITE_BIT | VK_ACCESS_2_MEMORY_READ_BIT;
+
+	VkDependencyInfo depInfo = {.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO};
+	depInfo.memoryBarrierCount = 1;
+	depInfo.pMemoryBarriers = &serialize;
+
+	size_t defaultVariant = kernel.selected;
+	submit([&](VkCommandBuffer cmd) {
+		vkCmdResetQueryPool(cmd, _queryPool, 0, queryCount);
+		for (size_t v = 0; v < kernel.variants.size(); v++) {
+			kernel.selected = v;
+
+			// one untimed run so pipeline warmup and cache state do not favour later variants
+			record(cmd, kernel);
+			vkCmdPipelineBarrier2(cmd, &depInfo);
+
+			vkCmdWriteTimestamp2(cmd, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, _queryPool, (uint32_t)v * 2);
+			for (uint32_t i = 0; i < iterations; i++) {
+				record(cmd, kernel);
+				vkCmdPipelineBarrier2(cmd, &depInfo);
+			}
+			vkCmdWriteTimestamp2(cmd, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, _queryPool, (uint32_t)v * 2 + 1);
+		}
+	});
+
+	std::vector<uint64_t> timestamps(queryCount);
+	vk_check(vkGetQueryPoolResults(_device, _queryPool, 0, queryCount, timestamps.size() * sizeof(uint64_t),
+		timestamps.data(), sizeof(uint64_t), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT));
+
+	double bestTime = std::numeric_limits<double>::max();
+	kernel.selected = defaultVariant;
+	for (size_t v = 0; v < kernel.variants.size(); v++) {
+		double ms = vkutil::timestamp_nanoseconds(timestamps[v * 2], timestamps[v * 2 + 1], _timestampValidBits,
+			_timestampPeriod) / 1e6 / iterations;
+		const WorkgroupSize& wg = kernel.variants[v].workgroup;
+		spdlog::debug("{} {}x{}x{}: {:.4f} ms", kernel.name, wg.x, wg.y, wg.z, ms);
+		if (ms < bestTime) {
+			bestTime = ms;
+			kernel.selected = v;
+		}
+	}
+
+	const WorkgroupSize& best = kernel.current().workgroup;
+	spdlog::info("Tuned {}: {}x{}x{} ({:.4f} ms)", kernel.name, best.x, best.y, best.z, bestTime);
+
+	_cache[cache_key(kernel)] = best;
+	save_cache();
+}
+
+// The cache is a plain text file with one "<device> <kernel> <x> <y> <z>" line per entry
+void KernelTuner::load_cache()
+{
+	std::ifstream file(_cachePath);
+	if (!file.is_open()) {
+		return;
+	}
+
+	std::string line;
+	while (std::getline(file, line)) {
+		std::istringstream entry(line);
+		std::string device, kernel;
+		WorkgroupSize wg;
+		if (entry >> device >> kernel >> wg.x >> wg.y >> wg.z) {
+			_cache[device + " " + kernel] = wg;
+		}
+	}
+}
+
+void KernelTuner::save_cache() const
+{
+	std::ofstream file(_cachePath, std::ios::trunc);
+	if (!file.is_open()) {
+		spdlog::warn("Could not write kernel tuning cache {}", _cachePath);
+		return;
+	}
+
+	for (const auto& [key, wg] : _cache) {
+		file << key << " " << wg.x << " " << wg.y << " " << wg.z << "\n";
+	}
+}
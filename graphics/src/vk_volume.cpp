@@ -0,0 +1,406 @@
+#include <vk_volume.h>
+#include <vk_descriptors.h>
+#include <vk_engine.h>
+#include <vk_images.h>
+#include <vk_initializers.h>
+
+#include <algorithm>
+#include <cstring>
+
+// must match the modes in shaders/volume_update.comp and volume_activate.comp
+enum : uint32_t {
+	UPDATE_BEGIN = 0,
+	UPDATE_ACTIVATED = 1,
+	UPDATE_COMPACTED = 2,
+};
+
+enum : uint32_t {
+	ACTIVATE_NEIGHBOURS = 0,
+	ACTIVATE_EMITTER = 1,
+	ACTIVATE_REINSERT = 2,
+};
+
+static void pass_barrier(VkCommandBuffer cmd)
+{
+	vkutil::memory_barrier(cmd, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+		VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+		VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT);
+}
+
+// the update pass also writes the indirect arguments of the next passes
+static void state_barrier(VkCommandBuffer cmd)
+{
+	vkutil::memory_barrier(cmd, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+		VK_PIPELINE_STAGE_2_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+		VK_ACCESS_2_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_READ_BIT |
+			VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT);
+}
+
+static void transfer_barrier(VkCommandBuffer cmd)
+{
+	vkutil::memory_barrier(cmd, VK_PIPELINE_STAGE_2_ALL_TRANSFER_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT,
+		VK_PIPELINE_STAGE_2_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+		VK_ACCESS_2_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_READ_BIT |
+			VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT);
+}
+
+static uint32_t next_pow2(uint32_t v)
+{
+	uint32_t p = 1;
+	while (p < v) {
+		p <<= 1;
+	}
+	return p;
+}
+
+void SparseVolume::init(VulkanEngine* engine, const VolumeSettings& settings)
+{
+	_engine = engine;
+	_settings = settings;
+	_settings.maxBlocks = std::max(_settings.maxBlocks, 1u);
+	_settings.initialBlocks = std::clamp(_settings.initialBlocks, 1u, _settings.maxBlocks);
+
+	VkDevice device = _engine->_device;
+	const VkPhysicalDeviceLimits& limits = _engine->_gpuProperties.limits;
+
+	_pool = create_pool(_settings.initialBlocks);
+
+	GPUVolumeState state{};
+	state.blockDispatch = {0, 1, 1};
+	state.newDispatch = {0, 1, 1};
+	state.listDispatch = {0, 1, 1};
+	state.capacity = _pool.capacity;
+	_state = _engine->upload_buffer(&state, sizeof(state),
+		VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT |
+			VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+		MemoryTag::Simulation);
+
+	GPUVolumeBuffers table = buffer_table();
+	_table = _engine->upload_buffer(&table, sizeof(table),
+		VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT, MemoryTag::Simulation);
+
+	_engine->immediate_submit([&](VkCommandBuffer cmd) {
+		vkCmdFillBuffer(cmd, _pool.keys.buffer, 0, VK_WHOLE_SIZE, UINT32_MAX);
+		vkCmdFillBuffer(cmd, _pool.stamps.buffer, 0, VK_WHOLE_SIZE, 0);
+	});
+
+	// the scene depth is only fetched texel by texel
+	VkSamplerCreateInfo samplerInfo = {.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO};
+	samplerInfo.magFilter = VK_FILTER_NEAREST;
+	samplerInfo.minFilter = VK_FILTER_NEAREST;
+	samplerInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+	samplerInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+	samplerInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+	vk_check(vkCreateSampler(device, &samplerInfo, nullptr, &_depthSampler));
+
+	DescriptorLayoutBuilder builder;
+	builder.add_binding(0, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE);
+	builder.add_binding(1, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER);
+	_renderSetLayout = builder.build(device, VK_SHADER_STAGE_COMPUTE_BIT);
+
+	_renderSet = _engine->globalDescriptorAllocator.allocate(device, _renderSetLayout);
+	VkDescriptorImageInfo colorInfo{};
+	colorInfo.imageView = _engine->_drawImage.imageView;
+	colorInfo.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+	VkDescriptorImageInfo depthInfo{};
+	depthInfo.sampler = _depthSampler;
+	depthInfo.imageView = _engine->_depthImage.imageView;
+	depthInfo.imageLayout = VK_IMAGE_LAYOUT_DEPTH_READ_ONLY_OPTIMAL;
+	VkWriteDescriptorSet writes[] = {
+		vkinit::write_descriptor_image(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, _renderSet, &colorInfo, 0),
+		vkinit::write_descriptor_image(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, _renderSet, &depthInfo, 1),
+	};
+	vkUpdateDescriptorSets(device, 2, writes, 0, nullptr);
+
+	VkPushConstantRange range{};
+	range.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+	range.size = sizeof(PushConstants);
+
+	VkPipelineLayoutCreateInfo layoutInfo = vkinit::pipeline_layout_create_info();
+	layoutInfo.pushConstantRangeCount = 1;
+	layoutInfo.pPushConstantRanges = &range;
+	vk_check(vkCreatePipelineLayout(device, &layoutInfo, nullptr, &_layout));
+
+	range.size = sizeof(RenderPushConstants);
+	layoutInfo.setLayoutCount = 1;
+	layoutInfo.pSetLayouts = &_renderSetLayout;
+	vk_check(vkCreatePipelineLayout(device, &layoutInfo, nullptr, &_renderLayout));
+
+	// the block passes index voxels and neighbours by local invocation
+	const WorkgroupSize singleSize[] = {{1, 1, 1}};
+	const WorkgroupSize blockSize[] = {{VOLUME_LIST_GROUP, 1, 1}};
+	const WorkgroupSize imageSizes[] = {{16, 16, 1}, {8, 8, 1}, {32, 8, 1}};
+	_updateKernel = vkutil::build_compute_kernel(device, limits, "volume_update", _layout,
+		_engine->_shaders.get("volume_update_cs"), singleSize);
+	_activateKernel = vkutil::build_compute_kernel(device, limits, "volume_activate", _layout,
+		_engine->_shaders.get("volume_activate_cs"), blockSize);
+	_clearKernel = vkutil::build_compute_kernel(device, limits, "volume_clear", _layout,
+		_engine->_shaders.get("volume_clear_cs"), blockSize);
+	_advectKernel = vkutil::build_compute_kernel(device, limits, "volume_advect", _layout,
+		_engine->_shaders.get("volume_advect_cs"), blockSize);
+	_compactKernel = vkutil::build_compute_kernel(device, limits, "volume_compact", _layout,
+		_engine->_shaders.get("volume_compact_cs"), blockSize);
+	_renderKernel = vkutil::build_compute_kernel(device, limits, "volume_render", _renderLayout,
+		_engine->_shaders.get("volume_render_cs"), imageSizes);
+
+	_stats.capacity = _pool.capacity;
+	_stats.poolBytes = pool_bytes(_pool);
+
+	glm::vec3 extent = (_settings.boundsMax - _settings.boundsMin) / _settings.voxelSize;
+	spdlog::info("Sparse volume: {}^3 voxel blocks of {} m, {} blocks ({:.1f} MiB) for a {}x{}x{} voxel domain",
+		VOLUME_BLOCK_SIZE, _settings.voxelSize, _pool.capacity, _stats.poolBytes / (1024.0 * 1024.0),
+		uint32_t(extent.x), uint32_t(extent.y), uint32_t(extent.z));
+}
+
+void SparseVolume::cleanup()
+{
+	VkDevice device = _engine->_device;
+
+	for (ComputeKernel* kernel :
+		{&_updateKernel, &_activateKernel, &_clearKernel, &_advectKernel, &_compactKernel, &_renderKernel}) {
+		kernel->destroy(device);
+	}
+	vkDestroyPipelineLayout(device, _layout, nullptr);
+	vkDestroyPipelineLayout(device, _renderLayout, nullptr);
+	vkDestroyDescriptorSetLayout(device, _renderSetLayout, nullptr);
+	vkDestroySampler(device, _depthSampler, nullptr);
+
+	destroy_pool(_pool);
+	_engine->_memory.destroy_buffer(_state);
+	_engine->_memory.destroy_buffer(_table);
+}
+
+SparseVolume::Pool SparseVolume::create_pool(uint32_t capacity)
+{
+	GpuMemory& memory = _engine->_memory;
+	// grown pools copy the old contents in, tables are cleared with fills
+	const VkBufferUsageFlags usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT |
+		VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+	auto create = [&](VkDeviceSize size) {
+		return memory.create_buffer(size, usage, VMA_MEMORY_USAGE_GPU_ONLY, MemoryTag::Simulation);
+	};
+
+	Pool pool;
+	pool.capacity = capacity;
+	// at most half full, probe sequences stay short
+	pool.tableSize = next_pow2(capacity * 2);
+	pool.keys = create(pool.tableSize * sizeof(uint32_t));
+	pool.values = create(pool.tableSize * sizeof(uint32_t));
+	pool.stamps = create(pool.tableSize * sizeof(uint32_t));
+	pool.blockCoord = create(capacity * sizeof(glm::ivec4));
+	pool.blockSlot = create(capacity * sizeof(uint32_t));
+	pool.blockMax = create(capacity * sizeof(float));
+	pool.freeStack = create(capacity * sizeof(uint32_t));
+	for (int i = 0; i < 2; i++) {
+		pool.active[i] = create(capacity * sizeof(uint32_t));
+		pool.fields[i] = create(VkDeviceSize(capacity) * VOLUME_BLOCK_VOXELS * sizeof(glm::vec4));
+		pool.heat[i] = create(VkDeviceSize(capacity) * VOLUME_BLOCK_VOXELS * sizeof(float));
+	}
+	return pool;
+}
+
+void SparseVolume::destroy_pool(const Pool& pool)
+{
+	GpuMemory& memory = _engine->_memory;
+	for (const AllocatedBuffer* buffer : {&pool.keys, &pool.values, &pool.stamps, &pool.blockCoord, &pool.blockSlot,
+			 &pool.blockMax, &pool.freeStack}) {
+		memory.destroy_buffer(*buffer);
+	}
+	for (int i = 0; i < 2; i++) {
+		memory.destroy_buffer(pool.active[i]);
+		memory.destroy_buffer(pool.fields[i]);
+		memory.destroy_buffer(pool.heat[i]);
+	}
+}
+
+VkDeviceSize SparseVolume::pool_bytes(const Pool& pool) const
+{
+	VkDeviceSize perBlock = sizeof(glm::ivec4) + 4 * sizeof(uint32_t) +
+		2 * VOLUME_BLOCK_VOXELS * (sizeof(glm::vec4) + sizeof(float));
+	return VkDeviceSize(pool.capacity) * perBlock + VkDeviceSize(pool.tableSize) * 3 * sizeof(uint32_t);
+}
+
+GPUVolumeBuffers SparseVolume::buffer_table() const
+{
+	GPUVolumeBuffers table{};
+	table.state = _state.address;
+	table.keys = _pool.keys.address;
+	table.values = _pool.values.address;
+	table.stamps = _pool.stamps.address;
+	table.blockCoord = _pool.blockCoord.address;
+	table.blockSlot = _pool.blockSlot.address;
+	table.blockMax = _pool.blockMax.address;
+	table.freeStack = _pool.freeStack.address;
+	for (int i = 0; i < 2; i++) {
+		table.active[i] = _pool.active[i].address;
+		table.fields[i] = _pool.fields[i].address;
+		table.heat[i] = _pool.heat[i].address;
+	}
+	table.tableMask = _pool.tableSize - 1;
+	return table;
+}
+
+SparseVolume::PushConstants SparseVolume::push_constants(float dt) const
+{
+	PushConstants push{};
+	push.volume = _table.address;
+	push.parity = _parity;
+	push.dt = dt;
+	push.voxelSize = _settings.voxelSize;
+	push.threshold = _settings.threshold;
+	push.emitter = glm::vec4(_settings.emitterCenter, _settings.emitterRadius);
+	push.emitVelocity = glm::vec4(_settings.emitterVelocity, _settings.emitDensity);
+	push.forces = glm::vec4(_settings.buoyancy, _settings.smokeWeight, _settings.densityDecay, _settings.heatDecay);
+	push.boundsMin = glm::vec4(_settings.boundsMin, _settings.emitHeat);
+	push.boundsMax = glm::vec4(_settings.boundsMax, _settings.heatDiffusion);
+	return push;
+}
+
+void SparseVolume::update(VkCommandBuffer cmd, PushConstants& push, uint32_t mode)
+{
+	push.mode = mode;
+	_updateKernel.bind(cmd);
+	vkCmdPushConstants(cmd, _layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(PushConstants), &push);
+	_updateKernel.dispatch(cmd, 1, 1);
+	state_barrier(cmd);
+}
+
+void SparseVolume::rehash(VkCommandBuffer cmd, PushConstants& push)
+{
+	vkCmdFillBuffer(cmd, _pool.keys.buffer, 0, VK_WHOLE_SIZE, UINT32_MAX);
+	vkCmdFillBuffer(cmd, _pool.stamps.buffer, 0, VK_WHOLE_SIZE, 0);
+	transfer_barrier(cmd);
+
+	push.mode = ACTIVATE_REINSERT;
+	_activateKernel.bind(cmd);
+	vkCmdPushConstants(cmd, _layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(PushConstants), &push);
+	vkCmdDispatchIndirect(cmd, _state.buffer, offsetof(GPUVolumeState, listDispatch));
+	pass_barrier(cmd);
+}
+
+void SparseVolume::grow(VkCommandBuffer cmd, uint32_t capacity)
+{
+	Pool old = _pool;
+	_pool = create_pool(capacity);
+
+	// the last step of the previous frame wrote the old pool
+	vkutil::memory_barrier(cmd, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+		VK_PIPELINE_STAGE_2_ALL_TRANSFER_BIT, VK_ACCESS_2_TRANSFER_READ_BIT | VK_ACCESS_2_TRANSFER_WRITE_BIT);
+
+	auto copy = [&](const AllocatedBuffer& from, const AllocatedBuffer& to, VkDeviceSize size) {
+		VkBufferCopy region{0, 0, size};
+		vkCmdCopyBuffer(cmd, from.buffer, to.buffer, 1, &region);
+	};
+	// block indices stay valid, only the table is sized differently and rebuilt
+	copy(old.blockCoord, _pool.blockCoord, old.capacity * sizeof(glm::ivec4));
+	copy(old.blockSlot, _pool.blockSlot, old.capacity * sizeof(uint32_t));
+	copy(old.blockMax, _pool.blockMax, old.capacity * sizeof(float));
+	copy(old.freeStack, _pool.freeStack, old.capacity * sizeof(uint32_t));
+	for (int i = 0; i < 2; i++) {
+		copy(old.active[i], _pool.active[i], old.capacity * sizeof(uint32_t));
+		copy(old.fields[i], _pool.fields[i], VkDeviceSize(old.capacity) * VOLUME_BLOCK_VOXELS * sizeof(glm::vec4));
+		copy(old.heat[i], _pool.heat[i], VkDeviceSize(old.capacity) * VOLUME_BLOCK_VOXELS * sizeof(float));
+	}
+	vkCmdUpdateBuffer(cmd, _state.buffer, offsetof(GPUVolumeState, capacity), sizeof(uint32_t), &capacity);
+	GPUVolumeBuffers table = buffer_table();
+	vkCmdUpdateBuffer(cmd, _table.buffer, 0, sizeof(table), &table);
+	transfer_barrier(cmd);
+
+	PushConstants push = push_constants(0.f);
+	rehash(cmd, push);
+
+	// frames still in flight read the old pool
+	_engine->get_current_frame()._deletionQueue.add([this, old]() { destroy_pool(old); });
+
+	_stats.capacity = _pool.capacity;
+	_stats.poolBytes = pool_bytes(_pool);
+	_stats.growths++;
+	spdlog::info("Sparse volume: pool grown to {} blocks ({:.1f} MiB)", _pool.capacity,
+		_stats.poolBytes / (1024.0 * 1024.0));
+}
+
+void SparseVolume::step(VkCommandBuffer cmd, float dt)
+{
+	if (_growTo > _pool.capacity) {
+		grow(cmd, _growTo);
+	}
+
+	// long frames would trace back further than the neighbour blocks reach
+	PushConstants push = push_constants(std::min(dt, 1.f / 30.f));
+	update(cmd, push, UPDATE_BEGIN);
+
+	// both activations only append, they may overlap
+	_activateKernel.bind(cmd);
+	push.mode = ACTIVATE_NEIGHBOURS;
+	vkCmdPushConstants(cmd, _layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(PushConstants), &push);
+	vkCmdDispatchIndirect(cmd, _state.buffer, offsetof(GPUVolumeState, blockDispatch));
+
+	float blockSize = _settings.voxelSize * VOLUME_BLOCK_SIZE;
+	glm::ivec3 first(glm::floor((_settings.emitterCenter - _settings.emitterRadius) / blockSize));
+	glm::ivec3 last(glm::floor((_settings.emitterCenter + _settings.emitterRadius) / blockSize));
+	glm::ivec3 extent = last - first + 1;
+	push.mode = ACTIVATE_EMITTER;
+	vkCmdPushConstants(cmd, _layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(PushConstants), &push);
+	vkCmdDispatch(cmd, vkutil::group_count(uint32_t(extent.x * extent.y * extent.z), VOLUME_LIST_GROUP), 1, 1);
+	pass_barrier(cmd);
+	update(cmd, push, UPDATE_ACTIVATED);
+
+	_clearKernel.bind(cmd);
+	vkCmdPushConstants(cmd, _layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(PushConstants), &push);
+	vkCmdDispatchIndirect(cmd, _state.buffer, offsetof(GPUVolumeState, newDispatch));
+	pass_barrier(cmd);
+
+	_advectKernel.bind(cmd);
+	vkCmdPushConstants(cmd, _layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(PushConstants), &push);
+	vkCmdDispatchIndirect(cmd, _state.buffer, offsetof(GPUVolumeState, blockDispatch));
+	pass_barrier(cmd);
+
+	_compactKernel.bind(cmd);
+	vkCmdPushConstants(cmd, _layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(PushConstants), &push);
+	vkCmdDispatchIndirect(cmd, _state.buffer, offsetof(GPUVolumeState, listDispatch));
+	pass_barrier(cmd);
+	update(cmd, push, UPDATE_COMPACTED);
+
+	// the advection wrote the other fields and compaction the other list
+	_parity ^= 1;
+	push.parity = _parity;
+	rehash(cmd, push);
+
+	_engine->_readback.read(_state, 0, sizeof(GPUVolumeState), [this](std::span<const uint8_t> data) {
+		GPUVolumeState state;
+		std::memcpy(&state, data.data(), sizeof(state));
+		bool dropped = state.overflow > _stats.overflow;
+		_stats.activeBlocks = state.activeCount;
+		_stats.overflow = state.overflow;
+
+		// a step activates at most one ring of blocks around the dense ones,
+		// so the pool grows well before it runs out
+		if ((dropped || state.activeCount > state.capacity / 4 * 3) && state.capacity < _settings.maxBlocks) {
+			_growTo = std::max(_growTo, std::min(state.capacity * 2, _settings.maxBlocks));
+		}
+	});
+}
+
+void SparseVolume::draw(VkCommandBuffer cmd, const glm::mat4& viewProjection)
+{
+	// the draw image may just have been written from compute too
+	pass_barrier(cmd);
+
+	VkExtent2D extent = {_engine->_drawImage.imageExtent.width, _engine->_drawImage.imageExtent.height};
+
+	RenderPushConstants push{};
+	push.volume = _table.address;
+	push.width = extent.width;
+	push.height = extent.height;
+	push.invViewProj = glm::inverse(viewProjection);
+	push.boundsMin = glm::vec4(_settings.boundsMin, _settings.voxelSize);
+	push.boundsMax = glm::vec4(_settings.boundsMax, _settings.emission);
+	push.parity = _parity;
+	push.maxSteps = _settings.maxMarchSteps;
+	push.extinction = _settings.extinction;
+
+	_renderKernel.bind(cmd);
+	vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _renderLayout, 0, 1, &_renderSet, 0, nullptr);
+	vkCmdPushConstants(cmd, _renderLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(RenderPushConstants), &push);
+	_renderKernel.dispatch(cmd, extent.width, extent.height);
+}
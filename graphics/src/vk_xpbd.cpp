@@ -0,0 +1,589 @@
+#include <vk_xpbd.h>
+#include <vk_engine.h>
+#include <vk_images.h>
+#include <vk_indirect.h>
+#include <vk_initializers.h>
+
+#include <meshoptimizer.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+// must match the modes in shaders/xpbd_color.comp
+enum : uint32_t {
+	COLOR_PICK = 0,
+	COLOR_RESOLVE = 1,
+};
+
+// must match XpbdState in shaders/xpbd.glsl
+struct GPUXpbdState {
+	uint32_t uncolored;
+	uint32_t pad[3];
+};
+
+// rounds after which coloring gives up, every round colors at least the
+// lowest uncolored constraint of every conflict
+constexpr uint32_t MAX_COLORING_ROUNDS = 256;
+
+static void pass_barrier(VkCommandBuffer cmd)
+{
+	vkutil::memory_barrier(cmd, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+		VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+		VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT);
+}
+
+void XpbdSolver::init(VulkanEngine* engine, XpbdModel model, const XpbdSettings& settings, const MeshBvh* collider)
+{
+	_engine = engine;
+	_model = std::move(model);
+	_settings = settings;
+	_settings.substeps = std::max(_settings.substeps, 1u);
+	_settings.iterations = std::max(_settings.iterations, 1u);
+
+	init_pipelines();
+
+	auto start = std::chrono::steady_clock::now();
+	std::vector<uint32_t> colors = color_constraints(vkutil::constraint_adjacency(_model));
+	_stats.coloringMilliseconds =
+		std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	vkutil::batch_constraints(_model, colors);
+	_stats.colors = _model.color_count();
+
+	upload_model(collider);
+	spdlog::info("XPBD: {} particles, {} constraints in {} colors after {} rounds ({:.1f} ms)",
+		_model.positions.size(), _model.constraints.size(), _stats.colors, _stats.coloringRounds,
+		_stats.coloringMilliseconds);
+}
+
+void XpbdSolver::init_pipelines()
+{
+	VkDevice device = _engine->_device;
+	const VkPhysicalDeviceLimits& limits = _engine->_gpuProperties.limits;
+
+	VkPushConstantRange range{};
+	range.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+	range.size = sizeof(PushConstants);
+
+	VkPipelineLayoutCreateInfo layoutInfo = vkinit::pipeline_layout_create_info();
+	layoutInfo.pushConstantRangeCount = 1;
+	layoutInfo.pPushConstantRanges = &range;
+	vk_check(vkCreatePipelineLayout(device, &layoutInfo, nullptr, &_layout));
+
+	const WorkgroupSize sizes[] = {{128, 1, 1}, {64, 1, 1}, {256, 1, 1}};
+	auto kernel = [&](const char* name) {
+		return vkutil::build_compute_kernel(device, limits, name, _layout,
+			_engine->_shaders.get(std::string(name) + "_cs"), sizes);
+	};
+	_colorKernel = kernel("xpbd_color");
+	_predictKernel = kernel("xpbd_predict");
+	_solveKernel = kernel("xpbd_solve");
+	_collideKernel = kernel("xpbd_collide");
+	_updateKernel = kernel("xpbd_update");
+	_surfaceKernel = kernel("xpbd_surface");
+
+	// the scene's mesh shaders, with the particles as the vertex stream
+	VkPushConstantRange drawRange{};
+	drawRange.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+	drawRange.size = sizeof(DrawPushConstants);
+
+	VkPipelineLayoutCreateInfo drawLayoutInfo = vkinit::pipeline_layout_create_info();
+	drawLayoutInfo.pushConstantRangeCount = 1;
+	drawLayoutInfo.pPushConstantRanges = &drawRange;
+	vk_check(vkCreatePipelineLayout(device, &drawLayoutInfo, nullptr, &_drawLayout));
+
+	PipelineBuilder builder;
+	builder.set_shaders(_engine->_shaders.get("mesh_vs"), _engine->_shaders.get("mesh_fs"));
+	builder.set_layout(_drawLayout);
+	builder.set_input_topology(VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST);
+	builder.set_polygon_mode(VK_POLYGON_MODE_FILL);
+	builder.set_multisampling_none();
+	builder.disable_blending();
+	builder.set_color_attachment_format(_engine->_drawImage.imageFormat);
+	builder.set_depth_format(_engine->_depthImage.imageFormat);
+	_drawPipeline = builder.desc;
+	_engine->_pipelines.precompile(_drawPipeline);
+
+}
+
+std::vector<uint32_t> XpbdSolver::color_constraints(const XpbdAdjacency& adjacency)
+{
+	GpuMemory& memory = _engine->_memory;
+	const VkBufferUsageFlags usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT;
+	uint32_t count = (uint32_t)_model.constraints.size();
+	if (count == 0) {
+		return {};
+	}
+
+	AllocatedBuffer constraints = _engine->upload_buffer(_model.constraints.data(),
+		count * sizeof(XpbdConstraint), usage, MemoryTag::Simulation);
+	AllocatedBuffer adjacencyStart = _engine->upload_buffer(adjacency.start.data(),
+		adjacency.start.size() * sizeof(uint32_t), usage, MemoryTag::Simulation);
+	AllocatedBuffer adjacencyList = _engine->upload_buffer(adjacency.constraints.data(),
+		adjacency.constraints.size() * sizeof(uint32_t), usage, MemoryTag::Simulation);
+	AllocatedBuffer colors = memory.create_buffer(count * sizeof(uint32_t),
+		usage | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_ONLY,
+		MemoryTag::Simulation);
+	AllocatedBuffer tentative = memory.create_buffer(count * sizeof(uint32_t), usage, VMA_MEMORY_USAGE_GPU_ONLY,
+		MemoryTag::Simulation);
+	AllocatedBuffer state = memory.create_buffer(sizeof(GPUXpbdState),
+		usage | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_ONLY,
+		MemoryTag::Simulation);
+	// the conflict count of every round, and the colors in the end
+	AllocatedBuffer readback = memory.create_buffer(count * sizeof(uint32_t), VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+		VMA_MEMORY_USAGE_GPU_TO_CPU, MemoryTag::Readback, VMA_ALLOCATION_CREATE_MAPPED_BIT);
+
+	GPUXpbdBuffers table{};
+	table.constraints = constraints.address;
+	table.colors = colors.address;
+	table.tentative = tentative.address;
+	table.adjacencyStart = adjacencyStart.address;
+	table.adjacency = adjacencyList.address;
+	table.state = state.address;
+	AllocatedBuffer tableBuffer = _engine->upload_buffer(&table, sizeof(table), usage, MemoryTag::Simulation);
+
+	PushConstants push{};
+	push.buffers = tableBuffer.address;
+	push.particleCount = (uint32_t)_model.positions.size();
+	push.constraintCount = count;
+
+	_engine->immediate_submit([&](VkCommandBuffer cmd) { vkCmdFillBuffer(cmd, colors.buffer, 0, VK_WHOLE_SIZE,
+		XPBD_UNCOLORED); });
+
+	uint32_t uncolored = count;
+	_stats.coloringRounds = 0;
+	while (uncolored > 0 && _stats.coloringRounds < MAX_COLORING_ROUNDS) {
+		_engine->immediate_submit([&](VkCommandBuffer cmd) {
+			vkCmdFillBuffer(cmd, state.buffer, 0, VK_WHOLE_SIZE, 0);
+			vkutil::memory_barrier(cmd, VK_PIPELINE_STAGE_2_CLEAR_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT,
+				VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+				VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT);
+			dispatch(cmd, _colorKernel, push, count);
+			pass_barrier(cmd);
+			push.mode = COLOR_RESOLVE;
+			dispatch(cmd, _colorKernel, push, count);
+			push.mode = COLOR_PICK;
+			vkutil::memory_barrier(cmd, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+				VK_PIPELINE_STAGE_2_COPY_BIT, VK_ACCESS_2_TRANSFER_READ_BIT);
+			VkBufferCopy copy{0, 0, sizeof(uint32_t)};
+			vkCmdCopyBuffer(cmd, state.buffer, readback.buffer, 1, &copy);
+		});
+		vk_check(vmaInvalidateAllocation(_engine->_allocator, readback.allocation, 0, VK_WHOLE_SIZE));
+		memcpy(&uncolored, readback.info.pMappedData, sizeof(uint32_t));
+		_stats.coloringRounds++;
+	}
+
+	_engine->immediate_submit([&](VkCommandBuffer cmd) {
+		VkBufferCopy copy{0, 0, count * sizeof(uint32_t)};
+		vkCmdCopyBuffer(cmd, colors.buffer, readback.buffer, 1, &copy);
+	});
+	vk_check(vmaInvalidateAllocation(_engine->_allocator, readback.allocation, 0, VK_WHOLE_SIZE));
+	std::vector<uint32_t> result(count);
+	memcpy(result.data(), readback.info.pMappedData, count * sizeof(uint32_t));
+
+	for (AllocatedBuffer* buffer : {&constraints, &adjacencyStart, &adjacencyList, &colors, &tentative, &state,
+			 &readback, &tableBuffer}) {
+		memory.destroy_buffer(*buffer);
+	}
+
+	// a particle with far too many constraints needs more colors than the
+	// pick pass tracks, or the rounds ran out
+	if (uint32_t leftovers = vkutil::color_leftovers(_model, adjacency, result)) {
+		spdlog::warn("XPBD: {} constraints left after {} colors, colored on the CPU", leftovers, XPBD_MAX_COLORS);
+	}
+	return result;
+}
+
+void XpbdSolver::upload_model(const MeshBvh* collider)
+{
+	GpuMemory& memory = _engine->_memory;
+	const VkBufferUsageFlags usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT;
+	auto upload = [&](const auto& data, VkBufferUsageFlags extra = 0) {
+		return _engine->upload_buffer(data.data(), std::max<size_t>(data.size(), 1) * sizeof(data[0]),
+			usage | extra, MemoryTag::Simulation);
+	};
+	auto create = [&](VkDeviceSize size) {
+		return memory.create_buffer(std::max<VkDeviceSize>(size, 4), usage, VMA_MEMORY_USAGE_GPU_ONLY,
+			MemoryTag::Simulation);
+	};
+
+	uint32_t particles = (uint32_t)_model.positions.size();
+	_positions = upload(_model.positions, VK_BUFFER_USAGE_TRANSFER_SRC_BIT);
+	_previous = create(particles * sizeof(glm::vec4));
+	_velocities = upload(std::vector<glm::vec4>(particles, glm::vec4(0.f)), VK_BUFFER_USAGE_TRANSFER_SRC_BIT);
+	_constraints = upload(_model.constraints);
+	_lambdas = create(_model.constraints.size() * sizeof(float));
+
+	// triangles around every particle, for the normals
+	std::vector<uint32_t> triangleStart(particles + 1, 0);
+	for (uint32_t v : _model.triangles) {
+		triangleStart[v + 1]++;
+	}
+	for (uint32_t i = 0; i < particles; i++) {
+		triangleStart[i + 1] += triangleStart[i];
+	}
+	std::vector<uint32_t> vertexTriangles(_model.triangles.size());
+	std::vector<uint32_t> fill(triangleStart.begin(), triangleStart.end() - 1);
+	for (uint32_t i = 0; i < _model.triangles.size(); i++) {
+		vertexTriangles[fill[_model.triangles[i]]++] = i / 3;
+	}
+	_vertexTriangleStart = upload(triangleStart);
+	_vertexTriangles = upload(vertexTriangles);
+	_indices = upload(_model.triangles, VK_BUFFER_USAGE_INDEX_BUFFER_BIT);
+
+	// the uvs stay, the surface pass rewrites positions and normals
+	std::vector<VertexAttributes> attributes(particles);
+	for (uint32_t i = 0; i < particles; i++) {
+		vkutil::encode_octahedral(glm::vec3(0.f, 1.f, 0.f), attributes[i].normal);
+		glm::vec2 uv = i < _model.uvs.size() ? _model.uvs[i] : glm::vec2(0.f);
+		attributes[i].uv[0] = meshopt_quantizeHalf(uv.x);
+		attributes[i].uv[1] = meshopt_quantizeHalf(uv.y);
+	}
+	_attributes = upload(attributes);
+	_renderPositions = create(particles * 3 * sizeof(float));
+
+	_collide = collider && !collider->empty();
+	if (_collide) {
+		_bvhNodes = upload(collider->nodes());
+		_bvhTriangles = upload(collider->triangles());
+	}
+
+	GPUInstance instance{};
+	instance.transform = glm::mat4(1.f);
+	instance.scale = 1.f;
+	_instance = _engine->upload_buffer(&instance, sizeof(instance), usage, MemoryTag::Simulation);
+
+	GPUXpbdBuffers table = buffers_table();
+	_buffersTable = _engine->upload_buffer(&table, sizeof(table), usage, MemoryTag::Simulation);
+
+	// the table holds the addresses, it is rewritten by the next step after
+	// any of them moves
+	for (AllocatedBuffer* buffer : {&_positions, &_previous, &_velocities, &_constraints, &_lambdas,
+			 &_vertexTriangleStart, &_vertexTriangles, &_indices, &_renderPositions, &_attributes, &_bvhNodes,
+			 &_bvhTriangles}) {
+		if (buffer->buffer != VK_NULL_HANDLE) {
+			memory.register_movable(buffer, [this](const AllocatedBuffer&) { _tableStale = true; });
+		}
+	}
+	memory.register_movable(&_instance);
+	memory.register_movable(&_buffersTable);
+}
+
+GPUXpbdBuffers XpbdSolver::buffers_table() const
+{
+	GPUXpbdBuffers table{};
+	table.positions = _positions.address;
+	table.previous = _previous.address;
+	table.velocities = _velocities.address;
+	table.constraints = _constraints.address;
+	table.lambdas = _lambdas.address;
+	table.vertexTriangleStart = _vertexTriangleStart.address;
+	table.vertexTriangles = _vertexTriangles.address;
+	table.indices = _indices.address;
+	table.renderPositions = _renderPositions.address;
+	table.attributes = _attributes.address;
+	table.bvhNodes = _collide ? _bvhNodes.address : 0;
+	table.bvhTriangles = _collide ? _bvhTriangles.address : 0;
+	return table;
+}
+
+void XpbdSolver::cleanup()
+{
+	if (!_engine) {
+		return;
+	}
+	VkDevice device = _engine->_device;
+	GpuMemory& memory = _engine->_memory;
+
+	for (ComputeKernel* kernel :
+		{&_colorKernel, &_predictKernel, &_solveKernel, &_collideKernel, &_updateKernel, &_surfaceKernel}) {
+		kernel->destroy(device);
+	}
+	vkDestroyPipelineLayout(device, _layout, nullptr);
+	vkDestroyPipelineLayout(device, _drawLayout, nullptr);
+
+	for (AllocatedBuffer* buffer : {&_positions, &_previous, &_velocities, &_constraints, &_lambdas,
+			 &_vertexTriangleStart, &_vertexTriangles, &_indices, &_renderPositions, &_attributes, &_instance,
+			 &_buffersTable}) {
+		memory.destroy_buffer(*buffer);
+	}
+	if (_collide) {
+		memory.destroy_buffer(_bvhNodes);
+		memory.destroy_buffer(_bvhTriangles);
+	}
+	_engine = nullptr;
+}
+
+void XpbdSolver::dispatch(VkCommandBuffer cmd, const ComputeKernel& kernel, PushConstants& push, uint32_t count)
+{
+	kernel.bind(cmd);
+	vkCmdPushConstants(cmd, _layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(PushConstants), &push);
+	kernel.dispatch(cmd, count);
+}
+
+void XpbdSolver::step(VkCommandBuffer cmd, float dt)
+{
+	if (_tableStale) {
+		// earlier steps and the cloth draw may still read the old table, the
+		// solver and the draw both read the new one
+		const VkPipelineStageFlags2 readers = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT
+			| VK_PIPELINE_STAGE_2_VERTEX_SHADER_BIT;
+		vkutil::memory_barrier(cmd, readers, VK_ACCESS_2_SHADER_STORAGE_READ_BIT, VK_PIPELINE_STAGE_2_CLEAR_BIT,
+			VK_ACCESS_2_TRANSFER_WRITE_BIT);
+		GPUXpbdBuffers table = buffers_table();
+		vkCmdUpdateBuffer(cmd, _buffersTable.buffer, 0, sizeof(table), &table);
+		vkutil::memory_barrier(cmd, VK_PIPELINE_STAGE_2_CLEAR_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT, readers,
+			VK_ACCESS_2_SHADER_STORAGE_READ_BIT);
+		_tableStale = false;
+	}
+
+	uint32_t particles = (uint32_t)_model.positions.size();
+	if (particles == 0 || dt <= 0.f) {
+		return;
+	}
+
+	PushConstants push{};
+	push.buffers = _buffersTable.address;
+	push.particleCount = particles;
+	push.constraintCount = (uint32_t)_model.constraints.size();
+	push.collide = _collide ? 1 : 0;
+	push.dt = dt / _settings.substeps;
+	push.damping = _settings.damping;
+	push.thickness = _settings.thickness;
+	push.friction = _settings.friction;
+	push.gravityX = _settings.gravity.x;
+	push.gravityY = _settings.gravity.y;
+	push.gravityZ = _settings.gravity.z;
+
+	for (uint32_t substep = 0; substep < _settings.substeps; substep++) {
+		dispatch(cmd, _predictKernel, push, particles);
+		pass_barrier(cmd);
+
+		// a dispatch per color, its constraints share no particle
+		for (uint32_t iteration = 0; iteration < _settings.iterations; iteration++) {
+			push.mode = iteration;
+			for (uint32_t color = 0; color < _model.color_count(); color++) {
+				push.first = _model.batchStart[color];
+				push.count = _model.batchStart[color + 1] - push.first;
+				if (push.count == 0) {
+					continue;
+				}
+				dispatch(cmd, _solveKernel, push, push.count);
+				pass_barrier(cmd);
+			}
+		}
+		push.mode = 0;
+
+		if (_collide) {
+			dispatch(cmd, _collideKernel, push, particles);
+			pass_barrier(cmd);
+		}
+		dispatch(cmd, _updateKernel, push, particles);
+		pass_barrier(cmd);
+	}
+
+	dispatch(cmd, _surfaceKernel, push, particles);
+	vkutil::memory_barrier(cmd, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+		VK_PIPELINE_STAGE_2_VERTEX_SHADER_BIT | VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+		VK_ACCESS_2_SHADER_STORAGE_READ_BIT);
+}
+
+void XpbdSolver::draw(VkCommandBuffer cmd, VkDeviceAddress sceneData)
+{
+	if (_model.triangles.empty()) {
+		return;
+	}
+
+	vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, _engine->_pipelines.get(_drawPipeline));
+	_drawState.apply(cmd, _engine->_drawExtent);
+
+	DrawPushConstants push{};
+	push.scene = sceneData;
+	push.instances = _instance.address;
+	push.positions = _renderPositions.address;
+	push.attributes = _attributes.address;
+	vkCmdPushConstants(cmd, _drawLayout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(DrawPushConstants), &push);
+
+	vkCmdBindIndexBuffer(cmd, _indices.buffer, 0, VK_INDEX_TYPE_UINT32);
+	vkCmdDrawIndexed(cmd, (uint32_t)_model.triangles.size(), 1, 0, 0, 0);
+}
+
+XpbdModel vkutil::make_cloth(const glm::mat4& transform, const ClothSettings& settings)
+{
+	uint32_t n = std::max(settings.resolution, 2u);
+	float spacing = settings.size / (n - 1);
+	float inverseMass = float(n * n) / std::max(settings.mass, 1e-6f);
+
+	XpbdModel model;
+	model.positions.resize(n * n);
+	model.uvs.resize(n * n);
+	for (uint32_t y = 0; y < n; y++) {
+		for (uint32_t x = 0; x < n; x++) {
+			glm::vec3 local(x * spacing - 0.5f * settings.size, 0.f, y * spacing - 0.5f * settings.size);
+			model.positions[y * n + x] = glm::vec4(glm::vec3(transform * glm::vec4(local, 1.f)), inverseMass);
+			model.uvs[y * n + x] = glm::vec2(x, y) / float(n - 1);
+		}
+	}
+
+	auto add = [&](uint32_t a, uint32_t b, float compliance) {
+		float rest = glm::length(glm::vec3(model.positions[a]) - glm::vec3(model.positions[b]));
+		model.constraints.push_back({a, b, rest, compliance});
+	};
+	// the constraints leaving a particle together, so neighbours stay close
+	for (uint32_t y = 0; y < n; y++) {
+		for (uint32_t x = 0; x < n; x++) {
+			uint32_t i = y * n + x;
+			if (x + 1 < n) {
+				add(i, i + 1, settings.stretchCompliance);
+			}
+			if (y + 1 < n) {
+				add(i, i + n, settings.stretchCompliance);
+			}
+			if (x + 1 < n && y + 1 < n) {
+				add(i, i + n + 1, settings.shearCompliance);
+				add(i + 1, i + n, settings.shearCompliance);
+			}
+			if (x + 2 < n) {
+				add(i, i + 2, settings.bendCompliance);
+			}
+			if (y + 2 < n) {
+				add(i, i + 2 * n, settings.bendCompliance);
+			}
+		}
+	}
+
+	for (uint32_t y = 0; y + 1 < n; y++) {
+		for (uint32_t x = 0; x + 1 < n; x++) {
+			uint32_t i = y * n + x;
+			model.triangles.insert(model.triangles.end(), {i, i + 1, i + n, i + 1, i + n + 1, i + n});
+		}
+	}
+	return model;
+}
+
+XpbdAdjacency vkutil::constraint_adjacency(const XpbdModel& model)
+{
+	XpbdAdjacency adjacency;
+	adjacency.start.assign(model.positions.size() + 1, 0);
+	for (const XpbdConstraint& c : model.constraints) {
+		adjacency.start[c.a + 1]++;
+		adjacency.start[c.b + 1]++;
+	}
+	for (size_t i = 0; i + 1 < adjacency.start.size(); i++) {
+		adjacency.start[i + 1] += adjacency.start[i];
+	}
+
+	adjacency.constraints.resize(adjacency.start.back());
+	std::vector<uint32_t> fill(adjacency.start.begin(), adjacency.start.end() - 1);
+	for (uint32_t i = 0; i < model.constraints.size(); i++) {
+		adjacency.constraints[fill[model.constraints[i].a]++] = i;
+		adjacency.constraints[fill[model.constraints[i].b]++] = i;
+	}
+	return adjacency;
+}
+
+bool vkutil::valid_batches(const XpbdModel& model)
+{
+	std::vector<uint32_t> stamp(model.positions.size(), XPBD_UNCOLORED);
+	for (uint32_t color = 0; color < model.color_count(); color++) {
+		for (uint32_t i = model.batchStart[color]; i < model.batchStart[color + 1]; i++) {
+			const XpbdConstraint& c = model.constraints[i];
+			if (stamp[c.a] == color || stamp[c.b] == color) {
+				return false;
+			}
+			stamp[c.a] = color;
+			stamp[c.b] = color;
+		}
+	}
+	return model.batchStart.empty() || model.batchStart.back() == model.constraints.size();
+}
+
+uint32_t vkutil::color_leftovers(const XpbdModel& model, const XpbdAdjacency& adjacency, std::span<uint32_t> colors)
+{
+	uint32_t leftovers = 0;
+	// per color, the last constraint it was seen next to
+	std::vector<uint32_t> used(XPBD_MAX_COLORS, XPBD_UNCOLORED);
+	for (uint32_t c = 0; c < colors.size(); c++) {
+		if (colors[c] != XPBD_UNCOLORED) {
+			continue;
+		}
+		const XpbdConstraint& constraint = model.constraints[c];
+		for (uint32_t p : {constraint.a, constraint.b}) {
+			for (uint32_t i = adjacency.start[p]; i < adjacency.start[p + 1]; i++) {
+				uint32_t color = colors[adjacency.constraints[i]];
+				if (color != XPBD_UNCOLORED) {
+					used.resize(std::max<size_t>(used.size(), color + 1), XPBD_UNCOLORED);
+					used[color] = c;
+				}
+			}
+		}
+		// a color is only taken when all below it are, so no batch stays empty
+		uint32_t color = 0;
+		while (color < used.size() && used[color] == c) {
+			color++;
+		}
+		colors[c] = color;
+		leftovers++;
+	}
+	return leftovers;
+}
+
+std::vector<uint32_t> vkutil::batch_constraints(XpbdModel& model, std::span<const uint32_t> colors)
+{
+	// counting sort by color, stable so batches keep the model's locality
+	uint32_t colorCount = 0;
+	for (uint32_t color : colors) {
+		colorCount = std::max(colorCount, color + 1);
+	}
+	model.batchStart.assign(colorCount + 1, 0);
+	for (uint32_t color : colors) {
+		model.batchStart[color + 1]++;
+	}
+	for (uint32_t c = 0; c < colorCount; c++) {
+		model.batchStart[c + 1] += model.batchStart[c];
+	}
+	std::vector<XpbdConstraint> sorted(model.constraints.size());
+	std::vector<uint32_t> fill(model.batchStart.begin(), model.batchStart.end() - 1);
+	for (size_t i = 0; i < model.constraints.size(); i++) {
+		sorted[fill[colors[i]]++] = model.constraints[i];
+	}
+
+	// particles in the order the batches reach them, unconstrained ones last
+	uint32_t particles = (uint32_t)model.positions.size();
+	std::vector<uint32_t> remap(particles, XPBD_UNCOLORED);
+	uint32_t next = 0;
+	for (const XpbdConstraint& c : sorted) {
+		for (uint32_t p : {c.a, c.b}) {
+			if (remap[p] == XPBD_UNCOLORED) {
+				remap[p] = next++;
+			}
+		}
+	}
+	for (uint32_t& index : remap) {
+		if (index == XPBD_UNCOLORED) {
+			index = next++;
+		}
+	}
+
+	std::vector<glm::vec4> positions(particles);
+	for (uint32_t i = 0; i < particles; i++) {
+		positions[remap[i]] = model.positions[i];
+	}
+	model.positions = std::move(positions);
+	if (model.uvs.size() == particles) {
+		std::vector<glm::vec2> uvs(particles);
+		for (uint32_t i = 0; i < particles; i++) {
+			uvs[remap[i]] = model.uvs[i];
+		}
+		model.uvs = std::move(uvs);
+	}
+	for (XpbdConstraint& c : sorted) {
+		c.a = remap[c.a];
+		c.b = remap[c.b];
+	}
+	model.constraints = std::move(sorted);
+	for (uint32_t& v : model.triangles) {
+		v = remap[v];
+	}
+	return remap;
+}